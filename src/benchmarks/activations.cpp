@@ -0,0 +1,47 @@
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+#include "../ops.h"
+
+/*
+    Saved state and backward time of ReLU / DROPOUT on a large float tensor:
+    the 1 bit mask against keeping the input and computing max(x, 0)/x * g
+*/
+
+double seconds(const std::function<void()> & fn, int reps){
+    fn();
+    auto begin = std::chrono::steady_clock::now();
+    for(int i=0; i<reps; i++) fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / reps;
+}
+
+int main(){
+    const int reps = 10;
+    const long n = 1 << 24;
+    Tensor<float> x(2, 4096, 4096), g(2, 4096, 4096), dx(2, 4096, 4096);
+    x.randn();
+    g.randn();
+    dx.setAll(0);
+    const float * xs = x.getData(), * gs = g.getData();
+    float * d = dx.getData();
+
+    BitMask mask;
+    mask.pack_positive(xs, n);
+    std::cout << "SAVED STATE: " << sizeof(float) * n / 1048576 << " MB INPUT, "
+              << mask.bytes() / 1048576.0 << " MB MASK (" << sizeof(float) * n / (double)mask.bytes() << "x)" << std::endl;
+
+    double t_div = seconds([&]{
+        parallel_for(0, n / 4096, 4, [&](int lo, int hi){
+            for(long i=(long)lo * 4096; i<(long)hi * 4096; i++) d[i] += (std::max(xs[i], 0.0f) / xs[i]) * gs[i];
+        });
+    }, reps);
+    double t_pack = seconds([&]{ mask.pack_positive(xs, n); }, reps);
+    double t_apply = seconds([&]{ mask.apply(gs, 1.0f, d); }, reps);
+    double t_bernoulli = seconds([&]{ mask.pack_bernoulli(n, 0.5, 1, 0); }, reps);
+    std::cout << "BACKWARD max(x, 0)/x * g: " << t_div * 1e3 << " ms" << std::endl;
+    std::cout << "BACKWARD FROM MASK: " << t_apply * 1e3 << " ms" << std::endl;
+    std::cout << "PACK x > 0: " << t_pack * 1e3 << " ms" << std::endl;
+    std::cout << "PACK BERNOULLI (PHILOX): " << t_bernoulli * 1e3 << " ms" << std::endl;
+    return 0;
+}
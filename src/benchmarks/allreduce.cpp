@@ -0,0 +1,36 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include "../comm.h"
+
+/*
+    Ring all reduce bus bandwidth against message size for N local processes
+    bus bandwidth = 2(N-1)/N * bytes / time, the traffic every rank moves
+    Usage: allreduce [n_processes]
+*/
+
+int main(int argc, char ** argv){
+    int n = argc > 1 ? std::atoi(argv[1]) : 4;
+    spawn_local(n, [](Transport * transport){
+        Communicator<float> comm(transport);
+        int p = comm.size();
+        if(comm.rank() == 0)
+            std::cout << std::setw(12) << "BYTES" << std::setw(14) << "TIME (us)" << std::setw(16) << "BUS BW (GB/s)" << std::endl;
+        for(int els=256; els<=(1<<24); els*=4){
+            std::vector<float> data(els, 1);
+            int iters = std::max(2, (1<<22) / els);
+            comm.all_reduce(data.data(), els);
+            auto begin = std::chrono::steady_clock::now();
+            for(int i=0; i<iters; i++) comm.all_reduce(data.data(), els);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+            double seconds = elapsed.count() / iters;
+            double bytes = sizeof(float) * (double)els;
+            if(comm.rank() == 0)
+                std::cout << std::setw(12) << (long)bytes << std::setw(14) << seconds * 1e6
+                          << std::setw(16) << 2.0 * (p-1) / p * bytes / seconds / 1e9 << std::endl;
+        }
+        return true;
+    });
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <iostream>
+#include <chrono>
+#include "../module.h"
+#include "../parallel.h"
+
+/*
+    Steps per second of a data parallel MLP training step
+    as the number of threads grows (the number of shards is fixed)
+*/
+
+Module<float> * mlp(){
+    Sequential<float> * model = new Sequential<float>();
+    model->add(new Linear<float>(64, 128)).add(new ReLU<float>()).add(new Linear<float>(128, 10));
+    return model;
+}
+
+Tensor<float> * squared_error(Module<float> & model, Tensor<float> * x, Tensor<float> * y){
+    Tensor<float> * diff = OPS::SUB(model.forward(x), y);
+    return OPS::MULT(diff, diff);
+}
+
+int main(){
+    const int batch = 256;
+    const int shards = 16;
+    const int steps = 5;
+    Tensor<float> x(2, batch, 64);
+    Tensor<float> y(2, batch, 10);
+    x.randn();
+    y.randn();
+
+    double base = 0;
+    int max_threads = std::thread::hardware_concurrency();
+    for(int threads=1; threads<=max_threads; threads*=2){
+        DataParallel<float> parallel(mlp, shards, threads);
+        parallel.step(&x, &y, squared_error);
+        auto begin = std::chrono::steady_clock::now();
+        for(int i=0; i<steps; i++) parallel.step(&x, &y, squared_error);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        double rate = steps / elapsed.count();
+        if(threads == 1) base = rate;
+        std::cout << "THREADS: " << threads << " STEPS/S: " << rate << " SPEEDUP: " << rate / base << std::endl;
+    }
+    return 0;
+}
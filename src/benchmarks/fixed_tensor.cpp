@@ -0,0 +1,75 @@
+#include <iostream>
+#include <chrono>
+#include "../ops.h"
+
+/*
+    Element access through Tensor::get (va_args and through an index
+    array, both loop over the dims) against a rank 4 FixedTensor view of
+    the same storage (operator() and for_each), on a plain sum and on
+    the direct convolution written both ways
+*/
+
+double seconds(const std::function<void()> & fn, int reps){
+    fn();
+    auto begin = std::chrono::steady_clock::now();
+    for(int i=0; i<reps; i++) fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / reps;
+}
+
+Tensor<float> * conv_get(Tensor<float> * X, Tensor<float> * K){
+    int height = X->getDims()[2] - K->getDims()[2] + 1, width = X->getDims()[3] - K->getDims()[3] + 1;
+    Tensor<float> * out = new Tensor<float>(4, X->getDims()[0], K->getDims()[0], height, width);
+    for(int b=0; b<out->getDims()[0]; b++)
+        for(int o=0; o<out->getDims()[1]; o++)
+            for(int h=0; h<height; h++)
+                for(int w=0; w<width; w++){
+                    float sum = 0;
+                    for(int l=0; l<X->getDims()[1]; l++)
+                        for(int m=0; m<K->getDims()[2]; m++)
+                            for(int n=0; n<K->getDims()[3]; n++){
+                                int k_ind[] = {o, l, m, n};
+                                int x_ind[] = {b, l, h + m, w + n};
+                                sum += X->get(x_ind) * K->get(k_ind);
+                            }
+                    out->get(4, b, o, h, w) = sum;
+                }
+    return out;
+}
+
+int main(){
+    Tensor<float> t(4, 16, 32, 32, 32);
+    t.randn();
+    FixedTensor<float, 4> v(&t);
+    const int * d = t.getDims();
+    float sink = 0;
+
+    double t_va = seconds([&]{
+        for(int a=0; a<d[0]; a++) for(int b=0; b<d[1]; b++) for(int c=0; c<d[2]; c++) for(int e=0; e<d[3]; e++) sink += t.get(4, a, b, c, e);
+    }, 5);
+    double t_arr = seconds([&]{
+        for(int a=0; a<d[0]; a++) for(int b=0; b<d[1]; b++) for(int c=0; c<d[2]; c++) for(int e=0; e<d[3]; e++){
+            int idx[] = {a, b, c, e};
+            sink += t.get(idx);
+        }
+    }, 5);
+    double t_fixed = seconds([&]{
+        for(int a=0; a<v.dim(0); a++) for(int b=0; b<v.dim(1); b++) for(int c=0; c<v.dim(2); c++) for(int e=0; e<v.dim(3); e++) sink += v(a, b, c, e);
+    }, 5);
+    double t_each = seconds([&]{ v.for_each([&](float & x){ sink += x; }); }, 5);
+    std::cout << "SUM OF 16x32x32x32 (NS PER ELEMENT)" << std::endl;
+    std::cout << "    GET(N, ...):   " << t_va / t.getTotalElements() * 1e9 << std::endl;
+    std::cout << "    GET(INDEX):    " << t_arr / t.getTotalElements() * 1e9 << std::endl;
+    std::cout << "    FIXED (...):   " << t_fixed / t.getTotalElements() * 1e9 << std::endl;
+    std::cout << "    FOR_EACH:      " << t_each / t.getTotalElements() * 1e9 << std::endl;
+
+    Tensor<float> x(4, 2, 8, 16, 16), k(4, 16, 8, 3, 3);
+    x.randn();
+    k.randn();
+    double t_conv_get = seconds([&]{ delete conv_get(&x, &k); }, 3);
+    double t_conv = seconds([&]{ delete conv(&x, &k, std::make_pair(1, 1)); }, 3);
+    std::cout << "DIRECT CONV 2x8x16x16, 16 3x3 KERNELS" << std::endl;
+    std::cout << "    GET():   " << t_conv_get * 1e3 << " MS" << std::endl;
+    std::cout << "    FIXED:   " << t_conv * 1e3 << " MS (" << t_conv_get / t_conv << "X)" << std::endl;
+    return sink == 12345;
+}
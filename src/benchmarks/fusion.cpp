@@ -0,0 +1,51 @@
+#include <iostream>
+#include <chrono>
+#include "../ops.h"
+#include "../expr.h"
+
+/*
+    Forward + backward time of exp(-(a + b)) * relu(a)
+    as separate ops (one tensor and one memory pass per step)
+    and as one fused expression
+*/
+
+const int N = 1 << 22;
+
+double unfused(Tensor<float> * a, Tensor<float> * b){
+    auto begin = std::chrono::steady_clock::now();
+    Tensor<float> * sum = OPS::ADD(a, b);
+    Tensor<float> * neg = OPS::NEG(sum);
+    Tensor<float> * exp = OPS::EXP(neg);
+    Tensor<float> * relu = OPS::ReLU(a);
+    Tensor<float> * out = OPS::MULT(exp, relu);
+    OPS::backward(out);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    OPS::release_graph(out);
+    return elapsed.count();
+}
+
+double fused(Tensor<float> * a, Tensor<float> * b){
+    auto begin = std::chrono::steady_clock::now();
+    Tensor<float> * out = LAZY::eval(LAZY::MULT(LAZY::EXP(LAZY::NEG(LAZY::ADD(a, b))), LAZY::ReLU(a)));
+    OPS::backward(out);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    OPS::release_graph(out);
+    return elapsed.count();
+}
+
+int main(){
+    Tensor<float> a(1, N);
+    Tensor<float> b(1, N);
+    a.randn();
+    b.randn();
+    const int reps = 5;
+    double t_unfused = 0, t_fused = 0;
+    for(int i=0; i<reps; i++){
+        t_unfused += unfused(&a, &b);
+        t_fused += fused(&a, &b);
+    }
+    std::cout << "UNFUSED: " << t_unfused / reps * 1000 << " MS" << std::endl;
+    std::cout << "FUSED: " << t_fused / reps * 1000 << " MS" << std::endl;
+    std::cout << "SPEEDUP: " << t_unfused / t_fused << std::endl;
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include "../inference.h"
+
+/*
+    Per request latency of a small MLP: eager forward (graph, ops,
+    untracked matmul) against the frozen InferenceEngine and against
+    the GEMM kernels alone on the same packed weights
+*/
+
+double seconds(const std::function<void()> & fn, int reps){
+    fn();
+    auto begin = std::chrono::steady_clock::now();
+    for(int i=0; i<reps; i++) fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / reps;
+}
+
+int main(){
+    const int widths[] = {256, 512, 512, 10};
+    const int depth = 3;
+    Sequential<float> model;
+    for(int l=0; l<depth; l++){
+        model.add(new Linear<float>(widths[l], widths[l + 1]));
+        if(l + 1 < depth) model.add(new BatchNorm<float>(widths[l + 1])).add(new ReLU<float>());
+    }
+    model.train(false);
+
+    for(int batch : {1, 32}){
+        Tensor<float> x(2, batch, widths[0]);
+        x.randn();
+        InferenceEngine<float> engine(model, &x);
+
+        //The GEMMs of the engine's schedule without anything around them
+        std::vector<PackedMatrix<float>> packed;
+        std::vector<std::vector<float>> acts(1, std::vector<float>(x.getData(), x.getData() + x.getTotalElements()));
+        for(int l=0; l<depth; l++){
+            std::vector<float> w((size_t)widths[l] * widths[l + 1]);
+            for(size_t i=0; i<w.size(); i++) w[i] = std::sin((float)i);
+            packed.push_back(PackedMatrix<float>(w.data(), widths[l], widths[l + 1], widths[l + 1], 1));
+            acts.push_back(std::vector<float>((size_t)batch * widths[l + 1]));
+        }
+        std::vector<float> bias(512, 0.1f);
+        auto kernels = [&]{
+            for(int l=0; l<depth; l++){
+                GemmEpilogue<float> ep;
+                ep.bias = bias.data();
+                ep.relu = l + 1 < depth;
+                ep.out = acts[l + 1].data();
+                ep.rs = widths[l + 1];
+                gemm_packed(acts[l].data(), widths[l], batch, packed[l], ep);
+            }
+        };
+
+        Tensor<float> * expected = model.forward(&x);
+        Tensor<float> * out = engine.run(&x);
+        double err = 0;
+        for(int i=0; i<out->getTotalElements(); i++) err = std::max(err, (double)std::fabs(out->getData()[i] - expected->getData()[i]));
+        OPS::release_graph(expected);
+        delete out;
+
+        std::vector<float> y((size_t)batch * engine.output_size());
+        double t_eager = seconds([&]{ OPS::release_graph(model.forward(&x)); }, 3);
+        double t_engine = seconds([&]{ engine.run(x.getData(), batch, y.data()); }, 1000);
+        double t_kernels = seconds(kernels, 1000);
+        std::cout << "MLP 256-512-512-10, BATCH " << batch << " (" << engine.steps() << " STEPS, ARENA "
+                  << engine.arena_bytes() / 1024.0 << " KB, MAX DIFF " << err << ")" << std::endl;
+        std::cout << "    EAGER:   " << t_eager * 1e6 << " US" << std::endl;
+        std::cout << "    ENGINE:  " << t_engine * 1e6 << " US" << std::endl;
+        std::cout << "    KERNELS: " << t_kernels * 1e6 << " US" << std::endl;
+    }
+    return 0;
+}
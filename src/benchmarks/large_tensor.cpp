@@ -0,0 +1,141 @@
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include <climits>
+#include "../ops.h"
+
+/*
+    Sizes, strides and offsets are 64 bit, the inner loops still count
+    with ints over runs that are capped below INT_MAX. Each inner loop is
+    timed with an int and with a long counter (NS PER ELEMENT, the two
+    columns should match), next to the OPS:: call that uses it.
+    With --large a (65536, 32769) uint8 tensor (just over 2^31 elements,
+    2 GB of address space, only the touched pages are mapped) checks
+    indexing, views, the broadcast walk and INDEX_SELECT past INT_MAX.
+*/
+
+const long N = 1 << 24;
+
+double seconds(const std::function<void()> & fn, int reps){
+    fn();
+    auto begin = std::chrono::steady_clock::now();
+    for(int i=0; i<reps; i++) fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / reps;
+}
+
+template <typename I>
+void add_run(float * o, const float * x, const float * y, I n) {
+    for(I i=0; i<n; i++) o[i] = x[i] + y[i];
+}
+
+template <typename I>
+void add_strided(float * o, long so, const float * x, long sx, const float * y, I n) {
+    for(I i=0; i<n; i++) o[i*so] = x[i*sx] + y[i];
+}
+
+template <typename I>
+float sum_run(const float * x, I n) {
+    float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    I i = 0;
+    for(; i + 8 <= n; i += 8)
+        for(int k=0; k<8; k++) acc[k] += x[i + k];
+    for(; i<n; i++) acc[0] += x[i];
+    return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+}
+
+void row(const std::string & name, double t_int, double t_long, double t_op) {
+    std::cout << "    " << name;
+    if(t_int > 0) std::cout << t_int / N * 1e9 << " / " << t_long / N * 1e9;
+    if(t_op > 0) std::cout << "    OPS " << t_op / N * 1e9;
+    std::cout << std::endl;
+}
+
+bool large() {
+    const int rows = 1 << 16, cols = (1 << 15) + 1;
+    Tensor<uint8_t> big(2, rows, cols);
+    bool passed = big.getTotalElements() == (long)rows * cols && big.getTotalElements() > INT_MAX;
+
+    //The last element sits past INT_MAX
+    int last[] = {rows - 1, cols - 1};
+    passed &= big.getIndex(last) == big.getTotalElements() - 1;
+    big.getData()[big.getTotalElements() - 1] = 7;
+    passed &= big.get(2, rows - 1, cols - 1) == 7;
+
+    //A view of the last rows starts past INT_MAX
+    int dims[] = {2, cols};
+    Tensor<uint8_t> tail(&big, (long)(rows - 2) * cols, 2, dims);
+    passed &= tail.get(2, 1, cols - 1) == 7;
+
+    //Broadcasting a row over the table: the runs stay int, the offsets do not
+    Tensor<uint8_t> bias(2, 1, cols);
+    Tensor<uint8_t> * ops[2] = {&big, &bias};
+    broadcast_iterator<uint8_t> it(2, ops);
+    long runs = 0, covered = 0;
+    do {
+        passed &= it.run() <= INT_MAX && it.stride(0) == 1;
+        covered += it.run();
+        runs++;
+    } while(it.next());
+    passed &= covered == big.getTotalElements();
+    passed &= it.ptr(0) == big.getData();
+
+    //The transposed strides index the same last element
+    big.transpose();
+    passed &= big.getMults()[0] == 1 && big.getMults()[1] == cols;
+    passed &= big.get(2, cols - 1, rows - 1) == 7;
+    big.transpose();
+
+    //INDEX_SELECT repeating the 2 columns of a small table past INT_MAX output rows (inner is 1)
+    Tensor<uint8_t> table(2, rows, 2);
+    for(int r=0; r<rows; r++) { table.getData()[2 * r] = r % 251; table.getData()[2 * r + 1] = 3; }
+    std::vector<int> pick(cols);
+    for(int k=0; k<cols; k++) pick[k] = k % 2;
+    Tensor<uint8_t> * picked = OPS::INDEX_SELECT(&table, 1, pick);
+    passed &= picked->getTotalElements() == big.getTotalElements();
+    passed &= picked->get(2, rows - 1, cols - 1) == (rows - 1) % 251 && picked->get(2, rows - 1, cols - 2) == 3;
+    delete picked;
+
+    std::cout << "LARGE TENSOR " << rows << "x" << cols << " (" << big.getTotalElements() << " ELEMENTS, " << runs << " RUNS): "
+              << (passed ? "PASSED" : "FAILED") << std::endl;
+    return passed;
+}
+
+int main(int argc, char ** argv){
+    Tensor<float> a(2, 1 << 12, 1 << 12), b(2, 1 << 12, 1 << 12), c(2, 1 << 12, 1 << 12), r(2, 1, 1 << 12);
+    a.randn();
+    b.randn();
+    r.randn();
+    float * o = c.getData();
+    const float * x = a.getData(), * y = b.getData();
+    float sink = 0;
+
+    std::cout << "INNER LOOPS OVER 2^24 FLOATS (NS PER ELEMENT, INT / LONG COUNTER)" << std::endl;
+    double t_int = seconds([&]{ add_run<int>(o, x, y, (int)N); }, 10);
+    double t_long = seconds([&]{ add_run<long>(o, x, y, N); }, 10);
+    double t_op = seconds([&]{ delete OPS::ADD(&a, &b); }, 10);
+    row("CONTIGUOUS ADD:   ", t_int, t_long, t_op);
+
+    t_int = seconds([&]{ add_strided<int>(o, 2, x, 2, y, (int)N / 2); }, 10) * 2;
+    t_long = seconds([&]{ add_strided<long>(o, 2, x, 2, y, N / 2); }, 10) * 2;
+    row("STRIDED ADD:      ", t_int, t_long, 0);
+
+    t_op = seconds([&]{ delete OPS::ADD(&a, &r); }, 10);
+    row("BROADCAST ADD:    ", 0, 0, t_op);
+
+    t_int = seconds([&]{ sink += sum_run<int>(x, (int)N); }, 10);
+    t_long = seconds([&]{ sink += sum_run<long>(x, N); }, 10);
+    t_op = seconds([&]{ delete OPS::SUM(&a); }, 10);
+    row("SUM:              ", t_int, t_long, t_op);
+
+    Tensor<float> m1(2, 256, 256), m2(2, 256, 256);
+    m1.randn();
+    m2.randn();
+    double t_mm = seconds([&]{ delete OPS::_matmul(&m1, &m2); }, 20);
+    std::cout << "MATMUL 256x256x256: " << 2.0 * 256 * 256 * 256 / t_mm / 1e9 << " GFLOP/S" << std::endl;
+
+    bool passed = true;
+    if(argc > 1 && std::strcmp(argv[1], "--large") == 0) passed = large();
+    else std::cout << "LARGE TENSOR CHECK SKIPPED (RUN WITH --large)" << std::endl;
+    return (passed ? 0 : 1) + (sink == 12345);
+}
@@ -0,0 +1,73 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include "../inference.h"
+
+/*
+    The same small CNN in NCHW, NHWC and NCHWc (blocks of 8): images
+    per second of the InferenceEngine compiled for each format (im2col
+    + packed GEMM, reorders only at the boundaries) and of the eager
+    ops (direct CONV, pooling) run in each format, plus the cost of
+    the reorders themselves
+*/
+
+double seconds(const std::function<void()> & fn, int reps){
+    fn();
+    auto begin = std::chrono::steady_clock::now();
+    for(int i=0; i<reps; i++) fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / reps;
+}
+
+const char * name(MemoryFormat f){
+    return f == FORMAT_NCHW ? "NCHW  " : f == FORMAT_NHWC ? "NHWC  " : "NCHW8C";
+}
+
+int main(){
+    const int batch = 8;
+    const MemoryFormat formats[] = {FORMAT_NCHW, FORMAT_NHWC, FORMAT_NCHWC};
+    Sequential<float> model;
+    model.add(new Conv2d<float>(16, 32, 3, 1, 1)).add(new BatchNorm<float>(32)).add(new ReLU<float>()).add(new MaxPool2d<float>(2))
+         .add(new Conv2d<float>(32, 64, 3, 1, 1)).add(new BatchNorm<float>(64)).add(new ReLU<float>()).add(new MaxPool2d<float>(2))
+         .add(new Conv2d<float>(64, 64, 3, 1, 1)).add(new ReLU<float>()).add(new AvgPool2d<float>(2));
+    model.train(false);
+    Tensor<float> x(4, batch, 16, 32, 32);
+    x.randn();
+
+    Tensor<float> * expected = model.forward(&x);
+    std::cout << "CNN 16-32-64-64 ON " << batch << "x16x32x32, ENGINE (IMAGES PER SECOND)" << std::endl;
+    for(MemoryFormat f : formats){
+        InferenceEngine<float> engine(model, &x, f, 8);
+        std::vector<float> y((size_t)batch * engine.output_size());
+        double t = seconds([&]{ engine.run(x.getData(), batch, y.data()); }, 10);
+        double err = 0;
+        for(size_t i=0; i<y.size(); i++) err = std::max(err, (double)std::fabs(y[i] - expected->getData()[i]));
+        std::cout << "    " << name(f) << " " << batch / t << " (" << engine.steps() << " STEPS, "
+                  << engine.reorders() << " REORDERS, MAX DIFF " << err << ")" << std::endl;
+    }
+    OPS::release_graph(expected);
+
+    //Eager ops without the module wrappers, in and out of the format once
+    Tensor<float> k1(4, 32, 16, 3, 3), k2(4, 64, 32, 3, 3), k3(4, 64, 64, 3, 3);
+    k1.randn();
+    k2.randn();
+    k3.randn();
+    auto eager = [&](MemoryFormat f){
+        Tensor<float> * h = OPS::TO_FORMAT(&x, f, 8);
+        h = OPS::MAXPOOL2D(OPS::ReLU(OPS::CONV(OPS::PAD(h, 1, 1), &k1)), std::make_pair(2, 2));
+        h = OPS::MAXPOOL2D(OPS::ReLU(OPS::CONV(OPS::PAD(h, 1, 1), &k2)), std::make_pair(2, 2));
+        h = OPS::AVGPOOL2D(OPS::ReLU(OPS::CONV(OPS::PAD(h, 1, 1), &k3)), std::make_pair(2, 2));
+        OPS::release_graph(OPS::TO_FORMAT(h, FORMAT_NCHW));
+    };
+    std::cout << "SAME LAYERS, EAGER OPS (IMAGES PER SECOND)" << std::endl;
+    for(MemoryFormat f : formats) std::cout << "    " << name(f) << " " << batch / seconds([&]{ eager(f); }, 2) << std::endl;
+
+    Tensor<float> act(4, batch, 64, 32, 32);
+    act.randn();
+    std::cout << "REORDER " << batch << "x64x32x32 FROM NCHW AND BACK (MS)" << std::endl;
+    for(int i=1; i<3; i++){
+        double t = seconds([&]{ OPS::release_graph(OPS::TO_FORMAT(OPS::TO_FORMAT(&act, formats[i], 8), FORMAT_NCHW)); }, 10);
+        std::cout << "    " << name(formats[i]) << " " << t * 1e3 << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cmath>
+#include "../ops.h"
+
+/*
+    Crossover of the MatMul kernels of gemm.h in GFLOP/S, each run on
+    the same row major operands:
+        - square products: the unrolled kernels (up to SMALL_MATMUL)
+          against the packed GEMM, which packs B on every call
+        - (1, K) @ (K, N) and (M, K) @ (K, 1): the GEMVs against the
+          packed GEMM
+    OPS::_matmul (tensor allocation and dispatch included) is timed next
+    to them, so the dispatch can be checked to follow the faster kernel.
+*/
+
+double seconds(const std::function<void()> & fn, double budget = 0.05){
+    fn();
+    int reps = 0;
+    auto begin = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0);
+    while(elapsed.count() < budget){
+        fn();
+        reps++;
+        elapsed = std::chrono::steady_clock::now() - begin;
+    }
+    return elapsed.count() / reps;
+}
+
+void row(const std::string & shape, double flops, double t_special, double t_gemm, double t_dispatch){
+    std::cout << "    " << std::setw(16) << std::left << shape << std::right << std::fixed << std::setprecision(2)
+              << std::setw(10) << (t_special > 0 ? flops / t_special / 1e9 : 0) << std::setw(10) << flops / t_gemm / 1e9
+              << std::setw(10) << flops / t_dispatch / 1e9 << "    " << (t_special > 0 && t_special < t_gemm ? "SPECIAL" : "GEMM") << std::endl;
+}
+
+int main(){
+    std::cout << "SQUARE (N, N) @ (N, N)       SMALL      GEMM  DISPATCH    FASTER" << std::endl;
+    for(int n : {2, 3, 4, 8, 12, 16, 24, 32, 64, 128}){
+        Tensor<float> a(2, n, n), b(2, n, n), c(2, n, n);
+        a.randn();
+        b.randn();
+        const float * A = a.getData(), * B = b.getData();
+        float * C = c.getData();
+        double t_small = n <= SMALL_MATMUL ? seconds([&]{ small_matmul(A, n, 1, B, n, 1, C, n, 1, n, n, n); }) : 0;
+        double t_gemm = seconds([&]{ gemm(A, n, 1, B, n, 1, C, n, 1, n, n, n); });
+        double t_dispatch = seconds([&]{ delete OPS::_matmul(&a, &b); });
+        row(std::to_string(n), 2.0 * n * n * n, t_small, t_gemm, t_dispatch);
+    }
+
+    std::cout << "VECTOR (1, K) @ (K, N)        GEMV      GEMM  DISPATCH    FASTER" << std::endl;
+    for(int n : {16, 64, 256, 1024, 2048}){
+        Tensor<float> x(2, 1, n), w(2, n, n), y(2, 1, n);
+        x.randn();
+        w.randn();
+        const float * X = x.getData(), * W = w.getData();
+        float * Y = y.getData();
+        double t_gemv = seconds([&]{ gemv(W, n, n, 1, n, X, 1, Y, 1); });
+        double t_gemm = seconds([&]{ gemm(X, n, 1, W, n, 1, Y, n, 1, 1, n, n); });
+        double t_dispatch = seconds([&]{ delete OPS::_matmul(&x, &w); });
+        row("K = N = " + std::to_string(n), 2.0 * n * n, t_gemv, t_gemm, t_dispatch);
+    }
+
+    std::cout << "VECTOR (M, K) @ (K, 1)        GEMV      GEMM  DISPATCH    FASTER" << std::endl;
+    for(int n : {16, 64, 256, 1024, 2048}){
+        Tensor<float> w(2, n, n), x(2, n, 1), y(2, n, 1);
+        x.randn();
+        w.randn();
+        const float * X = x.getData(), * W = w.getData();
+        float * Y = y.getData();
+        double t_gemv = seconds([&]{ gemv(W, n, n, n, 1, X, 1, Y, 1); });
+        double t_gemm = seconds([&]{ gemm(W, n, 1, X, 1, 1, Y, 1, 1, n, n, 1); });
+        double t_dispatch = seconds([&]{ delete OPS::_matmul(&w, &x); });
+        row("M = K = " + std::to_string(n), 2.0 * n * n, t_gemv, t_gemm, t_dispatch);
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include "../quant.h"
+
+/*
+    Int8 MatMul and conv against float: time, speedup and the relative
+    error (RMS difference / RMS of the float output) of the quantized
+    result, with inputs calibrated on the batch itself (min/max)
+*/
+
+double seconds(const std::function<void()> & fn, int reps){
+    fn();
+    auto begin = std::chrono::steady_clock::now();
+    for(int i=0; i<reps; i++) fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / reps;
+}
+
+double rel_err(Tensor<float> * x, Tensor<float> * y){
+    double num = 0, den = 0;
+    for(int i=0; i<y->getTotalElements(); i++){
+        num += (x->getData()[i] - y->getData()[i]) * (x->getData()[i] - y->getData()[i]);
+        den += y->getData()[i] * y->getData()[i];
+    }
+    return std::sqrt(num / den);
+}
+
+void report(const std::string & name, double macs, double t_float, double t_int8, double err){
+    std::cout << name << std::endl;
+    std::cout << "    FLOAT: " << t_float * 1e3 << " MS (" << 2 * macs / t_float / 1e9 << " GFLOP/S)" << std::endl;
+    std::cout << "    INT8:  " << t_int8 * 1e3 << " MS (" << 2 * macs / t_int8 / 1e9 << " GOP/S)" << std::endl;
+    std::cout << "    SPEEDUP: " << t_float / t_int8 << "X, RELATIVE ERROR: " << err << std::endl;
+}
+
+int main(){
+    {
+        const int M = 128, K = 512, N = 512;
+        Linear<float> lin(K, N);
+        Tensor<float> x(2, M, K);
+        x.randn();
+        x.no_history();
+        Observer obs;
+        obs.observe(&x);
+        QLinear<float> per_channel(lin, obs.qparams()), per_tensor(lin, obs.qparams(), false);
+
+        Tensor<float> * y = lin.forward(&x);
+        double t_float = seconds([&]{ OPS::release_graph(lin.forward(&x)); }, 1);
+        Tensor<float> * q = per_channel.forward(&x);
+        double t_int8 = seconds([&]{ delete per_channel.forward(&x); }, 20);
+        report("LINEAR " + std::to_string(M) + "x" + std::to_string(K) + "x" + std::to_string(N) + " PER CHANNEL",
+               (double)M * K * N, t_float, t_int8, rel_err(q, y));
+        delete q;
+        q = per_tensor.forward(&x);
+        std::cout << "    PER TENSOR RELATIVE ERROR: " << rel_err(q, y) << std::endl;
+        delete q;
+
+        //uint8 in and out, the quantization of the input and the float output are skipped
+        QTensor qx(&x, obs.qparams());
+        Observer out_obs;
+        out_obs.observe(y);
+        double t_chain = seconds([&]{ per_channel.forward(qx, out_obs.qparams()); }, 20);
+        std::cout << "    UINT8 -> UINT8 (REQUANTIZED): " << t_chain * 1e3 << " MS" << std::endl;
+        OPS::release_graph(y);
+    }
+    {
+        const int B = 4, C = 16, O = 32, H = 16, k = 3;
+        Conv2d<float> conv(C, O, k, 1, 1);
+        Tensor<float> x(4, B, C, H, H);
+        x.randn();
+        x.no_history();
+        Observer obs;
+        obs.observe(&x);
+        QConv2d<float> qconv(conv, obs.qparams());
+
+        Tensor<float> * y = conv.forward(&x);
+        double t_float = seconds([&]{ OPS::release_graph(conv.forward(&x)); }, 1);
+        Tensor<float> * q = qconv.forward(&x);
+        double t_int8 = seconds([&]{ delete qconv.forward(&x); }, 20);
+        report("CONV " + std::to_string(B) + "x" + std::to_string(C) + "x" + std::to_string(H) + "x" + std::to_string(H)
+               + " -> " + std::to_string(O) + " CHANNELS, 3x3 PAD 1", (double)B * O * H * H * C * k * k, t_float, t_int8, rel_err(q, y));
+        delete q;
+        OPS::release_graph(y);
+    }
+    return 0;
+}
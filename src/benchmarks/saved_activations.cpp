@@ -0,0 +1,45 @@
+#include <iostream>
+#include <chrono>
+#include "../module.h"
+#include "../optim.h"
+
+/*
+    Activation memory held for backward at the end of the forward pass
+    and time per training step of an MLP for every SavedFormat
+*/
+
+int main(){
+    const int batch = 64, width = 128, depth = 4, steps = 3;
+    const char * names[] = {"FULL", "BF16", "FP16", "INT8"};
+    Tensor<float> x(2, batch, width);
+    x.randn();
+    for(int f=SAVED_FULL; f<=SAVED_INT8; f++){
+        generator.seed(0);
+        Sequential<float> model;
+        for(int i=0; i<depth; i++) model.add(new Linear<float>(width, width)).add(new ReLU<float>());
+        model.save_activations((SavedFormat)f);
+        SGD<float> sgd(model.flat(), 1e-4f);
+
+        size_t held = 0;
+        double seconds = 0;
+        for(int step=0; step<=steps; step++){
+            auto begin = std::chrono::steady_clock::now();
+            model.zero_grad();
+            Tensor<float> * out = model.forward(&x);
+            if(step == 0){
+                //Intermediate tensors only, the input and parameters are not saved activations
+                std::vector<Tensor<float>*> graph = OPS::_topological_order(out);
+                for(size_t i=0; i<graph.size(); i++)
+                    if(graph[i]->getOp() != NULL)
+                        held += graph[i]->is_packed() ? graph[i]->packed_bytes() : sizeof(float) * graph[i]->getTotalElements();
+            }
+            OPS::backward(out);
+            OPS::release_graph(out);
+            sgd.step();
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+            if(step > 0) seconds += elapsed.count();
+        }
+        std::cout << names[f] << ": " << held / 1048576.0 << " MB SAVED, " << seconds / steps * 1e3 << " MS/STEP" << std::endl;
+    }
+    return 0;
+}
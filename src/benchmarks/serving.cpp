@@ -0,0 +1,53 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include "../serve.h"
+
+/*
+    Closed loop load generator against InferenceServer: every client
+    thread sends one sample, waits for its result and sends the next.
+    Throughput and p50/p99 latency for a range of client counts, with
+    batching off (max batch 1) and with batches of up to 32 formed within
+    a 0.2 or 2 ms deadline
+*/
+
+const double DURATION = 0.5;
+
+void load(InferenceEngine<float> & engine, int max_batch, double max_delay, int clients){
+    InferenceServer<float> server(engine, max_batch, max_delay);
+    std::vector<float> x(engine.input_size());
+    for(size_t i=0; i<x.size(); i++) x[i] = std::sin((float)i);
+
+    std::vector<std::thread> threads;
+    auto begin = std::chrono::steady_clock::now();
+    for(int c=0; c<clients; c++) threads.push_back(std::thread([&]{
+        std::vector<float> y(engine.output_size());
+        while(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() < DURATION) server.infer(x.data(), y.data());
+    }));
+    for(int c=0; c<clients; c++) threads[c].join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+    ServerStats s = server.stats();
+    std::cout << "    CLIENTS " << clients << ": " << s.requests / elapsed.count() << " REQ/S, P50 " << s.p50 * 1e6
+              << " US, P99 " << s.p99 * 1e6 << " US, MEAN BATCH " << s.mean_batch << ", MAX QUEUE " << s.max_queue_depth << std::endl;
+}
+
+int main(){
+    const int widths[] = {256, 512, 512, 10};
+    Sequential<float> model;
+    for(int l=0; l<3; l++){
+        model.add(new Linear<float>(widths[l], widths[l + 1]));
+        if(l < 2) model.add(new ReLU<float>());
+    }
+    model.train(false);
+    Tensor<float> example(2, 32, widths[0]);
+    InferenceEngine<float> engine(model, &example);
+
+    const int batches[] = {1, 32, 32};
+    const double delays[] = {0, 2e-4, 2e-3};
+    for(int i=0; i<3; i++){
+        std::cout << "MLP 256-512-512-10, MAX BATCH " << batches[i] << ", MAX DELAY " << delays[i] * 1e3 << " MS" << std::endl;
+        for(int clients : {1, 4, 16, 64}) load(engine, batches[i], delays[i], clients);
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include <iostream>
+#include <chrono>
+#include <cstring>
+#include "../ops.h"
+
+/*
+    Bandwidth (read + write) of PERMUTE on large float tensors
+    against memcpy of the same size
+*/
+
+double seconds(const std::function<void()> & fn, int reps){
+    fn();
+    auto begin = std::chrono::steady_clock::now();
+    for(int i=0; i<reps; i++) fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / reps;
+}
+
+int main(){
+    const int reps = 10;
+    const int n = 4096;
+    Tensor<float> x(2, n, n);
+    x.randn();
+    x.no_history();
+    double bytes = 2.0 * sizeof(float) * n * n;
+
+    std::vector<float> dst((size_t)n * n);
+    double t_copy = seconds([&]{ std::memcpy(dst.data(), x.getData(), sizeof(float) * n * n); }, reps);
+    std::cout << "MEMCPY: " << bytes / t_copy / 1e9 << " GB/S" << std::endl;
+
+    //Kernel only (preallocated output), then the op including its allocation
+    long strides[] = {1, n};
+    int dims[] = {n, n};
+    double t_kernel = seconds([&]{ strided_copy((const float *)x.getData(), 2, dims, strides, dst.data()); }, reps);
+    std::cout << "TRANSPOSE KERNEL " << n << "x" << n << ": " << bytes / t_kernel / 1e9 << " GB/S" << std::endl;
+
+    double t_2d = seconds([&]{ delete OPS::PERMUTE(&x, {1, 0}); }, reps);
+    std::cout << "PERMUTE (1, 0) " << n << "x" << n << ": " << bytes / t_2d / 1e9 << " GB/S" << std::endl;
+
+    Tensor<float> y(4, 64, 64, 64, 64);
+    y.randn();
+    y.no_history();
+    double t_4d = seconds([&]{ delete OPS::PERMUTE(&y, {0, 3, 1, 2}); }, reps);
+    std::cout << "PERMUTE (0, 3, 1, 2) 64^4: " << bytes / t_4d / 1e9 << " GB/S" << std::endl;
+    return 0;
+}
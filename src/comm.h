@@ -0,0 +1,587 @@
+#ifndef COMM_H_
+#define COMM_H_
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cassert>
+#include <cerrno>
+#include <stdexcept>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "tensor.h"
+#include "ops.h"
+#include "module.h"
+
+/*
+    Collective communication between processes.
+    A Transport moves bytes between ranks; Communicator builds
+    all_reduce (ring reduce scatter + all gather), broadcast (binomial tree)
+    and all_gather (ring) on top of it. Only the Transport knows about sockets,
+    so a TCP transport only has to implement the same four methods.
+*/
+class Transport {
+    public:
+        virtual ~Transport() {}
+
+        /***************************************************************
+        * int rank() const; int size() const;
+        *
+        *   Returns:
+        *       the id of this process and the number of processes
+        ***************************************************************/
+        virtual int rank() const = 0;
+        virtual int size() const = 0;
+
+        /***************************************************************
+        * void send(int peer, const void * data, size_t bytes);
+        * void recv(int peer, void * data, size_t bytes);
+        *
+        *   Description:
+        *       blocking point to point transfers, a failed transfer
+        *       or a closed peer throws std::runtime_error
+        ***************************************************************/
+        virtual void send(int peer, const void * data, size_t bytes) = 0;
+        virtual void recv(int peer, void * data, size_t bytes) = 0;
+
+        /***************************************************************
+        * void sendrecv(int to, const void * out, size_t out_bytes,
+        *               int from, void * in, size_t in_bytes);
+        *
+        *   Description:
+        *       sends to one peer while receiving from another,
+        *       every rank of a ring can call it at once without deadlocking
+        ***************************************************************/
+        virtual void sendrecv(int to, const void * out, size_t out_bytes, int from, void * in, size_t in_bytes) = 0;
+};
+/*###############################################################################################################*/
+class UnixSocketTransport: public Transport {
+/*
+    Full mesh of Unix domain stream sockets.
+    Rank r listens on "<prefix>.<r>", connects to every lower rank
+    and accepts a connection from every higher rank.
+*/
+    public:
+        UnixSocketTransport(int rank, int size, const std::string & prefix);
+        ~UnixSocketTransport();
+
+        int rank() const { return my_rank; }
+        int size() const { return n_ranks; }
+        void send(int peer, const void * data, size_t bytes);
+        void recv(int peer, void * data, size_t bytes);
+        void sendrecv(int to, const void * out, size_t out_bytes, int from, void * in, size_t in_bytes);
+
+    private:
+        int my_rank;
+        int n_ranks;
+        std::string path;
+        std::vector<int> fds;
+};
+/*###############################################################################################################*/
+/***************************************************************
+* sockaddr_un unix_address(const std::string & path);
+*
+*   Returns:
+*       the address of the Unix domain socket at path
+***************************************************************/
+inline sockaddr_un unix_address(const std::string & path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("SOCKET PATH TOO LONG: " + path);
+    std::strcpy(addr.sun_path, path.c_str());
+    return addr;
+}
+
+//Throws what, followed by the reason errno gives
+inline void _socket_error(const std::string & what) {
+    throw std::runtime_error(what + ": " + std::strerror(errno));
+}
+/*###############################################################################################################*/
+/***************************************************************
+* bool _send_all(int fd, const void * data, size_t bytes);
+* bool _recv_all(int fd, void * data, size_t bytes);
+*
+*   Description:
+*       whole buffer transfers on a socket, retried when a signal
+*       interrupts them. MSG_NOSIGNAL turns a send to a closed peer
+*       into an error instead of a SIGPIPE.
+*
+*   Returns:
+*       false once the peer has closed the connection or on an error
+***************************************************************/
+inline bool _send_all(int fd, const void * data, size_t bytes) {
+    const char * ptr = (const char *)data;
+    while(bytes > 0){
+        ssize_t n = ::send(fd, ptr, bytes, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        ptr += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+inline bool _recv_all(int fd, void * data, size_t bytes) {
+    char * ptr = (char *)data;
+    while(bytes > 0){
+        ssize_t n = ::recv(fd, ptr, bytes, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        ptr += n;
+        bytes -= n;
+    }
+    return true;
+}
+/*###############################################################################################################*/
+inline UnixSocketTransport::UnixSocketTransport(int rank, int size, const std::string & prefix)
+    : my_rank(rank), n_ranks(size), fds(size, -1) {
+    path = prefix + "." + std::to_string(rank);
+    unlink(path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0) _socket_error("COULD NOT CREATE SOCKET");
+    sockaddr_un addr = unix_address(path);
+    if(bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(listener, size) != 0){
+        close(listener);
+        _socket_error("COULD NOT LISTEN ON " + path);
+    }
+
+    try {
+        //Connect to the lower ranks, retrying for up to ~10s until they are listening
+        for(int peer=0; peer<rank; peer++){
+            std::string peer_path = prefix + "." + std::to_string(peer);
+            sockaddr_un peer_addr = unix_address(peer_path);
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(fd < 0) _socket_error("COULD NOT CREATE SOCKET");
+            fds[peer] = fd;
+            int tries = 0;
+            while(connect(fd, (sockaddr *)&peer_addr, sizeof(peer_addr)) != 0){
+                if(errno != EINTR && ++tries >= 10000) _socket_error("COULD NOT CONNECT TO " + peer_path);
+                usleep(1000);
+            }
+            send(peer, &my_rank, sizeof(int));
+        }
+
+        //Accept the higher ranks, which introduce themselves
+        for(int i=rank+1; i<size; i++){
+            int fd = accept(listener, NULL, NULL);
+            if(fd < 0 && errno == EINTR) { i--; continue; }
+            if(fd < 0) _socket_error("COULD NOT ACCEPT PEER");
+            int peer;
+            bool got = _recv_all(fd, &peer, sizeof(int));
+            if(!got || peer <= rank || peer >= size || fds[peer] >= 0){
+                close(fd);
+                throw std::runtime_error("PEER DID NOT INTRODUCE ITSELF");
+            }
+            fds[peer] = fd;
+        }
+    }
+    catch(...){
+        close(listener);
+        for(int i=0; i<n_ranks; i++) if(fds[i] >= 0) close(fds[i]);
+        unlink(path.c_str());
+        throw;
+    }
+    close(listener);
+}
+/*###############################################################################################################*/
+inline UnixSocketTransport::~UnixSocketTransport() {
+    for(int i=0; i<n_ranks; i++) if(fds[i] >= 0) close(fds[i]);
+    unlink(path.c_str());
+}
+/*###############################################################################################################*/
+inline void UnixSocketTransport::send(int peer, const void * data, size_t bytes) {
+    if(!_send_all(fds[peer], data, bytes)) _socket_error("SEND TO RANK " + std::to_string(peer) + " FAILED");
+}
+/*###############################################################################################################*/
+inline void UnixSocketTransport::recv(int peer, void * data, size_t bytes) {
+    //A clean close leaves errno alone, say so rather than report a stale one
+    errno = 0;
+    if(!_recv_all(fds[peer], data, bytes)){
+        if(errno == 0) throw std::runtime_error("RANK " + std::to_string(peer) + " CLOSED THE CONNECTION");
+        _socket_error("RECV FROM RANK " + std::to_string(peer) + " FAILED");
+    }
+}
+/*###############################################################################################################*/
+inline void UnixSocketTransport::sendrecv(int to, const void * out, size_t out_bytes, int from, void * in, size_t in_bytes) {
+    //Interleave both directions with poll so neither side blocks on a full socket buffer
+    const char * out_ptr = (const char *)out;
+    char * in_ptr = (char *)in;
+    while(out_bytes > 0 || in_bytes > 0){
+        pollfd polled[2];
+        int n_polled = 0;
+        if(out_bytes > 0) polled[n_polled++] = {fds[to], POLLOUT, 0};
+        if(in_bytes > 0) polled[n_polled++] = {fds[from], POLLIN, 0};
+        if(poll(polled, n_polled, -1) < 0){
+            if(errno == EINTR) continue;
+            _socket_error("POLL FAILED");
+        }
+        for(int i=0; i<n_polled; i++){
+            if(polled[i].revents == 0) continue;
+            //Non blocking calls, a blocking write of a large message could wait on a peer that is also writing.
+            //POLLERR and POLLHUP fall through to the call, which then reports the error or the close.
+            if(polled[i].events == POLLOUT){
+                ssize_t n = ::send(fds[to], out_ptr, out_bytes, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+                if(n <= 0) _socket_error("SEND TO RANK " + std::to_string(to) + " FAILED");
+                out_ptr += n;
+                out_bytes -= n;
+            }
+            else {
+                ssize_t n = ::recv(fds[from], in_ptr, in_bytes, MSG_DONTWAIT);
+                if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+                if(n == 0) throw std::runtime_error("RANK " + std::to_string(from) + " CLOSED THE CONNECTION");
+                if(n < 0) _socket_error("RECV FROM RANK " + std::to_string(from) + " FAILED");
+                in_ptr += n;
+                in_bytes -= n;
+            }
+        }
+    }
+}
+
+/*###############################################################################################################*/
+/*                                                COLLECTIVES                                                    */
+/*###############################################################################################################*/
+template <typename T>
+class Communicator {
+    public:
+        Communicator(Transport * transport): transport(transport) {}
+
+        int rank() const { return transport->rank(); }
+        int size() const { return transport->size(); }
+
+        /***************************************************************
+        * void all_reduce(T * data, long n);
+        *
+        *   Description:
+        *       replaces data on every rank with the elementwise sum
+        *       over all ranks. Ring algorithm: every rank sends and
+        *       receives 2(size-1)/size * n elements regardless of size.
+        ***************************************************************/
+        void all_reduce(T * data, long n);
+
+        /***************************************************************
+        * void broadcast(T * data, long n, int root=0);
+        *
+        *   Description:
+        *       copies data from root to every rank along a binomial tree
+        ***************************************************************/
+        void broadcast(T * data, long n, int root=0);
+
+        /***************************************************************
+        * void all_gather(const T * in, long n, T * out);
+        *
+        *   Description:
+        *       out (size * n elements) receives the n elements of
+        *       every rank, ordered by rank
+        ***************************************************************/
+        void all_gather(const T * in, long n, T * out);
+
+        /*Tensor versions, the tensors are made contiguous first*/
+        void all_reduce(Tensor<T> * tensor);
+        void broadcast(Tensor<T> * tensor, int root=0);
+        void all_gather(Tensor<T> * in, Tensor<T> * out);
+
+    private:
+        Transport * transport;
+};
+/*###############################################################################################################*/
+template <typename T>
+void Communicator<T>::all_reduce(T * data, long n) {
+    int p = size(), r = rank();
+    if(p == 1) return;
+    int next = (r + 1) % p, prev = (r + p - 1) % p;
+
+    //Chunk c covers [begin[c], begin[c+1])
+    std::vector<long> begin;
+    for(int c=0; c<=p; c++) begin.push_back(n * c / p);
+    std::vector<T> incoming(begin[1] - begin[0] + 1);
+
+    //Reduce scatter: after p-1 steps rank r holds the full sum of chunk (r+1)%p
+    for(int step=0; step<p-1; step++){
+        int send_c = (r - step + p) % p;
+        int recv_c = (r - step - 1 + 2*p) % p;
+        long send_n = begin[send_c+1] - begin[send_c];
+        long recv_n = begin[recv_c+1] - begin[recv_c];
+        if((long)incoming.size() < recv_n) incoming.resize(recv_n);
+        transport->sendrecv(next, data + begin[send_c], sizeof(T) * send_n, prev, incoming.data(), sizeof(T) * recv_n);
+        T * dest = data + begin[recv_c];
+        for(long i=0; i<recv_n; i++) dest[i] += incoming[i];
+    }
+
+    //All gather: circulate the reduced chunks
+    for(int step=0; step<p-1; step++){
+        int send_c = (r + 1 - step + p) % p;
+        int recv_c = (r - step + p) % p;
+        transport->sendrecv(next, data + begin[send_c], sizeof(T) * (begin[send_c+1] - begin[send_c]),
+                            prev, data + begin[recv_c], sizeof(T) * (begin[recv_c+1] - begin[recv_c]));
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
+void Communicator<T>::broadcast(T * data, long n, int root) {
+    int p = size();
+    //Work in ranks relative to the root so the root is 0
+    int rel = (rank() - root + p) % p;
+    int mask = 1;
+    while(mask < p){
+        if(rel & mask){
+            transport->recv((rel - mask + root) % p, data, sizeof(T) * n);
+            break;
+        }
+        mask <<= 1;
+    }
+    //Forward to the subtree below this rank
+    mask >>= 1;
+    while(mask > 0){
+        if(rel + mask < p) transport->send((rel + mask + root) % p, data, sizeof(T) * n);
+        mask >>= 1;
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
+void Communicator<T>::all_gather(const T * in, long n, T * out) {
+    int p = size(), r = rank();
+    copyElements(n, out + (size_t)r * n, in);
+    int next = (r + 1) % p, prev = (r + p - 1) % p;
+    for(int step=0; step<p-1; step++){
+        int send_b = (r - step + p) % p;
+        int recv_b = (r - step - 1 + p) % p;
+        transport->sendrecv(next, out + (size_t)send_b * n, sizeof(T) * n, prev, out + (size_t)recv_b * n, sizeof(T) * n);
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
+void Communicator<T>::all_reduce(Tensor<T> * tensor) {
+    if(!tensor->is_contiguous()) tensor->as_contiguous();
+    all_reduce(tensor->getData(), tensor->getTotalElements());
+}
+/*###############################################################################################################*/
+template <typename T>
+void Communicator<T>::broadcast(Tensor<T> * tensor, int root) {
+    if(!tensor->is_contiguous()) tensor->as_contiguous();
+    broadcast(tensor->getData(), tensor->getTotalElements(), root);
+}
+/*###############################################################################################################*/
+template <typename T>
+void Communicator<T>::all_gather(Tensor<T> * in, Tensor<T> * out) {
+    assert(out->getTotalElements() == in->getTotalElements() * size());
+    if(!in->is_contiguous()) in->as_contiguous();
+    if(!out->is_contiguous()) out->as_contiguous();
+    all_gather(in->getData(), in->getTotalElements(), out->getData());
+}
+
+/*###############################################################################################################*/
+/*                                            GRADIENT SYNC                                                      */
+/*###############################################################################################################*/
+template <typename T>
+class GradientSync {
+/*
+    Averages a model's flat gradient buffer over every rank.
+    The buffer is cut into buckets of whole parameters. backward() marks
+    a bucket ready once all of its parameters have a final gradient and a
+    communication thread all reduces the buckets (in the same fixed order on
+    every rank) while the rest of backward is still running.
+*/
+    public:
+        GradientSync(Communicator<T> * comm, Module<T> * model, int bucket_els=1<<16);
+        ~GradientSync();
+
+        GradientSync(const GradientSync<T>&) = delete;
+        GradientSync<T> & operator=(const GradientSync<T>&) = delete;
+
+        /***************************************************************
+        * void backward(Tensor<T> * loss);
+        *
+        *   Description:
+        *       runs OPS::backward on loss and returns once every
+        *       bucket has been averaged over all ranks. A transport
+        *       failure on the communication thread is rethrown here,
+        *       by this and every later call.
+        ***************************************************************/
+        void backward(Tensor<T> * loss);
+
+    private:
+        void communicate();
+        void mark(int bucket);
+
+        Communicator<T> * comm;
+        Module<T> * model;
+        std::vector<long> bucket_begin;
+        std::vector<int> param_bucket;
+        std::vector<int> remaining;         //[bucket] params without a final gradient
+        std::vector<bool> ready;
+        int reduced = 0;
+        bool stop = false;
+        std::exception_ptr error;           //set once the communication thread failed, which then exits
+        std::mutex lock;
+        std::condition_variable changed;
+        std::thread worker;
+};
+/*###############################################################################################################*/
+template <typename T>
+GradientSync<T>::GradientSync(Communicator<T> * comm, Module<T> * model, int bucket_els)
+    : comm(comm), model(model) {
+    ParameterBuffer<T> * flat = model->flat();
+    //Backward finishes the last parameters first, so buckets are cut from the end
+    const std::vector<long> & offsets = flat->getOffsets();
+    std::vector<long> ends;
+    ends.push_back(flat->size());
+    param_bucket.resize(offsets.size());
+    for(int p=offsets.size()-1; p>=0; p--){
+        param_bucket[p] = ends.size() - 1;
+        if(ends.back() - offsets[p] >= bucket_els && p > 0) ends.push_back(offsets[p]);
+    }
+    if(offsets.empty() || ends.back() != 0) ends.push_back(0);
+    //bucket b covers [bucket_begin[b+1], bucket_begin[b])
+    bucket_begin = ends;
+    worker = std::thread(&GradientSync<T>::communicate, this);
+}
+/*###############################################################################################################*/
+template <typename T>
+GradientSync<T>::~GradientSync() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    changed.notify_all();
+    worker.join();
+}
+/*###############################################################################################################*/
+template <typename T>
+void GradientSync<T>::communicate() {
+    T * grad = model->flat()->getGrad();
+    int reduced_local = 0;
+    while(true){
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]{ return stop || (reduced_local < (int)ready.size() && ready[reduced_local]); });
+        if(stop) return;
+        int b = reduced_local;
+        guard.unlock();
+
+        long lo = bucket_begin[b+1], hi = bucket_begin[b];
+        try {
+            comm->all_reduce(grad + lo, hi - lo);
+        }
+        catch(...){
+            //Escaping the thread would terminate the process, backward() rethrows it instead
+            guard.lock();
+            error = std::current_exception();
+            guard.unlock();
+            changed.notify_all();
+            return;
+        }
+        T scale = (T)1 / comm->size();
+        for(long i=lo; i<hi; i++) grad[i] *= scale;
+
+        guard.lock();
+        ready[b] = false;
+        reduced = ++reduced_local;
+        if(reduced_local == (int)ready.size()) reduced_local = 0;
+        guard.unlock();
+        changed.notify_all();
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
+void GradientSync<T>::mark(int bucket) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(--remaining[bucket] > 0) return;
+        ready[bucket] = true;
+    }
+    changed.notify_all();
+}
+/*###############################################################################################################*/
+template <typename T>
+void GradientSync<T>::backward(Tensor<T> * loss) {
+    int n_buckets = bucket_begin.size() - 1;
+    std::vector<Tensor<T>*> params = model->parameters();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(error) std::rethrow_exception(error);
+        remaining.assign(n_buckets, 0);
+        for(size_t p=0; p<params.size(); p++) remaining[param_bucket[p]]++;
+        //A bucket without parameters (a model with none) is never marked, it is ready right away
+        ready.assign(n_buckets, false);
+        for(int b=0; b<n_buckets; b++) ready[b] = remaining[b] == 0;
+        reduced = 0;
+    }
+    changed.notify_all();
+
+    std::map<Tensor<T>*, int> index;
+    for(size_t p=0; p<params.size(); p++) index[params[p]] = p;
+    std::vector<bool> done(params.size(), false);
+    auto leaf_ready = [&](Tensor<T> * leaf){
+        typename std::map<Tensor<T>*, int>::const_iterator it = index.find(leaf);
+        if(it == index.end() || done[it->second]) return;
+        done[it->second] = true;
+        mark(param_bucket[it->second]);
+    };
+    OPS::backward(loss, std::function<void(Tensor<T>*)>(leaf_ready));
+    //Parameters outside of the graph still take part in the reduction
+    for(size_t p=0; p<params.size(); p++) leaf_ready(params[p]);
+
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&]{ return reduced == n_buckets || error; });
+    if(error) std::rethrow_exception(error);
+}
+
+/*###############################################################################################################*/
+/*                                              LOCAL LAUNCHER                                                   */
+/*###############################################################################################################*/
+/***************************************************************
+* bool spawn_local(int n, const std::function<bool(Transport *)> & fn);
+*
+*   Description:
+*       forks n processes connected by a UnixSocketTransport
+*       and runs fn in each of them
+*
+*   Returns:
+*       true if fn returned true in every process
+***************************************************************/
+inline bool spawn_local(int n, const std::function<bool(Transport *)> & fn) {
+    std::string prefix = "/tmp/lennygrad." + std::to_string(getpid());
+    std::cout.flush();
+    std::vector<pid_t> children;
+    for(int r=0; r<n; r++){
+        pid_t pid = fork();
+        assert(pid >= 0 && "FORK FAILED");
+        if(pid == 0){
+            bool passed;
+            try {
+                UnixSocketTransport transport(r, n, prefix);
+                passed = fn(&transport);
+            }
+            catch(const std::exception & e){
+                std::cerr << "RANK " << r << ": " << e.what() << std::endl;
+                passed = false;
+            }
+            std::cout.flush();
+            _exit(passed ? 0 : 1);
+        }
+        children.push_back(pid);
+    }
+    bool passed = true;
+    for(int r=0; r<n; r++){
+        int status;
+        waitpid(children[r], &status, 0);
+        passed &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return passed;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <vector>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+
+#include "half.h"
+#include "threadpool.h"
+
+/*
+    Reduced precision copies of tensors kept for backward
+    (see Tensor::pack and OPS::pack_graph).
+        - SAVED_BF16 / SAVED_FP16: 2 bytes per element
+        - SAVED_INT8: 1 byte per element plus a float scale per
+          PACK_INT8_BLOCK elements (absmax / 127 of the block)
+*/
+enum SavedFormat { SAVED_FULL, SAVED_BF16, SAVED_FP16, SAVED_INT8 };
+
+//Elements sharing one int8 scale
+const int PACK_INT8_BLOCK = 64;
+
+class PackedStorage {
+    public:
+        /***************************************************************
+        * PackedStorage(const T * x, long n, SavedFormat format);
+        *
+        *   Description:
+        *       encodes the n elements of x in format (not SAVED_FULL)
+        ***************************************************************/
+        template <typename T>
+        PackedStorage(const T * x, long n, SavedFormat format);
+
+        /***************************************************************
+        * void decode(T * out) const;
+        *
+        *   Description:
+        *       writes the n decoded elements to out
+        ***************************************************************/
+        template <typename T>
+        void decode(T * out) const;
+
+        /***************************************************************
+        * size_t bytes() const;
+        * SavedFormat format() const { return fmt; }
+        *
+        *   Returns:
+        *       the bytes the encoded elements take, and their format
+        ***************************************************************/
+        size_t bytes() const { return halfs.size() * sizeof(uint16_t) + q.size() + scales.size() * sizeof(float); }
+        SavedFormat format() const { return fmt; }
+
+    private:
+        SavedFormat fmt;
+        long n;
+        std::vector<uint16_t> halfs;
+        std::vector<int8_t> q;
+        std::vector<float> scales;
+};
+/*###############################################################################################################*/
+template <typename T>
+PackedStorage::PackedStorage(const T * x, long n, SavedFormat format): fmt(format), n(n) {
+    assert(format != SAVED_FULL && "NOTHING TO PACK IN FULL PRECISION");
+    if(format == SAVED_BF16) { halfs.resize(n); to_bf16(x, n, halfs.data()); return; }
+    if(format == SAVED_FP16) { halfs.resize(n); to_half(x, n, halfs.data()); return; }
+
+    long blocks = (n + PACK_INT8_BLOCK - 1) / PACK_INT8_BLOCK;
+    q.resize(n);
+    scales.resize(blocks);
+    parallel_for(0, blocks, 256, [&](int lo, int hi){
+        for(long b=lo; b<hi; b++){
+            long begin = b * PACK_INT8_BLOCK, end = std::min(n, begin + PACK_INT8_BLOCK);
+            float absmax = 0;
+            for(long i=begin; i<end; i++) absmax = std::max(absmax, std::fabs((float)x[i]));
+            float scale = absmax / 127, inv = absmax > 0 ? 127 / absmax : 0;
+            scales[b] = scale;
+            for(long i=begin; i<end; i++) q[i] = (int8_t)std::lrint((float)x[i] * inv);
+        }
+    });
+}
+
+template <typename T>
+void PackedStorage::decode(T * out) const {
+    if(fmt == SAVED_BF16) { from_bf16(halfs.data(), n, out); return; }
+    if(fmt == SAVED_FP16) { from_half(halfs.data(), n, out); return; }
+    long blocks = scales.size();
+    parallel_for(0, blocks, 256, [&](int lo, int hi){
+        for(long b=lo; b<hi; b++){
+            long begin = b * PACK_INT8_BLOCK, end = std::min(n, begin + PACK_INT8_BLOCK);
+            for(long i=begin; i<end; i++) out[i] = (T)(q[i] * scales[b]);
+        }
+    });
+}
+
+#endif
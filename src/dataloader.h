@@ -0,0 +1,453 @@
+#ifndef DATALOADER_H_
+#define DATALOADER_H_
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tensor.h"
+#include "utils.h"
+
+/*
+    Input pipeline
+    A Dataset decodes single samples into caller provided memory.
+    The DataLoader runs a pool of worker threads which collate samples
+    into preallocated batch tensors held in a bounded ring, so the
+    training loop only waits when every worker has fallen behind.
+
+    Binary array format (written by save_array):
+        char[4]   magic "LGAR"
+        int32     element size in bytes
+        int32     n_dims
+        int32     dims[n_dims]        (dims[0] is the number of samples)
+        T         data[]              (C contiguous)
+*/
+
+const char ARRAY_MAGIC[4] = {'L', 'G', 'A', 'R'};
+
+/***************************************************************
+* void save_array(Tensor<T> * tensor, const std::string & path);
+*
+*   Description:
+*       Writes the tensor to path in the binary array format
+***************************************************************/
+template <typename T>
+void save_array(Tensor<T> * tensor, const std::string & path) {
+    if(!tensor->is_contiguous()) tensor->as_contiguous();
+    std::ofstream out(path, std::ios::binary);
+    assert(out.good() && "COULD NOT OPEN FILE");
+    int32_t el_size = sizeof(T);
+    int32_t n_dims = tensor->getNDims();
+    out.write(ARRAY_MAGIC, 4);
+    out.write((const char *)&el_size, sizeof(int32_t));
+    out.write((const char *)&n_dims, sizeof(int32_t));
+    for(int i=0; i<n_dims; i++){
+        int32_t dim = tensor->getDims()[i];
+        out.write((const char *)&dim, sizeof(int32_t));
+    }
+    out.write((const char *)tensor->getData(), sizeof(T) * tensor->getTotalElements());
+}
+
+/*###############################################################################################################*/
+/*                                                  DATASETS                                                     */
+/*###############################################################################################################*/
+template <typename T>
+class Dataset {
+/*
+    Abstract Class for datasets
+    All descendents of the Dataset class
+    Must implement size(), sampleShape() and read()
+    read() is called concurrently from the loader's workers
+*/
+    public:
+        virtual ~Dataset() {}
+
+        /***************************************************************
+        * int size() const;
+        *
+        *   Returns:
+        *       the number of samples in the dataset
+        ***************************************************************/
+        virtual int size() const = 0;
+
+        /***************************************************************
+        * const std::vector<int> & sampleShape() const;
+        *
+        *   Returns:
+        *       the dimensions of a single sample
+        ***************************************************************/
+        virtual const std::vector<int> & sampleShape() const = 0;
+
+        /***************************************************************
+        * void read(int index, T * dest) const;
+        *
+        *   Description:
+        *       decodes sample index into dest, dest has room
+        *       for sampleElements() values
+        ***************************************************************/
+        virtual void read(int index, T * dest) const = 0;
+
+        /***************************************************************
+        * int sampleElements() const;
+        *
+        *   Returns:
+        *       the number of values in a single sample
+        ***************************************************************/
+        int sampleElements() const {
+            int els = 1;
+            for(size_t i=0; i<sampleShape().size(); i++) els *= sampleShape()[i];
+            return els;
+        }
+};
+/*###############################################################################################################*/
+template <typename T>
+class TensorDataset: public Dataset<T> {
+/*
+    Serves the slices along the first dimension of an in memory tensor
+    The tensor must outlive the dataset
+*/
+    public:
+        TensorDataset(Tensor<T> * tensor): tensor(tensor) {
+            assert(tensor->getNDims() >= 1);
+            if(!tensor->is_contiguous()) tensor->as_contiguous();
+            for(int i=1; i<tensor->getNDims(); i++) shape.push_back(tensor->getDims()[i]);
+        }
+
+        int size() const { return tensor->getDims()[0]; }
+        const std::vector<int> & sampleShape() const { return shape; }
+        void read(int index, T * dest) const {
+            int els = this->sampleElements();
+            std::memcpy(dest, tensor->getData() + (size_t)index * els, sizeof(T) * els);
+        }
+
+    private:
+        Tensor<T> * tensor;
+        std::vector<int> shape;
+};
+/*###############################################################################################################*/
+template <typename T>
+class ArrayFileDataset: public Dataset<T> {
+/*
+    Memory maps a file written by save_array,
+    samples are paged in by the OS as the workers touch them
+*/
+    public:
+        ArrayFileDataset(const std::string & path);
+        ~ArrayFileDataset();
+
+        int size() const { return n_samples; }
+        const std::vector<int> & sampleShape() const { return shape; }
+        void read(int index, T * dest) const {
+            assert(index < n_samples && "OUT OF BOUNDS ERROR");
+            int els = this->sampleElements();
+            std::memcpy(dest, values + (size_t)index * els, sizeof(T) * els);
+        }
+
+    private:
+        int fd;
+        void * mapped;
+        size_t mapped_bytes;
+        const T * values;
+        int n_samples;
+        std::vector<int> shape;
+};
+/*###############################################################################################################*/
+template <typename T>
+ArrayFileDataset<T>::ArrayFileDataset(const std::string & path) {
+    fd = open(path.c_str(), O_RDONLY);
+    assert(fd >= 0 && "COULD NOT OPEN FILE");
+    struct stat info;
+    fstat(fd, &info);
+    mapped_bytes = info.st_size;
+    mapped = mmap(NULL, mapped_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(mapped != MAP_FAILED && "COULD NOT MAP FILE");
+
+    //Parse the header
+    const char * bytes = (const char *)mapped;
+    assert(std::memcmp(bytes, ARRAY_MAGIC, 4) == 0 && "NOT AN ARRAY FILE");
+    int32_t header[2];
+    std::memcpy(header, bytes + 4, sizeof(header));
+    assert(header[0] == sizeof(T) && "ELEMENT SIZE MISMATCH");
+    int32_t dims[header[1]];
+    std::memcpy(dims, bytes + 4 + sizeof(header), sizeof(int32_t) * header[1]);
+    n_samples = dims[0];
+    for(int i=1; i<header[1]; i++) shape.push_back(dims[i]);
+
+    size_t offset = 4 + sizeof(header) + sizeof(int32_t) * header[1];
+    values = (const T *)(bytes + offset);
+    assert(offset + sizeof(T) * (size_t)n_samples * this->sampleElements() <= mapped_bytes && "TRUNCATED ARRAY FILE");
+}
+/*###############################################################################################################*/
+template <typename T>
+ArrayFileDataset<T>::~ArrayFileDataset() {
+    munmap(mapped, mapped_bytes);
+    close(fd);
+}
+
+/*###############################################################################################################*/
+/*                                                  LOADER                                                       */
+/*###############################################################################################################*/
+template <typename T>
+struct Batch {
+    Tensor<T> * input = NULL;   //(size, sample dims...) owned by the loader
+    Tensor<T> * target = NULL;  //NULL when the loader has no targets
+    int size = 0;
+};
+
+struct LoaderStats {
+    long batches = 0;
+    double stall_seconds = 0;   //time the consumer spent waiting in next()
+    double worker_seconds = 0;  //time the workers spent decoding and collating
+};
+
+template <typename T>
+class DataLoader {
+    public:
+        DataLoader(Dataset<T> * inputs, Dataset<T> * targets, int batch_size, int n_workers=2,
+                   int prefetch=4, bool shuffle=true, bool drop_last=true, unsigned seed=0);
+        ~DataLoader();
+
+        DataLoader(const DataLoader<T>&) = delete;
+        DataLoader<T> & operator=(const DataLoader<T>&) = delete;
+
+        /***************************************************************
+        * void start_epoch();
+        *
+        *   Description:
+        *       Reshuffles (if enabled) and lets the workers begin
+        *       filling the ring with the batches of a new epoch
+        ***************************************************************/
+        void start_epoch();
+
+        /***************************************************************
+        * bool next(Batch<T> & batch);
+        *
+        *   Description:
+        *       Releases the previously returned batch and waits for
+        *       the next one. The batch tensors stay valid until the
+        *       following call to next().
+        *
+        *   Returns:
+        *       false once every batch of the epoch has been returned
+        ***************************************************************/
+        bool next(Batch<T> & batch);
+
+        /***************************************************************
+        * int batches() const { return n_batches; }
+        *
+        *   Returns:
+        *       the number of batches in an epoch
+        ***************************************************************/
+        int batches() const { return n_batches; }
+
+        /***************************************************************
+        * LoaderStats stats() const;
+        *
+        *   Returns:
+        *       the accumulated stall and worker times
+        ***************************************************************/
+        LoaderStats stats() const;
+
+    private:
+        enum SlotState { FREE, FILLING, READY };
+        struct Slot {
+            Batch<T> full;
+            SlotState state = FREE;
+            int batch = -1;
+        };
+
+        void work();
+        Tensor<T> * allocate(Dataset<T> * data, int rows);
+
+        Dataset<T> * inputs;
+        Dataset<T> * targets;
+        int batch_size;
+        bool shuffle;
+        int n_batches;
+        std::vector<int> order;
+        std::default_random_engine rng;
+
+        std::vector<Slot> ring;
+        Batch<T> tail;          //Used for the smaller last batch when drop_last is false
+        int tail_size;
+        int next_fill = 0;
+        int current = -1;
+        bool started = false;
+        bool stop = false;
+
+        LoaderStats totals;
+        mutable std::mutex lock;
+        std::condition_variable changed;
+        std::vector<std::thread> workers;
+};
+/*###############################################################################################################*/
+template <typename T>
+DataLoader<T>::DataLoader(Dataset<T> * inputs, Dataset<T> * targets, int batch_size, int n_workers,
+                          int prefetch, bool shuffle, bool drop_last, unsigned seed)
+    : inputs(inputs), targets(targets), batch_size(batch_size), shuffle(shuffle), rng(seed) {
+    assert(batch_size > 0 && n_workers > 0 && prefetch > 0);
+    assert(targets == NULL || targets->size() == inputs->size());
+
+    n_batches = inputs->size() / batch_size;
+    tail_size = drop_last ? 0 : inputs->size() % batch_size;
+    if(tail_size > 0) n_batches++;
+
+    for(int i=0; i<inputs->size(); i++) order.push_back(i);
+
+    //Preallocate the ring so steady state loading never allocates
+    ring.resize(prefetch);
+    for(int i=0; i<prefetch; i++){
+        ring[i].full.input = allocate(inputs, batch_size);
+        ring[i].full.target = targets == NULL ? NULL : allocate(targets, batch_size);
+        ring[i].full.size = batch_size;
+    }
+    if(tail_size > 0){
+        tail.input = allocate(inputs, tail_size);
+        tail.target = targets == NULL ? NULL : allocate(targets, tail_size);
+        tail.size = tail_size;
+    }
+
+    for(int i=0; i<n_workers; i++) workers.push_back(std::thread(&DataLoader<T>::work, this));
+}
+/*###############################################################################################################*/
+template <typename T>
+DataLoader<T>::~DataLoader() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    changed.notify_all();
+    for(size_t i=0; i<workers.size(); i++) workers[i].join();
+
+    for(size_t i=0; i<ring.size(); i++){
+        delete ring[i].full.input;
+        if(ring[i].full.target != NULL) delete ring[i].full.target;
+    }
+    if(tail.input != NULL) delete tail.input;
+    if(tail.target != NULL) delete tail.target;
+}
+/*###############################################################################################################*/
+template <typename T>
+Tensor<T> * DataLoader<T>::allocate(Dataset<T> * data, int rows) {
+    std::vector<int> dims;
+    dims.push_back(rows);
+    dims.insert(dims.end(), data->sampleShape().begin(), data->sampleShape().end());
+    Tensor<T> * out = new Tensor<T>((int)dims.size(), dims.data());
+    out->no_history();
+    return out;
+}
+/*###############################################################################################################*/
+template <typename T>
+void DataLoader<T>::start_epoch() {
+    std::unique_lock<std::mutex> guard(lock);
+    //Let in flight batches of the previous epoch finish before reusing the slots
+    changed.wait(guard, [this]{
+        for(size_t i=0; i<ring.size(); i++) if(ring[i].state == FILLING) return false;
+        return true;
+    });
+    if(shuffle) std::shuffle(order.begin(), order.end(), rng);
+    for(size_t i=0; i<ring.size(); i++) ring[i].state = FREE;
+    next_fill = 0;
+    current = -1;
+    started = true;
+    guard.unlock();
+    changed.notify_all();
+}
+/*###############################################################################################################*/
+template <typename T>
+void DataLoader<T>::work() {
+    while(true){
+        //Claim the next batch once its slot in the ring has been released
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this]{
+            return stop || (started && next_fill < n_batches && ring[next_fill % ring.size()].state == FREE);
+        });
+        if(stop) return;
+        int b = next_fill++;
+        Slot & slot = ring[b % ring.size()];
+        slot.state = FILLING;
+        slot.batch = b;
+        Batch<T> & dest = (tail_size > 0 && b == n_batches-1) ? tail : slot.full;
+        guard.unlock();
+
+        //Decode and collate outside of the lock
+        auto begin = std::chrono::steady_clock::now();
+        int in_els = inputs->sampleElements();
+        int out_els = targets == NULL ? 0 : targets->sampleElements();
+        for(int i=0; i<dest.size; i++){
+            int index = order[b * batch_size + i];
+            inputs->read(index, dest.input->getData() + (size_t)i * in_els);
+            if(targets != NULL) targets->read(index, dest.target->getData() + (size_t)i * out_els);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+
+        guard.lock();
+        slot.state = READY;
+        totals.worker_seconds += elapsed.count();
+        guard.unlock();
+        changed.notify_all();
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
+bool DataLoader<T>::next(Batch<T> & batch) {
+    std::unique_lock<std::mutex> guard(lock);
+    if(!started){
+        guard.unlock();
+        start_epoch();
+        guard.lock();
+    }
+
+    //Release the batch returned by the previous call
+    if(current >= 0) {
+        ring[current % ring.size()].state = FREE;
+        changed.notify_all();
+    }
+    current++;
+    if(current >= n_batches) {
+        started = false;
+        return false;
+    }
+
+    Slot & slot = ring[current % ring.size()];
+    auto begin = std::chrono::steady_clock::now();
+    changed.wait(guard, [this, &slot]{ return slot.state == READY && slot.batch == current; });
+    std::chrono::duration<double> stalled = std::chrono::steady_clock::now() - begin;
+    totals.stall_seconds += stalled.count();
+    totals.batches++;
+
+    batch = (tail_size > 0 && current == n_batches-1) ? tail : slot.full;
+    return true;
+}
+/*###############################################################################################################*/
+template <typename T>
+LoaderStats DataLoader<T>::stats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return totals;
+}
+/*###############################################################################################################*/
+inline std::ostream & operator<<(std::ostream & ostr, const LoaderStats & stats) {
+    ostr << "BATCHES: " << stats.batches << std::endl;
+    ostr << "STALL TIME: " << stats.stall_seconds << "s";
+    if(stats.batches > 0) ostr << " (" << 1000 * stats.stall_seconds / stats.batches << "ms per batch)";
+    ostr << std::endl;
+    ostr << "WORKER TIME: " << stats.worker_seconds << "s" << std::endl;
+    return ostr;
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef EXPR_H_
+#define EXPR_H_
+
+#include <vector>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <type_traits>
+
+#include "tensor.h"
+#include "ops.h"
+#include "threadpool.h"
+
+/*
+    Lazy elementwise expressions.
+    LAZY::ADD, SUB, MULT, DIV, NEG, EXP and ReLU mirror the OPS:: calls but
+    return an expression node instead of a Tensor, so a chain like
+    LAZY::EXP(LAZY::NEG(LAZY::ADD(a, b))) is a single type known at compile time.
+    LAZY::eval materializes it with one loop over the elements (no temporaries,
+    one Op in the graph) and the Op's back() walks the same tree once per element,
+    recomputing the intermediate values instead of storing them.
+    Every tensor in an expression must have the same shape.
+*/
+namespace LAZY {
+
+    //Marks expression nodes
+    struct _Expr {};
+
+    template <typename T>
+    struct Leaf: _Expr {
+        typedef T value_type;
+        Tensor<T> * tensor;
+        const T * x = NULL;
+        T * grad = NULL;
+
+        Leaf(Tensor<T> * tensor): tensor(tensor) {}
+        T value(size_t i) const { return x[i]; }
+        void backprop(size_t i, T g) const { grad[i] += g; }
+        void collect(std::vector<Tensor<T>*> & tensors) const {
+            if(std::find(tensors.begin(), tensors.end(), tensor) == tensors.end()) tensors.push_back(tensor);
+        }
+        void bind(bool with_grad) {
+            x = tensor->getData();
+            grad = with_grad ? tensor->getGrad()->getData() : NULL;
+        }
+    };
+
+    template <typename T>
+    struct Scalar: _Expr {
+        typedef T value_type;
+        T c;
+
+        Scalar(T c): c(c) {}
+        T value(size_t) const { return c; }
+        void backprop(size_t, T) const {}
+        void collect(std::vector<Tensor<T>*> &) const {}
+        void bind(bool) {}
+    };
+
+    template <typename F, typename E>
+    struct Unary: _Expr {
+        typedef typename E::value_type value_type;
+        E e;
+
+        Unary(const E & e): e(e) {}
+        value_type value(size_t i) const { return F::f(e.value(i)); }
+        void backprop(size_t i, value_type g) const {
+            value_type x = e.value(i);
+            e.backprop(i, g * F::df(x, F::f(x)));
+        }
+        void collect(std::vector<Tensor<value_type>*> & tensors) const { e.collect(tensors); }
+        void bind(bool with_grad) { e.bind(with_grad); }
+    };
+
+    template <typename F, typename L, typename R>
+    struct Binary: _Expr {
+        typedef typename L::value_type value_type;
+        static_assert(std::is_same<value_type, typename R::value_type>::value, "MIXED TYPES IN EXPRESSION");
+        L l;
+        R r;
+
+        Binary(const L & l, const R & r): l(l), r(r) {}
+        value_type value(size_t i) const { return F::f(l.value(i), r.value(i)); }
+        void backprop(size_t i, value_type g) const {
+            value_type a = l.value(i), b = r.value(i);
+            l.backprop(i, g * F::da(a, b));
+            r.backprop(i, g * F::db(a, b));
+        }
+        void collect(std::vector<Tensor<value_type>*> & tensors) const {
+            l.collect(tensors);
+            r.collect(tensors);
+        }
+        void bind(bool with_grad) {
+            l.bind(with_grad);
+            r.bind(with_grad);
+        }
+    };
+
+    /*
+        Elementwise functions: value and local derivatives
+    */
+    struct _add  { template <typename T> static T f(T a, T b) { return a + b; }
+                   template <typename T> static T da(T, T) { return 1; }
+                   template <typename T> static T db(T, T) { return 1; } };
+    struct _sub  { template <typename T> static T f(T a, T b) { return a - b; }
+                   template <typename T> static T da(T, T) { return 1; }
+                   template <typename T> static T db(T, T) { return -1; } };
+    struct _mult { template <typename T> static T f(T a, T b) { return a * b; }
+                   template <typename T> static T da(T, T b) { return b; }
+                   template <typename T> static T db(T a, T) { return a; } };
+    struct _div  { template <typename T> static T f(T a, T b) { return a / b; }
+                   template <typename T> static T da(T, T b) { return 1 / b; }
+                   template <typename T> static T db(T a, T b) { return -a / (b * b); } };
+    struct _neg  { template <typename T> static T f(T x) { return -x; }
+                   template <typename T> static T df(T, T) { return -1; } };
+    struct _exp  { template <typename T> static T f(T x) { return std::exp(x); }
+                   template <typename T> static T df(T, T y) { return y; } };
+    struct _relu { template <typename T> static T f(T x) { return x > 0 ? x : 0; }
+                   template <typename T> static T df(T x, T) { return x > 0 ? 1 : 0; } };
+
+    //Tensors become leaves, expressions are used as they are
+    template <typename T>
+    Leaf<T> _node(Tensor<T> * t) { return Leaf<T>(t); }
+
+    template <typename E, typename = typename std::enable_if<std::is_base_of<_Expr, E>::value>::type>
+    const E & _node(const E & e) { return e; }
+
+    template <typename A>
+    using _node_t = typename std::decay<decltype(_node(std::declval<A>()))>::type;
+
+    /***************************************************************
+    * Scalar<T> constant(T c);
+    *
+    *   Returns:
+    *       an expression that is c everywhere
+    ***************************************************************/
+    template <typename T>
+    Scalar<T> constant(T c) { return Scalar<T>(c); }
+
+    template <typename A, typename B>
+    Binary<_add, _node_t<A>, _node_t<B>> ADD(const A & a, const B & b) { return {_node(a), _node(b)}; }
+
+    template <typename A, typename B>
+    Binary<_sub, _node_t<A>, _node_t<B>> SUB(const A & a, const B & b) { return {_node(a), _node(b)}; }
+
+    template <typename A, typename B>
+    Binary<_mult, _node_t<A>, _node_t<B>> MULT(const A & a, const B & b) { return {_node(a), _node(b)}; }
+
+    template <typename A, typename B>
+    Binary<_div, _node_t<A>, _node_t<B>> DIV(const A & a, const B & b) { return {_node(a), _node(b)}; }
+
+    template <typename A>
+    Unary<_neg, _node_t<A>> NEG(const A & a) { return {_node(a)}; }
+
+    template <typename A>
+    Unary<_exp, _node_t<A>> EXP(const A & a) { return {_node(a)}; }
+
+    template <typename A>
+    Unary<_relu, _node_t<A>> ReLU(const A & a) { return {_node(a)}; }
+}
+
+//Operator Descendent for a fused expression
+template <typename T, typename E>
+class _FUSED: public Op<T>{
+    public:
+    _FUSED(Tensor<T>*output, const std::vector<Tensor<T>*> & inputs, const E & expr)
+        : Op<T>(output, inputs.size(), inputs.data()), expr(expr) {}
+
+    void back(){
+        assert(this->history);
+        for(int i=0; i < this->n_in; i++){
+            if(!this->inputs[i]->is_contiguous()) this->inputs[i]->as_contiguous();
+            this->inputs[i]->reshape_grad(this->inputs[i]->getNDims(), this->inputs[i]->getDims());
+        }
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+
+        //One pass: every element pushes its gradient down the whole tree
+        expr.bind(true);
+        parallel_for(0, this->output->getTotalElements(), 1 << 14, [&](long lo, long hi){
+            for(long i=lo; i<hi; i++) expr.backprop(i, g[i]);
+        });
+    }
+
+    private:
+    E expr;
+};
+
+namespace LAZY {
+
+    /***************************************************************
+    * Tensor<T> * eval(E expr);
+    *
+    *   Description:
+    *       Computes the expression in one pass over the elements.
+    *       The result is a single node in the graph whose inputs
+    *       are the distinct tensors of the expression.
+    *
+    *   Returns:
+    *       A new tensor with the shape of the expression's tensors
+    ***************************************************************/
+    template <typename E, typename T = typename E::value_type>
+    Tensor<T> * eval(E expr) {
+        std::vector<Tensor<T>*> inputs;
+        expr.collect(inputs);
+        assert(!inputs.empty() && "EXPRESSION HAS NO TENSORS");
+        for(size_t k=0; k<inputs.size(); k++){
+            assert(inputs[k]->getNDims() == inputs[0]->getNDims() && "EXPRESSION SHAPES DIFFER");
+            for(int d=0; d<inputs[0]->getNDims(); d++)
+                assert(inputs[k]->getDims()[d] == inputs[0]->getDims()[d] && "EXPRESSION SHAPES DIFFER");
+            if(!inputs[k]->is_contiguous()) inputs[k]->as_contiguous();
+        }
+
+        Tensor<T> * out = new Tensor<T>(inputs[0]->getNDims(), inputs[0]->getDims());
+        T * y = out->getData();
+        expr.bind(false);
+        parallel_for(0, out->getTotalElements(), 1 << 14, [&](long lo, long hi){
+            for(long i=lo; i<hi; i++) y[i] = expr.value(i);
+        });
+
+        // Set up Out Tensor
+        _FUSED<T, E> * fused = new _FUSED<T, E>(out, inputs, expr);
+        out->setOP(dynamic_cast<Op<T>*>(fused));
+        return out;
+    }
+
+    //Tensors evaluate to themselves, handy in generic code
+    template <typename T>
+    Tensor<T> * eval(Tensor<T> * t) { return t; }
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef FIXED_TENSOR_H_
+#define FIXED_TENSOR_H_
+
+#include <array>
+#include <vector>
+#include <cassert>
+#include <utility>
+
+#include "tensor.h"
+
+/*
+    Fixed rank tensors.
+    FixedTensor<T, Rank> keeps its dims and strides in std::arrays
+    instead of heap arrays sized at run time, so indexing is Rank
+    multiply-adds with no loop, no va_args and no bounds loop, and
+    nested loops over the dims unroll. It either owns its elements
+    (row major) or views the storage of a Tensor<T> with the tensor's
+    strides, so a transposed tensor is viewed without a copy.
+    to_tensor() goes back to a dynamic Tensor<T>.
+    Shapes fixed at compile time use StaticShape<D...>, whose strides
+    are computed by the same constexpr helpers.
+*/
+
+/***************************************************************
+* constexpr std::array<long, Rank> row_major_strides(const std::array<int, Rank> & dims);
+* constexpr long shape_size(const std::array<int, Rank> & dims);
+*
+*   Returns:
+*       the C contiguous strides of dims and its number of elements
+***************************************************************/
+template <size_t Rank>
+constexpr std::array<long, Rank> row_major_strides(const std::array<int, Rank> & dims) {
+    std::array<long, Rank> strides{};
+    long mult = 1;
+    for(int i=(int)Rank-1; i>=0; i--){
+        strides[i] = mult;
+        mult *= dims[i];
+    }
+    return strides;
+}
+
+template <size_t Rank>
+constexpr long shape_size(const std::array<int, Rank> & dims) {
+    long size = 1;
+    for(size_t i=0; i<Rank; i++) size *= dims[i];
+    return size;
+}
+
+//sum_i idx[i] * strides[i], written out for every i
+template <size_t Rank, size_t... I>
+constexpr long _offset(const std::array<long, Rank> & strides, const std::array<long, Rank> & idx, std::index_sequence<I...>) {
+    return (0 + ... + (idx[I] * strides[I]));
+}
+
+template <int... D>
+struct StaticShape {
+    static constexpr size_t rank = sizeof...(D);
+    static constexpr std::array<int, rank> dims = {D...};
+    static constexpr std::array<long, rank> strides = row_major_strides(dims);
+    static constexpr long size = shape_size(dims);
+
+    template <typename... I>
+    static constexpr long offset(I... i) {
+        static_assert(sizeof...(I) == rank, "ONE INDEX PER DIMENSION");
+        return _offset(strides, std::array<long, rank>{(long)i...}, std::make_index_sequence<rank>());
+    }
+};
+/*###############################################################################################################*/
+template <typename T, int Rank>
+class FixedTensor {
+    static_assert(Rank >= 1, "RANK MUST BE POSITIVE");
+
+    public:
+        /***************************************************************
+        * FixedTensor(const std::array<int, Rank> & dims);
+        * FixedTensor(Tensor<T> * tensor);
+        *
+        *   Description:
+        *       a new zero filled row major tensor, or a view of the
+        *       elements of tensor (which must have Rank dims and
+        *       readable data, and outlive the view)
+        ***************************************************************/
+        FixedTensor(const std::array<int, Rank> & dims);
+        FixedTensor(Tensor<T> * tensor);
+
+        //A copy of a view is another view of the same elements
+        FixedTensor(const FixedTensor<T, Rank> & other);
+        FixedTensor<T, Rank> & operator=(const FixedTensor<T, Rank> & other);
+        FixedTensor(FixedTensor<T, Rank>&& other) = default;
+        FixedTensor<T, Rank> & operator=(FixedTensor<T, Rank>&& other) = default;
+
+        /***************************************************************
+        * T & operator()(I... i) const;
+        * T & operator[](const std::array<int, Rank> & idx) const;
+        *
+        *   Returns:
+        *       the element at (i0, i1, ...), not bounds checked
+        ***************************************************************/
+        template <typename... I>
+        T & operator()(I... i) const {
+            static_assert(sizeof...(I) == Rank, "ONE INDEX PER DIMENSION");
+            return ptr[_offset(step, std::array<long, Rank>{(long)i...}, std::make_index_sequence<Rank>())];
+        }
+        T & operator[](const std::array<int, Rank> & idx) const {
+            std::array<long, Rank> i;
+            for(int d=0; d<Rank; d++) i[d] = idx[d];
+            return ptr[_offset(step, i, std::make_index_sequence<Rank>())];
+        }
+
+        /***************************************************************
+        * void for_each(F fn) const;
+        *
+        *   Description:
+        *       calls fn(T &) on every element in row major order
+        ***************************************************************/
+        template <typename F>
+        void for_each(F fn) const { walk<0>(ptr, fn); }
+
+        /***************************************************************
+        * Tensor<T> * to_tensor() const;
+        *
+        *   Returns:
+        *       a new contiguous Tensor<T> holding a copy of the elements
+        ***************************************************************/
+        Tensor<T> * to_tensor() const;
+
+        const std::array<int, Rank> & dims() const { return shape; }
+        const std::array<long, Rank> & strides() const { return step; }
+        int dim(int i) const { return shape[i]; }
+        long size() const { return shape_size(shape); }
+        T * data() const { return ptr; }
+        bool owns_data() const { return !storage.empty() && ptr == storage.data(); }
+        bool is_contiguous() const { return step == row_major_strides(shape); }
+
+    private:
+        template <int D, typename F>
+        void walk(T * p, F & fn) const {
+            if constexpr (D == Rank - 1) {
+                if(step[D] == 1) for(int i=0; i<shape[D]; i++) fn(p[i]);
+                else for(int i=0; i<shape[D]; i++) fn(p[i * step[D]]);
+            }
+            else {
+                for(int i=0; i<shape[D]; i++) walk<D + 1>(p + i * step[D], fn);
+            }
+        }
+
+        std::array<int, Rank> shape;
+        std::array<long, Rank> step;
+        std::vector<T> storage;
+        T * ptr;
+};
+/*###############################################################################################################*/
+template <typename T, int Rank>
+FixedTensor<T, Rank>::FixedTensor(const std::array<int, Rank> & dims)
+    : shape(dims), step(row_major_strides(dims)), storage(shape_size(dims), T(0)), ptr(storage.data()) {}
+/*###############################################################################################################*/
+template <typename T, int Rank>
+FixedTensor<T, Rank>::FixedTensor(Tensor<T> * tensor) {
+    assert(tensor->getNDims() == Rank && "RANK MISMATCH");
+    assert(tensor->getData() != NULL && "TENSOR HAS NO READABLE DATA");
+    for(int i=0; i<Rank; i++){
+        shape[i] = tensor->getDims()[i];
+        step[i] = tensor->getMults()[i];
+    }
+    ptr = tensor->getData();
+}
+/*###############################################################################################################*/
+template <typename T, int Rank>
+FixedTensor<T, Rank>::FixedTensor(const FixedTensor<T, Rank> & other)
+    : shape(other.shape), step(other.step), storage(other.storage), ptr(other.owns_data() ? storage.data() : other.ptr) {}
+/*###############################################################################################################*/
+template <typename T, int Rank>
+FixedTensor<T, Rank> & FixedTensor<T, Rank>::operator=(const FixedTensor<T, Rank> & other) {
+    if(this != &other){
+        shape = other.shape;
+        step = other.step;
+        storage = other.storage;
+        ptr = other.owns_data() ? storage.data() : other.ptr;
+    }
+    return *this;
+}
+/*###############################################################################################################*/
+template <typename T, int Rank>
+Tensor<T> * FixedTensor<T, Rank>::to_tensor() const {
+    Tensor<T> * out = new Tensor<T>(Rank, shape.data());
+    T * dst = out->getData();
+    for_each([&](T & x){ *dst++ = x; });
+    return out;
+}
+
+#endif
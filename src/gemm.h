@@ -0,0 +1,315 @@
+#ifndef GEMM_H_
+#define GEMM_H_
+
+#include <vector>
+#include <cassert>
+#include <algorithm>
+#include <utility>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+#include "threadpool.h"
+#include "half.h"
+
+/*
+    GEMM against a right operand packed once and reused (weights).
+    B (K, N) is cut into panels of nr columns stored k major (nr
+    consecutive values per k, the last panel zero padded), so a 4 x nr
+    tile reads one contiguous stream of B and broadcasts 4 values of A
+    per k. The epilogue (bias, ReLU, strided store) runs on each tile as
+    soon as it is computed. With AVX2/FMA a panel is two registers wide
+    (16 floats, 8 doubles) and the 8 sums of a tile stay in registers.
+    matmul() picks a kernel for one product of strided operands: a GEMV
+    when either side is a vector, fully unrolled kernels for sizes up to
+    SMALL_MATMUL, and the packed GEMM (packing B on every call) otherwise.
+*/
+
+//Register kernel: acc[r][c] = sum_k a[r][k] * b[k * nr + c]
+template <typename T>
+struct _gemm_micro {
+    static const int nr = 8;
+    static void tile(const T * const a[4], const T * b, int K, acc_t<T> acc[4][nr]) {
+        for(int r=0; r<4; r++)
+            for(int c=0; c<nr; c++) acc[r][c] = 0;
+        for(int k=0; k<K; k++, b+=nr)
+            for(int r=0; r<4; r++){
+                acc_t<T> x = a[r][k];
+                for(int c=0; c<nr; c++) acc[r][c] += x * (acc_t<T>)b[c];
+            }
+    }
+};
+
+#if defined(__AVX2__) && defined(__FMA__)
+template <>
+struct _gemm_micro<float> {
+    static const int nr = 16;
+    static void tile(const float * const a[4], const float * b, int K, float acc[4][nr]) {
+        __m256 c00 = _mm256_setzero_ps(), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00, c30 = c00, c31 = c00;
+        for(int k=0; k<K; k++, b+=nr){
+            __m256 b0 = _mm256_loadu_ps(b), b1 = _mm256_loadu_ps(b + 8);
+            __m256 x = _mm256_broadcast_ss(a[0] + k);
+            c00 = _mm256_fmadd_ps(x, b0, c00); c01 = _mm256_fmadd_ps(x, b1, c01);
+            x = _mm256_broadcast_ss(a[1] + k);
+            c10 = _mm256_fmadd_ps(x, b0, c10); c11 = _mm256_fmadd_ps(x, b1, c11);
+            x = _mm256_broadcast_ss(a[2] + k);
+            c20 = _mm256_fmadd_ps(x, b0, c20); c21 = _mm256_fmadd_ps(x, b1, c21);
+            x = _mm256_broadcast_ss(a[3] + k);
+            c30 = _mm256_fmadd_ps(x, b0, c30); c31 = _mm256_fmadd_ps(x, b1, c31);
+        }
+        _mm256_storeu_ps(acc[0], c00); _mm256_storeu_ps(acc[0] + 8, c01);
+        _mm256_storeu_ps(acc[1], c10); _mm256_storeu_ps(acc[1] + 8, c11);
+        _mm256_storeu_ps(acc[2], c20); _mm256_storeu_ps(acc[2] + 8, c21);
+        _mm256_storeu_ps(acc[3], c30); _mm256_storeu_ps(acc[3] + 8, c31);
+    }
+};
+
+template <>
+struct _gemm_micro<double> {
+    static const int nr = 8;
+    static void tile(const double * const a[4], const double * b, int K, double acc[4][nr]) {
+        __m256d c00 = _mm256_setzero_pd(), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00, c30 = c00, c31 = c00;
+        for(int k=0; k<K; k++, b+=nr){
+            __m256d b0 = _mm256_loadu_pd(b), b1 = _mm256_loadu_pd(b + 4);
+            __m256d x = _mm256_broadcast_sd(a[0] + k);
+            c00 = _mm256_fmadd_pd(x, b0, c00); c01 = _mm256_fmadd_pd(x, b1, c01);
+            x = _mm256_broadcast_sd(a[1] + k);
+            c10 = _mm256_fmadd_pd(x, b0, c10); c11 = _mm256_fmadd_pd(x, b1, c11);
+            x = _mm256_broadcast_sd(a[2] + k);
+            c20 = _mm256_fmadd_pd(x, b0, c20); c21 = _mm256_fmadd_pd(x, b1, c21);
+            x = _mm256_broadcast_sd(a[3] + k);
+            c30 = _mm256_fmadd_pd(x, b0, c30); c31 = _mm256_fmadd_pd(x, b1, c31);
+        }
+        _mm256_storeu_pd(acc[0], c00); _mm256_storeu_pd(acc[0] + 4, c01);
+        _mm256_storeu_pd(acc[1], c10); _mm256_storeu_pd(acc[1] + 4, c11);
+        _mm256_storeu_pd(acc[2], c20); _mm256_storeu_pd(acc[2] + 4, c21);
+        _mm256_storeu_pd(acc[3], c30); _mm256_storeu_pd(acc[3] + 4, c31);
+    }
+};
+#endif
+
+//Rows of A handed to one task
+const int GEMM_ROWS = 64;
+
+template <typename T>
+class PackedMatrix {
+/*
+    Element (k, n) of B is read at b[k * sk + n * sn], so both (K, N)
+    weights and transposed ones (CONV kernels (out, in * kh * kw)) are
+    packed without a copy
+*/
+    public:
+        static const int nr = _gemm_micro<T>::nr;
+
+        PackedMatrix() {}
+        PackedMatrix(const T * b, int K, int N, long sk, long sn): K(K), N(N) {
+            int panels = (N + nr - 1) / nr;
+            data.assign((size_t)panels * K * nr, 0);
+            for(int n=0; n<N; n++){
+                T * p = data.data() + (size_t)(n / nr) * K * nr + n % nr;
+                for(int k=0; k<K; k++) p[(size_t)k * nr] = b[k * sk + n * sn];
+            }
+        }
+
+        int rows() const { return K; }
+        int cols() const { return N; }
+        const T * panel(int j) const { return data.data() + (size_t)j * K * nr; }
+        size_t bytes() const { return data.size() * sizeof(T); }
+
+    private:
+        int K = 0;
+        int N = 0;
+        std::vector<T> data;
+};
+
+template <typename T>
+struct GemmEpilogue {
+/*
+    y = sum + bias[n], y = max(y, 0) if relu,
+    written to out[m * rs + n * cs], or with block > 0 to
+    out[m * rs + (n / block) * bs + (n % block) * cs]
+    (outputs whose columns are split into blocks, like NCHWc channels)
+*/
+    const T * bias = NULL;
+    bool relu = false;
+    T * out = NULL;
+    long rs = 0;
+    long cs = 1;
+    int block = 0;
+    long bs = 0;
+
+    long col(int n) const { return block > 0 ? (n / block) * bs + (n % block) * cs : n * cs; }
+};
+
+/***************************************************************
+* void gemm_packed(const T * A, long lda, int M, const PackedMatrix<T> & B, const GemmEpilogue<T> & ep);
+*
+*   Description:
+*       ep applied to A @ B for the M rows of A (lda apart)
+***************************************************************/
+template <typename T>
+void gemm_packed(const T * A, long lda, int M, const PackedMatrix<T> & B, const GemmEpilogue<T> & ep) {
+    const int nr = PackedMatrix<T>::nr;
+    int N = B.cols(), panels = (N + nr - 1) / nr;
+    parallel_for(0, (M + GEMM_ROWS - 1) / GEMM_ROWS, 1, [&](int lo, int hi){
+        acc_t<T> acc[4][nr];
+        for(int chunk=lo; chunk<hi; chunk++){
+            int m_end = std::min(M, (chunk + 1) * GEMM_ROWS);
+            //Each panel is reused from cache by every row of the chunk
+            for(int j=0; j<panels; j++){
+                int n0 = j * nr, nc = std::min(nr, N - n0);
+                long col[nr];
+                for(int c=0; c<nc; c++) col[c] = ep.col(n0 + c);
+                for(int m=chunk * GEMM_ROWS; m<m_end; m+=4){
+                    int mr = std::min(4, m_end - m);
+                    //Missing rows of the last tile repeat the first one, their sums are not written
+                    const T * rows[4];
+                    for(int r=0; r<4; r++) rows[r] = A + (m + (r < mr ? r : 0)) * lda;
+                    _gemm_micro<T>::tile(rows, B.panel(j), B.rows(), acc);
+                    for(int r=0; r<mr; r++){
+                        T * y = ep.out + (m + r) * ep.rs;
+                        for(int c=0; c<nc; c++){
+                            acc_t<T> v = acc[r][c] + (ep.bias != NULL ? (acc_t<T>)ep.bias[n0 + c] : 0);
+                            y[col[c]] = (T)(ep.relu && v < 0 ? 0 : v);
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+/*###############################################################################################################*/
+//Largest M, K and N of the unrolled kernels, rows of A per GEMV task
+const int SMALL_MATMUL = 16;
+const int GEMV_ROWS = 256;
+
+/***************************************************************
+* void gemv(const T * A, int M, int K, long rs, long cs, const T * x, long xs, T * y, long ys);
+*
+*   Description:
+*       y[m * ys] = sum_k A[m * rs + k * cs] * x[k * xs].
+*       A is read once in storage order: one dot product per
+*       row when rows are contiguous (or neither is), M running
+*       sums updated a column at a time when columns are
+***************************************************************/
+template <typename T>
+void gemv(const T * A, int M, int K, long rs, long cs, const T * x, long xs, T * y, long ys) {
+    typedef acc_t<T> A_t;
+    if(rs == 1 && cs != 1){
+        parallel_for(0, M, GEMV_ROWS, [&](int lo, int hi){
+            A_t sums[GEMV_ROWS];
+            int rows = hi - lo;
+            for(int m=0; m<rows; m++) sums[m] = 0;
+            for(int k=0; k<K; k++){
+                const T * col = A + lo + k * cs;
+                A_t v = x[k * xs];
+                int m = 0;
+                //Fixed width blocks vectorize without a cost model that accepts remainder loops
+                for(; m+8<=rows; m+=8)
+                    for(int j=0; j<8; j++) sums[m + j] += (A_t)col[m + j] * v;
+                for(; m<rows; m++) sums[m] += (A_t)col[m] * v;
+            }
+            for(int m=0; m<rows; m++) y[(lo + m) * ys] = sums[m];
+        });
+        return;
+    }
+    parallel_for(0, M, GEMV_ROWS, [&](int lo, int hi){
+        for(int m=lo; m<hi; m++){
+            const T * row = A + m * rs;
+            //Independent partial sums keep the adds out of one dependency chain
+            A_t s[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            int k = 0;
+            if(cs == 1 && xs == 1)
+                for(; k+8<=K; k+=8)
+                    for(int j=0; j<8; j++) s[j] += (A_t)row[k + j] * (A_t)x[k + j];
+            for(; k<K; k++) s[0] += (A_t)row[k * cs] * (A_t)x[k * xs];
+            y[m * ys] = ((s[0] + s[1]) + (s[2] + s[3])) + ((s[4] + s[5]) + (s[6] + s[7]));
+        }
+    });
+}
+
+template <int... I, typename F>
+inline void _unrolled(std::integer_sequence<int, I...>, F f) {
+    (f(I), ...);
+}
+
+//C (M, N) = A (M, K) @ B (K, N) with N known at compile time and M, K <= SMALL_MATMUL
+template <typename T, int N>
+void _small_matmul(const T * A, long ars, long acs, const T * B, long brs, long bcs, T * C, long crs, long ccs, int M, int K) {
+    typedef acc_t<T> A_t;
+    const auto cols = std::make_integer_sequence<int, N>();
+    //B is gathered once so every row reads it from a dense local copy
+    A_t b[SMALL_MATMUL][N];
+    for(int k=0; k<K; k++) _unrolled(cols, [&](int n){ b[k][n] = B[k * brs + n * bcs]; });
+    for(int m=0; m<M; m++){
+        A_t acc[N] = {};
+        for(int k=0; k<K; k++){
+            A_t a = A[m * ars + k * acs];
+            _unrolled(cols, [&](int n){ acc[n] += a * b[k][n]; });
+        }
+        _unrolled(cols, [&](int n){ C[m * crs + n * ccs] = acc[n]; });
+    }
+}
+
+template <typename T, int... N>
+void _small_dispatch(std::integer_sequence<int, N...>, const T * A, long ars, long acs, const T * B, long brs, long bcs,
+                     T * C, long crs, long ccs, int M, int K, int cols) {
+    typedef void (*Kernel)(const T *, long, long, const T *, long, long, T *, long, long, int, int);
+    static const Kernel table[] = {_small_matmul<T, N + 1>...};
+    table[cols - 1](A, ars, acs, B, brs, bcs, C, crs, ccs, M, K);
+}
+
+/***************************************************************
+* void small_matmul(const T * A, long ars, long acs, const T * B, long brs, long bcs,
+*                   T * C, long crs, long ccs, int M, int K, int N);
+* void gemm(...);
+*
+*   Description:
+*       C[m * crs + n * ccs] = sum_k A[m * ars + k * acs] * B[k * brs + n * bcs]
+*       with the unrolled kernel for N (all sizes at most SMALL_MATMUL)
+*       or with B packed for this call
+***************************************************************/
+template <typename T>
+void small_matmul(const T * A, long ars, long acs, const T * B, long brs, long bcs, T * C, long crs, long ccs, int M, int K, int N) {
+    assert(M <= SMALL_MATMUL && K <= SMALL_MATMUL && N >= 1 && N <= SMALL_MATMUL && "TOO LARGE FOR THE SMALL KERNELS");
+    _small_dispatch(std::make_integer_sequence<int, SMALL_MATMUL>(), A, ars, acs, B, brs, bcs, C, crs, ccs, M, K, N);
+}
+
+template <typename T>
+void gemm(const T * A, long ars, long acs, const T * B, long brs, long bcs, T * C, long crs, long ccs, int M, int K, int N) {
+    PackedMatrix<T> packed(B, K, N, brs, bcs);
+    //The micro kernel walks rows of A, a transposed A is gathered first
+    std::vector<T> rows;
+    if(acs != 1){
+        rows.resize((size_t)M * K);
+        for(int m=0; m<M; m++)
+            for(int k=0; k<K; k++) rows[(size_t)m * K + k] = A[m * ars + k * acs];
+        A = rows.data();
+        ars = K;
+    }
+    GemmEpilogue<T> ep;
+    ep.out = C;
+    ep.rs = crs;
+    ep.cs = ccs;
+    gemm_packed(A, ars, M, packed, ep);
+}
+
+/***************************************************************
+* void matmul(const T * A, long ars, long acs, const T * B, long brs, long bcs,
+*             T * C, long crs, long ccs, int M, int K, int N);
+*
+*   Description:
+*       C = A @ B for strided (M, K) and (K, N) operands with
+*       the kernel that suits the shape
+***************************************************************/
+template <typename T>
+void matmul(const T * A, long ars, long acs, const T * B, long brs, long bcs, T * C, long crs, long ccs, int M, int K, int N) {
+    if(N == 1) gemv(A, M, K, ars, acs, B, brs, C, crs);
+    else if(M == 1) gemv(B, N, K, bcs, brs, A, acs, C, ccs);
+    else if(std::max(M, std::max(K, N)) <= SMALL_MATMUL) small_matmul(A, ars, acs, B, brs, bcs, C, crs, ccs, M, K, N);
+    else gemm(A, ars, acs, B, brs, bcs, C, crs, ccs, M, K, N);
+}
+
+#endif
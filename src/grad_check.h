@@ -4,6 +4,7 @@
 #include <iostream>
 #include <iomanip>
 #include <cstdlib>
+#include <vector>
 #include "tensor.h"
 #include "ops.h"
 
@@ -27,7 +28,7 @@ bool grad_check(T test_func, Tensor<K> * t1, Tensor<K> * t2) {
     t1->reshape_grad(t1->getNDims(), t1->getDims());
     iterator<K> it1(t1, NULL, arr);
     iterator<K> it1_g(t1->getGrad(), NULL, arr);
-    for(int i=0; i<t1->getTotalElements(); i++) {
+    for(long i=0; i<t1->getTotalElements(); i++) {
         K goal = it1_g.next();
         K& temp_ref = it1.next();
         K val = temp_ref;
@@ -57,8 +58,8 @@ bool grad_check(T test_func, Tensor<K> * t1, Tensor<K> * t2) {
     for(int i=0; i<t2->getNDims(); i++) arr_2[i] = 0;
     t2->reshape_grad(t2->getNDims(), t2->getDims());
     iterator<K> it2(t2, NULL, arr_2);
-    iterator<K> it2_g(t2->getGrad(), NULL, arr);
-    for(int i=0; i<t2->getTotalElements(); i++) {
+    iterator<K> it2_g(t2->getGrad(), NULL, arr_2);
+    for(long i=0; i<t2->getTotalElements(); i++) {
         K goal = it2_g.next();
         K& temp_ref = it2.next();
         K val = temp_ref;
@@ -90,13 +91,16 @@ bool grad_check(T test_func, Tensor<K> * t1, Tensor<K> * t2) {
 }
 
 template <typename T, typename K>
-bool grad_check_unary(T test_func, Tensor<K> * t1) {
+bool grad_check_unary(T test_func, Tensor<K> * t1, Tensor<K> * weights=NULL) {
+    //weights (optional, same shape as the output) turns the loss into
+    //a weighted sum, for ops whose plain sum has a trivial gradient
     bool pass = true;
     const double EPS = .00001;
     const double EPS_2 = EPS/2;
 
-    Tensor<K> * out = UNARY_TEST(t1, test_func, true).first;//Out puts a scalar ("LOSS")
-    out->getGrad()->setAll(1);
+    Tensor<K> * out = UNARY_TEST(t1, test_func, true, weights).first;//Out puts a scalar ("LOSS")
+    if(weights == NULL) out->getGrad()->setAll(1);
+    else OPS::inplace_add(out->getGrad(), weights);
     out->getOp()->back();
 
     //Check Gradient
@@ -106,18 +110,18 @@ bool grad_check_unary(T test_func, Tensor<K> * t1) {
     t1->reshape_grad(t1->getNDims(), t1->getDims());
     iterator<K> it1(t1, NULL, arr);
     iterator<K> it1_g(t1->getGrad(), NULL, arr);
-    for(int i=0; i<t1->getTotalElements(); i++) {
+    for(long i=0; i<t1->getTotalElements(); i++) {
         K goal = it1_g.next();
         K& temp_ref = it1.next();
         K val = temp_ref;
         
         temp_ref += EPS_2;
-        auto temp1 = UNARY_TEST(t1, test_func, false);
+        auto temp1 = UNARY_TEST(t1, test_func, false, weights);
         delete temp1.first;
         K out1 = temp1.second;
 
         temp_ref -= 2*EPS_2;
-        temp1 = UNARY_TEST(t1, test_func, false);
+        temp1 = UNARY_TEST(t1, test_func, false, weights);
         delete temp1.first;
         K out2 = temp1.second;
 
@@ -136,37 +140,37 @@ bool grad_check_unary(T test_func, Tensor<K> * t1) {
 }
 
 /*GRADIENT CHECKING TEST FUNCTIONS*/
-//Manually implement the sum operation
-//We can implement the SUM op later and test it 
-//Again using these functions
+//The loss is the sum of the output, computed with the SUM
+//kernel directly so no graph is attached to the output
 template <typename T, typename K>
 std::pair<Tensor<T> *, T> BINARY_TEST(Tensor<T>* t1, Tensor<T> * t2, K op, bool history=true){
     if(!history) t1->no_history(); 
     Tensor<T> * out = op(t1,t2);
     
     //Sum up all
-    int arr[out->getNDims()];
-    for(int i=0; i < out->getNDims(); i++) arr[i] = 0;
     T sum = 0;
-    iterator<T> it1(out, NULL, arr);
-    for(int i=0; i<out->getTotalElements(); i++){
-        sum +=  it1.next();
-    }
+    std::vector<bool> all(out->getNDims(), true);
+    OPS::_sum_kernel(out->getData(), OPS::_reduce_layout(out, all), (T)1, &sum);
     return std::make_pair(out,sum);
 }
 
 template <typename T, typename K>
-std::pair<Tensor<T> *, T> UNARY_TEST(Tensor<T>* t1, K op, bool history=true){
+std::pair<Tensor<T> *, T> UNARY_TEST(Tensor<T>* t1, K op, bool history=true, Tensor<T> * weights=NULL){
     if(!history) t1->no_history(); 
     Tensor<T> * out = op(t1);
     
     //Sum up all
+    T sum = 0;
+    if(weights == NULL){
+        std::vector<bool> all(out->getNDims(), true);
+        OPS::_sum_kernel(out->getData(), OPS::_reduce_layout(out, all), (T)1, &sum);
+        return std::make_pair(out,sum);
+    }
     int arr[out->getNDims()];
     for(int i=0; i < out->getNDims(); i++) arr[i] = 0;
-    T sum = 0;
     iterator<T> it1(out, NULL, arr);
-    for(int i=0; i<out->getTotalElements(); i++){
-        sum +=  it1.next();
+    for(long i=0; i<out->getTotalElements(); i++){
+        sum += it1.next() * weights->getData()[i];
     }
     return std::make_pair(out,sum);
 }
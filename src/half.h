@@ -0,0 +1,269 @@
+#ifndef HALF_H_
+#define HALF_H_
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include <limits>
+
+#if defined(__F16C__) || defined(__AVX512BF16__)
+#include <immintrin.h>
+#endif
+
+#include "threadpool.h"
+
+/*
+    16 bit floating point formats, stored as uint16_t bit patterns:
+        - bf16: the top half of a float (8 bit exponent, 7 bit mantissa),
+          same range as float, ~3 significant digits
+        - fp16: IEEE half (5 bit exponent, 10 bit mantissa),
+          range +-65504, ~3.3 significant digits
+    Both round to nearest even. Array conversions use F16C (fp16) and
+    AVX512-BF16 (float to bf16, which flushes float subnormals to 0)
+    when available, everything else is done in integer arithmetic.
+    bfloat16 and float16 are the matching element types (Tensor<bfloat16>).
+*/
+
+inline uint32_t _float_bits(float f) { uint32_t u; std::memcpy(&u, &f, 4); return u; }
+inline float _bits_float(uint32_t u) { float f; std::memcpy(&f, &u, 4); return f; }
+
+/***************************************************************
+* uint16_t float_to_bf16(float f);
+* float bf16_to_float(uint16_t h);
+*
+*   Description:
+*       float <-> bf16, NaN stays a (quiet) NaN
+***************************************************************/
+inline uint16_t float_to_bf16(float f) {
+    uint32_t u = _float_bits(f);
+    if((u & 0x7FFFFFFFu) > 0x7F800000u) return (uint16_t)((u >> 16) | 0x40);
+    u += 0x7FFFu + ((u >> 16) & 1);
+    return (uint16_t)(u >> 16);
+}
+
+inline float bf16_to_float(uint16_t h) { return _bits_float((uint32_t)h << 16); }
+
+/***************************************************************
+* uint16_t float_to_half(float f);
+* float half_to_float(uint16_t h);
+*
+*   Description:
+*       float <-> fp16, values too large for fp16 become +-inf,
+*       values too small become fp16 subnormals or 0
+***************************************************************/
+inline uint16_t float_to_half(float f) {
+    uint32_t u = _float_bits(f);
+    uint32_t sign = u & 0x80000000u;
+    u ^= sign;
+    uint16_t h;
+    if(u >= (143u << 23)) {
+        //|f| >= 2^16, inf or NaN (65520 <= |f| < 2^16 rounds up to inf below)
+        h = u > (255u << 23) ? 0x7E00 : 0x7C00;
+    }
+    else if(u < (113u << 23)) {
+        //fp16 subnormal or 0: adding 0.5 shifts the mantissa into place with float rounding
+        const uint32_t magic = ((127 - 15) + (23 - 10) + 1) << 23;
+        h = (uint16_t)(_float_bits(_bits_float(u) + _bits_float(magic)) - magic);
+    }
+    else {
+        //Rebias the exponent and round the 13 dropped mantissa bits to nearest even
+        uint32_t odd = (u >> 13) & 1;
+        u += ((uint32_t)(15 - 127) << 23) + 0xFFF + odd;
+        h = (uint16_t)(u >> 13);
+    }
+    return h | (uint16_t)(sign >> 16);
+}
+
+inline float half_to_float(uint16_t h) {
+    const uint32_t exp_mask = 0x7C00u << 13;
+    uint32_t u = ((uint32_t)h & 0x7FFF) << 13;
+    uint32_t exp = u & exp_mask;
+    u += (uint32_t)(127 - 15) << 23;
+    if(exp == exp_mask) u += (uint32_t)(128 - 16) << 23;
+    else if(exp == 0) {
+        //Subnormal: renormalize through a float subtraction
+        u += 1u << 23;
+        u = _float_bits(_bits_float(u) - _bits_float(113u << 23));
+    }
+    return _bits_float(u | (((uint32_t)h & 0x8000) << 16));
+}
+
+/*
+    Element types: they convert to and from float implicitly, so any
+    expression on them is evaluated in float and only rounded when it
+    is stored back. Kernels keep running sums in acc_t<T> (float for
+    both) so a long accumulation is not rounded at every step.
+*/
+struct bfloat16 {
+    uint16_t bits;
+
+    bfloat16() = default;
+    bfloat16(float f): bits(float_to_bf16(f)) {}
+    operator float() const { return bf16_to_float(bits); }
+
+    bfloat16 & operator+=(float v) { return *this = (float)*this + v; }
+    bfloat16 & operator-=(float v) { return *this = (float)*this - v; }
+    bfloat16 & operator*=(float v) { return *this = (float)*this * v; }
+    bfloat16 & operator/=(float v) { return *this = (float)*this / v; }
+};
+
+struct float16 {
+    uint16_t bits;
+
+    float16() = default;
+    float16(float f): bits(float_to_half(f)) {}
+    operator float() const { return half_to_float(bits); }
+
+    float16 & operator+=(float v) { return *this = (float)*this + v; }
+    float16 & operator-=(float v) { return *this = (float)*this - v; }
+    float16 & operator*=(float v) { return *this = (float)*this * v; }
+    float16 & operator/=(float v) { return *this = (float)*this / v; }
+};
+
+template <typename T> struct accumulator { typedef T type; };
+template <> struct accumulator<bfloat16> { typedef float type; };
+template <> struct accumulator<float16> { typedef float type; };
+
+//Type of the running sums of kernels over T
+template <typename T>
+using acc_t = typename accumulator<T>::type;
+
+namespace std {
+    template <> struct numeric_limits<bfloat16> {
+        static const bool is_specialized = true;
+        static const bool has_infinity = true;
+        static bfloat16 min() { bfloat16 h; h.bits = 0x0080; return h; }
+        static bfloat16 max() { bfloat16 h; h.bits = 0x7F7F; return h; }
+        static bfloat16 lowest() { bfloat16 h; h.bits = 0xFF7F; return h; }
+        static bfloat16 epsilon() { bfloat16 h; h.bits = 0x3C00; return h; }
+        static bfloat16 infinity() { bfloat16 h; h.bits = 0x7F80; return h; }
+        static bfloat16 quiet_NaN() { bfloat16 h; h.bits = 0x7FC0; return h; }
+    };
+
+    template <> struct numeric_limits<float16> {
+        static const bool is_specialized = true;
+        static const bool has_infinity = true;
+        static float16 min() { float16 h; h.bits = 0x0400; return h; }
+        static float16 max() { float16 h; h.bits = 0x7BFF; return h; }
+        static float16 lowest() { float16 h; h.bits = 0xFBFF; return h; }
+        static float16 epsilon() { float16 h; h.bits = 0x1400; return h; }
+        static float16 infinity() { float16 h; h.bits = 0x7C00; return h; }
+        static float16 quiet_NaN() { float16 h; h.bits = 0x7E00; return h; }
+    };
+}
+
+/***************************************************************
+* void to_bf16(const T * x, long n, uint16_t * out);
+* void from_bf16(const uint16_t * x, long n, T * out);
+* void to_half(const T * x, long n, uint16_t * out);
+* void from_half(const uint16_t * x, long n, T * out);
+*
+*   Description:
+*       converts n elements (through float for other types T),
+*       split across the thread pool
+***************************************************************/
+//Elements handed to one task
+const int HALF_GRAIN = 16384;
+
+//Register path for the first elements of [i, end), returns where the scalar loop continues
+template <typename T>
+inline long _to_bf16_fast(const T *, long i, long, uint16_t *) { return i; }
+
+#if defined(__AVX512BF16__) && defined(__AVX512VL__)
+inline long _to_bf16_fast(const float * x, long i, long end, uint16_t * out) {
+    for(; i+8<=end; i+=8)
+        _mm_storeu_si128((__m128i*)(out + i), (__m128i)_mm256_cvtneps_pbh(_mm256_loadu_ps(x + i)));
+    return i;
+}
+#endif
+
+template <typename T>
+void to_bf16(const T * x, long n, uint16_t * out) {
+    parallel_for(0, (n + HALF_GRAIN - 1) / HALF_GRAIN, 1, [&](int lo, int hi){
+        long end = std::min(n, (long)hi * HALF_GRAIN);
+        for(long i=_to_bf16_fast(x, (long)lo * HALF_GRAIN, end, out); i<end; i++) out[i] = float_to_bf16((float)x[i]);
+    });
+}
+
+template <typename T>
+void from_bf16(const uint16_t * x, long n, T * out) {
+    parallel_for(0, (n + HALF_GRAIN - 1) / HALF_GRAIN, 1, [&](int lo, int hi){
+        for(long i=(long)lo * HALF_GRAIN; i<std::min(n, (long)hi * HALF_GRAIN); i++) out[i] = (T)bf16_to_float(x[i]);
+    });
+}
+
+template <typename T>
+void to_half(const T * x, long n, uint16_t * out) {
+    parallel_for(0, (n + HALF_GRAIN - 1) / HALF_GRAIN, 1, [&](int lo, int hi){
+        long i = (long)lo * HALF_GRAIN, end = std::min(n, (long)hi * HALF_GRAIN);
+#if defined(__F16C__)
+        for(; i+8<=end; i+=8){
+            float v[8];
+            for(int j=0; j<8; j++) v[j] = (float)x[i + j];
+            _mm_storeu_si128((__m128i*)(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(v), _MM_FROUND_TO_NEAREST_INT));
+        }
+#endif
+        for(; i<end; i++) out[i] = float_to_half((float)x[i]);
+    });
+}
+
+template <typename T>
+void from_half(const uint16_t * x, long n, T * out) {
+    parallel_for(0, (n + HALF_GRAIN - 1) / HALF_GRAIN, 1, [&](int lo, int hi){
+        long i = (long)lo * HALF_GRAIN, end = std::min(n, (long)hi * HALF_GRAIN);
+#if defined(__F16C__)
+        for(; i+8<=end; i+=8){
+            float v[8];
+            _mm256_storeu_ps(v, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(x + i))));
+            for(int j=0; j<8; j++) out[i + j] = (T)v[j];
+        }
+#endif
+        for(; i<end; i++) out[i] = (T)half_to_float(x[i]);
+    });
+}
+
+/***************************************************************
+* void convert(const S * x, long n, D * out);
+*
+*   Description:
+*       out[i] = x[i] for any pair of element types, conversions from
+*       and to bfloat16/float16 use the array kernels above
+***************************************************************/
+template <typename S, typename D>
+struct _convert {
+    static void run(const S * x, long n, D * out) {
+        parallel_for(0, (n + HALF_GRAIN - 1) / HALF_GRAIN, 1, [&](int lo, int hi){
+            for(long i=(long)lo * HALF_GRAIN; i<std::min(n, (long)hi * HALF_GRAIN); i++) out[i] = (D)(acc_t<S>)x[i];
+        });
+    }
+};
+template <typename S> struct _convert<S, bfloat16> {
+    static void run(const S * x, long n, bfloat16 * out) { to_bf16(x, n, (uint16_t *)out); }
+};
+template <typename D> struct _convert<bfloat16, D> {
+    static void run(const bfloat16 * x, long n, D * out) { from_bf16((const uint16_t *)x, n, out); }
+};
+template <typename S> struct _convert<S, float16> {
+    static void run(const S * x, long n, float16 * out) { to_half(x, n, (uint16_t *)out); }
+};
+template <typename D> struct _convert<float16, D> {
+    static void run(const float16 * x, long n, D * out) { from_half((const uint16_t *)x, n, out); }
+};
+template <> struct _convert<bfloat16, bfloat16> {
+    static void run(const bfloat16 * x, long n, bfloat16 * out) { std::memcpy(out, x, sizeof(bfloat16) * n); }
+};
+template <> struct _convert<float16, float16> {
+    static void run(const float16 * x, long n, float16 * out) { std::memcpy(out, x, sizeof(float16) * n); }
+};
+template <> struct _convert<bfloat16, float16> {
+    static void run(const bfloat16 * x, long n, float16 * out) { for(long i=0; i<n; i++) out[i] = (float)x[i]; }
+};
+template <> struct _convert<float16, bfloat16> {
+    static void run(const float16 * x, long n, bfloat16 * out) { for(long i=0; i<n; i++) out[i] = (float)x[i]; }
+};
+
+template <typename S, typename D>
+void convert(const S * x, long n, D * out) { _convert<S, D>::run(x, n, out); }
+
+#endif
@@ -0,0 +1,680 @@
+#ifndef INFERENCE_H_
+#define INFERENCE_H_
+
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+#include <limits>
+
+#include "tensor.h"
+#include "ops.h"
+#include "module.h"
+#include "gemm.h"
+#include "layout.h"
+#include "threadpool.h"
+
+/*
+    Frozen forward pass for serving.
+    InferenceEngine runs model.forward once on an example batch and
+    compiles the graph it produced into a flat list of steps:
+        - parameters are copied, so later updates of the model do not
+          reach the engine, and ops that only depend on parameters are
+          folded into constants
+        - MatMul and CONV with a constant right operand become GEMMs
+          against weights packed once (gemm.h). A PAD feeding a CONV is
+          done by its im2col, and a BIAS_ADD, an eval mode BATCHNORM and
+          a ReLU after them are folded into the weights and the epilogue
+        - images between the steps are kept in a memory format (NCHW,
+          NHWC or NCHWc, see layout.h): CONVs write the requested one,
+          PAD, pooling, ReLU, per channel affines and binary ops follow
+          their input, and a reorder step is put in only where a reader
+          needs NCHW (GEMM, SOFTMAX, the output) or two inputs differ
+        - every intermediate lives at a fixed offset of one arena,
+          buffers are reused once their last reader has run
+    run() then executes the steps without creating tensors, ops or graph
+    edges. Every supported op treats the rows of the first dimension
+    independently, so any batch up to the traced one can be run.
+    Supported ops: MatMul, CONV, PAD, BIAS_ADD, BATCHNORM (eval), ReLU,
+    ADD/SUB/MULT (same shapes), MAXPOOL2D, AVGPOOL2D, SOFTMAX (not over
+    the batch). Dropout is the identity in eval mode and never traced.
+*/
+
+//Arena buffers start on multiples of this many elements
+const int ARENA_ALIGN = 16;
+
+template <typename T>
+class InferenceEngine {
+    public:
+        /***************************************************************
+        * InferenceEngine(Module<T> & model, Tensor<T> * example, MemoryFormat format=FORMAT_NCHW, int block=8);
+        *
+        *   Description:
+        *       traces model (in NCHW) on example and compiles it, keeping
+        *       the images in format (block channels per block for
+        *       FORMAT_NCHWC, CONVs whose channels it does not divide
+        *       write NCHW). Input and output stay NCHW.
+        ***************************************************************/
+        InferenceEngine(Module<T> & model, Tensor<T> * example, MemoryFormat format=FORMAT_NCHW, int block=8);
+
+        InferenceEngine(const InferenceEngine<T>&) = delete;
+        InferenceEngine<T> & operator=(const InferenceEngine<T>&) = delete;
+
+        /***************************************************************
+        * Tensor<T> * run(Tensor<T> * input);
+        * void run(const T * input, int batch, T * output);
+        *
+        *   Description:
+        *       Forward pass of a batch shaped like the example except
+        *       for its first dimension (at most the example's). The
+        *       pointer version reads batch * input_size() values and
+        *       writes batch * output_size() values without allocating.
+        *       Steps share the arena, so an engine runs one batch at a time.
+        *
+        *   Returns:
+        *       a new tensor (without history) with the output
+        ***************************************************************/
+        Tensor<T> * run(Tensor<T> * input);
+        void run(const T * input, int batch, T * output);
+
+        /***************************************************************
+        * int max_batch() const;
+        * long input_size() const;
+        * long output_size() const;
+        * const std::vector<int> & output_dims() const;
+        *
+        *   Returns:
+        *       the traced batch, the number of values of one sample of
+        *       the input and of the output, and the traced output shape
+        ***************************************************************/
+        int max_batch() const { return batch_max; }
+        long input_size() const { return values[0].per_sample; }
+        long output_size() const { return values[out_value].per_sample; }
+        const std::vector<int> & output_dims() const { return values[out_value].dims; }
+
+        /***************************************************************
+        * int steps() const;
+        * size_t arena_bytes() const;
+        * size_t weight_bytes() const;
+        *
+        *   Returns:
+        *       the length of the schedule, the memory of the
+        *       intermediates and of the packed weights
+        ***************************************************************/
+        int steps() const { return schedule.size(); }
+        size_t arena_bytes() const { return arena.size() * sizeof(T); }
+        size_t weight_bytes() const;
+
+        /***************************************************************
+        * int reorders() const;
+        *
+        *   Returns:
+        *       how many steps of the schedule only change the memory
+        *       format of an image
+        ***************************************************************/
+        int reorders() const;
+
+    private:
+        enum StepKind { STEP_GEMM, STEP_CONV, STEP_PAD, STEP_AFFINE, STEP_RELU, STEP_BINARY, STEP_MAXPOOL, STEP_AVGPOOL, STEP_SOFTMAX, STEP_REORDER };
+
+        struct Value {
+            std::vector<int> dims;      //traced shape (NCHW for images), dim 0 is the batch
+            long per_sample = 0;
+            long offset = 0;            //in the arena (not used by the input and the output)
+            int inner = 1;              //channels innermost at every pixel: 1 NCHW, C NHWC, b NCHWc
+        };
+
+        struct Step {
+            StepKind kind;
+            int in[2] = {-1, -1};
+            int out = -1;
+            //GEMM (K, N) and CONV (K = C * kh * kw, N = out channels), w is dropped once packed
+            int K = 0, N = 0;
+            std::vector<T> w;
+            long sk = 0, sn = 0;
+            PackedMatrix<T> packed;
+            std::vector<T> bias;
+            bool relu = false;
+            //CONV and PAD geometry, fill is the padding value
+            int C = 0, H = 0, W = 0, kh = 0, kw = 0, sh = 1, sw = 1, ph = 0, pw = 0, OH = 0, OW = 0;
+            T fill = 0;
+            //AFFINE: x * scale[c] + shift[c] over (outer, C, inner) per sample, SOFTMAX over (outer, C, inner)
+            long outer = 1, inner = 1;
+            std::vector<T> scale, shift;
+            //BINARY: 0 ADD, 1 SUB, 2 MULT
+            int op = 0;
+            OPS::_Pool2d P;
+        };
+
+        int new_value(Tensor<T> * t);
+        void compile(Tensor<T> * t);
+        Step * foldable(Tensor<T> * t);
+        void fold_affine(Step & s, const std::vector<T> & scale, const std::vector<T> & shift);
+        const T * constant(Tensor<T> * t);
+        void propagate(MemoryFormat format, int block);
+        ImageLayout layout(int v, int batch) const;
+        void plan();
+        void execute(const Step & s, int batch);
+
+        int batch_max;
+        int out_value = -1;
+        std::vector<Value> values;
+        std::vector<Step> schedule;
+        std::vector<T> arena;
+        std::vector<T*> where;                  //value -> memory of the current run
+        std::vector<T> cols;                    //im2col of one image
+        std::vector<unsigned short> arg;        //window positions MAXPOOL2D writes
+
+        //Trace state, cleared once compiled
+        std::map<Tensor<T>*, int> id;           //activation -> value
+        std::map<Tensor<T>*, int> uses;         //readers of a tensor inside the trace
+        std::map<int, int> producer;            //value -> step writing it
+        std::map<Tensor<T>*, Step> pads;        //PADs done by the CONV reading them
+};
+/*###############################################################################################################*/
+template <typename T>
+InferenceEngine<T>::InferenceEngine(Module<T> & model, Tensor<T> * example, MemoryFormat format, int block) {
+    //Trace on a private copy, so the graph only reaches the model's parameters
+    if(!example->is_contiguous()) example->as_contiguous();
+    batch_max = example->getDims()[0];
+    Tensor<T> * x = new Tensor<T>(example->getNDims(), example->getDims());
+    std::memcpy(x->getData(), example->getData(), sizeof(T) * x->getTotalElements());
+    Tensor<T> * root = model.forward(x);
+    assert(root != x && "NOTHING TO COMPILE");
+
+    std::vector<Tensor<T>*> order = OPS::_topological_order(root);
+    for(size_t i=0; i<order.size(); i++){
+        std::vector<Tensor<T>*> parents = order[i]->getParents();
+        for(size_t p=0; p<parents.size(); p++) uses[parents[p]]++;
+    }
+    new_value(x);
+    for(size_t i=0; i<order.size(); i++){
+        Tensor<T> * t = order[i];
+        if(t == x || t->getOp() == NULL) continue;
+        //Ops that only read parameters were computed by the trace, readers take the result as a constant
+        std::vector<Tensor<T>*> parents = t->getParents();
+        bool reads_input = false;
+        for(size_t p=0; p<parents.size(); p++) reads_input |= id.count(parents[p]) > 0 || pads.count(parents[p]) > 0;
+        if(reads_input) compile(t);
+    }
+    assert(id.count(root) && "THE OUTPUT DOES NOT DEPEND ON THE INPUT");
+    out_value = id[root];
+    propagate(format, block);
+
+    for(size_t i=0; i<schedule.size(); i++){
+        Step & s = schedule[i];
+        if(s.kind != STEP_GEMM && s.kind != STEP_CONV) continue;
+        s.packed = PackedMatrix<T>(s.w.data(), s.K, s.N, s.sk, s.sn);
+        std::vector<T>().swap(s.w);
+    }
+    plan();
+
+    id.clear();
+    uses.clear();
+    producer.clear();
+    pads.clear();
+    OPS::release_graph(root);
+    delete x;
+}
+/*###############################################################################################################*/
+template <typename T>
+int InferenceEngine<T>::new_value(Tensor<T> * t) {
+    assert(t->getNDims() >= 1 && t->getDims()[0] == batch_max && "EVERY ACTIVATION MUST KEEP THE BATCH AS ITS FIRST DIMENSION");
+    assert(t->getFormat() == FORMAT_NCHW && "TRACE THE MODEL IN NCHW, THE ENGINE PICKS THE MEMORY FORMAT");
+    Value v;
+    v.dims.assign(t->getDims(), t->getDims() + t->getNDims());
+    v.per_sample = t->getTotalElements() / batch_max;
+    values.push_back(v);
+    id[t] = values.size() - 1;
+    return values.size() - 1;
+}
+/*###############################################################################################################*/
+template <typename T>
+const T * InferenceEngine<T>::constant(Tensor<T> * t) {
+    assert(!id.count(t) && "EXPECTED A PARAMETER, GOT AN ACTIVATION");
+    if(!t->is_contiguous()) t->as_contiguous();
+    return t->getData();
+}
+/*###############################################################################################################*/
+template <typename T>
+typename InferenceEngine<T>::Step * InferenceEngine<T>::foldable(Tensor<T> * t) {
+    //The GEMM/CONV step writing t, when the only reader of t can be folded into it
+    if(!id.count(t) || uses[t] != 1 || !producer.count(id[t])) return NULL;
+    Step * s = &schedule[producer[id[t]]];
+    if((s->kind != STEP_GEMM && s->kind != STEP_CONV) || s->relu) return NULL;
+    return s;
+}
+
+template <typename T>
+void InferenceEngine<T>::fold_affine(Step & s, const std::vector<T> & scale, const std::vector<T> & shift) {
+    //Output channel n of the step becomes out * scale[n] + shift[n]
+    if(s.bias.empty()) s.bias.assign(s.N, 0);
+    for(int n=0; n<s.N; n++){
+        for(int k=0; k<s.K; k++) s.w[k * s.sk + n * s.sn] *= scale[n];
+        s.bias[n] = s.bias[n] * scale[n] + shift[n];
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceEngine<T>::compile(Tensor<T> * t) {
+    Op<T> * op = t->getOp();
+    std::vector<Tensor<T>*> p = t->getParents();
+    Step s;
+
+    if(dynamic_cast<_MatMul<T>*>(op)){
+        assert(id.count(p[0]) && !id.count(p[1]) && p[1]->getNDims() == 2 && "MATMUL NEEDS A CONSTANT (K, N) RIGHT OPERAND");
+        s.kind = STEP_GEMM;
+        s.K = p[1]->getDims()[0];
+        s.N = p[1]->getDims()[1];
+        const T * w = constant(p[1]);
+        s.w.assign(w, w + (size_t)s.K * s.N);
+        s.sk = s.N;
+        s.sn = 1;
+        s.in[0] = id[p[0]];
+    }
+    else if(_CONV<T> * conv_ = dynamic_cast<_CONV<T>*>(op)){
+        assert(!id.count(p[1]) && "CONV NEEDS A CONSTANT KERNEL");
+        const int * kd = p[1]->getDims();
+        s.kind = STEP_CONV;
+        if(pads.count(p[0])) s = pads[p[0]];
+        else {
+            s.in[0] = id[p[0]];
+            s.C = p[0]->getDims()[1];
+            s.H = p[0]->getDims()[2];
+            s.W = p[0]->getDims()[3];
+        }
+        s.kind = STEP_CONV;
+        s.kh = kd[2];
+        s.kw = kd[3];
+        s.sh = conv_->getStride().first;
+        s.sw = conv_->getStride().second;
+        s.OH = t->getDims()[2];
+        s.OW = t->getDims()[3];
+        s.K = kd[1] * kd[2] * kd[3];
+        s.N = kd[0];
+        const T * w = constant(p[1]);
+        s.w.assign(w, w + (size_t)s.K * s.N);
+        s.sk = 1;
+        s.sn = s.K;
+    }
+    else if(_PAD<T> * pad = dynamic_cast<_PAD<T>*>(op)){
+        int n = t->getNDims();
+        s.kind = STEP_PAD;
+        s.in[0] = id[p[0]];
+        s.H = p[0]->getDims()[n-2];
+        s.W = p[0]->getDims()[n-1];
+        s.ph = (t->getDims()[n-2] - s.H) / 2;
+        s.pw = (t->getDims()[n-1] - s.W) / 2;
+        s.C = n == 4 ? p[0]->getDims()[1] : 0;
+        s.fill = pad->getValue();
+        //The im2col of a CONV reading it pads on the fly
+        std::vector<Tensor<T>*> readers = t->getChildren();
+        bool into_conv = n == 4 && uses[t] == 1 && readers.size() == 1 && dynamic_cast<_CONV<T>*>(readers[0]->getOp())
+                         && readers[0]->getParents()[0] == t;
+        if(into_conv){
+            pads[t] = s;
+            return;
+        }
+    }
+    else if(_BIAS_ADD<T> * bias_add = dynamic_cast<_BIAS_ADD<T>*>(op)){
+        int n = p[1]->getTotalElements(), axis = bias_add->getAxis();
+        std::vector<T> ones(n, 1), b(constant(p[1]), constant(p[1]) + n);
+        Step * into = foldable(p[0]);
+        if(into != NULL && axis == (into->kind == STEP_CONV ? 1 : p[0]->getNDims() - 1)){
+            fold_affine(*into, ones, b);
+            id[t] = id[p[0]];
+            return;
+        }
+        assert(axis > 0 && "CANNOT ADD A BIAS ALONG THE BATCH");
+        s.kind = STEP_AFFINE;
+        s.in[0] = id[p[0]];
+        s.C = n;
+        for(int d=1; d<axis; d++) s.outer *= t->getDims()[d];
+        for(int d=axis+1; d<t->getNDims(); d++) s.inner *= t->getDims()[d];
+        s.scale = ones;
+        s.shift = b;
+    }
+    else if(_BATCHNORM<T> * bn = dynamic_cast<_BATCHNORM<T>*>(op)){
+        assert(!bn->is_training() && "FREEZE THE MODEL IN EVAL MODE");
+        int C = t->getDims()[1];
+        const T * gamma = constant(p[1]), * beta = constant(p[2]);
+        std::vector<T> scale(C), shift(C);
+        for(int c=0; c<C; c++){
+            scale[c] = gamma[c] * bn->getInvStd()[c];
+            shift[c] = beta[c] - bn->getMean()[c] * scale[c];
+        }
+        Step * into = foldable(p[0]);
+        if(into != NULL && (into->kind == STEP_CONV || p[0]->getNDims() == 2)){
+            fold_affine(*into, scale, shift);
+            id[t] = id[p[0]];
+            return;
+        }
+        s.kind = STEP_AFFINE;
+        s.in[0] = id[p[0]];
+        s.C = C;
+        for(int d=2; d<t->getNDims(); d++) s.inner *= t->getDims()[d];
+        s.scale = scale;
+        s.shift = shift;
+    }
+    else if(dynamic_cast<_ReLU<T>*>(op)){
+        Step * into = foldable(p[0]);
+        if(into != NULL){
+            into->relu = true;
+            id[t] = id[p[0]];
+            return;
+        }
+        s.kind = STEP_RELU;
+        s.in[0] = id[p[0]];
+    }
+    else if(dynamic_cast<_ADD<T>*>(op) || dynamic_cast<_SUB<T>*>(op) || dynamic_cast<_MULT<T>*>(op)){
+        bool same = id.count(p[0]) && id.count(p[1]) && p[0]->getTotalElements() == p[1]->getTotalElements()
+                    && p[0]->getTotalElements() == t->getTotalElements();
+        assert(same && "ONLY ACTIVATIONS OF THE SAME SHAPE CAN BE COMBINED");
+        (void)same;
+        s.kind = STEP_BINARY;
+        s.op = dynamic_cast<_ADD<T>*>(op) ? 0 : dynamic_cast<_SUB<T>*>(op) ? 1 : 2;
+        s.in[0] = id[p[0]];
+        s.in[1] = id[p[1]];
+    }
+    else if(dynamic_cast<_MAXPOOL2D<T>*>(op) || dynamic_cast<_AVGPOOL2D<T>*>(op)){
+        _MAXPOOL2D<T> * max_pool = dynamic_cast<_MAXPOOL2D<T>*>(op);
+        s.kind = max_pool != NULL ? STEP_MAXPOOL : STEP_AVGPOOL;
+        s.P = max_pool != NULL ? max_pool->getPool() : dynamic_cast<_AVGPOOL2D<T>*>(op)->getPool();
+        s.C = t->getDims()[1];
+        s.in[0] = id[p[0]];
+    }
+    else if(_SOFTMAX<T> * softmax = dynamic_cast<_SOFTMAX<T>*>(op)){
+        int axis = softmax->getAxis();
+        if(axis < 0) axis += t->getNDims();
+        assert(axis > 0 && "CANNOT NORMALIZE OVER THE BATCH");
+        s.kind = STEP_SOFTMAX;
+        s.in[0] = id[p[0]];
+        s.C = t->getDims()[axis];
+        for(int d=1; d<axis; d++) s.outer *= t->getDims()[d];
+        for(int d=axis+1; d<t->getNDims(); d++) s.inner *= t->getDims()[d];
+    }
+    else {
+        assert(false && "OP NOT SUPPORTED BY THE INFERENCE ENGINE");
+    }
+
+    s.out = new_value(t);
+    producer[s.out] = schedule.size();
+    schedule.push_back(s);
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceEngine<T>::propagate(MemoryFormat format, int block) {
+    //One pass in schedule order: a value's format is decided by its writer, readers that need
+    //another one get a reorder, made once per (value, format) and put right before them
+    std::vector<Step> steps;
+    std::map<std::pair<int,int>, int> reordered;
+    auto as = [&](int v, int inner){
+        if(values[v].inner == inner) return v;
+        std::pair<int,int> key(v, inner);
+        if(!reordered.count(key)){
+            Value r = values[v];
+            r.inner = inner;
+            values.push_back(r);
+            Step s;
+            s.kind = STEP_REORDER;
+            s.in[0] = v;
+            s.out = values.size() - 1;
+            steps.push_back(s);
+            reordered[key] = s.out;
+        }
+        return reordered[key];
+    };
+
+    for(size_t i=0; i<schedule.size(); i++){
+        Step & s = schedule[i];
+        int in = s.in[0] >= 0 ? values[s.in[0]].inner : 1;
+        switch(s.kind){
+            case STEP_CONV: {
+                //Any input format: im2col reads the channels plane by plane, in is the channels of a plane
+                if(in > 1){
+                    std::vector<T> w(s.w.size());
+                    for(int n=0; n<s.N; n++)
+                        for(int ch=0; ch<s.C; ch++)
+                            for(int k=0; k<s.kh * s.kw; k++)
+                                w[(((long)(ch / in) * s.kh * s.kw + k) * in + ch % in) * s.sk + n * s.sn] = s.w[((long)ch * s.kh * s.kw + k) * s.sk + n * s.sn];
+                    s.w.swap(w);
+                }
+                values[s.out].inner = format == FORMAT_NHWC ? s.N : format == FORMAT_NCHWC && s.N % block == 0 ? block : 1;
+                break;
+            }
+            case STEP_PAD:
+            case STEP_RELU:
+            case STEP_MAXPOOL:
+            case STEP_AVGPOOL:
+                values[s.out].inner = in;
+                break;
+            case STEP_AFFINE:
+                //Per channel of an image it only needs to find the channels
+                if(values[s.out].dims.size() == 4 && s.outer == 1 && s.C == values[s.out].dims[1]) values[s.out].inner = in;
+                else s.in[0] = as(s.in[0], 1);
+                break;
+            case STEP_BINARY:
+                if(values[s.in[0]].dims == values[s.in[1]].dims) s.in[1] = as(s.in[1], in);
+                else {
+                    s.in[0] = as(s.in[0], 1);
+                    s.in[1] = as(s.in[1], 1);
+                }
+                values[s.out].inner = values[s.in[0]].inner;
+                break;
+            default:
+                s.in[0] = as(s.in[0], 1);
+        }
+        steps.push_back(std::move(s));
+    }
+    if(values[out_value].inner != 1) out_value = as(out_value, 1);
+    schedule.swap(steps);
+}
+
+template <typename T>
+ImageLayout InferenceEngine<T>::layout(int v, int batch) const {
+    const Value & a = values[v];
+    ImageLayout L = {batch, a.dims[1], a.dims[2], a.dims[3], a.inner};
+    return L;
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceEngine<T>::plan() {
+    //Last step reading each value
+    std::vector<int> last(values.size(), -1);
+    for(size_t i=0; i<schedule.size(); i++)
+        for(int k=0; k<2; k++) if(schedule[i].in[k] >= 0) last[schedule[i].in[k]] = i;
+
+    //First fit: a value takes the lowest offset that does not overlap a live one
+    std::vector<std::pair<long,long>> live;
+    long end = 0;
+    size_t cols_size = 0, arg_size = 0;
+    for(size_t i=0; i<schedule.size(); i++){
+        const Step & s = schedule[i];
+        if(s.out != out_value){
+            long size = (values[s.out].per_sample * batch_max + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+            std::sort(live.begin(), live.end());
+            long at = 0;
+            for(size_t l=0; l<live.size() && at + size > live[l].first; l++) at = std::max(at, live[l].first + live[l].second);
+            live.push_back(std::make_pair(at, size));
+            values[s.out].offset = at;
+            end = std::max(end, at + size);
+        }
+        for(int k=0; k<2; k++){
+            int v = s.in[k];
+            if(v <= 0 || last[v] != (int)i) continue;
+            for(size_t l=0; l<live.size(); l++)
+                if(live[l].first == values[v].offset) { live.erase(live.begin() + l); break; }
+        }
+        if(s.kind == STEP_CONV) cols_size = std::max(cols_size, (size_t)s.OH * s.OW * s.K);
+        if(s.kind == STEP_MAXPOOL) arg_size = std::max(arg_size, (size_t)values[s.out].per_sample * batch_max);
+    }
+    arena.assign(end, 0);
+    cols.assign(cols_size, 0);
+    arg.assign(arg_size, 0);
+    where.assign(values.size(), NULL);
+}
+/*###############################################################################################################*/
+template <typename T>
+size_t InferenceEngine<T>::weight_bytes() const {
+    size_t bytes = 0;
+    for(size_t i=0; i<schedule.size(); i++){
+        const Step & s = schedule[i];
+        bytes += s.packed.bytes() + (s.bias.size() + s.scale.size() + s.shift.size()) * sizeof(T);
+    }
+    return bytes;
+}
+
+template <typename T>
+int InferenceEngine<T>::reorders() const {
+    int n = 0;
+    for(size_t i=0; i<schedule.size(); i++) n += schedule[i].kind == STEP_REORDER;
+    return n;
+}
+/*###############################################################################################################*/
+template <typename T>
+Tensor<T> * InferenceEngine<T>::run(Tensor<T> * input) {
+    if(!input->is_contiguous()) input->as_contiguous();
+    int batch = input->getDims()[0];
+    assert(input->getTotalElements() == (long)batch * input_size() && "INPUT SHAPE DIFFERS FROM THE TRACE");
+    std::vector<int> dims = output_dims();
+    dims[0] = batch;
+    Tensor<T> * out = new Tensor<T>(dims.size(), dims.data());
+    out->no_history();
+    run(input->getData(), batch, out->getData());
+    return out;
+}
+
+template <typename T>
+void InferenceEngine<T>::run(const T * input, int batch, T * output) {
+    assert(batch >= 1 && batch <= batch_max && "BATCH LARGER THAN THE TRACED ONE");
+    for(size_t v=0; v<values.size(); v++) where[v] = arena.data() + values[v].offset;
+    where[0] = const_cast<T*>(input);
+    where[out_value] = output;
+    for(size_t i=0; i<schedule.size(); i++) execute(schedule[i], batch);
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceEngine<T>::execute(const Step & s, int batch) {
+    const T * x = where[s.in[0]];
+    T * y = where[s.out];
+    long n = values[s.out].per_sample * batch;
+    GemmEpilogue<T> ep;
+    ep.bias = s.bias.empty() ? NULL : s.bias.data();
+    ep.relu = s.relu;
+
+    switch(s.kind){
+        case STEP_GEMM: {
+            ep.out = y;
+            ep.rs = s.N;
+            gemm_packed(x, s.K, (int)(values[s.in[0]].per_sample * batch / s.K), s.packed, ep);
+            break;
+        }
+        case STEP_CONV: {
+            //One image at a time: im2col rows are output pixels, columns (plane, u, v, channel of the plane)
+            size_t in_image = (size_t)s.C * s.H * s.W, out_image = (size_t)s.N * s.OH * s.OW;
+            int in = values[s.in[0]].inner, out = values[s.out].inner;
+            //The GEMM writes (pixel, channel) where the output format keeps them
+            ep.rs = out;
+            ep.cs = out == 1 ? (long)s.OH * s.OW : 1;
+            if(out > 1 && out < s.N){
+                ep.block = out;
+                ep.bs = (long)s.OH * s.OW * out;
+            }
+            for(int b=0; b<batch; b++){
+                const T * img = x + b * in_image;
+                T * c = cols.data();
+                parallel_for(0, s.OH, 1, [&](int lo, int hi){
+                    for(int i=lo; i<hi; i++)
+                        for(int j=0; j<s.OW; j++){
+                            T * row = c + ((size_t)i * s.OW + j) * s.K;
+                            for(int p=0; p<s.C / in; p++)
+                                for(int u=0; u<s.kh; u++){
+                                    int r = i * s.sh + u - s.ph;
+                                    for(int v=0; v<s.kw; v++){
+                                        int q = j * s.sw + v - s.pw;
+                                        if(r < 0 || r >= s.H || q < 0 || q >= s.W) for(int cc=0; cc<in; cc++) *row++ = s.fill;
+                                        else {
+                                            const T * px = img + (((size_t)p * s.H + r) * s.W + q) * in;
+                                            for(int cc=0; cc<in; cc++) *row++ = px[cc];
+                                        }
+                                    }
+                                }
+                        }
+                });
+                ep.out = y + b * out_image;
+                gemm_packed(cols.data(), s.K, s.OH * s.OW, s.packed, ep);
+            }
+            break;
+        }
+        case STEP_PAD: {
+            //Planes of (H, W, inner), whatever the rank
+            int in = values[s.in[0]].inner;
+            ImageLayout L = {(int)(values[s.in[0]].per_sample * batch / ((long)s.H * s.W * in)), in, s.H, s.W, in};
+            pad_image(x, L, s.ph, s.pw, s.fill, y);
+            break;
+        }
+        case STEP_AFFINE: {
+            //Channel p * blk + c of a plane, blk > 1 when the channels are innermost
+            int blk = values[s.in[0]].inner, planes = s.C / blk;
+            parallel_for(0, s.outer * planes * batch, 1, [&](long lo, long hi){
+                for(long o=lo; o<hi; o++){
+                    const T * scale = s.scale.data() + (o % planes) * blk, * shift = s.shift.data() + (o % planes) * blk;
+                    for(long i=0; i<s.inner; i++){
+                        size_t base = ((size_t)o * s.inner + i) * blk;
+                        for(int c=0; c<blk; c++) y[base + c] = x[base + c] * scale[c] + shift[c];
+                    }
+                }
+            });
+            break;
+        }
+        case STEP_RELU: {
+            for(long i=0; i<n; i++) y[i] = x[i] > 0 ? x[i] : 0;
+            break;
+        }
+        case STEP_BINARY: {
+            const T * z = where[s.in[1]];
+            if(s.op == 0) for(long i=0; i<n; i++) y[i] = x[i] + z[i];
+            else if(s.op == 1) for(long i=0; i<n; i++) y[i] = x[i] - z[i];
+            else for(long i=0; i<n; i++) y[i] = x[i] * z[i];
+            break;
+        }
+        case STEP_MAXPOOL:
+        case STEP_AVGPOOL: {
+            OPS::_Pool2d P = s.P;
+            P.inner = values[s.in[0]].inner;
+            size_t in_plane = (size_t)P.H * P.W * P.inner, out_plane = (size_t)P.OH * P.OW * P.inner;
+            parallel_for(0, s.C / P.inner * batch, 1, [&](int lo, int hi){
+                for(int c=lo; c<hi; c++){
+                    unsigned short * at = arg.data() + c * out_plane;
+                    if(s.kind == STEP_MAXPOOL && P.inner == 1) OPS::_maxpool_plane(x + c * in_plane, P, y + c * out_plane, at);
+                    else if(s.kind == STEP_MAXPOOL) OPS::_maxpool_pixels(x + c * in_plane, P, y + c * out_plane, at);
+                    else if(P.inner == 1) OPS::_avgpool_plane(x + c * in_plane, P, y + c * out_plane);
+                    else OPS::_avgpool_pixels(x + c * in_plane, P, y + c * out_plane);
+                }
+            });
+            break;
+        }
+        case STEP_REORDER: {
+            reorder(x, layout(s.in[0], batch), y, layout(s.out, batch));
+            break;
+        }
+        case STEP_SOFTMAX: {
+            parallel_for(0, s.outer * batch, 1, [&](int lo, int hi){
+                for(long o=lo; o<hi; o++)
+                    for(long i=0; i<s.inner; i++){
+                        const T * row = x + (size_t)o * s.C * s.inner + i;
+                        T * out = y + (size_t)o * s.C * s.inner + i;
+                        T m = -std::numeric_limits<T>::infinity(), sum = 0;
+                        for(int c=0; c<s.C; c++) m = std::max(m, row[c * s.inner]);
+                        for(int c=0; c<s.C; c++) sum += (out[c * s.inner] = std::exp(row[c * s.inner] - m));
+                        for(int c=0; c<s.C; c++) out[c * s.inner] /= sum;
+                    }
+            });
+            break;
+        }
+    }
+}
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef ITERATOR_H_
 #define ITERATOR_H_
 
+#include <climits>
+
 #include "utils.h"
 
 template <typename T> class Tensor;
@@ -65,9 +67,9 @@ class iterator {
         int n_dims;
         int * curr;
         int * order;
-        int curr_ind;
+        long curr_ind;
         int * dims;
-        int n_els;
+        long n_els;
 };
 /*###############################################################################################################*/
 
@@ -222,4 +224,176 @@ void iterator<T>::getCurr(int * curr) const {
     for(int i=0; i<n_dims; i++) curr[i] = this->curr[order[i]];
 }
 /*###############################################################################################################*/
+/*                                          BROADCAST ITERATOR                                                   */
+/*###############################################################################################################*/
+/*
+    Walks several tensors at once over their broadcast shape
+    (NumPy rules: shapes are right aligned, a dim of 1 stretches).
+    A stretched dim gets a stride of 0, so nothing is ever expanded in memory.
+    Dims that are contiguous for every operand are merged and the innermost
+    merged dim is handed out as a run (base pointer + stride per operand),
+    which keeps the inner loops of the kernels flat.
+    Offsets and strides are 64 bit, a run is never merged past INT_MAX
+    elements so the kernels can count through it with an int.
+*/
+template <typename T>
+class broadcast_iterator {
+    public:
+        broadcast_iterator(int n_ops, Tensor<T> * const * ops);
+        ~broadcast_iterator(){
+            delete [] dims;
+            delete [] loop_dims;
+            delete [] strides;
+            delete [] curr;
+            delete [] offsets;
+            delete [] data;
+        }
+        broadcast_iterator(const broadcast_iterator<T>&) = delete;
+        broadcast_iterator<T> & operator=(const broadcast_iterator<T>&) = delete;
+
+        /***************************************************************
+        * static bool broadcastable(int n_ops, Tensor<T> * const * ops, int * n_dims, int * dims);
+        *
+        *   Description:
+        *       Computes the broadcast shape of the operands,
+        *       dims must hold the largest number of dimensions
+        *       of the operands, dims and n_dims can be NULL
+        *
+        *   Returns:
+        *       false if the shapes are not compatible
+        ***************************************************************/
+        static bool broadcastable(int n_ops, Tensor<T> * const * ops, int * n_dims=NULL, int * dims=NULL);
+
+        /***************************************************************
+        * int getNDims() const; const int * getDims() const;
+        *
+        *   Returns:
+        *       The broadcast shape
+        ***************************************************************/
+        int getNDims() const { return n_dims; }
+        const int * getDims() const { return dims; }
+
+        /***************************************************************
+        * int run() const;
+        *
+        *   Returns:
+        *       The number of elements in the current run (at most INT_MAX)
+        ***************************************************************/
+        int run() const { return n_loop > 0 ? loop_dims[n_loop-1] : 1; }
+
+        /***************************************************************
+        * T * ptr(int op) const; long stride(int op) const;
+        *
+        *   Returns:
+        *       The first element of operand op in the current run
+        *       and the distance between its elements in the run (0 if stretched)
+        ***************************************************************/
+        T * ptr(int op) const { return data[op] + offsets[op]; }
+        long stride(int op) const { return n_loop > 0 ? strides[op*n_loop + n_loop-1] : 0; }
+
+        /***************************************************************
+        * bool next();
+        *
+        *   Description:
+        *       Moves to the next run
+        *
+        *   Returns:
+        *       false once every run has been visited
+        ***************************************************************/
+        bool next();
+
+    private:
+        int n_ops;
+        int n_dims;
+        int * dims;
+        int n_loop;
+        int * loop_dims;
+        long * strides;     //[op][loop dim]
+        int * curr;
+        long * offsets;
+        T ** data;
+};
+/*###############################################################################################################*/
+template <typename T>
+bool broadcast_iterator<T>::broadcastable(int n_ops, Tensor<T> * const * ops, int * n_dims, int * dims) {
+    int n = 0;
+    for(int k=0; k<n_ops; k++) if(ops[k]->getNDims() > n) n = ops[k]->getNDims();
+    if(n_dims != NULL) *n_dims = n;
+    for(int d=0; d<n; d++){
+        int size = 1;
+        for(int k=0; k<n_ops; k++){
+            int od = d - (n - ops[k]->getNDims());
+            int s = od >= 0 ? ops[k]->getDims()[od] : 1;
+            if(s == 1) continue;
+            if(size != 1 && size != s) return false;
+            size = s;
+        }
+        if(dims != NULL) dims[d] = size;
+    }
+    return true;
+}
+/*###############################################################################################################*/
+template <typename T>
+broadcast_iterator<T>::broadcast_iterator(int n_ops, Tensor<T> * const * ops) : n_ops(n_ops) {
+    n_dims = 0;
+    for(int k=0; k<n_ops; k++) if(ops[k]->getNDims() > n_dims) n_dims = ops[k]->getNDims();
+    dims = new int[n_dims];
+    bool ok = broadcastable(n_ops, ops, NULL, dims);
+    assert(ok && "SHAPES CANNOT BE BROADCAST");
+    (void)ok;
+
+    //Collect the loop dims outermost first, skipping dims of size 1
+    //and merging a dim into the previous one when every operand allows it
+    loop_dims = new int[n_dims > 0 ? n_dims : 1];
+    strides = new long[n_ops * (n_dims > 0 ? n_dims : 1)];
+    n_loop = 0;
+    long full_strides[n_ops];
+    for(int d=0; d<n_dims; d++){
+        if(dims[d] == 1) continue;
+        for(int k=0; k<n_ops; k++){
+            int od = d - (n_dims - ops[k]->getNDims());
+            full_strides[k] = (od >= 0 && ops[k]->getDims()[od] != 1) ? ops[k]->getMults()[od] : 0;
+        }
+        bool merge = n_loop > 0 && (long)loop_dims[n_loop-1] * dims[d] <= INT_MAX;
+        for(int k=0; k<n_ops && merge; k++)
+            merge = strides[k*n_dims + n_loop-1] == full_strides[k] * dims[d];
+        if(merge){
+            loop_dims[n_loop-1] *= dims[d];
+            for(int k=0; k<n_ops; k++) strides[k*n_dims + n_loop-1] = full_strides[k];
+        }
+        else {
+            loop_dims[n_loop] = dims[d];
+            for(int k=0; k<n_ops; k++) strides[k*n_dims + n_loop] = full_strides[k];
+            n_loop++;
+        }
+    }
+    //Compact the strides to [op][n_loop]
+    for(int k=0; k<n_ops; k++)
+        for(int d=0; d<n_loop; d++) strides[k*n_loop + d] = strides[k*n_dims + d];
+
+    curr = new int[n_loop > 0 ? n_loop : 1];
+    setAllElements(n_loop, curr, 0);
+    offsets = new long[n_ops];
+    data = new T*[n_ops];
+    for(int k=0; k<n_ops; k++){
+        offsets[k] = 0;
+        data[k] = ops[k]->getData();
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
+bool broadcast_iterator<T>::next() {
+    //Odometer over every loop dim but the innermost (the run)
+    int d = n_loop - 2;
+    while(d >= 0){
+        curr[d]++;
+        for(int k=0; k<n_ops; k++) offsets[k] += strides[k*n_loop + d];
+        if(curr[d] < loop_dims[d]) return true;
+        for(int k=0; k<n_ops; k++) offsets[k] -= strides[k*n_loop + d] * loop_dims[d];
+        curr[d] = 0;
+        d--;
+    }
+    return false;
+}
+/*###############################################################################################################*/
 #endif
\ No newline at end of file
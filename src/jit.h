@@ -0,0 +1,403 @@
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <algorithm>
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <sys/stat.h>
+
+#include "tensor.h"
+#include "ops.h"
+#include "threadpool.h"
+
+/*
+    Runtime compilation of fused kernels.
+    JIT::compile walks the graph that produced a tensor, collects the
+    connected elementwise ops (ADD, SUB, MULT, DIV, NEG, EXP, ReLU, without
+    broadcasting) optionally topped by a SUM/MEAN over trailing axes, and
+    generates C++ for one loop computing all of them. The source is built
+    with the system compiler (CXX, default c++) into a shared object that is
+    dlopen'ed and kept on disk (LENNYGRAD_JIT_CACHE, default
+    $XDG_CACHE_HOME/lennygrad-jit or ~/.cache/lennygrad-jit) under a hash of
+    the source, the compiler and the CPU features, so later runs only pay
+    for the dlopen. Whatever is in the cache gets loaded into the process,
+    so the directory is created private and nothing is loaded from one that
+    another user owns or could write to. Kernels compute the forward pass only.
+    Programs using it must link with -ldl on older C libraries.
+*/
+
+template <typename T> class JITKernel;
+
+template <typename T> struct _jit_type;
+template <> struct _jit_type<float> { static const char * name() { return "float"; } };
+template <> struct _jit_type<double> { static const char * name() { return "double"; } };
+
+//Generated kernels: for a reduction (m > 1 or a SUM root) out[j] = scale * sum_k f(j*m + k),
+//otherwise out[i] = f(i), for output elements in [lo, hi)
+template <typename T>
+using _jit_fn = void (*)(const T * const * in, T * out, long lo, long hi, long m, T scale);
+
+class JIT {
+    public:
+        JIT(const std::string & cache_dir = default_cache_dir(), const std::string & compiler = default_compiler());
+        ~JIT();
+
+        JIT(const JIT&) = delete;
+        JIT & operator=(const JIT&) = delete;
+
+        /***************************************************************
+        * JITKernel<T> compile(Tensor<T> * root);
+        *
+        *   Description:
+        *       Traces the fusible subgraph ending at root and returns
+        *       a kernel computing root from the tensors the subgraph
+        *       reads. Kernels must not outlive the JIT.
+        ***************************************************************/
+        template <typename T>
+        JITKernel<T> compile(Tensor<T> * root);
+
+        /***************************************************************
+        * int compiled() const; int loaded() const;
+        *
+        *   Returns:
+        *       how many kernels were built by the compiler and
+        *       how many were found in the disk cache
+        ***************************************************************/
+        int compiled() const { return n_compiled; }
+        int loaded() const { return n_loaded; }
+
+        static std::string default_cache_dir();
+        static std::string default_compiler();
+        static std::string cpu_features();
+
+    private:
+        void * load(const std::string & source);
+        bool private_cache() const;
+
+        std::string cache_dir;
+        std::string compiler;
+        std::map<std::string, void*> symbols;
+        std::vector<void*> handles;
+        std::mutex lock;
+        int n_compiled = 0;
+        int n_loaded = 0;
+};
+/*###############################################################################################################*/
+template <typename T>
+class JITKernel {
+    public:
+        /***************************************************************
+        * const std::vector<Tensor<T>*> & inputs() const;
+        *
+        *   Returns:
+        *       the tensors read by the kernel, in argument order
+        ***************************************************************/
+        const std::vector<Tensor<T>*> & inputs() const { return leaves; }
+
+        /***************************************************************
+        * const std::string & source() const;
+        *
+        *   Returns:
+        *       the generated C++
+        ***************************************************************/
+        const std::string & source() const { return code; }
+
+        bool valid() const { return fn != NULL; }
+
+        /***************************************************************
+        * Tensor<T> * operator()(const std::vector<Tensor<T>*> & inputs) const;
+        *
+        *   Description:
+        *       Runs the kernel on tensors with the shapes of inputs(),
+        *       or on the traced tensors themselves when called without
+        *       arguments
+        *
+        *   Returns:
+        *       A new tensor (without history) shaped like the traced root
+        ***************************************************************/
+        Tensor<T> * operator()(const std::vector<Tensor<T>*> & inputs) const;
+        Tensor<T> * operator()() const { return (*this)(leaves); }
+
+    private:
+        friend class JIT;
+        _jit_fn<T> fn = NULL;
+        std::vector<Tensor<T>*> leaves;
+        std::vector<int> out_dims;
+        long n_out = 0;
+        long m = 1;
+        T scale = 1;
+        std::string code;
+};
+/*###############################################################################################################*/
+template <typename T>
+Tensor<T> * JITKernel<T>::operator()(const std::vector<Tensor<T>*> & inputs) const {
+    assert(valid() && "KERNEL FAILED TO COMPILE");
+    assert(inputs.size() == leaves.size() && "WRONG NUMBER OF INPUTS");
+    const T * in[inputs.size() > 0 ? inputs.size() : 1];
+    for(size_t k=0; k<inputs.size(); k++){
+        assert(inputs[k]->getTotalElements() == leaves[k]->getTotalElements() && "INPUT SHAPES DIFFER FROM THE TRACE");
+        if(!inputs[k]->is_contiguous()) inputs[k]->as_contiguous();
+        in[k] = inputs[k]->getData();
+    }
+    Tensor<T> * out = new Tensor<T>((int)out_dims.size(), out_dims.data());
+    out->no_history();
+    T * y = out->getData();
+    parallel_for(0, n_out, std::max(1L, 16384 / m), [&](long lo, long hi){ fn(in, y, lo, hi, m, scale); });
+    return out;
+}
+/*###############################################################################################################*/
+/*                                              CODE GENERATION                                                  */
+/*###############################################################################################################*/
+template <typename T>
+class _JITTracer {
+    /*
+        Emits one "const T vN = ...;" line per fused node in topological
+        order. Anything that cannot be fused (other ops, broadcasting,
+        tensors without history) becomes an input read as in[K][i].
+    */
+    public:
+        _JITTracer(Tensor<T> * domain): domain(domain) {}
+
+        std::string emit(Tensor<T> * t, bool force_fuse=false){
+            typename std::map<Tensor<T>*, std::string>::iterator found = names.find(t);
+            if(found != names.end()) return found->second;
+
+            std::string expr;
+            std::vector<Tensor<T>*> parents = t->getParents();
+            const char * symbol = NULL;
+            int arity = 0;
+            if(dynamic_cast<_ADD<T>*>(t->getOp())) { symbol = "+"; arity = 2; }
+            else if(dynamic_cast<_SUB<T>*>(t->getOp())) { symbol = "-"; arity = 2; }
+            else if(dynamic_cast<_MULT<T>*>(t->getOp())) { symbol = "*"; arity = 2; }
+            else if(dynamic_cast<_DIV<T>*>(t->getOp())) { symbol = "/"; arity = 2; }
+            else if(dynamic_cast<_NEG<T>*>(t->getOp())) { symbol = "-"; arity = 1; }
+            else if(dynamic_cast<_EXP<T>*>(t->getOp())) { symbol = "std::exp"; arity = 1; }
+            else if(dynamic_cast<_ReLU<T>*>(t->getOp())) { symbol = "relu"; arity = 1; }
+
+            bool fuse = arity > 0 && (int)parents.size() == arity && same_shape(t);
+            for(size_t p=0; p<parents.size() && fuse; p++) fuse = same_shape(parents[p]);
+            assert((fuse || !force_fuse) && "NOTHING TO FUSE");
+            (void)force_fuse;
+
+            if(!fuse){
+                std::ostringstream read;
+                read << "in[" << leaves.size() << "][i]";
+                leaves.push_back(t);
+                expr = read.str();
+            }
+            else if(arity == 2){
+                std::string a = emit(parents[0]), b = emit(parents[1]);
+                expr = a + " " + symbol + " " + b;
+            }
+            else if(std::string(symbol) == "relu"){
+                std::string a = emit(parents[0]);
+                expr = "(" + a + " > 0 ? " + a + " : (T)0)";
+            }
+            else {
+                expr = std::string(symbol) + "(" + emit(parents[0]) + ")";
+            }
+
+            std::ostringstream name;
+            name << "v" << names.size();
+            body << "        const T " << name.str() << " = " << expr << ";\n";
+            names[t] = name.str();
+            return name.str();
+        }
+
+        bool same_shape(Tensor<T> * t) const {
+            if(t->getNDims() != domain->getNDims()) return false;
+            for(int d=0; d<t->getNDims(); d++) if(t->getDims()[d] != domain->getDims()[d]) return false;
+            return true;
+        }
+
+        Tensor<T> * domain;
+        std::vector<Tensor<T>*> leaves;
+        std::map<Tensor<T>*, std::string> names;
+        std::ostringstream body;
+};
+/*###############################################################################################################*/
+template <typename T>
+JITKernel<T> JIT::compile(Tensor<T> * root) {
+    JITKernel<T> kernel;
+    kernel.out_dims.assign(root->getDims(), root->getDims() + root->getNDims());
+    kernel.n_out = root->getTotalElements();
+
+    //A SUM/MEAN root is fused when it reduces a trailing block of axes
+    Tensor<T> * domain = root;
+    _SUM<T> * sum = dynamic_cast<_SUM<T>*>(root->getOp());
+    bool reduce = false;
+    if(sum != NULL && root->getParents().size() == 1){
+        Tensor<T> * input = root->getParents()[0];
+        const std::vector<bool> & reduced = sum->getReduced();
+        reduce = true;
+        bool in_suffix = false;
+        long m = 1;
+        for(int d=0; d<input->getNDims(); d++){
+            if(input->getDims()[d] == 1) continue;
+            if(reduced[d]) { in_suffix = true; m *= input->getDims()[d]; }
+            else if(in_suffix) reduce = false;
+        }
+        if(reduce){
+            domain = input;
+            kernel.m = m;
+            kernel.scale = sum->getScale();
+        }
+    }
+
+    _JITTracer<T> tracer(domain);
+    std::string result = tracer.emit(domain, !reduce);
+    kernel.leaves = tracer.leaves;
+
+    std::ostringstream src;
+    src << "#include <cmath>\n"
+        << "typedef " << _jit_type<T>::name() << " T;\n"
+        << "extern \"C\" void lg_kernel(const T * const * in, T * out, long lo, long hi, long m, T scale) {\n";
+    if(reduce){
+        src << "    for(long j=lo; j<hi; j++){\n"
+            << "      T acc = 0;\n"
+            << "      for(long i=j*m; i<(j+1)*m; i++){\n"
+            << tracer.body.str()
+            << "        acc += " << result << ";\n"
+            << "      }\n"
+            << "      out[j] = acc * scale;\n"
+            << "    }\n";
+    }
+    else {
+        src << "    (void)m; (void)scale;\n"
+            << "    for(long i=lo; i<hi; i++){\n"
+            << tracer.body.str()
+            << "        out[i] = " << result << ";\n"
+            << "    }\n";
+    }
+    src << "}\n";
+    kernel.code = src.str();
+    kernel.fn = (_jit_fn<T>)load(kernel.code);
+    return kernel;
+}
+/*###############################################################################################################*/
+/*                                                  BUILD AND CACHE                                              */
+/*###############################################################################################################*/
+inline JIT::JIT(const std::string & cache_dir, const std::string & compiler)
+    : cache_dir(cache_dir), compiler(compiler) {
+    //mkdir -p, readable by this user only
+    for(size_t at = cache_dir.find('/', 1); ; at = cache_dir.find('/', at + 1)){
+        mkdir(cache_dir.substr(0, at).c_str(), 0700);
+        if(at == std::string::npos) break;
+    }
+}
+/*###############################################################################################################*/
+inline JIT::~JIT() {
+    for(size_t i=0; i<handles.size(); i++) dlclose(handles[i]);
+}
+/*###############################################################################################################*/
+inline std::string JIT::default_cache_dir() {
+    //Per user, a shared directory would let anyone plant a kernel
+    const char * dir = std::getenv("LENNYGRAD_JIT_CACHE");
+    if(dir != NULL) return dir;
+    const char * xdg = std::getenv("XDG_CACHE_HOME");
+    if(xdg != NULL && xdg[0] == '/') return std::string(xdg) + "/lennygrad-jit";
+    const char * home = std::getenv("HOME");
+    if(home == NULL){
+        passwd * user = getpwuid(getuid());
+        home = user != NULL ? user->pw_dir : NULL;
+    }
+    return home != NULL ? std::string(home) + "/.cache/lennygrad-jit" : "/tmp/lennygrad-jit-" + std::to_string(getuid());
+}
+/*###############################################################################################################*/
+inline bool JIT::private_cache() const {
+    //Owned by us and writable by nobody else, so only we could have put a library there
+    struct stat st;
+    if(stat(cache_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) return false;
+    return st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+/*###############################################################################################################*/
+inline std::string JIT::default_compiler() {
+    const char * cxx = std::getenv("CXX");
+    return cxx != NULL ? cxx : "c++";
+}
+/*###############################################################################################################*/
+inline std::string JIT::cpu_features() {
+    //Kernels are built with -march=native so the cache must not be shared across CPUs
+    std::string features;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) features += "sse4.2 ";
+    if(__builtin_cpu_supports("avx")) features += "avx ";
+    if(__builtin_cpu_supports("avx2")) features += "avx2 ";
+    if(__builtin_cpu_supports("fma")) features += "fma ";
+    if(__builtin_cpu_supports("avx512f")) features += "avx512f ";
+#else
+    features = "generic";
+#endif
+    return features;
+}
+/*###############################################################################################################*/
+inline void * JIT::load(const std::string & source) {
+    const std::string flags = "-O3 -march=native -std=c++11 -shared -fPIC";
+    std::string signature = source + "|" + compiler + " " + flags + "|" + cpu_features();
+
+    //64 bit FNV-1a
+    unsigned long long hash = 14695981039346656037ULL;
+    for(size_t i=0; i<signature.size(); i++){
+        hash ^= (unsigned char)signature[i];
+        hash *= 1099511628211ULL;
+    }
+    char key[17];
+    std::snprintf(key, sizeof(key), "%016llx", hash);
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::map<std::string, void*>::iterator found = symbols.find(key);
+    if(found != symbols.end()) return found->second;
+
+    if(!private_cache()){
+        std::cerr << "JIT CACHE " << cache_dir << " IS NOT OWNED BY THIS USER OR IS WRITABLE BY OTHERS, NOT USING IT" << std::endl;
+        return NULL;
+    }
+    std::string base = cache_dir + "/" + key;
+    std::string so = base + ".so";
+    if(access(so.c_str(), R_OK) == 0) n_loaded++;
+    else {
+        //Build under a unique name and rename, other processes only ever see whole files
+        std::string tmp = base + ".XXXXXX";
+        int fd = mkstemp(&tmp[0]);
+        if(fd < 0 || write(fd, source.data(), source.size()) != (ssize_t)source.size()){
+            std::cerr << "JIT COULD NOT WRITE " << tmp << std::endl;
+            if(fd >= 0) { close(fd); std::remove(tmp.c_str()); }
+            return NULL;
+        }
+        close(fd);
+        std::string command = compiler + " " + flags + " -o " + tmp + ".so -x c++ " + tmp + " 2> " + tmp + ".log";
+        if(std::system(command.c_str()) != 0){
+            std::cerr << "JIT COMPILATION FAILED, SEE " << tmp << ".log" << std::endl;
+            std::remove(tmp.c_str());
+            return NULL;
+        }
+        std::rename(tmp.c_str(), (base + ".cpp").c_str());
+        std::rename((tmp + ".so").c_str(), so.c_str());
+        std::remove((tmp + ".log").c_str());
+        n_compiled++;
+    }
+
+    void * handle = dlopen(so.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(handle == NULL){
+        std::cerr << "JIT COULD NOT LOAD " << so << ": " << dlerror() << std::endl;
+        return NULL;
+    }
+    handles.push_back(handle);
+    void * symbol = dlsym(handle, "lg_kernel");
+    symbols[key] = symbol;
+    return symbol;
+}
+
+#endif
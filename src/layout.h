@@ -0,0 +1,218 @@
+#ifndef LAYOUT_H_
+#define LAYOUT_H_
+
+#include <vector>
+#include <cstring>
+#include <cassert>
+#include <utility>
+#include <algorithm>
+
+#include "tensor.h"
+#include "transpose.h"
+#include "threadpool.h"
+#include "half.h"
+
+/*
+    Image memory formats (see MemoryFormat in tensor.h).
+    Every format stores, per image, C / inner planes of H x W pixels
+    with inner channels at every pixel:
+        NCHW    inner = 1
+        NHWC    inner = C (a single plane)
+        NCHWc   inner = b
+    so one offset function covers the three of them, and a kernel
+    written over (planes, H, W, inner) serves every format.
+    With the channels innermost the channels of a pixel are contiguous:
+    the direct CONV below runs its inner loop over output channels and
+    pooling runs over channels, unit stride for any kernel or stride.
+*/
+
+struct ImageLayout {
+    int N, C, H, W, inner;
+
+    long offset(int n, int c, int h, int w) const {
+        return (((long)n * (C / inner) + c / inner) * H + h) * W * inner + (long)w * inner + c % inner;
+    }
+    int planes() const { return N * (C / inner); }
+    long size() const { return (long)N * C * H * W; }
+};
+
+/***************************************************************
+* ImageLayout image_layout(MemoryFormat format, int N, int C, int H, int W, int block=1);
+* int format_dims(MemoryFormat format, const ImageLayout & L, int * dims);
+*
+*   Description:
+*       the layout of an (N, C, H, W) image in format (block is
+*       the channel block of FORMAT_NCHWC), and the physical dims
+*       of a tensor holding it in that format
+*
+*   Returns:
+*       the layout, and the number of dims written
+***************************************************************/
+inline ImageLayout image_layout(MemoryFormat format, int N, int C, int H, int W, int block=1) {
+    ImageLayout L = {N, C, H, W, format == FORMAT_NCHW ? 1 : format == FORMAT_NHWC ? C : block};
+    assert(L.inner > 0 && C % L.inner == 0 && "CHANNELS MUST BE A MULTIPLE OF THE BLOCK");
+    return L;
+}
+
+inline int format_dims(MemoryFormat format, const ImageLayout & L, int * dims) {
+    if(format == FORMAT_NCHWC){
+        int d[] = {L.N, L.C / L.inner, L.H, L.W, L.inner};
+        std::copy(d, d + 5, dims);
+        return 5;
+    }
+    int d[] = {L.N, L.C, L.H, L.W};
+    if(format == FORMAT_NHWC) { d[1] = L.H; d[2] = L.W; d[3] = L.C; }
+    std::copy(d, d + 4, dims);
+    return 4;
+}
+
+/***************************************************************
+* ImageLayout image_layout(Tensor<T> * t);
+*
+*   Returns:
+*       the layout of the image tensor t, read from its dims and
+*       its memory format (t is made contiguous)
+***************************************************************/
+template <typename T>
+ImageLayout image_layout(Tensor<T> * t) {
+    const int * d = t->getDims();
+    MemoryFormat f = t->getFormat();
+    assert(t->getNDims() == (f == FORMAT_NCHWC ? 5 : 4) && "DIMS DO NOT MATCH THE MEMORY FORMAT");
+    if(!t->is_contiguous()) t->as_contiguous();
+    if(f == FORMAT_NHWC) return image_layout(f, d[0], d[3], d[1], d[2]);
+    if(f == FORMAT_NCHWC) return image_layout(f, d[0], d[1] * d[4], d[2], d[3], d[4]);
+    return image_layout(f, d[0], d[1], d[2], d[3]);
+}
+/*###############################################################################################################*/
+/***************************************************************
+* void reorder(const T * src, const ImageLayout & from, T * dst, const ImageLayout & to);
+*
+*   Description:
+*       copies the image src stored in layout from into dst in
+*       layout to. Both describe the same (N, C, H, W). Between
+*       NCHW, NHWC and any NCHWc this is one strided_copy (tiled
+*       transposes), between two different blocks an element loop.
+***************************************************************/
+template <typename T>
+void reorder(const T * src, const ImageLayout & from, T * dst, const ImageLayout & to) {
+    assert(from.N == to.N && from.C == to.C && from.H == to.H && from.W == to.W && "A REORDER KEEPS THE IMAGE SHAPE");
+    long HW = (long)from.H * from.W, image = from.C * HW;
+    if(from.inner == 1 || from.inner == from.C){
+        //Channel c of the source is c * sc away from channel 0: gather the destination's (n, plane, h, w, inner) order
+        long sc = from.inner == 1 ? HW : 1;
+        int dims[] = {to.N, to.C / to.inner, to.H, to.W, to.inner};
+        long strides[] = {image, to.inner * sc, (long)from.W * from.inner, from.inner, sc};
+        strided_copy(src, 5, dims, strides, dst);
+    }
+    else if(to.inner == 1 || to.inner == to.C){
+        //Blocked source: the destination's channel axis splits into (block, channel in block)
+        int b = from.inner, Cb = from.C / b;
+        if(to.inner == 1){
+            int dims[] = {to.N, Cb, b, to.H, to.W};
+            long strides[] = {image, HW * b, 1, (long)from.W * b, b};
+            strided_copy(src, 5, dims, strides, dst);
+        }
+        else {
+            int dims[] = {to.N, to.H, to.W, Cb, b};
+            long strides[] = {image, (long)from.W * b, b, HW * b, 1};
+            strided_copy(src, 5, dims, strides, dst);
+        }
+    }
+    else {
+        parallel_for(0, (long)to.N * to.C, 1, [&](long lo, long hi){
+            for(long nc=lo; nc<hi; nc++){
+                int n = nc / to.C, c = nc % to.C;
+                for(int h=0; h<to.H; h++)
+                    for(int w=0; w<to.W; w++) dst[to.offset(n, c, h, w)] = src[from.offset(n, c, h, w)];
+            }
+        });
+    }
+}
+/*###############################################################################################################*/
+/***************************************************************
+* void pad_image(const T * x, const ImageLayout & in, int ph, int pw, T fill, T * y);
+* void pad_image_back(const T * g, const ImageLayout & in, int ph, int pw, T * dx);
+*
+*   Description:
+*       y (in's layout grown to H + 2 ph, W + 2 pw) is x framed
+*       by fill, pad_image_back adds the interior of g into dx.
+*       A row of a plane is W * inner contiguous values in every format.
+***************************************************************/
+template <typename T>
+void pad_image(const T * x, const ImageLayout & in, int ph, int pw, T fill, T * y) {
+    int OH = in.H + 2 * ph, OW = in.W + 2 * pw, c = in.inner;
+    parallel_for(0, in.planes(), 1, [&](int lo, int hi){
+        for(long p=lo; p<hi; p++){
+            T * o = y + p * OH * OW * c;
+            std::fill(o, o + (size_t)OH * OW * c, fill);
+            for(int r=0; r<in.H; r++)
+                std::memcpy(o + ((size_t)(r + ph) * OW + pw) * c, x + (p * in.H + r) * in.W * c, sizeof(T) * in.W * c);
+        }
+    });
+}
+
+template <typename T>
+void pad_image_back(const T * g, const ImageLayout & in, int ph, int pw, T * dx) {
+    int OH = in.H + 2 * ph, OW = in.W + 2 * pw, c = in.inner;
+    parallel_for(0, in.planes(), 1, [&](int lo, int hi){
+        for(long p=lo; p<hi; p++)
+            for(int r=0; r<in.H; r++){
+                const T * row = g + ((p * OH + r + ph) * OW + pw) * c;
+                T * d = dx + (p * in.H + r) * in.W * c;
+                for(long i=0; i<(long)in.W * c; i++) d[i] += row[i];
+            }
+    });
+}
+/*###############################################################################################################*/
+/***************************************************************
+* void conv_channels_inner(const T * x, const ImageLayout & in, const T * K, int kh, int kw,
+*                          std::pair<int,int> s, T * y, const ImageLayout & out);
+*
+*   Description:
+*       direct (valid) convolution of x by the (out.C, in.C, kh, kw)
+*       kernel K into y. The kernel is repacked to (kh, kw, in.C, out.C)
+*       so a window tap multiplies one input value by a contiguous
+*       row of out.C weights, accumulated into out.C sums that are
+*       written once per output pixel. Any layouts work, the inner
+*       loop is unit stride when the input's channels are innermost.
+***************************************************************/
+template <typename T>
+void conv_channels_inner(const T * x, const ImageLayout & in, const T * K, int kh, int kw,
+                         std::pair<int,int> s, T * y, const ImageLayout & out) {
+    int C = in.C, O = out.C;
+    std::vector<T> wt((size_t)kh * kw * C * O);
+    for(int o=0; o<O; o++)
+        for(int c=0; c<C; c++)
+            for(int u=0; u<kh; u++)
+                for(int v=0; v<kw; v++) wt[(((size_t)u * kw + v) * C + c) * O + o] = K[(((size_t)o * C + c) * kh + u) * kw + v];
+
+    //Offsets of the channels from channel 0 of a pixel
+    std::vector<long> in_off(C), out_off(O);
+    for(int c=0; c<C; c++) in_off[c] = in.offset(0, c, 0, 0);
+    for(int o=0; o<O; o++) out_off[o] = out.offset(0, o, 0, 0);
+
+    //One output row per task
+    parallel_for(0, (long)out.N * out.H, 1, [&](long lo, long hi){
+        std::vector<acc_t<T>> acc(O);
+        for(long r=lo; r<hi; r++){
+            int n = r / out.H, oh = r % out.H;
+            for(int ow=0; ow<out.W; ow++){
+                std::fill(acc.begin(), acc.end(), (acc_t<T>)0);
+                for(int u=0; u<kh; u++)
+                    for(int v=0; v<kw; v++){
+                        const T * px = x + in.offset(n, 0, oh * s.first + u, ow * s.second + v);
+                        const T * w = wt.data() + ((size_t)u * kw + v) * C * O;
+                        for(int c=0; c<C; c++){
+                            acc_t<T> xv = px[in_off[c]];
+                            const T * row = w + (size_t)c * O;
+                            for(int o=0; o<O; o++) acc[o] += xv * (acc_t<T>)row[o];
+                        }
+                    }
+                T * py = y + out.offset(n, 0, oh, ow);
+                for(int o=0; o<O; o++) py[out_off[o]] = (T)acc[o];
+            }
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef MASK_H_
+#define MASK_H_
+
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "threadpool.h"
+
+/*
+    1 bit per element saved state for backward.
+    Ops whose gradient is g or 0 (times a constant) per element (ReLU,
+    dropout) keep a BitMask instead of their input: n/8 bytes instead of
+    n * sizeof(T), 32x less for float and 64x less for double.
+    Bit i of the mask is bit i % 64 of word i / 64.
+    Packing and applying work on whole 64 bit words, with the compare
+    and the bit expansion done in AVX2 registers when available.
+*/
+
+/***************************************************************
+* void philox4x32(uint64_t counter, uint64_t stream, uint64_t seed, uint32_t out[4]);
+*
+*   Description:
+*       Philox4x32-10, a counter based RNG: out is 4 independent
+*       uniform 32 bit values that only depend on (counter, stream, seed),
+*       so any element can be drawn on its own (any order, any thread)
+***************************************************************/
+inline void philox4x32(uint64_t counter, uint64_t stream, uint64_t seed, uint32_t out[4]) {
+    uint32_t c0 = (uint32_t)counter, c1 = (uint32_t)(counter >> 32);
+    uint32_t c2 = (uint32_t)stream, c3 = (uint32_t)(stream >> 32);
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+    for(int round=0; round<10; round++){
+        uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0, n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c0 = n0;
+        c1 = (uint32_t)p1;
+        c2 = n2;
+        c3 = (uint32_t)p0;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+//philox4x32 of the 16 counters first, ..., first + 15 (64 values, out[4 * l + i] = value i of counter l)
+#if defined(__AVX2__)
+inline void _philox4x32_x16(uint64_t first, uint64_t stream, uint64_t seed, uint32_t out[64]) {
+    //4 counters per register, one 32 bit word in the low half of each 64 bit lane
+    //so _mm256_mul_epu32 gives the full 64 bit products
+    const __m256i M0 = _mm256_set1_epi64x(0xD2511F53u), M1 = _mm256_set1_epi64x(0xCD9E8D57u);
+    const __m256i LOW = _mm256_set1_epi64x(0xFFFFFFFFu);
+    for(int g=0; g<4; g++){
+        uint64_t c = first + 4 * g;
+        __m256i c0 = _mm256_setr_epi64x((uint32_t)c, (uint32_t)(c + 1), (uint32_t)(c + 2), (uint32_t)(c + 3));
+        __m256i c1 = _mm256_setr_epi64x((c >> 32), ((c + 1) >> 32), ((c + 2) >> 32), ((c + 3) >> 32));
+        __m256i c2 = _mm256_set1_epi64x((uint32_t)stream), c3 = _mm256_set1_epi64x(stream >> 32);
+        uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+        for(int round=0; round<10; round++){
+            __m256i p0 = _mm256_mul_epu32(M0, c0), p1 = _mm256_mul_epu32(M1, c2);
+            c0 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p1, 32), c1), _mm256_set1_epi64x(k0));
+            c1 = _mm256_and_si256(p1, LOW);
+            c2 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p0, 32), c3), _mm256_set1_epi64x(k1));
+            c3 = _mm256_and_si256(p0, LOW);
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        alignas(32) uint64_t v[4][4];
+        _mm256_store_si256((__m256i*)v[0], c0);
+        _mm256_store_si256((__m256i*)v[1], c1);
+        _mm256_store_si256((__m256i*)v[2], c2);
+        _mm256_store_si256((__m256i*)v[3], c3);
+        for(int l=0; l<4; l++)
+            for(int i=0; i<4; i++) out[16 * g + 4 * l + i] = (uint32_t)v[i][l];
+    }
+}
+#else
+inline void _philox4x32_x16(uint64_t first, uint64_t stream, uint64_t seed, uint32_t out[64]) {
+    for(int l=0; l<16; l++) philox4x32(first + l, stream, seed, out + 4 * l);
+}
+#endif
+
+//Register kernels on 64 elements, step 0 means use the scalar loops for this type
+template <typename T>
+struct _mask_micro {
+    static const int step = 0;
+    static uint64_t pack_positive(const T *) { return 0; }
+    static void apply(uint64_t, const T *, T, T *) {}
+};
+
+#if defined(__AVX2__)
+template <>
+struct _mask_micro<float> {
+    static const int step = 64;
+    static uint64_t pack_positive(const float * x) {
+        uint64_t w = 0;
+        __m256 zero = _mm256_setzero_ps();
+        for(int j=0; j<64; j+=8)
+            w |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(x + j), zero, _CMP_GT_OQ)) << j;
+        return w;
+    }
+    static void apply(uint64_t w, const float * g, float scale, float * dx) {
+        //Spread 8 bits over 8 lanes and turn each into an all ones / all zeros lane
+        const __m256i bit = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+        __m256 s = _mm256_set1_ps(scale);
+        for(int j=0; j<64; j+=8){
+            __m256i lanes = _mm256_and_si256(_mm256_set1_epi32((int)((w >> j) & 0xFF)), bit);
+            __m256 keep = _mm256_castsi256_ps(_mm256_cmpeq_epi32(lanes, bit));
+            __m256 v = _mm256_and_ps(_mm256_mul_ps(_mm256_loadu_ps(g + j), s), keep);
+            _mm256_storeu_ps(dx + j, _mm256_add_ps(_mm256_loadu_ps(dx + j), v));
+        }
+    }
+};
+
+template <>
+struct _mask_micro<double> {
+    static const int step = 64;
+    static uint64_t pack_positive(const double * x) {
+        uint64_t w = 0;
+        __m256d zero = _mm256_setzero_pd();
+        for(int j=0; j<64; j+=4)
+            w |= (uint64_t)_mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(x + j), zero, _CMP_GT_OQ)) << j;
+        return w;
+    }
+    static void apply(uint64_t w, const double * g, double scale, double * dx) {
+        const __m256i bit = _mm256_setr_epi64x(1, 2, 4, 8);
+        __m256d s = _mm256_set1_pd(scale);
+        for(int j=0; j<64; j+=4){
+            __m256i lanes = _mm256_and_si256(_mm256_set1_epi64x((long long)((w >> j) & 0xF)), bit);
+            __m256d keep = _mm256_castsi256_pd(_mm256_cmpeq_epi64(lanes, bit));
+            __m256d v = _mm256_and_pd(_mm256_mul_pd(_mm256_loadu_pd(g + j), s), keep);
+            _mm256_storeu_pd(dx + j, _mm256_add_pd(_mm256_loadu_pd(dx + j), v));
+        }
+    }
+};
+#endif
+
+//Bits (r[j] < threshold) for j < m, threshold <= 2^32
+inline uint64_t _below(const uint32_t * r, int m, uint64_t threshold) {
+    uint64_t w = 0;
+    int j = 0;
+#if defined(__AVX2__)
+    if(threshold < 4294967296u) {
+        //Unsigned compare as a signed one after flipping the sign bits
+        const __m256i flip = _mm256_set1_epi32((int)0x80000000u);
+        __m256i t = _mm256_xor_si256(_mm256_set1_epi32((int)(uint32_t)threshold), flip);
+        for(; j+8<=m; j+=8){
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(r + j)), flip);
+            w |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(t, v))) << j;
+        }
+    }
+#endif
+    for(; j<m; j++) w |= (uint64_t)(r[j] < threshold) << j;
+    return w;
+}
+
+class BitMask {
+    public:
+        BitMask(): n(0) {}
+
+        /***************************************************************
+        * void pack_positive(const T * x, long n);
+        *
+        *   Description:
+        *       bit i = x[i] > 0 (NaN and 0 give 0)
+        ***************************************************************/
+        template <typename T>
+        void pack_positive(const T * x, long n);
+
+        /***************************************************************
+        * void pack_bernoulli(long n, double keep, uint64_t seed, uint64_t stream);
+        *
+        *   Description:
+        *       bit i = 1 with probability keep, value i % 4 of philox4x32
+        *       at counter i / 4, so the mask only depends on (n, keep, seed, stream)
+        ***************************************************************/
+        void pack_bernoulli(long n, double keep, uint64_t seed, uint64_t stream);
+
+        /***************************************************************
+        * void apply(const T * g, T scale, T * dx) const;
+        *
+        *   Description:
+        *       dx[i] += scale * g[i] where bit i is set, every array
+        *       has size() elements
+        ***************************************************************/
+        template <typename T>
+        void apply(const T * g, T scale, T * dx) const;
+
+        /***************************************************************
+        * bool get(long i) const;
+        *
+        *   Returns:
+        *       bit i
+        ***************************************************************/
+        bool get(long i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+
+        /***************************************************************
+        * long size() const { return n; }
+        * size_t bytes() const;
+        *
+        *   Returns:
+        *       the number of elements, and the bytes the bits take
+        ***************************************************************/
+        long size() const { return n; }
+        size_t bytes() const { return words.size() * sizeof(uint64_t); }
+
+        void swap(BitMask & other) {
+            std::swap(n, other.n);
+            words.swap(other.words);
+        }
+
+    private:
+        void resize(long n) {
+            this->n = n;
+            words.assign((n + 63) / 64, 0);
+        }
+
+        long n;
+        std::vector<uint64_t> words;
+};
+/*###############################################################################################################*/
+//Words handed to one task, 256 words is 16k elements
+const int MASK_GRAIN = 256;
+
+template <typename T>
+void BitMask::pack_positive(const T * x, long n) {
+    resize(n);
+    long full = n / 64;
+    parallel_for(0, words.size(), MASK_GRAIN, [&](int lo, int hi){
+        for(long k=lo; k<hi; k++){
+            const T * xk = x + k * 64;
+            if(k < full && _mask_micro<T>::step) {
+                words[k] = _mask_micro<T>::pack_positive(xk);
+                continue;
+            }
+            int m = k < full ? 64 : n - k * 64;
+            uint64_t w = 0;
+            for(int j=0; j<m; j++) w |= (uint64_t)(xk[j] > 0) << j;
+            words[k] = w;
+        }
+    });
+}
+
+inline void BitMask::pack_bernoulli(long n, double keep, uint64_t seed, uint64_t stream) {
+    assert(keep >= 0 && keep <= 1 && "KEEP PROBABILITY MUST BE IN [0, 1]");
+    resize(n);
+    //u < threshold with u uniform in [0, 2^32)
+    uint64_t threshold = (uint64_t)(keep * 4294967296.0);
+    parallel_for(0, words.size(), MASK_GRAIN, [&](int lo, int hi){
+        //Word k takes the 64 values of counters 16k, ..., 16k + 15
+        uint32_t r[64];
+        for(long k=lo; k<hi; k++){
+            _philox4x32_x16((uint64_t)k * 16, stream, seed, r);
+            int m = std::min<long>(64, n - k * 64);
+            words[k] = _below(r, m, threshold);
+        }
+    });
+}
+
+template <typename T>
+void BitMask::apply(const T * g, T scale, T * dx) const {
+    long full = n / 64;
+    parallel_for(0, words.size(), MASK_GRAIN, [&](int lo, int hi){
+        for(long k=lo; k<hi; k++){
+            uint64_t w = words[k];
+            const T * gk = g + k * 64;
+            T * dk = dx + k * 64;
+            if(k < full && _mask_micro<T>::step) {
+                _mask_micro<T>::apply(w, gk, scale, dk);
+                continue;
+            }
+            int m = k < full ? 64 : n - k * 64;
+            for(int j=0; j<m; j++) if((w >> j) & 1) dk[j] += scale * gk[j];
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,708 @@
+#ifndef MODULE_H_
+#define MODULE_H_
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cassert>
+#include <string>
+#include <stdexcept>
+
+#include "tensor.h"
+#include "ops.h"
+#include "utils.h"
+
+/*
+    The Module layer groups parameters into layers.
+    Once the outermost module is finalized every parameter
+    and every gradient lives inside one flat aligned buffer
+    owned by a ParameterBuffer, so whole model operations
+    (zero grad, optimizer steps, saving, reducing across replicas)
+    are single passes over contiguous memory.
+*/
+
+//Alignment (in bytes) of the flat buffers and of every parameter inside them
+const int PARAM_ALIGN = 64;
+
+template <typename T>
+class ParameterBuffer {
+    public:
+        ParameterBuffer(const std::vector<Tensor<T>*> & params);
+        ~ParameterBuffer();
+
+        ParameterBuffer(const ParameterBuffer<T>&) = delete;
+        ParameterBuffer<T> & operator=(const ParameterBuffer<T>&) = delete;
+
+        /***************************************************************
+        * T * getData() const { return data; }
+        *
+        *   Returns:
+        *       A pointer to the flat array storing every parameter
+        ***************************************************************/
+        T * getData() const { return data; }
+
+        /***************************************************************
+        * T * getGrad() const { return grad; }
+        *
+        *   Returns:
+        *       A pointer to the flat array storing every gradient,
+        *       it has the same layout as getData()
+        ***************************************************************/
+        T * getGrad() const { return grad; }
+
+        /***************************************************************
+        * long size() const { return n_els; }
+        *
+        *   Returns:
+        *       the length of the flat arrays (including the padding
+        *       between parameters, which is always 0)
+        ***************************************************************/
+        long size() const { return n_els; }
+
+        /***************************************************************
+        * const std::vector<long> & getOffsets() const { return offsets; }
+        *
+        *   Returns:
+        *       the offset of each parameter within the flat arrays
+        ***************************************************************/
+        const std::vector<long> & getOffsets() const { return offsets; }
+
+        /***************************************************************
+        * void zero_grad();
+        *
+        *   Description:
+        *       sets every gradient to 0
+        ***************************************************************/
+        void zero_grad() { std::memset(grad, 0, sizeof(T) * n_els); }
+
+        /***************************************************************
+        * void scale_grad(T scale);
+        *
+        *   Description:
+        *       multiplies every gradient by scale
+        ***************************************************************/
+        void scale_grad(T scale);
+
+        /***************************************************************
+        * T grad_norm() const;
+        *
+        *   Returns:
+        *       the l2 norm of all the gradients
+        ***************************************************************/
+        T grad_norm() const;
+
+        /***************************************************************
+        * void clip_grad_norm(T max_norm);
+        *
+        *   Description:
+        *       rescales the gradients so their l2 norm is at most max_norm
+        ***************************************************************/
+        void clip_grad_norm(T max_norm);
+
+        /***************************************************************
+        * void save(std::ostream & out) const;
+        * void load(std::istream & in);
+        *
+        *   Description:
+        *       writes/reads every parameter as one binary block.
+        *       load throws std::runtime_error if the stored size does
+        *       not match this buffer or the stream ends early.
+        ***************************************************************/
+        void save(std::ostream & out) const;
+        void load(std::istream & in);
+
+    private:
+        T * data;
+        T * grad;
+        long n_els;
+        std::vector<long> offsets;
+};
+
+/*###############################################################################################################*/
+template <typename T>
+T * _aligned_new(long n_els) {
+    //Rounds the allocation up to a multiple of the alignment as aligned_alloc requires
+    size_t bytes = sizeof(T) * n_els;
+    bytes = ((bytes + PARAM_ALIGN - 1) / PARAM_ALIGN) * PARAM_ALIGN;
+    if(bytes == 0) bytes = PARAM_ALIGN;
+    T * ptr = (T *) std::aligned_alloc(PARAM_ALIGN, bytes);
+    assert(ptr != NULL && "FAILED TO ALLOCATE PARAMETER BUFFER");
+    std::memset(ptr, 0, bytes);
+    return ptr;
+}
+/*###############################################################################################################*/
+template <typename T>
+ParameterBuffer<T>::ParameterBuffer(const std::vector<Tensor<T>*> & params) {
+    //Lay out the parameters back to back, each starting on an aligned address
+    const int stride = PARAM_ALIGN / sizeof(T) > 0 ? PARAM_ALIGN / sizeof(T) : 1;
+    n_els = 0;
+    for(size_t i=0; i<params.size(); i++){
+        offsets.push_back(n_els);
+        n_els += ((params[i]->getTotalElements() + stride - 1) / stride) * stride;
+    }
+    data = _aligned_new<T>(n_els);
+    grad = _aligned_new<T>(n_els);
+
+    //Move each parameter (and its gradient) into the flat arrays
+    for(size_t i=0; i<params.size(); i++)
+        params[i]->bind(data + offsets[i], grad + offsets[i]);
+}
+/*###############################################################################################################*/
+template <typename T>
+ParameterBuffer<T>::~ParameterBuffer() {
+    std::free(data);
+    std::free(grad);
+}
+/*###############################################################################################################*/
+template <typename T>
+void ParameterBuffer<T>::scale_grad(T scale) {
+    for(long i=0; i<n_els; i++) grad[i] *= scale;
+}
+/*###############################################################################################################*/
+template <typename T>
+T ParameterBuffer<T>::grad_norm() const {
+    T accum = 0;
+    for(long i=0; i<n_els; i++) accum += grad[i] * grad[i];
+    return std::sqrt(accum);
+}
+/*###############################################################################################################*/
+template <typename T>
+void ParameterBuffer<T>::clip_grad_norm(T max_norm) {
+    T norm = grad_norm();
+    if(norm > max_norm) scale_grad(max_norm / norm);
+}
+/*###############################################################################################################*/
+//One (int64 count, values) block of a saved module, read only if the count is n
+template <typename T>
+void _load_block(std::istream & in, T * data, long n, const char * what) {
+    int64_t stored;
+    if(!in.read((char *)&stored, sizeof(int64_t))) throw std::runtime_error(std::string("TRUNCATED ") + what);
+    if(stored != n)
+        throw std::runtime_error(std::string(what) + " SIZE MISMATCH: STORED " + std::to_string(stored) + ", EXPECTED " + std::to_string(n));
+    if(!in.read((char *)data, sizeof(T) * n)) throw std::runtime_error(std::string("TRUNCATED ") + what);
+}
+/*###############################################################################################################*/
+template <typename T>
+void ParameterBuffer<T>::save(std::ostream & out) const {
+    int64_t stored = n_els;
+    out.write((const char *)&stored, sizeof(int64_t));
+    out.write((const char *)data, sizeof(T) * n_els);
+}
+/*###############################################################################################################*/
+template <typename T>
+void ParameterBuffer<T>::load(std::istream & in) {
+    _load_block(in, data, n_els, "PARAMETER BUFFER");
+}
+
+/*###############################################################################################################*/
+/*                                                  MODULES                                                      */
+/*###############################################################################################################*/
+template <typename T>
+class Module {
+/*
+    Abstract Class for layers
+    All descendents of the Module class
+    Must implement the forward() method
+    and register their parameters/submodules in their constructor
+*/
+    public:
+        Module() {}
+        virtual ~Module();
+
+        Module(const Module<T>&) = delete;
+        Module<T> & operator=(const Module<T>&) = delete;
+
+        /***************************************************************
+        * Tensor<T> * forward(Tensor<T> * input);
+        *
+        *   Returns:
+        *       The output of the layer, the caller is responsible
+        *       for the graph it creates (see OPS::release_graph)
+        ***************************************************************/
+        virtual Tensor<T> * forward(Tensor<T> * input) = 0;
+
+        /***************************************************************
+        * std::vector<Tensor<T>*> parameters() const;
+        *
+        *   Returns:
+        *       every parameter of this module and its submodules
+        *       in registration order
+        ***************************************************************/
+        std::vector<Tensor<T>*> parameters() const;
+
+        /***************************************************************
+        * std::vector<Tensor<T>*> sparse_parameters() const;
+        *
+        *   Returns:
+        *       every parameter with a sparse gradient (embedding tables)
+        *       of this module and its submodules. They are not part of
+        *       the flat buffer, optimizers take them with add_sparse()
+        ***************************************************************/
+        std::vector<Tensor<T>*> sparse_parameters() const;
+
+        /***************************************************************
+        * void finalize();
+        *
+        *   Description:
+        *       Moves every parameter into one flat buffer. Must be called
+        *       on the outermost module once it is fully constructed,
+        *       calling it again is a no op.
+        ***************************************************************/
+        void finalize();
+
+        /***************************************************************
+        * ParameterBuffer<T> * flat();
+        *
+        *   Returns:
+        *       The flat parameter buffer, finalizing the module if needed
+        ***************************************************************/
+        ParameterBuffer<T> * flat() { finalize(); return buffer; }
+
+        /***************************************************************
+        * void zero_grad();
+        *
+        *   Description:
+        *       sets the gradient of every parameter to 0
+        ***************************************************************/
+        void zero_grad();
+
+        /***************************************************************
+        * void save(std::ostream & out);
+        * void load(std::istream & in);
+        *
+        *   Description:
+        *       writes/reads every parameter of the module. load
+        *       throws std::runtime_error on a size mismatch or a
+        *       truncated stream.
+        ***************************************************************/
+        void save(std::ostream & out);
+        void load(std::istream & in);
+
+        /***************************************************************
+        * void train(bool mode=true);
+        * bool is_training() const { return training; }
+        *
+        *   Description:
+        *       switches the module and its submodules between training
+        *       (the default) and evaluation, layers such as BatchNorm
+        *       behave differently in the two modes
+        ***************************************************************/
+        void train(bool mode=true);
+        bool is_training() const { return training; }
+
+        /***************************************************************
+        * void save_activations(SavedFormat format);
+        * SavedFormat saved_format() const { return saved; }
+        *
+        *   Description:
+        *       Opt in to keeping the activations saved for backward in
+        *       reduced precision (SAVED_BF16, SAVED_FP16, SAVED_INT8) for
+        *       the module and its submodules, SAVED_FULL (the default)
+        *       turns it off. Containers pack the activations of a layer
+        *       as soon as the next layer has consumed them (OPS::pack_graph),
+        *       so gradients are computed from the decoded values.
+        ***************************************************************/
+        void save_activations(SavedFormat format);
+        SavedFormat saved_format() const { return saved; }
+
+    protected:
+        Tensor<T> * register_parameter(Tensor<T> * param);
+        Tensor<T> * register_sparse_parameter(Tensor<T> * param);
+        Tensor<T> * register_buffer(Tensor<T> * buffer);
+        Module<T> * register_module(Module<T> * module);
+
+    private:
+        std::vector<Tensor<T>*> all_buffers() const;
+
+        std::vector<Tensor<T>*> params;
+        std::vector<Tensor<T>*> sparse_params;
+        std::vector<Tensor<T>*> buffers;    //saved state that is not trained (running statistics)
+        bool training = true;
+        SavedFormat saved = SAVED_FULL;
+        std::vector<Module<T>*> modules;
+        ParameterBuffer<T> * buffer = NULL;
+};
+/*###############################################################################################################*/
+template <typename T>
+Module<T>::~Module() {
+    for(size_t i=0; i<modules.size(); i++) delete modules[i];
+    for(size_t i=0; i<params.size(); i++) delete params[i];
+    for(size_t i=0; i<sparse_params.size(); i++) delete sparse_params[i];
+    for(size_t i=0; i<buffers.size(); i++) delete buffers[i];
+    if(buffer != NULL) delete buffer;
+}
+/*###############################################################################################################*/
+template <typename T>
+Tensor<T> * Module<T>::register_parameter(Tensor<T> * param) {
+    assert(buffer == NULL && "CANNOT REGISTER PARAMETERS AFTER FINALIZE");
+    param->init_grad();
+    params.push_back(param);
+    return param;
+}
+/*###############################################################################################################*/
+template <typename T>
+Tensor<T> * Module<T>::register_sparse_parameter(Tensor<T> * param) {
+    param->use_sparse_grad();
+    sparse_params.push_back(param);
+    return param;
+}
+/*###############################################################################################################*/
+template <typename T>
+Tensor<T> * Module<T>::register_buffer(Tensor<T> * buffer) {
+    buffer->no_history();
+    buffers.push_back(buffer);
+    return buffer;
+}
+/*###############################################################################################################*/
+template <typename T>
+void Module<T>::train(bool mode) {
+    training = mode;
+    for(size_t i=0; i<modules.size(); i++) modules[i]->train(mode);
+}
+/*###############################################################################################################*/
+template <typename T>
+void Module<T>::save_activations(SavedFormat format) {
+    saved = format;
+    for(size_t i=0; i<modules.size(); i++) modules[i]->save_activations(format);
+}
+/*###############################################################################################################*/
+template <typename T>
+Module<T> * Module<T>::register_module(Module<T> * module) {
+    assert(buffer == NULL && "CANNOT REGISTER MODULES AFTER FINALIZE");
+    modules.push_back(module);
+    return module;
+}
+/*###############################################################################################################*/
+template <typename T>
+std::vector<Tensor<T>*> Module<T>::parameters() const {
+    std::vector<Tensor<T>*> all = params;
+    for(size_t i=0; i<modules.size(); i++){
+        std::vector<Tensor<T>*> sub = modules[i]->parameters();
+        all.insert(all.end(), sub.begin(), sub.end());
+    }
+    return all;
+}
+/*###############################################################################################################*/
+template <typename T>
+std::vector<Tensor<T>*> Module<T>::sparse_parameters() const {
+    std::vector<Tensor<T>*> all = sparse_params;
+    for(size_t i=0; i<modules.size(); i++){
+        std::vector<Tensor<T>*> sub = modules[i]->sparse_parameters();
+        all.insert(all.end(), sub.begin(), sub.end());
+    }
+    return all;
+}
+/*###############################################################################################################*/
+template <typename T>
+void Module<T>::zero_grad() {
+    flat()->zero_grad();
+    //Sparse gradients are emptied, never zero filled
+    std::vector<Tensor<T>*> sparse = sparse_parameters();
+    for(size_t i=0; i<sparse.size(); i++) sparse[i]->getSparseGrad()->clear();
+}
+/*###############################################################################################################*/
+template <typename T>
+void Module<T>::save(std::ostream & out) {
+    //The flat buffer, then every sparse parameter and buffer
+    flat()->save(out);
+    std::vector<Tensor<T>*> extra = sparse_parameters();
+    std::vector<Tensor<T>*> state = all_buffers();
+    extra.insert(extra.end(), state.begin(), state.end());
+    for(size_t i=0; i<extra.size(); i++){
+        int64_t n = extra[i]->getTotalElements();
+        out.write((const char *)&n, sizeof(int64_t));
+        out.write((const char *)extra[i]->getData(), sizeof(T) * n);
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
+void Module<T>::load(std::istream & in) {
+    flat()->load(in);
+    std::vector<Tensor<T>*> extra = sparse_parameters();
+    std::vector<Tensor<T>*> state = all_buffers();
+    extra.insert(extra.end(), state.begin(), state.end());
+    for(size_t i=0; i<extra.size(); i++) _load_block(in, extra[i]->getData(), extra[i]->getTotalElements(), "PARAMETER");
+}
+/*###############################################################################################################*/
+template <typename T>
+std::vector<Tensor<T>*> Module<T>::all_buffers() const {
+    std::vector<Tensor<T>*> all = buffers;
+    for(size_t i=0; i<modules.size(); i++){
+        std::vector<Tensor<T>*> sub = modules[i]->all_buffers();
+        all.insert(all.end(), sub.begin(), sub.end());
+    }
+    return all;
+}
+/*###############################################################################################################*/
+template <typename T>
+void Module<T>::finalize() {
+    if(buffer != NULL) return;
+    buffer = new ParameterBuffer<T>(parameters());
+}
+
+/*###############################################################################################################*/
+/*                                                  LAYERS                                                       */
+/*###############################################################################################################*/
+template <typename T>
+class Linear: public Module<T> {
+/*
+    y = xW + b
+    x: (batch, in_features), W: (in_features, out_features), b: (out_features)
+*/
+    public:
+        Linear(int in_features, int out_features, bool use_bias=true) {
+            W = this->register_parameter(new Tensor<T>(2, in_features, out_features));
+            W->randn();
+            //Scale so the variance of the output does not grow with the width
+            T * w = W->getData();
+            for(long i=0; i<W->getTotalElements(); i++) w[i] /= std::sqrt((T)in_features);
+            b = NULL;
+            if(use_bias){
+                b = this->register_parameter(new Tensor<T>(1, out_features));
+                b->setAll(0);
+            }
+        }
+
+        Tensor<T> * forward(Tensor<T> * input) {
+            Tensor<T> * out = OPS::MatMul(input, W);
+            if(b == NULL) return out;
+            return OPS::BIAS_ADD(out, b);
+        }
+
+        Tensor<T> * weight() const { return W; }
+        Tensor<T> * bias() const { return b; }
+
+    private:
+        Tensor<T> * W;
+        Tensor<T> * b;
+};
+/*###############################################################################################################*/
+template <typename T>
+class Conv2d: public Module<T> {
+/*
+    x: (batch, in_channels, height, width)
+    K: (out_channels, in_channels, kernel, kernel), b: (out_channels)
+*/
+    public:
+        Conv2d(int in_channels, int out_channels, int kernel, int stride=1, int padding=0, bool use_bias=true)
+            : stride(stride), padding(padding) {
+            K = this->register_parameter(new Tensor<T>(4, out_channels, in_channels, kernel, kernel));
+            K->randn();
+            T * k = K->getData();
+            for(long i=0; i<K->getTotalElements(); i++) k[i] /= std::sqrt((T)(in_channels * kernel * kernel));
+            b = NULL;
+            if(use_bias){
+                b = this->register_parameter(new Tensor<T>(1, out_channels));
+                b->setAll(0);
+            }
+        }
+
+        Tensor<T> * forward(Tensor<T> * input) {
+            if(padding > 0) input = OPS::PAD(input, padding, padding);
+            Tensor<T> * out = OPS::CONV(input, K, std::make_pair(stride, stride));
+            if(b == NULL) return out;
+            //A channels last input keeps its channels on the last axis
+            assert(out->getFormat() != FORMAT_NCHWC && "CONV2D BIAS OF BLOCKED CHANNELS, USE TO_FORMAT");
+            return OPS::BIAS_ADD(out, b, out->getFormat() == FORMAT_NHWC ? 3 : 1);
+        }
+
+        Tensor<T> * weight() const { return K; }
+        Tensor<T> * bias() const { return b; }
+        int getStride() const { return stride; }
+        int getPadding() const { return padding; }
+
+    private:
+        Tensor<T> * K;
+        Tensor<T> * b;
+        int stride;
+        int padding;
+};
+/*###############################################################################################################*/
+template <typename T>
+class Embedding: public Module<T> {
+/*
+    y = W[x]
+    x: indices of any shape, W: (num_embeddings, dim), y: (x dims..., dim)
+    With sparse=true (the default) W keeps a row sparse gradient outside
+    the flat buffer, hand it to the optimizer with add_sparse(weight())
+*/
+    public:
+        Embedding(int num_embeddings, int dim, bool sparse=true) {
+            Tensor<T> * table = new Tensor<T>(2, num_embeddings, dim);
+            table->randn();
+            W = sparse ? this->register_sparse_parameter(table) : this->register_parameter(table);
+        }
+
+        Tensor<T> * forward(Tensor<T> * input) { return OPS::EMBEDDING(W, input); }
+
+        Tensor<T> * weight() const { return W; }
+
+    private:
+        Tensor<T> * W;
+};
+/*###############################################################################################################*/
+template <typename T>
+class BatchNorm: public Module<T> {
+/*
+    x: (batch, features, ...) normalized per feature (dim 1), so it
+    follows both Linear (batch, features) and Conv2d (batch, channels, h, w).
+    In eval mode the running statistics are used, fold_into() then moves
+    the whole normalization into the preceding layer's weight and bias
+    and turns this layer into the identity.
+*/
+    public:
+        BatchNorm(int features, T momentum=0.1, T eps=1e-5): momentum(momentum), eps(eps) {
+            gamma = this->register_parameter(new Tensor<T>(1, features));
+            gamma->setAll(1);
+            beta = this->register_parameter(new Tensor<T>(1, features));
+            beta->setAll(0);
+            running_mean = this->register_buffer(new Tensor<T>(1, features));
+            running_mean->setAll(0);
+            running_var = this->register_buffer(new Tensor<T>(1, features));
+            running_var->setAll(1);
+        }
+
+        Tensor<T> * forward(Tensor<T> * input) {
+            if(folded) return input;
+            return OPS::BATCHNORM(input, gamma, beta, running_mean, running_var, this->is_training(), momentum, eps);
+        }
+
+        void fold_into(Linear<T> & layer) { fold(layer.weight(), layer.bias(), 1); }
+        void fold_into(Conv2d<T> & layer) { fold(layer.weight(), layer.bias(), 0); }
+
+        Tensor<T> * mean() const { return running_mean; }
+        Tensor<T> * var() const { return running_var; }
+
+    private:
+        void fold(Tensor<T> * weight, Tensor<T> * bias, int out_axis) {
+            assert(!this->is_training() && "ONLY AN EVAL MODE BATCHNORM CAN BE FOLDED");
+            assert(bias != NULL && "FOLDING NEEDS A LAYER WITH A BIAS");
+            OPS::fold_batchnorm(weight, bias, out_axis, gamma, beta, running_mean, running_var, eps);
+            folded = true;
+        }
+
+        Tensor<T> * gamma;
+        Tensor<T> * beta;
+        Tensor<T> * running_mean;
+        Tensor<T> * running_var;
+        T momentum;
+        T eps;
+        bool folded = false;
+};
+/*###############################################################################################################*/
+template <typename T>
+class LayerNorm: public Module<T> {
+/*
+    x: (..., features) normalized over the last dim
+*/
+    public:
+        LayerNorm(int features, T eps=1e-5): eps(eps) {
+            gamma = this->register_parameter(new Tensor<T>(1, features));
+            gamma->setAll(1);
+            beta = this->register_parameter(new Tensor<T>(1, features));
+            beta->setAll(0);
+        }
+
+        Tensor<T> * forward(Tensor<T> * input) { return OPS::LAYERNORM(input, gamma, beta, eps); }
+
+    private:
+        Tensor<T> * gamma;
+        Tensor<T> * beta;
+        T eps;
+};
+/*###############################################################################################################*/
+template <typename T>
+class MaxPool2d: public Module<T> {
+/*
+    x: (batch, channels, height, width), stride 0 means stride = kernel
+*/
+    public:
+        MaxPool2d(int kernel, int stride=0, int padding=0): kernel(kernel), stride(stride), padding(padding) {}
+
+        Tensor<T> * forward(Tensor<T> * input) {
+            return OPS::MAXPOOL2D(input, std::make_pair(kernel, kernel), std::make_pair(stride, stride), std::make_pair(padding, padding));
+        }
+
+    private:
+        int kernel;
+        int stride;
+        int padding;
+};
+/*###############################################################################################################*/
+template <typename T>
+class AvgPool2d: public Module<T> {
+/*
+    x: (batch, channels, height, width), stride 0 means stride = kernel
+*/
+    public:
+        AvgPool2d(int kernel, int stride=0, int padding=0): kernel(kernel), stride(stride), padding(padding) {}
+
+        Tensor<T> * forward(Tensor<T> * input) {
+            return OPS::AVGPOOL2D(input, std::make_pair(kernel, kernel), std::make_pair(stride, stride), std::make_pair(padding, padding));
+        }
+
+    private:
+        int kernel;
+        int stride;
+        int padding;
+};
+/*###############################################################################################################*/
+template <typename T>
+class ReLU: public Module<T> {
+    public:
+        Tensor<T> * forward(Tensor<T> * input) { return OPS::ReLU(input); }
+};
+/*###############################################################################################################*/
+template <typename T>
+class Dropout: public Module<T> {
+/*
+    Every forward in training mode draws a new mask (stream = number of
+    previous calls) from seed, the identity in eval mode
+*/
+    public:
+        Dropout(T p=0.5, uint64_t seed=0): p(p), seed(seed) {}
+
+        Tensor<T> * forward(Tensor<T> * input) {
+            if(!this->is_training() || p == 0) return input;
+            return OPS::DROPOUT(input, p, seed, calls++);
+        }
+
+    private:
+        T p;
+        uint64_t seed;
+        uint64_t calls = 0;
+};
+/*###############################################################################################################*/
+template <typename T>
+class Sequential: public Module<T> {
+/*
+    Container which applies its submodules in the order they were added
+    Sequential takes ownership of the added modules
+*/
+    public:
+        Sequential<T> & add(Module<T> * module) {
+            layers.push_back(this->register_module(module));
+            return *this;
+        }
+
+        Tensor<T> * forward(Tensor<T> * input) {
+            for(size_t i=0; i<layers.size(); i++){
+                Tensor<T> * out = layers[i]->forward(input);
+                //Later layers only read out, what input was computed from is only needed by backward
+                if(this->saved_format() != SAVED_FULL && out != input) OPS::pack_graph(input, this->saved_format());
+                input = out;
+            }
+            return input;
+        }
+
+        int size() const { return layers.size(); }
+        Module<T> * operator[](int i) const { return layers[i]; }
+
+    private:
+        std::vector<Module<T>*> layers;
+};
+
+#endif
@@ -4,8 +4,20 @@
 #include <algorithm>
 #include <iostream>
 #include <cmath>
+#include <set>
+#include <map>
+#include <functional>
+#include <vector>
+#include <cstring>
+#include <limits>
+#include <climits>
 #include "tensor.h"
 #include "utils.h"
+#include "threadpool.h"
+#include "gemm.h"
+#include "fixed_tensor.h"
+#include "layout.h"
+#include "mask.h"
 
 /*
     FORWARD DECLARATIONS
@@ -14,6 +26,9 @@ namespace OPS{
     template <typename T>
     Tensor<T> * _matmul(Tensor<T> * input1, Tensor<T> * input2);
 
+    template <typename T>
+    void _matmul_into(Tensor<T> * out, Tensor<T> * input1, Tensor<T> * input2);
+
     template <typename T>
     void inplace_add(Tensor<T> * input1, Tensor<T> * input2);
 
@@ -25,6 +40,532 @@ namespace OPS{
 
     template <typename T>
     void inplace_sub(Tensor<T> * input1, Tensor<T> * input2);
+
+    template <typename T, typename F>
+    void _broadcast_binary(Tensor<T> * out, Tensor<T> * input1, Tensor<T> * input2, F f) {
+        //out = f(input1, input2) over the broadcast shape (out has that shape)
+        Tensor<T> * ops[3] = {out, input1, input2};
+        broadcast_iterator<T> it(3, ops);
+        do {
+            T * o = it.ptr(0);
+            const T * x = it.ptr(1);
+            const T * y = it.ptr(2);
+            int n = it.run();
+            long so = it.stride(0), sx = it.stride(1), sy = it.stride(2);
+            if(so == 1 && sx == 1 && sy == 1){
+                for(int i=0; i<n; i++) o[i] = f(x[i], y[i]);
+            }
+            else if(so == 1 && sx == 1 && sy == 0){
+                T b = *y;
+                for(int i=0; i<n; i++) o[i] = f(x[i], b);
+            }
+            else if(so == 1 && sx == 0 && sy == 1){
+                T a = *x;
+                for(int i=0; i<n; i++) o[i] = f(a, y[i]);
+            }
+            else {
+                for(int i=0; i<n; i++) o[i*so] = f(x[i*sx], y[i*sy]);
+            }
+        } while(it.next());
+    }
+
+    template <typename T, typename F>
+    void _broadcast_accumulate(Tensor<T> * dest, Tensor<T> * grad, Tensor<T> * other, F f) {
+        //dest += f(grad, other), summed over every axis dest was broadcast along.
+        //grad and other have the broadcast shape, dest may be smaller.
+        Tensor<T> * ops[3] = {dest, grad, other};
+        broadcast_iterator<T> it(3, ops);
+        do {
+            T * d = it.ptr(0);
+            const T * g = it.ptr(1);
+            const T * x = it.ptr(2);
+            int n = it.run();
+            long sd = it.stride(0), sg = it.stride(1), sx = it.stride(2);
+            if(sd == 0){
+                //The whole run reduces into one element
+                acc_t<T> acc = 0;
+                if(sg == 1 && sx == 1) for(int i=0; i<n; i++) acc += f(g[i], x[i]);
+                else for(int i=0; i<n; i++) acc += f(g[i*sg], x[i*sx]);
+                *d += acc;
+            }
+            else if(sd == 1 && sg == 1 && sx == 1){
+                for(int i=0; i<n; i++) d[i] += f(g[i], x[i]);
+            }
+            else {
+                for(int i=0; i<n; i++) d[i*sd] += f(g[i*sg], x[i*sx]);
+            }
+        } while(it.next());
+    }
+
+    template <typename T>
+    Tensor<T> * _broadcast_output(Tensor<T> * input1, Tensor<T> * input2) {
+        Tensor<T> * ops[2] = {input1, input2};
+        int n_dims;
+        int dims[std::max(input1->getNDims(), input2->getNDims())];
+        bool ok = broadcast_iterator<T>::broadcastable(2, ops, &n_dims, dims);
+        assert(ok && "SHAPES CANNOT BE BROADCAST");
+        (void)ok;
+        Tensor<T> * out = new Tensor<T>(n_dims, dims);
+        //The output is in the memory format of the input it has the shape of
+        bool like1 = input1->getTotalElements() == out->getTotalElements(), like2 = input2->getTotalElements() == out->getTotalElements();
+        assert((!like1 || !like2 || input1->getFormat() == input2->getFormat()) && "MEMORY FORMATS DIFFER, USE TO_FORMAT");
+        out->setFormat(like1 ? input1->getFormat() : like2 ? input2->getFormat() : FORMAT_NCHW);
+        return out;
+    }
+
+    template <typename T>
+    void _axis_split(Tensor<T> * input, int & axis, int & outer, int & n, int & inner) {
+        //Views the (made contiguous) input as (outer, n, inner) around axis
+        if(axis < 0) axis += input->getNDims();
+        assert(axis >= 0 && axis < input->getNDims() && "INVALID AXIS");
+        if(!input->is_contiguous()) input->as_contiguous();
+        outer = 1;
+        inner = 1;
+        for(int i=0; i<axis; i++) outer *= input->getDims()[i];
+        for(int i=axis+1; i<input->getNDims(); i++) inner *= input->getDims()[i];
+        n = input->getDims()[axis];
+    }
+
+    template <typename T>
+    void _log_sum_exp(const T * x, int outer, int n, int inner, acc_t<T> * lse) {
+        //One online pass per row: the running sum is rescaled whenever the max grows
+        acc_t<T> * m = new acc_t<T>[inner];
+        acc_t<T> * s = new acc_t<T>[inner];
+        for(int o=0; o<outer; o++){
+            const T * row = x + (size_t)o * n * inner;
+            for(int i=0; i<inner; i++) { m[i] = row[i]; s[i] = 1; }
+            for(int k=1; k<n; k++){
+                const T * col = row + (size_t)k * inner;
+                for(int i=0; i<inner; i++){
+                    if(col[i] > m[i]) {
+                        s[i] = s[i] * std::exp(m[i] - col[i]) + 1;
+                        m[i] = col[i];
+                    }
+                    else s[i] += std::exp(col[i] - m[i]);
+                }
+            }
+            for(int i=0; i<inner; i++) lse[(size_t)o * inner + i] = m[i] + std::log(s[i]);
+        }
+        delete [] m;
+        delete [] s;
+    }
+
+    /*
+        Reduction layout
+        The dims of a contiguous tensor are split into kept and reduced blocks
+        (adjacent dims with the same role are merged, size 1 dims dropped).
+        The last block is the contiguous "inner" run: when it is reduced every
+        output element sums contiguous segments, when it is kept every output
+        row accumulates whole contiguous rows, so both cases stream memory.
+    */
+    struct _ReduceLayout {
+        std::vector<int> kept_sizes;
+        std::vector<size_t> kept_strides;
+        std::vector<int> red_sizes;
+        std::vector<size_t> red_strides;
+        int inner = 1;
+        bool inner_reduced = false;
+        size_t n_units = 1;     //output elements (inner reduced) or output rows (inner kept)
+        size_t n_red = 1;       //reduced combinations outside of the inner run
+
+        size_t kept_offset(size_t j) const { return _mixed_offset(j, kept_sizes, kept_strides); }
+        size_t red_offset(size_t r) const { return _mixed_offset(r, red_sizes, red_strides); }
+
+        static size_t _mixed_offset(size_t index, const std::vector<int> & sizes, const std::vector<size_t> & strides) {
+            size_t offset = 0;
+            for(int b=sizes.size()-1; b>=0; b--){
+                offset += (index % sizes[b]) * strides[b];
+                index /= sizes[b];
+            }
+            return offset;
+        }
+    };
+
+    template <typename T>
+    _ReduceLayout _reduce_layout(Tensor<T> * input, const std::vector<bool> & reduced) {
+        if(!input->is_contiguous()) input->as_contiguous();
+        std::vector<int> sizes;
+        std::vector<bool> flags;
+        std::vector<size_t> strides;
+        size_t stride = 1;
+        for(int d=input->getNDims()-1; d>=0; d--){
+            int size = input->getDims()[d];
+            if(size != 1){
+                //Blocks stay below INT_MAX elements so the inner loops count with ints
+                if(!flags.empty() && flags.back() == reduced[d] && (long)sizes.back() * size <= INT_MAX) sizes.back() *= size;
+                else {
+                    sizes.push_back(size);
+                    flags.push_back(reduced[d]);
+                    strides.push_back(stride);
+                }
+            }
+            stride *= size;
+        }
+
+        _ReduceLayout layout;
+        if(sizes.empty()) return layout;
+        //Blocks were collected innermost first
+        layout.inner = sizes[0];
+        layout.inner_reduced = flags[0];
+        for(int b=sizes.size()-1; b>=1; b--){
+            if(flags[b]){
+                layout.red_sizes.push_back(sizes[b]);
+                layout.red_strides.push_back(strides[b]);
+                layout.n_red *= sizes[b];
+            }
+            else {
+                layout.kept_sizes.push_back(sizes[b]);
+                layout.kept_strides.push_back(strides[b]);
+                layout.n_units *= sizes[b];
+            }
+        }
+        return layout;
+    }
+
+    template <typename T>
+    acc_t<T> _pairwise_sum(const T * x, size_t n) {
+        //Blocks of 8 independent accumulators (which the compiler vectorizes)
+        //combined pairwise, the error grows with log(n) instead of n
+        if(n <= 256){
+            acc_t<T> acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            size_t i = 0;
+            for(; i + 8 <= n; i += 8)
+                for(int k=0; k<8; k++) acc[k] += x[i + k];
+            acc_t<T> tail = 0;
+            for(; i<n; i++) tail += x[i];
+            return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7])) + tail;
+        }
+        size_t half = (n / 2) & ~(size_t)7;
+        return _pairwise_sum(x, half) + _pairwise_sum(x + half, n - half);
+    }
+
+    inline int _reduce_grain(size_t unit_els) {
+        //Chunks of roughly 32K input elements, independent of the thread count
+        size_t grain = 32768 / (unit_els > 0 ? unit_els : 1);
+        return grain > 0 ? grain : 1;
+    }
+
+    template <typename T>
+    void _sum_kernel(const T * x, const _ReduceLayout & L, T scale, T * out) {
+        if(L.inner_reduced){
+            parallel_for(0, L.n_units, _reduce_grain(L.n_red * L.inner), [&](long lo, long hi){
+                for(long j=lo; j<hi; j++){
+                    const T * base = x + L.kept_offset(j);
+                    acc_t<T> total = 0;
+                    for(size_t r=0; r<L.n_red; r++) total += _pairwise_sum(base + L.red_offset(r), L.inner);
+                    out[j] = total * scale;
+                }
+            });
+            return;
+        }
+        parallel_for(0, L.n_units, _reduce_grain(L.n_red * L.inner), [&](long lo, long hi){
+            //Kahan compensated accumulation of whole rows
+            std::vector<acc_t<T>> acc(L.inner), comp(L.inner);
+            for(long j=lo; j<hi; j++){
+                const T * base = x + L.kept_offset(j);
+                for(int i=0; i<L.inner; i++) { acc[i] = 0; comp[i] = 0; }
+                for(size_t r=0; r<L.n_red; r++){
+                    const T * row = base + L.red_offset(r);
+                    for(int i=0; i<L.inner; i++){
+                        acc_t<T> y = row[i] - comp[i];
+                        acc_t<T> t = acc[i] + y;
+                        comp[i] = (t - acc[i]) - y;
+                        acc[i] = t;
+                    }
+                }
+                T * dst = out + (size_t)j * L.inner;
+                for(int i=0; i<L.inner; i++) dst[i] = acc[i] * scale;
+            }
+        });
+    }
+
+    template <typename T>
+    void _sum_back_kernel(const T * g, const _ReduceLayout & L, T scale, T * dx) {
+        //Broadcasts the gradient over the reduced positions without expanding it
+        parallel_for(0, L.n_units, _reduce_grain(L.n_red * L.inner), [&](long lo, long hi){
+            for(long j=lo; j<hi; j++){
+                T * base = dx + L.kept_offset(j);
+                for(size_t r=0; r<L.n_red; r++){
+                    T * seg = base + L.red_offset(r);
+                    if(L.inner_reduced){
+                        T v = g[j] * scale;
+                        for(int i=0; i<L.inner; i++) seg[i] += v;
+                    }
+                    else {
+                        const T * grow = g + (size_t)j * L.inner;
+                        for(int i=0; i<L.inner; i++) seg[i] += grow[i] * scale;
+                    }
+                }
+            }
+        });
+    }
+
+    template <typename T>
+    void _extreme_kernel(const T * x, const _ReduceLayout & L, bool is_max, T * out, size_t * arg) {
+        //Max (or min) with the flat input offset of the first extreme element
+        parallel_for(0, L.n_units, _reduce_grain(L.n_red * L.inner), [&](long lo, long hi){
+            for(long j=lo; j<hi; j++){
+                size_t base = L.kept_offset(j);
+                if(L.inner_reduced){
+                    T best = x[base + L.red_offset(0)];
+                    size_t best_at = base + L.red_offset(0);
+                    for(size_t r=0; r<L.n_red; r++){
+                        size_t seg = base + L.red_offset(r);
+                        for(int i=0; i<L.inner; i++){
+                            T v = x[seg + i];
+                            if(is_max ? v > best : v < best) { best = v; best_at = seg + i; }
+                        }
+                    }
+                    out[j] = best;
+                    arg[j] = best_at;
+                }
+                else {
+                    T * best = out + (size_t)j * L.inner;
+                    size_t * best_at = arg + (size_t)j * L.inner;
+                    for(int i=0; i<L.inner; i++) { best[i] = x[base + i]; best_at[i] = base + i; }
+                    for(size_t r=0; r<L.n_red; r++){
+                        size_t row = base + L.red_offset(r);
+                        for(int i=0; i<L.inner; i++){
+                            T v = x[row + i];
+                            if(is_max ? v > best[i] : v < best[i]) { best[i] = v; best_at[i] = row + i; }
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    /*
+        2D pooling geometry over the last two dims of an (N, C, H, W) tensor.
+        A window of output (oh, ow) starts at (oh * sh - ph, ow * sw - pw),
+        positions outside the input are padding.
+    */
+    struct _Pool2d {
+        int kh, kw, sh, sw, ph, pw;
+        int H, W, OH, OW;
+        int inner = 1;      //channels at every pixel, a plane is (H, W, inner)
+
+        //Outputs [lo, hi) of a row whose window column kj lands inside the input
+        void cols(int kj, int & lo, int & hi) const {
+            int first = kj - pw;
+            lo = first >= 0 ? 0 : (-first + sw - 1) / sw;
+            hi = W - 1 - first < 0 ? 0 : std::min(OW, (W - 1 - first) / sw + 1);
+        }
+
+        //Window position of the first input the window at (oh, ow) covers,
+        //the argmax until a larger value shows up (none does when all are -inf or NaN)
+        unsigned short first(int oh, int ow) const {
+            return std::max(0, ph - oh * sh) * kw + std::max(0, pw - ow * sw);
+        }
+    };
+
+    template <typename T>
+    void _maxpool_plane(const T * x, const _Pool2d & P, T * y, unsigned short * arg) {
+        //Sweeps every window position across a whole output row so the
+        //inner loop runs along the width (contiguous when the stride is 1)
+        for(int oh=0; oh<P.OH; oh++){
+            T * best = y + (size_t)oh * P.OW;
+            unsigned short * at = arg + (size_t)oh * P.OW;
+            for(int ow=0; ow<P.OW; ow++) { best[ow] = -std::numeric_limits<T>::infinity(); at[ow] = P.first(oh, ow); }
+            for(int ki=0; ki<P.kh; ki++){
+                int ih = oh * P.sh - P.ph + ki;
+                if(ih < 0 || ih >= P.H) continue;
+                const T * row = x + (size_t)ih * P.W;
+                for(int kj=0; kj<P.kw; kj++){
+                    int lo, hi;
+                    P.cols(kj, lo, hi);
+                    int first = kj - P.pw;
+                    unsigned short pos = ki * P.kw + kj;
+                    if(P.sw == 1){
+                        for(int ow=lo; ow<hi; ow++){
+                            T v = row[ow + first];
+                            bool more = v > best[ow];
+                            best[ow] = more ? v : best[ow];
+                            at[ow] = more ? pos : at[ow];
+                        }
+                    }
+                    else {
+                        for(int ow=lo; ow<hi; ow++){
+                            T v = row[ow * P.sw + first];
+                            bool more = v > best[ow];
+                            best[ow] = more ? v : best[ow];
+                            at[ow] = more ? pos : at[ow];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    template <typename T>
+    void _avgpool_plane(const T * x, const _Pool2d & P, T * y) {
+        //Padding counts as zeros, every window is divided by kh * kw
+        T scale = (T)1 / (P.kh * P.kw);
+        for(int oh=0; oh<P.OH; oh++){
+            T * acc = y + (size_t)oh * P.OW;
+            for(int ow=0; ow<P.OW; ow++) acc[ow] = 0;
+            for(int ki=0; ki<P.kh; ki++){
+                int ih = oh * P.sh - P.ph + ki;
+                if(ih < 0 || ih >= P.H) continue;
+                const T * row = x + (size_t)ih * P.W;
+                for(int kj=0; kj<P.kw; kj++){
+                    int lo, hi;
+                    P.cols(kj, lo, hi);
+                    int first = kj - P.pw;
+                    if(P.sw == 1) for(int ow=lo; ow<hi; ow++) acc[ow] += row[ow + first];
+                    else for(int ow=lo; ow<hi; ow++) acc[ow] += row[ow * P.sw + first];
+                }
+            }
+            for(int ow=0; ow<P.OW; ow++) acc[ow] *= scale;
+        }
+    }
+
+    template <typename T>
+    void _avgpool_plane_back(const T * g, const _Pool2d & P, T * dx) {
+        T scale = (T)1 / (P.kh * P.kw);
+        for(int oh=0; oh<P.OH; oh++){
+            const T * grow = g + (size_t)oh * P.OW;
+            for(int ki=0; ki<P.kh; ki++){
+                int ih = oh * P.sh - P.ph + ki;
+                if(ih < 0 || ih >= P.H) continue;
+                T * row = dx + (size_t)ih * P.W;
+                for(int kj=0; kj<P.kw; kj++){
+                    int lo, hi;
+                    P.cols(kj, lo, hi);
+                    int first = kj - P.pw;
+                    for(int ow=lo; ow<hi; ow++) row[ow * P.sw + first] += scale * grow[ow];
+                }
+            }
+        }
+    }
+
+    /*
+        Planes with the channels innermost (NHWC, NCHWc): a window tap
+        updates the P.inner contiguous channels of an output pixel at once.
+        Same visiting order as the planar kernels, so ties pick the same position.
+    */
+    template <typename T>
+    void _maxpool_pixels(const T * x, const _Pool2d & P, T * y, unsigned short * arg) {
+        int c = P.inner;
+        for(int oh=0; oh<P.OH; oh++)
+            for(int ow=0; ow<P.OW; ow++){
+                T * best = y + ((size_t)oh * P.OW + ow) * c;
+                unsigned short * at = arg + ((size_t)oh * P.OW + ow) * c;
+                unsigned short start = P.first(oh, ow);
+                for(int i=0; i<c; i++) { best[i] = -std::numeric_limits<T>::infinity(); at[i] = start; }
+                for(int ki=0; ki<P.kh; ki++){
+                    int ih = oh * P.sh - P.ph + ki;
+                    if(ih < 0 || ih >= P.H) continue;
+                    for(int kj=0; kj<P.kw; kj++){
+                        int iw = ow * P.sw - P.pw + kj;
+                        if(iw < 0 || iw >= P.W) continue;
+                        const T * px = x + ((size_t)ih * P.W + iw) * c;
+                        unsigned short pos = ki * P.kw + kj;
+                        for(int i=0; i<c; i++){
+                            bool more = px[i] > best[i];
+                            best[i] = more ? px[i] : best[i];
+                            at[i] = more ? pos : at[i];
+                        }
+                    }
+                }
+            }
+    }
+
+    template <typename T>
+    void _avgpool_pixels(const T * x, const _Pool2d & P, T * y) {
+        int c = P.inner;
+        T scale = (T)1 / (P.kh * P.kw);
+        for(int oh=0; oh<P.OH; oh++)
+            for(int ow=0; ow<P.OW; ow++){
+                T * acc = y + ((size_t)oh * P.OW + ow) * c;
+                for(int i=0; i<c; i++) acc[i] = 0;
+                for(int ki=0; ki<P.kh; ki++){
+                    int ih = oh * P.sh - P.ph + ki;
+                    if(ih < 0 || ih >= P.H) continue;
+                    for(int kj=0; kj<P.kw; kj++){
+                        int iw = ow * P.sw - P.pw + kj;
+                        if(iw < 0 || iw >= P.W) continue;
+                        const T * px = x + ((size_t)ih * P.W + iw) * c;
+                        for(int i=0; i<c; i++) acc[i] += px[i];
+                    }
+                }
+                for(int i=0; i<c; i++) acc[i] *= scale;
+            }
+    }
+
+    template <typename T>
+    void _avgpool_pixels_back(const T * g, const _Pool2d & P, T * dx) {
+        int c = P.inner;
+        T scale = (T)1 / (P.kh * P.kw);
+        for(int oh=0; oh<P.OH; oh++)
+            for(int ow=0; ow<P.OW; ow++){
+                const T * gp = g + ((size_t)oh * P.OW + ow) * c;
+                for(int ki=0; ki<P.kh; ki++){
+                    int ih = oh * P.sh - P.ph + ki;
+                    if(ih < 0 || ih >= P.H) continue;
+                    for(int kj=0; kj<P.kw; kj++){
+                        int iw = ow * P.sw - P.pw + kj;
+                        if(iw < 0 || iw >= P.W) continue;
+                        T * px = dx + ((size_t)ih * P.W + iw) * c;
+                        for(int i=0; i<c; i++) px[i] += scale * gp[i];
+                    }
+                }
+            }
+    }
+
+    /*
+        Welford statistics
+        _Moments holds count, mean and the sum of squared deviations (m2)
+        of a set of values, two sets combine with merge (Chan et al.),
+        so segments can be summarized independently and merged in order.
+    */
+    template <typename T>
+    struct _Moments {
+        T count = 0, mean = 0, m2 = 0;
+
+        void merge(const _Moments<T> & o) {
+            if(o.count == 0) return;
+            T n = count + o.count;
+            T delta = o.mean - mean;
+            mean += delta * o.count / n;
+            m2 += o.m2 + delta * delta * count * o.count / n;
+            count = n;
+        }
+        T variance() const { return count > 0 ? m2 / count : 0; }
+    };
+
+    template <typename T>
+    _Moments<T> _welford(const T * x, size_t n, size_t stride=1) {
+        //One pass over n values: 8 interleaved Welford accumulators share
+        //their count (so the update vectorizes) and are merged at the end
+        const int L = 8;
+        T mean[L] = {0}, m2[L] = {0};
+        size_t full = n / L;
+        for(size_t k=0; k<full; k++){
+            T inv = (T)1 / (k + 1);
+            const T * v = x + k * L * stride;
+            for(int l=0; l<L; l++){
+                T d = v[l * stride] - mean[l];
+                mean[l] += d * inv;
+                m2[l] += d * (v[l * stride] - mean[l]);
+            }
+        }
+        _Moments<T> out;
+        for(int l=0; l<L && full > 0; l++){
+            _Moments<T> lane;
+            lane.count = full;
+            lane.mean = mean[l];
+            lane.m2 = m2[l];
+            out.merge(lane);
+        }
+        for(size_t i=full * L; i<n; i++){
+            _Moments<T> one;
+            one.count = 1;
+            one.mean = x[i * stride];
+            out.merge(one);
+        }
+        return out;
+    }
 }
 
 template <typename T>
@@ -36,10 +577,13 @@ class Op{
 */
     public:
         Op(Tensor<T> * output, int n_in, ...);
+        Op(Tensor<T> * output, int n_in, Tensor<T> * const * in) { attach(output, n_in, in); }
         virtual ~Op() { delete [] inputs; }
         virtual void back() = 0;
 
     protected:
+        void attach(Tensor<T> * output, int n_in, Tensor<T> * const * in);
+
         int n_in;
         Tensor<T> ** inputs;
         Tensor<T> * output;
@@ -55,7 +599,12 @@ Op<T>::Op(Tensor<T> * output, int n_in, ...) {
     va_list ins;
     va_start(ins, n_in);
     for(int i=0; i<n_in; i++) in[i] = va_arg(ins, Tensor<T>*);
+    va_end(ins);
+    attach(output, n_in, in);
+}
 
+template <typename T>
+void Op<T>::attach(Tensor<T> * output, int n_in, Tensor<T> * const * in) {
     //Initialize all memory
     this->n_in = n_in;
     this->inputs = new Tensor<T>* [n_in];
@@ -67,10 +616,12 @@ Op<T>::Op(Tensor<T> * output, int n_in, ...) {
 
     //Initialize input tensor history 
     for(int i=0; i<n_in; i++) {
+        assert((in[i]->getData() != NULL || !in[i]->is_packed()) && "PACKED TENSOR USED IN A FORWARD OP");
         //Add to graph and init Grad
         if(track){
             this->inputs[i] = in[i];
-            in[i]->init_grad();
+            //Sparse gradients are written by the op itself
+            if(!in[i]->has_sparse_grad()) in[i]->init_grad();
             in[i]->addChild(output);
             output->addParent(in[i]);
         }
@@ -103,8 +654,8 @@ class _ADD: public Op<T>{
             //Match correctly
             this->inputs[i]->reshape_grad(n_dims, shape);
 
-            //Add the gradients
-            OPS::inplace_add(this->inputs[i]->getGrad(), err_sig);
+            //Add the gradients (summed over broadcast axes)
+            OPS::_broadcast_accumulate(this->inputs[i]->getGrad(), err_sig, err_sig, [](T g, T) { return g; });
         }
     }
 };
@@ -131,9 +682,9 @@ class _SUB: public Op<T>{
             this->inputs[i]->reshape_grad(n_dims, shape);
         }
         //Add the gradients
-        OPS::inplace_add(this->inputs[0]->getGrad(), err_sig);
+        OPS::_broadcast_accumulate(this->inputs[0]->getGrad(), err_sig, err_sig, [](T g, T) { return g; });
         //Sub the gradients
-        OPS::inplace_sub(this->inputs[1]->getGrad(), err_sig);
+        OPS::_broadcast_accumulate(this->inputs[1]->getGrad(), err_sig, err_sig, [](T g, T) { return -g; });
     }
 };
 
@@ -145,17 +696,11 @@ class _MULT: public Op<T> {
     _MULT(Tensor<T>*output, Tensor<T>* input1, Tensor<T>* input2): Op<T>(output, 2, input1, input2) {}
 
     void back(){
-        assert(this->inputs[1]->history());
+        assert(this->inputs[0]->history());
         assert(this->inputs[1]->history());
 
         //Get dL/dout
         Tensor<T> * err_sig  = this->output->getGrad();
-        
-        //Init and Set index to 0
-        int arr[this->inputs[0]->getNDims()];
-
-        int zeros[this->inputs[0]->getNDims()];
-        setAllElements(this->inputs[0]->getNDims(), zeros, 0);
 
         for(int i=0; i < this->n_in; i++){
             //Get the historical shape to reshape the gradient
@@ -164,14 +709,10 @@ class _MULT: public Op<T> {
             this->inputs[i]->reshape_grad(n_dims, shape);
         }
 
-        
-        Tensor<T> err_sig2(*err_sig);
-        OPS::inplace_mult(err_sig, this->inputs[1]);
-        OPS::inplace_add(this->inputs[0]->getGrad(), err_sig);
-
-        OPS::inplace_mult(&err_sig2, this->inputs[0]);
-        OPS::inplace_add(this->inputs[1]->getGrad(), &err_sig2);
-
+        //dL/da = g * b and dL/db = g * a, each reduced to the shape of its input
+        auto mult = [](T g, T x) { return g * x; };
+        OPS::_broadcast_accumulate(this->inputs[0]->getGrad(), err_sig, this->inputs[1], mult);
+        OPS::_broadcast_accumulate(this->inputs[1]->getGrad(), err_sig, this->inputs[0], mult);
     }
 };
 
@@ -181,17 +722,11 @@ class _DIV: public Op<T> {
     _DIV(Tensor<T>*output, Tensor<T>* input1, Tensor<T>* input2): Op<T>(output, 2, input1, input2) {}
 
     void back(){
-        assert(this->inputs[1]->history());
+        assert(this->inputs[0]->history());
         assert(this->inputs[1]->history());
 
         //Get dL/dout
         Tensor<T> * err_sig  = this->output->getGrad();
-        
-        //Init and Set index to 0
-        int arr[this->inputs[0]->getNDims()];
-
-        int zeros[this->inputs[0]->getNDims()];
-        setAllElements(this->inputs[0]->getNDims(), zeros, 0);
 
         for(int i=0; i < this->n_in; i++){
             //Get the historical shape to reshape the gradient
@@ -200,18 +735,11 @@ class _DIV: public Op<T> {
             this->inputs[i]->reshape_grad(n_dims, shape);
         }
 
-        Tensor<T> err_sig2(*err_sig);
-        OPS::inplace_mult_recip(err_sig, this->inputs[1]);
-        OPS::inplace_add(this->inputs[0]->getGrad(), err_sig);
-
-        iterator it1 = err_sig2.begin();
-        iterator it2 = this->inputs[1]->getGrad()->begin();
-        iterator it3 = this->inputs[0]->begin();
-        iterator it4 = this->inputs[1]->begin();
-        for(int i=0; i<err_sig2.getTotalElements(); i++){
-            T denom = it4.next();
-            it2.next() += (-it1.next()) * (it3.next()/(denom * denom));
-        }
+        //With q = g / b: dL/da = q and dL/db = -q * a / b = -q * out
+        Tensor<T> q(this->output->getNDims(), this->output->getDims());
+        OPS::_broadcast_binary(&q, err_sig, this->inputs[1], [](T g, T b) { return g / b; });
+        OPS::_broadcast_accumulate(this->inputs[0]->getGrad(), &q, &q, [](T g, T) { return g; });
+        OPS::_broadcast_accumulate(this->inputs[1]->getGrad(), &q, this->output, [](T g, T y) { return -g * y; });
     }
 };
 
@@ -233,8 +761,8 @@ class _MatMul: public Op<T>{
         }
 
         //Compute Gradient dL/dX
-        this->inputs[1]->transpose();
         bool was_cont = this->inputs[1]->is_contiguous();
+        this->inputs[1]->transpose();
 
         Tensor<T> * dx = OPS::_matmul(err_sig, this->inputs[1]);
         OPS::inplace_add(this->inputs[0]->getGrad(), dx);
@@ -243,8 +771,8 @@ class _MatMul: public Op<T>{
         this->inputs[1]->set_contiguous(was_cont);
 
         //Compute Gradient dL/dW
-        this->inputs[0]->transpose();
         was_cont = this->inputs[0]->is_contiguous();
+        this->inputs[0]->transpose();
 
         Tensor<T> * dw = OPS::_matmul(this->inputs[0], err_sig);
         OPS::inplace_add(this->inputs[1]->getGrad(), dw);
@@ -283,32 +811,55 @@ class _NEG: public Op<T>{
 
 template <typename T>
 class _ReLU: public Op<T>{
+    /*
+        Only the sign of the input is saved (1 bit per element),
+        the gradient is g where x > 0 and 0 elsewhere (0 at x == 0)
+    */
     public:
-    _ReLU(Tensor<T>*output, Tensor<T>* input): Op<T>(output, 1, input) {}
+    _ReLU(Tensor<T>*output, Tensor<T>* input): Op<T>(output, 1, input) {
+        if(this->history) mask.pack_positive(output->getData(), output->getTotalElements());
+    }
 
     void back(){
         assert(this->inputs[0]->history());
 
         //Get dL/dout
         Tensor<T> * err_sig  = this->output->getGrad();
-
-        //Compute Gradients for each input (2)
-        const int * shape = this->inputs[0]->getDims();
-        const int n_dims = this->inputs[0]->getNDims();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
 
         //Shape the gradient to the historical state so shapes
         //Match correctly
-        this->inputs[0]->reshape_grad(n_dims, shape);
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
 
-        iterator it1 = err_sig->begin();
-        iterator it2 = this->inputs[0]->begin();
-        iterator it3 = this->inputs[0]->getGrad()->begin();
+        mask.apply(err_sig->getData(), (T)1, this->inputs[0]->getGrad()->getData());
+    }
 
-        for(int i=0; i<this->output->getTotalElements(); i++){
-            T next = it2.next();
-            it3.next() += (std::max(next, (T)0)/next) * it1.next();
-        }
+    private:
+    BitMask mask;
+};
+
+template <typename T>
+class _DROPOUT: public Op<T>{
+    /*
+        out = x * mask / keep, the mask is saved as 1 bit per element
+    */
+    public:
+    _DROPOUT(Tensor<T>*output, Tensor<T>* input, BitMask & mask, T scale)
+        : Op<T>(output, 1, input), scale(scale) {
+        this->mask.swap(mask);
     }
+
+    void back(){
+        assert(this->inputs[0]->history());
+        Tensor<T> * err_sig  = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
+        mask.apply(err_sig->getData(), scale, this->inputs[0]->getGrad()->getData());
+    }
+
+    private:
+    BitMask mask;
+    T scale;
 };
 
 template <typename T>
@@ -330,15 +881,15 @@ class _EXP: public Op<T>{
         //Match correctly
         this->inputs[0]->reshape_grad(n_dims, shape);
 
-        OPS::inplace_mult(err_sig, this->output);
-        OPS::inplace_add(this->inputs[0]->getGrad(), err_sig);
+        //d exp(x) = exp(x) dx, accumulated without touching the output's gradient
+        OPS::_broadcast_accumulate(this->inputs[0]->getGrad(), err_sig, this->output, [](T g, T y) { return g * y; });
     }
 };
 
 template <typename T>
 class _PAD: public Op<T>{
     public:
-    _PAD(Tensor<T>*output, Tensor<T>* input): Op<T>(output, 1, input) {}
+    _PAD(Tensor<T>*output, Tensor<T>* input, T value=0): Op<T>(output, 1, input), value(value) {}
 
     void back(){
         assert(this->inputs[0]->history());
@@ -354,6 +905,14 @@ class _PAD: public Op<T>{
         //Match correctly
         this->inputs[0]->reshape_grad(n_dims, shape);
 
+        //Channels last and blocked images pad their H and W dims, not the last two
+        if(this->inputs[0]->getFormat() != FORMAT_NCHW){
+            ImageLayout in = image_layout(this->inputs[0]), out = image_layout(this->output);
+            if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+            pad_image_back(err_sig->getData(), in, (out.H - in.H) / 2, (out.W - in.W) / 2, this->inputs[0]->getGrad()->getData());
+            return;
+        }
+
         //compute padx, pady
         int pady = (this->output->getDims()[this->output->getNDims()-1] - this->inputs[0]->getDims()[this->inputs[0]->getNDims()-1] )/2;
         int padx = (this->output->getDims()[this->output->getNDims()-2] - this->inputs[0]->getDims()[this->inputs[0]->getNDims()-2] )/2;
@@ -361,385 +920,2021 @@ class _PAD: public Op<T>{
         //Copy gradients over
         iterator it = this->inputs[0]->getGrad()->begin();
         int index[this->inputs[0]->getNDims()];
-        for(int i=0; i<this->inputs[0]->getTotalElements(); i++){
+        for(long i=0; i<this->inputs[0]->getTotalElements(); i++){
             it.getCurr(index);
             index[this->inputs[0]->getNDims()-2] += padx;
             index[this->inputs[0]->getNDims()-1] += pady;
             it.next() += err_sig->get(index);
         }
     }
-};
-namespace OPS{
 
-/*
-    OPS Helper Functions
-*/
-    template <typename T>
-    T _dot(Tensor<T>* input1, Tensor<T> * input2, int * index1, int * index2) {
-        assert(input1->getDims()[input1->getNDims()-1] == input2->getDims()[input2->getNDims()-1]);
+    T getValue() const { return value; }
 
+    private:
+    T value;
+};
+template <typename T>
+class _BIAS_ADD: public Op<T>{
+    public:
+    _BIAS_ADD(Tensor<T>*output, Tensor<T>* input, Tensor<T>* bias, int axis): Op<T>(output, 2, input, bias), axis(axis) {}
 
-        //Set up iterators and initialize accumulator
-        iterator<T> it1(input1, NULL, index1);
-        iterator<T> it2(input2, NULL, index2);
-        T accum = 0;
+    void back(){
+        assert(this->inputs[0]->history());
+        assert(this->inputs[1]->history());
 
-        for(int i=0; i<input1->getDims()[input1->getNDims()-1]; i++){
-            accum += (it1.next() * it2.next());
-        }
-        return accum;
-    }
-    
-    template <typename T>
-    Tensor<T> * _matmul(Tensor<T> * input1, Tensor<T> * input2) {
-        //Shapes must match except for the last 2 layers
-        assert(input1->getDims()[input1->getNDims()-1] == input2->getDims()[input2->getNDims()-2]);
-        assert(input1->getNDims() == input2->getNDims());
+        //Get dL/dout
+        Tensor<T> * err_sig  = this->output->getGrad();
 
-        //Initialize out tensor
-        int arr[input1->getNDims()];
-        copyElements(input1->getNDims(), arr, input1->getDims());
-        arr[input1->getNDims()-1] = input2->getDims()[input2->getNDims()-1];  //Correct last dimension
-        Tensor<T> * out = new Tensor<T>(input1->getNDims(), arr);
-        out->no_history();
+        //Shape the gradient to the historical state so shapes
+        //Match correctly
+        for(int i=0; i < this->n_in; i++)
+            this->inputs[i]->reshape_grad(this->inputs[i]->getNDims(), this->inputs[i]->getDims());
 
-        //set up input2 for the dot product
-        input2->transpose();
-        bool was_cont = input2->is_contiguous();
+        //dL/dinput is the error signal, dL/dbias sums it over every other axis
+        OPS::inplace_add(this->inputs[0]->getGrad(), err_sig);
 
-        //set up iterators 1 & 2
-        setAllElements(input1->getNDims(), arr, 0);
+        iterator it1 = err_sig->begin();
+        Tensor<T> * bias_grad = this->inputs[1]->getGrad();
+        int index[err_sig->getNDims()];
+        for(long i=0; i<err_sig->getTotalElements(); i++){
+            it1.getCurr(index);
+            bias_grad->get(index + axis) += it1.next();
+        }
+    }
 
-        int order[input1->getNDims()];
-        for(int i=0; i<input1->getNDims(); i++) order[i] = i+1;
-        order[input1->getNDims()-1] = 0;
+    int getAxis() const { return axis; }
 
-        iterator<T> it1(input1, order, arr);
-        iterator<T> it2(input2, order, arr);
+    private:
+    int axis;
+};
 
-        //set up iterator 3
-        for(int i=0; i<input1->getNDims(); i++) order[i] = i + 2;
-        order[input1->getNDims()-1] = 1;
-        order[input1->getNDims()-2] = 0;
-        iterator<T> it3(input1, order, arr);
+template <typename T>
+class _CONV: public Op<T>{
+    public:
+    _CONV(Tensor<T>*output, Tensor<T>* X, Tensor<T>* K, std::pair<int,int> s): Op<T>(output, 2, X, K), s(s) {}
 
-        //Set Loop Bounds
-        int divisor = input2->getDims()[input2->getNDims()-2]  * input2->getDims()[input2->getNDims()-1];   
-        int loop_bound =  input2->getTotalElements() / divisor;
-        int loop_bound1 = input2->getDims()[input2->getNDims()-2];
-        int loop_bound2 = input1->getDims()[input1->getNDims()-2];
+    void back(){
+        assert(this->inputs[0]->history());
+        assert(this->inputs[1]->history());
 
-        int test[input1->getNDims()];
-        //Multiply Tensors
-        for(int _=0; _<loop_bound; _++){
-            for(int i=0; i<loop_bound1; i++){
-                //Store it2 current index in arr
-                it2.getCurr(arr);
-                for(int j=0; j<loop_bound2; j++){
+        //Get dL/dout
+        Tensor<T> * err_sig  = this->output->getGrad();
+        Tensor<T> * X = this->inputs[0];
+        Tensor<T> * K = this->inputs[1];
 
-                    it1.getCurr(order);
-                    T element  = _dot(input1, input2, order, arr);
+        //Shape the gradient to the historical state so shapes
+        //Match correctly
+        for(int i=0; i < this->n_in; i++)
+            this->inputs[i]->reshape_grad(this->inputs[i]->getNDims(), this->inputs[i]->getDims());
 
-                    order[input1->getNDims()-1] = arr[input1->getNDims()-2];
+        if(X->getFormat() != FORMAT_NCHW){
+            back_layout(err_sig);
+            return;
+        }
 
-                    out->get(order) = element;
-                    it1.getCurr(test);
-                    it1.next();
+        FixedTensor<T, 4> x(X), k(K), dx(X->getGrad()), dk(K->getGrad()), g(err_sig);
+
+        //Every output element is a dot product of a window of X with a kernel,
+        //so scatter its error signal back into both
+        for(int b=0; b<g.dim(0); b++){
+            for(int o=0; o<g.dim(1); o++){
+                for(int h=0; h<g.dim(2); h++){
+                    for(int w=0; w<g.dim(3); w++){
+                        T e = g(b, o, h, w);
+                        for(int l=0; l<x.dim(1); l++){
+                            for(int m=0; m<k.dim(2); m++){
+                                for(int n=0; n<k.dim(3); n++){
+                                    dx(b, l, s.first*h + m, s.second*w + n) += e * k(o, l, m, n);
+                                    dk(o, l, m, n) += e * x(b, l, s.first*h + m, s.second*w + n);
+                                }
+                            }
+                        }
+                    }
                 }
-                it2.next();
-                it3.getCurr(order);
-                it1.setCurr(order);
             }
-            it3.next();
-            it3.getCurr(order);
-            it1.setCurr(order);
         }
-        //set input2 back to its orignal state
-        input2->transpose();
-        input2->set_contiguous(was_cont);
+    }
 
-        return out;
+    std::pair<int,int> getStride() const { return s; }
+
+    private:
+    void back_layout(Tensor<T> * err_sig){
+        //Same scatter as back() with the image elements addressed through their layouts
+        ImageLayout in = image_layout(this->inputs[0]), out = image_layout(this->output);
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        FixedTensor<T, 4> k(this->inputs[1]), dk(this->inputs[1]->getGrad());
+        const T * x = this->inputs[0]->getData(), * g = err_sig->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+        for(int b=0; b<out.N; b++)
+            for(int o=0; o<out.C; o++)
+                for(int h=0; h<out.H; h++)
+                    for(int w=0; w<out.W; w++){
+                        T e = g[out.offset(b, o, h, w)];
+                        for(int l=0; l<in.C; l++)
+                            for(int m=0; m<k.dim(2); m++)
+                                for(int n=0; n<k.dim(3); n++){
+                                    long i = in.offset(b, l, s.first*h + m, s.second*w + n);
+                                    dx[i] += e * k(o, l, m, n);
+                                    dk(o, l, m, n) += e * x[i];
+                                }
+                    }
     }
 
-    template <typename T>
-    void inplace_sub(Tensor<T> * input1, Tensor<T> * input2) {
-        //ADD INPLACE INTO input1
-        //assert same shape
-        assert(input1->getNDims() == input2->getNDims());
-        for(int i=0; i<input1->getNDims(); i++)
-            assert(input1->getDims()[i] == input2->getDims()[i]);
+    std::pair<int,int> s;
+};
+template <typename T>
+class _PERMUTE: public Op<T>{
+    public:
+    _PERMUTE(Tensor<T>*output, Tensor<T>* input, const std::vector<int> & order): Op<T>(output, 1, input), order(order) {}
 
-        iterator<T> it1 = input1->begin();
-        iterator<T> it2 = input2->begin();
-        //sub element wise
-        for(int i=0; i<input1->getTotalElements(); i++){
-            it1.next() -= it2.next();
-        }
+    void back(){
+        assert(this->inputs[0]->history());
+        Tensor<T> * input = this->inputs[0];
+        input->reshape_grad(input->getNDims(), input->getDims());
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        Tensor<T> * grad = input->getGrad();
+        if(!grad->is_contiguous()) grad->as_contiguous();
+
+        //Input dim order[i] is output dim i, gather g back into the input layout
+        int n_dims = input->getNDims();
+        long strides[n_dims];
+        for(int i=0; i<n_dims; i++) strides[order[i]] = err_sig->getMults()[i];
+        std::vector<T> dx(input->getTotalElements());
+        strided_copy((const T *)err_sig->getData(), n_dims, input->getDims(), strides, dx.data());
+        T * g = grad->getData();
+        for(size_t i=0; i<dx.size(); i++) g[i] += dx[i];
     }
 
-    template <typename T>
-    void inplace_add(Tensor<T> * input1, Tensor<T> * input2) {
-        //ADD INPLACE INTO input1
-        //assert same shape
-        assert(input1->getNDims() == input2->getNDims());
-        for(int i=0; i<input1->getNDims(); i++)
-            assert(input1->getDims()[i] == input2->getDims()[i]);
+    private:
+    std::vector<int> order;
+};
 
-        iterator<T> it1 = input1->begin();
-        iterator<T> it2 = input2->begin();
-        //add element wise
-        for(int i=0; i<input1->getTotalElements(); i++){
-            it1.next() += it2.next();
-        }
+template <typename T>
+class _TO_FORMAT: public Op<T>{
+    public:
+    _TO_FORMAT(Tensor<T>*output, Tensor<T>* input): Op<T>(output, 1, input) {}
+
+    void back(){
+        assert(this->inputs[0]->history());
+        Tensor<T> * input = this->inputs[0];
+        input->reshape_grad(input->getNDims(), input->getDims());
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        //The gradient goes back to the input's format
+        ImageLayout in = image_layout(input), out = image_layout(this->output);
+        std::vector<T> dx(input->getTotalElements());
+        reorder((const T *)err_sig->getData(), out, dx.data(), in);
+        T * g = input->getGrad()->getData();
+        for(size_t i=0; i<dx.size(); i++) g[i] += dx[i];
     }
+};
 
-    template <typename T>
-    void inplace_mult_recip(Tensor<T> * input1, Tensor<T> * input2) {
-        //ADD INPLACE INTO input1
-        //assert same shape
-        assert(input1->getNDims() == input2->getNDims());
-        for(int i=0; i<input1->getNDims(); i++)
-            assert(input1->getDims()[i] == input2->getDims()[i]);
+template <typename T>
+class _NARROW: public Op<T>{
+    /*
+        NARROW and SELECT, the input is (outer, n, inner) around the axis
+        and the output the rows [start, start + length) of it
+    */
+    public:
+    _NARROW(Tensor<T>*output, Tensor<T>* input, int outer, int n, int inner, int start, int length)
+        : Op<T>(output, 1, input), outer(outer), n(n), inner(inner), start(start), length(length) {}
 
-        iterator<T> it1 = input1->begin();
-        iterator<T> it2 = input2->begin();
-        //mult element wise
-        for(int i=0; i<input1->getTotalElements(); i++){
-            it1.next() *= (1/it2.next());
+    void back(){
+        assert(this->inputs[0]->history());
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+        size_t row = (size_t)length * inner;
+        for(int o=0; o<outer; o++){
+            T * d = dx + ((size_t)o * n + start) * inner;
+            const T * s = g + (size_t)o * row;
+            for(size_t i=0; i<row; i++) d[i] += s[i];
         }
     }
 
-    template <typename T>
-    void inplace_mult(Tensor<T> * input1, Tensor<T> * input2) {
-        //ADD INPLACE INTO input1
-        //assert same shape
-        assert(input1->getNDims() == input2->getNDims());
+    private:
+    int outer, n, inner, start, length;
+};
+
+template <typename T>
+class _INDEX_SELECT: public Op<T>{
+    /*
+        INDEX_SELECT and GATHER, output (outer, m, inner) picks input (outer, n, inner) rows.
+        INDEX_SELECT uses one index per output row (index.size() == m),
+        GATHER one per output element (index.size() == outer * m * inner)
+    */
+    public:
+    _INDEX_SELECT(Tensor<T>*output, Tensor<T>* input, int outer, int n, int m, int inner, std::vector<int> & index)
+        : Op<T>(output, 1, input), outer(outer), n(n), m(m), inner(inner) {
+        this->index.swap(index);
+    }
+
+    void back(){
+        assert(this->inputs[0]->history());
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+        //Repeated indices add into the same row, so only the outer dim is split
+        bool per_row = (int)index.size() == m;
+        parallel_for(0, outer, std::max(1, (1 << 14) / std::max(1, m * inner)), [&](int lo, int hi){
+            for(int o=lo; o<hi; o++)
+                for(int k=0; k<m; k++){
+                    const T * s = g + ((size_t)o * m + k) * inner;
+                    if(per_row){
+                        T * d = dx + ((size_t)o * n + index[k]) * inner;
+                        for(int i=0; i<inner; i++) d[i] += s[i];
+                    }
+                    else {
+                        const int * idx = index.data() + ((size_t)o * m + k) * inner;
+                        T * d = dx + (size_t)o * n * inner;
+                        for(int i=0; i<inner; i++) d[(size_t)idx[i] * inner + i] += s[i];
+                    }
+                }
+        });
+    }
+
+    private:
+    int outer, n, m, inner;
+    std::vector<int> index;
+};
+
+template <typename T>
+class _SCATTER_ADD: public Op<T>{
+    /*
+        output = input with src (outer, m, inner) added into the rows
+        of input (outer, n, inner) named by index (one per src element)
+    */
+    public:
+    _SCATTER_ADD(Tensor<T>*output, Tensor<T>* input, Tensor<T>* src, int outer, int n, int m, int inner, std::vector<int> & index)
+        : Op<T>(output, 2, input, src), outer(outer), n(n), m(m), inner(inner) {
+        this->index.swap(index);
+    }
+
+    void back(){
+        assert(this->inputs[0]->history());
+        assert(this->inputs[1]->history());
+        for(int i=0; i < this->n_in; i++)
+            this->inputs[i]->reshape_grad(this->inputs[i]->getNDims(), this->inputs[i]->getDims());
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+
+        //d input = g, d src = g at the scattered positions
+        T * dx = this->inputs[0]->getGrad()->getData();
+        for(long i=0; i<err_sig->getTotalElements(); i++) dx[i] += g[i];
+        T * ds = this->inputs[1]->getGrad()->getData();
+        for(int o=0; o<outer; o++)
+            for(int k=0; k<m; k++){
+                size_t j = ((size_t)o * m + k) * inner;
+                for(int i=0; i<inner; i++) ds[j + i] += g[((size_t)o * n + index[j + i]) * inner + i];
+            }
+    }
+
+    private:
+    int outer, n, m, inner;
+    std::vector<int> index;
+};
+
+template <typename T>
+class _CAT: public Op<T>{
+    /*
+        CAT and STACK, input k is (outer, sizes[k], inner) and
+        fills the rows [offsets[k], offsets[k] + sizes[k]) of the output
+    */
+    public:
+    _CAT(Tensor<T>*output, const std::vector<Tensor<T>*> & inputs, int outer, int inner, const std::vector<int> & sizes)
+        : Op<T>(output, inputs.size(), inputs.data()), outer(outer), inner(inner), sizes(sizes) {}
+
+    void back(){
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+        int total = 0;
+        for(size_t k=0; k<sizes.size(); k++) total += sizes[k];
+
+        int offset = 0;
+        for(int k=0; k < this->n_in; k++){
+            assert(this->inputs[k]->history());
+            this->inputs[k]->reshape_grad(this->inputs[k]->getNDims(), this->inputs[k]->getDims());
+            T * dx = this->inputs[k]->getGrad()->getData();
+            size_t row = (size_t)sizes[k] * inner;
+            for(int o=0; o<outer; o++){
+                const T * s = g + ((size_t)o * total + offset) * inner;
+                T * d = dx + (size_t)o * row;
+                for(size_t i=0; i<row; i++) d[i] += s[i];
+            }
+            offset += sizes[k];
+        }
+    }
+
+    private:
+    int outer, inner;
+    std::vector<int> sizes;
+};
+
+template <typename T>
+class _EMBEDDING: public Op<T>{
+    /*
+        Row lookup in a (rows, dim) table. A table with a sparse gradient
+        receives only the looked up rows (coalesced), otherwise the rows
+        are added into its dense gradient
+    */
+    public:
+    _EMBEDDING(Tensor<T>*output, Tensor<T>* table, std::vector<int> & index): Op<T>(output, 1, table) {
+        this->index.swap(index);
+    }
+
+    void back(){
+        Tensor<T> * table = this->inputs[0];
+        assert(table->history());
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+        int dim = table->getDims()[1];
+        if(table->has_sparse_grad()){
+            table->getSparseGrad()->add(index.data(), index.size(), g);
+            return;
+        }
+        table->reshape_grad(table->getNDims(), table->getDims());
+        T * dw = table->getGrad()->getData();
+        for(size_t k=0; k<index.size(); k++){
+            T * d = dw + (size_t)index[k] * dim;
+            const T * s = g + k * dim;
+            for(int i=0; i<dim; i++) d[i] += s[i];
+        }
+    }
+
+    private:
+    std::vector<int> index;
+};
+
+template <typename T>
+class _MAXPOOL2D: public Op<T>{
+    /*
+        Only the window position of every maximum is kept (2 bytes per output),
+        the input values are not needed for backward
+    */
+    public:
+    _MAXPOOL2D(Tensor<T>*output, Tensor<T>* input, const OPS::_Pool2d & P, std::vector<unsigned short> & arg)
+        : Op<T>(output, 1, input), P(P) {
+        this->arg.swap(arg);
+    }
+
+    void back(){
+        assert(this->inputs[0]->history());
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+        size_t in_plane = (size_t)P.H * P.W * P.inner, out_plane = (size_t)P.OH * P.OW * P.inner;
+        long planes = this->inputs[0]->getTotalElements() / std::max<size_t>(1, in_plane);
+        parallel_for(0, planes, 1, [&](long lo, long hi){
+            for(long c=lo; c<hi; c++)
+                for(int oh=0; oh<P.OH; oh++)
+                    for(int ow=0; ow<P.OW; ow++)
+                        for(int i=0; i<P.inner; i++){
+                            size_t j = c * out_plane + ((size_t)oh * P.OW + ow) * P.inner + i;
+                            int ih = oh * P.sh - P.ph + arg[j] / P.kw;
+                            int iw = ow * P.sw - P.pw + arg[j] % P.kw;
+                            dx[c * in_plane + ((size_t)ih * P.W + iw) * P.inner + i] += g[j];
+                        }
+        });
+    }
+
+    const OPS::_Pool2d & getPool() const { return P; }
+
+    private:
+    OPS::_Pool2d P;
+    std::vector<unsigned short> arg;
+};
+
+template <typename T>
+class _AVGPOOL2D: public Op<T>{
+    public:
+    _AVGPOOL2D(Tensor<T>*output, Tensor<T>* input, const OPS::_Pool2d & P): Op<T>(output, 1, input), P(P) {}
+
+    void back(){
+        assert(this->inputs[0]->history());
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+        size_t in_plane = (size_t)P.H * P.W * P.inner, out_plane = (size_t)P.OH * P.OW * P.inner;
+        long planes = this->inputs[0]->getTotalElements() / std::max<size_t>(1, in_plane);
+        parallel_for(0, planes, 1, [&](long lo, long hi){
+            for(long c=lo; c<hi; c++){
+                if(P.inner == 1) OPS::_avgpool_plane_back(g + c * out_plane, P, dx + c * in_plane);
+                else OPS::_avgpool_pixels_back(g + c * out_plane, P, dx + c * in_plane);
+            }
+        });
+    }
+
+    const OPS::_Pool2d & getPool() const { return P; }
+
+    private:
+    OPS::_Pool2d P;
+};
+
+template <typename T>
+class _BATCHNORM: public Op<T>{
+    /*
+        input (outer, C, inner) with channel c normalized by mean[c] and inv_std[c],
+        only those two per channel vectors are saved
+    */
+    public:
+    _BATCHNORM(Tensor<T>*output, Tensor<T>* input, Tensor<T>* gamma, Tensor<T>* beta, long outer, int C, int inner,
+               std::vector<T> & mean, std::vector<T> & inv_std, bool training)
+        : Op<T>(output, 3, input, gamma, beta), outer(outer), C(C), inner(inner), training(training) {
+        this->mean.swap(mean);
+        this->inv_std.swap(inv_std);
+    }
+
+    void back(){
+        for(int i=0; i < this->n_in; i++){
+            assert(this->inputs[i]->history());
+            this->inputs[i]->reshape_grad(this->inputs[i]->getNDims(), this->inputs[i]->getDims());
+        }
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+        const T * x = this->inputs[0]->getData();
+        const T * gamma = this->inputs[1]->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+        T * dgamma = this->inputs[1]->getGrad()->getData();
+        T * dbeta = this->inputs[2]->getGrad()->getData();
+        T M = (T)outer * inner;
+
+        parallel_for(0, C, 1, [&](int lo, int hi){
+            for(int c=lo; c<hi; c++){
+                //Pass 1: sum(g) and sum(g * x_hat), x_hat is recomputed
+                T sum_g = 0, sum_gx = 0;
+                for(long o=0; o<outer; o++){
+                    size_t base = ((size_t)o * C + c) * inner;
+                    for(int i=0; i<inner; i++){
+                        sum_g += g[base + i];
+                        sum_gx += g[base + i] * (x[base + i] - mean[c]) * inv_std[c];
+                    }
+                }
+                dgamma[c] += sum_gx;
+                dbeta[c] += sum_g;
+
+                //Pass 2: dx, the batch statistics depend on x only in training
+                T k = gamma[c] * inv_std[c];
+                T mean_g = training ? sum_g / M : 0, mean_gx = training ? sum_gx / M : 0;
+                for(long o=0; o<outer; o++){
+                    size_t base = ((size_t)o * C + c) * inner;
+                    for(int i=0; i<inner; i++){
+                        T x_hat = (x[base + i] - mean[c]) * inv_std[c];
+                        dx[base + i] += k * (g[base + i] - mean_g - x_hat * mean_gx);
+                    }
+                }
+            }
+        });
+    }
+
+    //Statistics the forward pass normalized with (the running ones in eval mode)
+    const std::vector<T> & getMean() const { return mean; }
+    const std::vector<T> & getInvStd() const { return inv_std; }
+    bool is_training() const { return training; }
+
+    private:
+    long outer;
+    int C, inner;
+    std::vector<T> mean;
+    std::vector<T> inv_std;
+    bool training;
+};
+
+template <typename T>
+class _LAYERNORM: public Op<T>{
+    /*
+        input (rows, D) with every row normalized by its own mean and inv_std
+    */
+    public:
+    _LAYERNORM(Tensor<T>*output, Tensor<T>* input, Tensor<T>* gamma, Tensor<T>* beta, int rows, int D,
+               std::vector<T> & mean, std::vector<T> & inv_std)
+        : Op<T>(output, 3, input, gamma, beta), rows(rows), D(D) {
+        this->mean.swap(mean);
+        this->inv_std.swap(inv_std);
+    }
+
+    void back(){
+        for(int i=0; i < this->n_in; i++){
+            assert(this->inputs[i]->history());
+            this->inputs[i]->reshape_grad(this->inputs[i]->getNDims(), this->inputs[i]->getDims());
+        }
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+        const T * x = this->inputs[0]->getData();
+        const T * gamma = this->inputs[1]->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+
+        //dgamma/dbeta partials per chunk of rows, summed in chunk order
+        const int grain = std::max(1, (1 << 14) / std::max(1, D));
+        int n_chunks = (rows + grain - 1) / grain;
+        std::vector<T> partial((size_t)n_chunks * 2 * D, 0);
+        parallel_for(0, rows, grain, [&](int lo, int hi){
+            T * pg = partial.data() + (size_t)(lo / grain) * 2 * D;
+            T * pb = pg + D;
+            for(int r=lo; r<hi; r++){
+                const T * xr = x + (size_t)r * D;
+                const T * gr = g + (size_t)r * D;
+                //Pass 1: sum(g * gamma), sum(g * gamma * x_hat) and the parameter gradients
+                T sum_g = 0, sum_gx = 0;
+                for(int j=0; j<D; j++){
+                    T x_hat = (xr[j] - mean[r]) * inv_std[r];
+                    T gg = gr[j] * gamma[j];
+                    sum_g += gg;
+                    sum_gx += gg * x_hat;
+                    pg[j] += gr[j] * x_hat;
+                    pb[j] += gr[j];
+                }
+                //Pass 2: dx
+                T * dr = dx + (size_t)r * D;
+                T mean_g = sum_g / D, mean_gx = sum_gx / D;
+                for(int j=0; j<D; j++){
+                    T x_hat = (xr[j] - mean[r]) * inv_std[r];
+                    dr[j] += inv_std[r] * (gr[j] * gamma[j] - mean_g - x_hat * mean_gx);
+                }
+            }
+        });
+        T * dgamma = this->inputs[1]->getGrad()->getData();
+        T * dbeta = this->inputs[2]->getGrad()->getData();
+        for(int k=0; k<n_chunks; k++)
+            for(int j=0; j<D; j++){
+                dgamma[j] += partial[(size_t)k * 2 * D + j];
+                dbeta[j] += partial[(size_t)k * 2 * D + D + j];
+            }
+    }
+
+    private:
+    int rows, D;
+    std::vector<T> mean;
+    std::vector<T> inv_std;
+};
+
+template <typename T>
+class _SOFTMAX: public Op<T>{
+    public:
+    _SOFTMAX(Tensor<T>*output, Tensor<T>* input, int axis): Op<T>(output, 1, input), axis(axis) {}
+
+    void back(){
+        assert(this->inputs[0]->history());
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
+
+        //dx = y * (g - sum(g * y)), only the output is needed
+        int outer, n, inner;
+        Tensor<T> * err_sig = this->output->getGrad();
+        OPS::_axis_split(this->output, axis, outer, n, inner);
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * y = this->output->getData();
+        const T * g = err_sig->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+        std::vector<acc_t<T>> dot(inner);
+        for(int o=0; o<outer; o++){
+            size_t base = (size_t)o * n * inner;
+            for(int i=0; i<inner; i++) dot[i] = 0;
+            for(int k=0; k<n; k++)
+                for(int i=0; i<inner; i++) dot[i] += g[base + k*inner + i] * y[base + k*inner + i];
+            for(int k=0; k<n; k++)
+                for(int i=0; i<inner; i++) {
+                    size_t j = base + k*inner + i;
+                    dx[j] += y[j] * (g[j] - dot[i]);
+                }
+        }
+    }
+
+    int getAxis() const { return axis; }
+
+    private:
+    int axis;
+};
+
+template <typename T>
+class _LOG_SOFTMAX: public Op<T>{
+    public:
+    _LOG_SOFTMAX(Tensor<T>*output, Tensor<T>* input, int axis): Op<T>(output, 1, input), axis(axis) {}
+
+    void back(){
+        assert(this->inputs[0]->history());
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
+
+        //dx = g - softmax * sum(g), softmax is recovered as exp(output)
+        int outer, n, inner;
+        Tensor<T> * err_sig = this->output->getGrad();
+        OPS::_axis_split(this->output, axis, outer, n, inner);
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * y = this->output->getData();
+        const T * g = err_sig->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+        std::vector<acc_t<T>> total(inner);
+        for(int o=0; o<outer; o++){
+            size_t base = (size_t)o * n * inner;
+            for(int i=0; i<inner; i++) total[i] = 0;
+            for(int k=0; k<n; k++)
+                for(int i=0; i<inner; i++) total[i] += g[base + k*inner + i];
+            for(int k=0; k<n; k++)
+                for(int i=0; i<inner; i++) {
+                    size_t j = base + k*inner + i;
+                    dx[j] += g[j] - std::exp(y[j]) * total[i];
+                }
+        }
+    }
+
+    private:
+    int axis;
+};
+
+template <typename T>
+class _CROSS_ENTROPY: public Op<T>{
+    /*
+        Only the logits are an input of the graph, the targets
+        are copied into the op so they never need a gradient
+    */
+    public:
+    _CROSS_ENTROPY(Tensor<T>*output, Tensor<T>* input, int axis, std::vector<int> & targets, std::vector<acc_t<T>> & lse)
+        : Op<T>(output, 1, input), axis(axis) {
+        this->targets.swap(targets);
+        this->lse.swap(lse);
+    }
+
+    void back(){
+        assert(this->inputs[0]->history());
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
+
+        //dx = g/N * (softmax - onehot), softmax is recomputed from the saved log sum exp
+        int outer, n, inner;
+        OPS::_axis_split(this->inputs[0], axis, outer, n, inner);
+        T scale = this->output->getGrad()->scalar() / (outer * inner);
+        const T * x = this->inputs[0]->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+        for(int o=0; o<outer; o++){
+            size_t base = (size_t)o * n * inner;
+            for(int k=0; k<n; k++)
+                for(int i=0; i<inner; i++) {
+                    size_t j = base + k*inner + i;
+                    dx[j] += scale * std::exp(x[j] - lse[(size_t)o*inner + i]);
+                }
+            for(int i=0; i<inner; i++)
+                dx[base + (size_t)targets[(size_t)o*inner + i]*inner + i] -= scale;
+        }
+    }
+
+    private:
+    int axis;
+    std::vector<int> targets;
+    std::vector<acc_t<T>> lse;
+};
+template <typename T>
+class _SUM: public Op<T>{
+    /*
+        Sum (scale 1) or mean (scale 1/count) over a set of axes
+    */
+    public:
+    _SUM(Tensor<T>*output, Tensor<T>* input, const std::vector<bool> & reduced, T scale)
+        : Op<T>(output, 1, input), reduced(reduced), scale(scale) {}
+
+    void back(){
+        assert(this->inputs[0]->history());
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        OPS::_ReduceLayout layout = OPS::_reduce_layout(this->inputs[0], reduced);
+        OPS::_sum_back_kernel(err_sig->getData(), layout, scale, this->inputs[0]->getGrad()->getData());
+    }
+
+    const std::vector<bool> & getReduced() const { return reduced; }
+    T getScale() const { return scale; }
+
+    private:
+    std::vector<bool> reduced;
+    T scale;
+};
+
+template <typename T>
+class _EXTREME: public Op<T>{
+    /*
+        Max/Min, only the flat offsets of the selected inputs are kept
+    */
+    public:
+    _EXTREME(Tensor<T>*output, Tensor<T>* input, std::vector<size_t> & arg): Op<T>(output, 1, input) {
+        this->arg.swap(arg);
+    }
+
+    void back(){
+        assert(this->inputs[0]->history());
+        this->inputs[0]->reshape_grad(this->inputs[0]->getNDims(), this->inputs[0]->getDims());
+        Tensor<T> * err_sig = this->output->getGrad();
+        if(!err_sig->is_contiguous()) err_sig->as_contiguous();
+        const T * g = err_sig->getData();
+        T * dx = this->inputs[0]->getGrad()->getData();
+        for(size_t j=0; j<arg.size(); j++) dx[arg[j]] += g[j];
+    }
+
+    private:
+    std::vector<size_t> arg;
+};
+namespace OPS{
+
+/*
+    OPS Helper Functions
+*/
+    template <typename T>
+    Tensor<T> * _matmul(Tensor<T> * input1, Tensor<T> * input2) {
+        //Shapes must match except for the last 2 layers
+        assert(input1->getDims()[input1->getNDims()-1] == input2->getDims()[input2->getNDims()-2]);
+        assert(input1->getNDims() == input2->getNDims());
+
+        //Initialize out tensor
+        int arr[input1->getNDims()];
+        copyElements(input1->getNDims(), arr, input1->getDims());
+        arr[input1->getNDims()-1] = input2->getDims()[input2->getNDims()-1];  //Correct last dimension
+        Tensor<T> * out = new Tensor<T>(input1->getNDims(), arr);
+        out->no_history();
+        _matmul_into(out, input1, input2);
+        return out;
+    }
+
+    template <typename T>
+    void _matmul_into(Tensor<T> * out, Tensor<T> * input1, Tensor<T> * input2) {
+        //Writes input1 @ input2 into out, which must already have the result shape
+        assert(input1->getDims()[input1->getNDims()-1] == input2->getDims()[input2->getNDims()-2]);
+        assert(input1->getNDims() == input2->getNDims());
+        assert(out->getNDims() == input1->getNDims() && "OUT HAS THE WRONG SHAPE");
+        for(int i=0; i<input1->getNDims()-1; i++)
+            assert(out->getDims()[i] == input1->getDims()[i] && "OUT HAS THE WRONG SHAPE");
+        assert(out->getDims()[out->getNDims()-1] == input2->getDims()[input2->getNDims()-1] && "OUT HAS THE WRONG SHAPE");
+
+        //The leading dimensions index independent (M, K) @ (K, N) products, each one
+        //goes to the kernel of gemm.h that suits its shape, straight on the strides
+        int n = input1->getNDims();
+        int M = input1->getDims()[n-2], K = input1->getDims()[n-1], N = input2->getDims()[n-1];
+        const long * s1 = input1->getMults(), * s2 = input2->getMults(), * so = out->getMults();
+        int batches = 1;
+        for(int i=0; i<n-2; i++) batches *= input1->getDims()[i];
+
+        for(int b=0; b<batches; b++){
+            long o1 = 0, o2 = 0, oo = 0;
+            for(int i=n-3, rest=b; i>=0; i--){
+                int idx = rest % input1->getDims()[i];
+                rest /= input1->getDims()[i];
+                o1 += (long)idx * s1[i];
+                o2 += (long)idx * s2[i];
+                oo += (long)idx * so[i];
+            }
+            matmul((const T *)input1->getData() + o1, s1[n-2], s1[n-1], (const T *)input2->getData() + o2, s2[n-2], s2[n-1],
+                   out->getData() + oo, so[n-2], so[n-1], M, K, N);
+        }
+    }
+
+    template <typename T>
+    void inplace_sub(Tensor<T> * input1, Tensor<T> * input2) {
+        //ADD INPLACE INTO input1
+        //assert same shape
+        assert(input1->getNDims() == input2->getNDims());
+        for(int i=0; i<input1->getNDims(); i++)
+            assert(input1->getDims()[i] == input2->getDims()[i]);
+
+        iterator<T> it1 = input1->begin();
+        iterator<T> it2 = input2->begin();
+        //sub element wise
+        for(long i=0; i<input1->getTotalElements(); i++){
+            it1.next() -= it2.next();
+        }
+    }
+
+    template <typename T>
+    void inplace_add(Tensor<T> * input1, Tensor<T> * input2) {
+        //ADD INPLACE INTO input1
+        //assert same shape
+        assert(input1->getNDims() == input2->getNDims());
         for(int i=0; i<input1->getNDims(); i++)
             assert(input1->getDims()[i] == input2->getDims()[i]);
 
-        iterator<T> it1 = input1->begin();
-        iterator<T> it2 = input2->begin();
-        //mult element wise
-        for(int i=0; i<input1->getTotalElements(); i++){
-            it1.next() *= it2.next();
+        iterator<T> it1 = input1->begin();
+        iterator<T> it2 = input2->begin();
+        //add element wise
+        for(long i=0; i<input1->getTotalElements(); i++){
+            it1.next() += it2.next();
+        }
+    }
+
+    template <typename T>
+    void inplace_mult_recip(Tensor<T> * input1, Tensor<T> * input2) {
+        //ADD INPLACE INTO input1
+        //assert same shape
+        assert(input1->getNDims() == input2->getNDims());
+        for(int i=0; i<input1->getNDims(); i++)
+            assert(input1->getDims()[i] == input2->getDims()[i]);
+
+        iterator<T> it1 = input1->begin();
+        iterator<T> it2 = input2->begin();
+        //mult element wise
+        for(long i=0; i<input1->getTotalElements(); i++){
+            it1.next() *= (1/it2.next());
+        }
+    }
+
+    template <typename T>
+    void inplace_mult(Tensor<T> * input1, Tensor<T> * input2) {
+        //ADD INPLACE INTO input1
+        //assert same shape
+        assert(input1->getNDims() == input2->getNDims());
+        for(int i=0; i<input1->getNDims(); i++)
+            assert(input1->getDims()[i] == input2->getDims()[i]);
+
+        iterator<T> it1 = input1->begin();
+        iterator<T> it2 = input2->begin();
+        //mult element wise
+        for(long i=0; i<input1->getTotalElements(); i++){
+            it1.next() *= it2.next();
+        }
+    }
+
+
+
+/***************************
+*     BINARY OPERATIONS    * 
+****************************/
+    /*
+        The _out variants write into a caller provided tensor with the
+        (broadcast) result shape and record no history, so loops can
+        reuse the same buffers every step.
+    */
+    template <typename T>
+    void _assert_out_shape(Tensor<T> * out, Tensor<T> * input1, Tensor<T> * input2) {
+        Tensor<T> * ops[2] = {input1, input2};
+        int n_dims;
+        int dims[std::max(input1->getNDims(), input2->getNDims())];
+        bool ok = broadcast_iterator<T>::broadcastable(2, ops, &n_dims, dims);
+        assert(ok && "SHAPES CANNOT BE BROADCAST");
+        assert(out->getNDims() == n_dims && "OUT HAS THE WRONG SHAPE");
+        for(int i=0; i<n_dims; i++) assert(out->getDims()[i] == dims[i] && "OUT HAS THE WRONG SHAPE");
+        (void)out;
+        (void)ok;
+    }
+
+    template <typename T>
+    void ADD_out(Tensor<T> * out, Tensor<T>* input1, Tensor<T> * input2) {
+        _assert_out_shape(out, input1, input2);
+        _broadcast_binary(out, input1, input2, [](T a, T b) { return a + b; });
+    }
+
+    template <typename T>
+    void SUB_out(Tensor<T> * out, Tensor<T>* input1, Tensor<T> * input2) {
+        _assert_out_shape(out, input1, input2);
+        _broadcast_binary(out, input1, input2, [](T a, T b) { return a - b; });
+    }
+
+    template <typename T>
+    void MULT_out(Tensor<T> * out, Tensor<T>* input1, Tensor<T> * input2) {
+        _assert_out_shape(out, input1, input2);
+        _broadcast_binary(out, input1, input2, [](T a, T b) { return a * b; });
+    }
+
+    template <typename T>
+    void DIV_out(Tensor<T> * out, Tensor<T>* input1, Tensor<T> * input2) {
+        _assert_out_shape(out, input1, input2);
+        _broadcast_binary(out, input1, input2, [](T a, T b) { return a / b; });
+    }
+
+    template <typename T>
+    void MatMul_out(Tensor<T> * out, Tensor<T>* input1, Tensor<T> * input2) {
+        _matmul_into(out, input1, input2);
+    }
+
+
+    template <typename T>
+    Tensor<T> * ADD(Tensor<T>* input1, Tensor<T> * input2) {
+        //Shapes follow the NumPy broadcasting rules
+        Tensor<T> * out = _broadcast_output(input1, input2);
+        ADD_out(out, input1, input2);
+
+        // Set up Out Tensor
+        _ADD<T> * add = new _ADD<T>(out, input1, input2);
+        out->setOP(dynamic_cast<Op<T>*>(add));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * SUB(Tensor<T>* input1, Tensor<T> * input2) {
+        //Shapes follow the NumPy broadcasting rules
+        Tensor<T> * out = _broadcast_output(input1, input2);
+        SUB_out(out, input1, input2);
+
+        // Set up Out Tensor
+        _SUB<T> * sub = new _SUB<T>(out, input1, input2);
+        out->setOP(dynamic_cast<Op<T>*>(sub));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * MULT(Tensor<T>* input1, Tensor<T> * input2) {
+        //Shapes follow the NumPy broadcasting rules
+        Tensor<T> * out = _broadcast_output(input1, input2);
+        MULT_out(out, input1, input2);
+
+        // Set up Out Tensor
+        _MULT<T> * mult = new _MULT<T>(out, input1, input2);
+        out->setOP(dynamic_cast<Op<T>*>(mult));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * DIV(Tensor<T>* input1, Tensor<T> * input2) {
+        //Shapes follow the NumPy broadcasting rules
+        Tensor<T> * out = _broadcast_output(input1, input2);
+        DIV_out(out, input1, input2);
+
+        // Set up Out Tensor
+        _DIV<T> * div = new _DIV<T>(out, input1, input2);
+        out->setOP(dynamic_cast<Op<T>*>(div));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * MatMul(Tensor<T>* input1, Tensor<T> * input2) {
+        assert(input1->getNDims() == input2->getNDims());
+
+        //Multiply Tensors
+        Tensor<T> * out = _matmul(input1, input2);
+        out->use_history();
+
+        // Set up Out Tensor
+        _MatMul<T> * matmul = new _MatMul<T>(out, input1, input2);
+        out->setOP(dynamic_cast<Op<T>*>(matmul));
+        return out;
+    }
+
+/***************************
+*      TYPE OPERATIONS     * 
+****************************/
+    /***************************************************************
+    * Tensor<D> * CAST(Tensor<S> * input);
+    *
+    *   Description:
+    *       A copy of input with elements of type D (CAST<bfloat16>(x),
+    *       CAST<float>(h)). The graph is typed, so the copy starts a
+    *       new graph: no gradient flows back into input.
+    ***************************************************************/
+    template <typename D, typename S>
+    Tensor<D> * CAST(Tensor<S> * input) {
+        if(!input->is_contiguous()) input->as_contiguous();
+        Tensor<D> * out = new Tensor<D>(input->getNDims(), input->getDims());
+        convert(input->getData(), input->getTotalElements(), out->getData());
+        return out;
+    }
+
+/***************************
+*     UNARY OPERATIONS     * 
+****************************/
+    template <typename T, typename F>
+    void _unary_out(Tensor<T> * out, Tensor<T> * input, F f) {
+        //out = f(input) elementwise, reading input in logical order
+        _assert_out_shape(out, input, input);
+        if(!out->is_contiguous()) out->as_contiguous();
+        out->setFormat(input->getFormat());
+        T * y = out->getData();
+        if(input->is_contiguous()){
+            const T * x = input->getData();
+            for(long i=0; i<input->getTotalElements(); i++) y[i] = f(x[i]);
+            return;
+        }
+        iterator<T> it = input->begin();
+        for(long i=0; i<input->getTotalElements(); i++) y[i] = f(it.next());
+    }
+
+    template <typename T>
+    void NEG_out(Tensor<T> * out, Tensor<T>* input) {
+        _unary_out(out, input, [](T x) { return -x; });
+    }
+
+    template <typename T>
+    Tensor<T> * NEG(Tensor<T>* input) {
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), input->getDims());
+        NEG_out(out, input);
+
+        // Set up Out Tensor
+        _NEG<T> * neg = new _NEG<T>(out, input);
+        out->setOP(dynamic_cast<Op<T>*>(neg));
+        return out;
+    }
+
+    template <typename T>
+    void ReLU_out(Tensor<T> * out, Tensor<T>* input) {
+        _unary_out(out, input, [](T x) { return x > 0 ? x : (T)0; });
+    }
+
+    template <typename T>
+    Tensor<T> * ReLU(Tensor<T>* input) {
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), input->getDims());
+        ReLU_out(out, input);
+
+        // Set up Out Tensor
+        _ReLU<T> * rel = new _ReLU<T>(out, input);
+        out->setOP(dynamic_cast<Op<T>*>(rel));
+        return out;
+    }
+
+    /***************************************************************
+    * Tensor<T> * DROPOUT(Tensor<T> * input, T p, uint64_t seed, uint64_t stream=0);
+    *
+    *   Description:
+    *       zeroes every element with probability p and scales the rest
+    *       by 1/(1-p). The mask is drawn from a counter based RNG: element
+    *       i uses counter i of (seed, stream), so the same seed and stream
+    *       always give the same mask whatever the thread count.
+    *       Use a new stream (or seed) for every call.
+    ***************************************************************/
+    template <typename T>
+    Tensor<T> * DROPOUT(Tensor<T>* input, T p, uint64_t seed, uint64_t stream=0) {
+        assert(p >= 0 && p < 1 && "DROPOUT PROBABILITY MUST BE IN [0, 1)");
+        if(!input->is_contiguous()) input->as_contiguous();
+        long n = input->getTotalElements();
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), input->getDims());
+        BitMask mask;
+        mask.pack_bernoulli(n, 1 - (double)p, seed, stream);
+
+        T scale = 1 / (1 - p);
+        const T * x = input->getData();
+        T * y = out->getData();
+        parallel_for(0, (n + 63) / 64, MASK_GRAIN, [&](int lo, int hi){
+            for(long i=(long)lo * 64; i<std::min(n, (long)hi * 64); i++) y[i] = mask.get(i) ? x[i] * scale : 0;
+        });
+
+        _DROPOUT<T> * drop = new _DROPOUT<T>(out, input, mask, scale);
+        out->setOP(dynamic_cast<Op<T>*>(drop));
+        return out;
+    }
+
+    template <typename T>
+    void EXP_out(Tensor<T> * out, Tensor<T>* input) {
+        _unary_out(out, input, [](T x) { return std::exp(x); });
+    }
+
+    template <typename T>
+    Tensor<T> * EXP(Tensor<T>* input) {
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), input->getDims());
+        EXP_out(out, input);
+
+        // Set up Out Tensor
+        _EXP<T> * exp = new _EXP<T>(out, input);
+        out->setOP(dynamic_cast<Op<T>*>(exp));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * PAD(Tensor<T>* input, int padx=2, int pady=2, int pad_val = 0) {
+        assert(input->getNDims() >= 2);
+
+        //Channels last and blocked images pad their H and W dims
+        if(input->getFormat() != FORMAT_NCHW){
+            ImageLayout in = image_layout(input), L = in;
+            L.H += 2 * padx;
+            L.W += 2 * pady;
+            int dims[5];
+            Tensor<T> * out = new Tensor<T>(format_dims(input->getFormat(), L, dims), dims);
+            out->setFormat(input->getFormat());
+            pad_image(input->getData(), in, padx, pady, (T)pad_val, out->getData());
+
+            _PAD<T> * pad_ = new _PAD<T>(out, input, pad_val);
+            out->setOP(dynamic_cast<Op<T>*>(pad_));
+            return out;
+        }
+
+        std::pair<int,int> pad = std::make_pair(padx, pady);
+
+        //Get new shape
+        int dims[input->getNDims()];
+        copyElements(input->getNDims(), dims, input->getDims());
+        dims[input->getNDims()-2] += 2*pad.first;
+        dims[input->getNDims()-1] += 2*pad.second;
+        //Create out tensor
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), dims);
+        out->setAll(pad_val);//0 pad
+        //Copy elements over
+        iterator<T> it = input->begin();
+
+        int index[input->getNDims()];
+        for(long i=0; i<input->getTotalElements(); i++){
+            it.getCurr(index);
+            index[input->getNDims()-2] += pad.first;
+            index[input->getNDims()-1] += pad.second;
+            out->get(index) = it.next();
         }
+
+        // Set up Out Tensor
+        _PAD<T> * pad_ = new _PAD<T>(out, input, pad_val);
+        out->setOP(dynamic_cast<Op<T>*>(pad_));
+        return out;
     }
 
+    template <typename T>
+    Tensor<T> * BIAS_ADD(Tensor<T>* input, Tensor<T>* bias, int axis=-1) {
+        //Adds the 1d tensor bias along the axis (default last) of input
+        if(axis < 0) axis += input->getNDims();
+        assert(bias->getNDims() == 1);
+        assert(bias->getDims()[0] == input->getDims()[axis]);
+
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), input->getDims());
+        out->setFormat(input->getFormat());
+        iterator<T> it = input->begin();
+        iterator<T> it_out = out->begin();
+        int index[input->getNDims()];
+        for(long i=0; i<input->getTotalElements(); i++){
+            it.getCurr(index);
+            it_out.next() = it.next() + bias->get(index + axis);
+        }
 
+        // Set up Out Tensor
+        _BIAS_ADD<T> * bias_add = new _BIAS_ADD<T>(out, input, bias, axis);
+        out->setOP(dynamic_cast<Op<T>*>(bias_add));
+        return out;
+    }
 
 /***************************
-*     BINARY OPERATIONS    * 
+*   REDUCTION OPERATIONS   * 
 ****************************/
+    template <typename T>
+    Tensor<T> * _reduce_output(Tensor<T> * input, const std::vector<int> & axes, bool keepdim, std::vector<bool> & reduced) {
+        //Marks the reduced axes (all of them when axes is empty) and allocates the output
+        reduced.assign(input->getNDims(), axes.empty());
+        for(size_t i=0; i<axes.size(); i++){
+            int axis = axes[i] < 0 ? axes[i] + input->getNDims() : axes[i];
+            assert(axis >= 0 && axis < input->getNDims() && "INVALID AXIS");
+            reduced[axis] = true;
+        }
+        std::vector<int> dims;
+        for(int d=0; d<input->getNDims(); d++){
+            if(!reduced[d]) dims.push_back(input->getDims()[d]);
+            else if(keepdim) dims.push_back(1);
+        }
+        if(dims.empty()) dims.push_back(1);
+        return new Tensor<T>((int)dims.size(), dims.data());
+    }
 
     template <typename T>
-    Tensor<T> * ADD(Tensor<T>* input1, Tensor<T> * input2) {
-        assert(input1->getTotalElements() == input2->getTotalElements());
-        assert(input1->getNDims() == input2->getNDims());
-        for(int i=0; i<input1->getNDims(); i++) 
-            assert(input1->getDims()[i] == input2->getDims()[i]);
+    Tensor<T> * SUM(Tensor<T>* input, const std::vector<int> & axes = std::vector<int>(), bool keepdim=false) {
+        //Sums over axes (every axis when empty)
+        std::vector<bool> reduced;
+        Tensor<T> * out = _reduce_output(input, axes, keepdim, reduced);
+        _ReduceLayout layout = _reduce_layout(input, reduced);
+        _sum_kernel(input->getData(), layout, (T)1, out->getData());
 
-        //Set Up iterators
-        iterator<T> it1 = input1->begin();
-        iterator<T> it2 = input2->begin();
+        // Set up Out Tensor
+        _SUM<T> * sum = new _SUM<T>(out, input, reduced, (T)1);
+        out->setOP(dynamic_cast<Op<T>*>(sum));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * MEAN(Tensor<T>* input, const std::vector<int> & axes = std::vector<int>(), bool keepdim=false) {
+        std::vector<bool> reduced;
+        Tensor<T> * out = _reduce_output(input, axes, keepdim, reduced);
+        T scale = (T)out->getTotalElements() / input->getTotalElements();
+        _ReduceLayout layout = _reduce_layout(input, reduced);
+        _sum_kernel(input->getData(), layout, scale, out->getData());
+
+        // Set up Out Tensor
+        _SUM<T> * mean = new _SUM<T>(out, input, reduced, scale);
+        out->setOP(dynamic_cast<Op<T>*>(mean));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * _extreme(Tensor<T>* input, const std::vector<int> & axes, bool keepdim, bool is_max) {
+        std::vector<bool> reduced;
+        Tensor<T> * out = _reduce_output(input, axes, keepdim, reduced);
+        _ReduceLayout layout = _reduce_layout(input, reduced);
+        std::vector<size_t> arg(out->getTotalElements());
+        _extreme_kernel(input->getData(), layout, is_max, out->getData(), arg.data());
+
+        // Set up Out Tensor
+        _EXTREME<T> * extreme = new _EXTREME<T>(out, input, arg);
+        out->setOP(dynamic_cast<Op<T>*>(extreme));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * MAX(Tensor<T>* input, const std::vector<int> & axes = std::vector<int>(), bool keepdim=false) {
+        return _extreme(input, axes, keepdim, true);
+    }
+
+    template <typename T>
+    Tensor<T> * MIN(Tensor<T>* input, const std::vector<int> & axes = std::vector<int>(), bool keepdim=false) {
+        return _extreme(input, axes, keepdim, false);
+    }
+
+    template <typename T>
+    Tensor<T> * ARGMAX(Tensor<T>* input, int axis=-1, bool keepdim=false) {
+        //Index along axis of the (first) largest element, not differentiable
+        if(axis < 0) axis += input->getNDims();
+        std::vector<bool> reduced;
+        std::vector<int> axes(1, axis);
+        Tensor<T> * out = _reduce_output(input, axes, keepdim, reduced);
+        out->no_history();
+        _ReduceLayout layout = _reduce_layout(input, reduced);
+        std::vector<size_t> arg(out->getTotalElements());
+        _extreme_kernel(input->getData(), layout, true, out->getData(), arg.data());
+        size_t stride = input->getMults()[axis];
+        T * y = out->getData();
+        for(size_t j=0; j<arg.size(); j++) y[j] = (arg[j] / stride) % input->getDims()[axis];
+        return out;
+    }
 
-        //Add data
-        T  new_data[input1->getTotalElements()];
-        for(int i=0; i<input1->getTotalElements(); i++){
-            new_data[i] = it1.next() + it2.next();
+/***************************
+*     SHAPE OPERATIONS     * 
+****************************/
+    template <typename T>
+    Tensor<T> * PERMUTE(Tensor<T>* input, const std::vector<int> & order) {
+        //Output dim i is input dim order[i], the result is contiguous
+        int n_dims = input->getNDims();
+        assert((int)order.size() == n_dims && "ORDER MUST NAME EVERY DIM");
+        std::vector<int> axes(n_dims);
+        int dims[n_dims];
+        long strides[n_dims];
+        std::vector<bool> seen(n_dims, false);
+        for(int i=0; i<n_dims; i++){
+            axes[i] = order[i] < 0 ? order[i] + n_dims : order[i];
+            assert(axes[i] >= 0 && axes[i] < n_dims && !seen[axes[i]] && "INVALID PERMUTATION");
+            seen[axes[i]] = true;
+            dims[i] = input->getDims()[axes[i]];
+            strides[i] = input->getMults()[axes[i]];
         }
-        //Create out tensor
-        Tensor<T> * out = new Tensor<T>(new_data, input1->getNDims(), input1->getDims());
-        _ADD<T> * add = new _ADD<T>(out, input1, input2);
-        out->setOP(dynamic_cast<Op<T>*>(add));
+        Tensor<T> * out = new Tensor<T>(n_dims, dims);
+        strided_copy((const T *)input->getData(), n_dims, dims, strides, out->getData());
+
+        // Set up Out Tensor
+        _PERMUTE<T> * permute = new _PERMUTE<T>(out, input, axes);
+        out->setOP(dynamic_cast<Op<T>*>(permute));
         return out;
     }
 
+    /***************************************************************
+    * Tensor<T> * TO_FORMAT(Tensor<T> * input, MemoryFormat format, int block=8);
+    *
+    *   Description:
+    *       the image input moved to memory format (block channels per
+    *       block for FORMAT_NCHWC, which must divide the channels).
+    *       The dims of the result are the physical ones of format.
+    *       Returns input itself when it already is in that format.
+    ***************************************************************/
     template <typename T>
-    Tensor<T> * SUB(Tensor<T>* input1, Tensor<T> * input2) {
-        assert(input1->getTotalElements() == input2->getTotalElements());
-        assert(input1->getNDims() == input2->getNDims());
-        for(int i=0; i<input1->getNDims(); i++) 
-            assert(input1->getDims()[i] == input2->getDims()[i]);
+    Tensor<T> * TO_FORMAT(Tensor<T>* input, MemoryFormat format, int block=8) {
+        ImageLayout in = image_layout(input);
+        ImageLayout L = image_layout(format, in.N, in.C, in.H, in.W, block);
+        if(input->getFormat() == format && in.inner == L.inner) return input;
+        int dims[5];
+        Tensor<T> * out = new Tensor<T>(format_dims(format, L, dims), dims);
+        out->setFormat(format);
+        reorder((const T *)input->getData(), in, out->getData(), L);
 
-        //Set Up iterators
-        iterator<T> it1 = input1->begin();
-        iterator<T> it2 = input2->begin();
+        // Set up Out Tensor
+        _TO_FORMAT<T> * to_format = new _TO_FORMAT<T>(out, input);
+        out->setOP(dynamic_cast<Op<T>*>(to_format));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * TRANSPOSE(Tensor<T>* input, int axis1=-2, int axis2=-1) {
+        //Swaps two dims, unlike Tensor::transpose the result is a tracked, contiguous tensor
+        int n_dims = input->getNDims();
+        if(axis1 < 0) axis1 += n_dims;
+        if(axis2 < 0) axis2 += n_dims;
+        std::vector<int> order(n_dims);
+        for(int i=0; i<n_dims; i++) order[i] = i;
+        std::swap(order[axis1], order[axis2]);
+        return PERMUTE(input, order);
+    }
 
-        //Add data
-        T  new_data[input1->getTotalElements()];
-        for(int i=0; i<input1->getTotalElements(); i++){
-            new_data[i] = it1.next() - it2.next();
+    template <typename T>
+    Tensor<T> * _slice(Tensor<T>* input, int outer, int n, int inner, int start, int length, int n_dims, const int * dims) {
+        //Rows [start, start + length) of the contiguous (outer, n, inner) input,
+        //a view when they are one block of its storage and a single copy otherwise
+        Tensor<T> * out;
+        if(outer == 1 || length == n) out = new Tensor<T>(input, start * inner, n_dims, dims);
+        else {
+            out = new Tensor<T>(n_dims, dims);
+            int block[3] = {outer, length, inner};
+            long strides[3] = {(long)n * inner, inner, 1};
+            strided_copy((const T *)input->getData() + (size_t)start * inner, 3, block, strides, out->getData());
         }
-        //Create out tensor
-        Tensor<T> * out = new Tensor<T>(new_data, input1->getNDims(), input1->getDims());
-        _SUB<T> * add = new _SUB<T>(out, input1, input2);
-        out->setOP(dynamic_cast<Op<T>*>(add));
+
+        // Set up Out Tensor
+        _NARROW<T> * narrow = new _NARROW<T>(out, input, outer, n, inner, start, length);
+        out->setOP(dynamic_cast<Op<T>*>(narrow));
         return out;
     }
 
     template <typename T>
-    Tensor<T> * MULT(Tensor<T>* input1, Tensor<T> * input2) {
-        assert(input1->getTotalElements() == input2->getTotalElements());
-        assert(input1->getNDims() == input2->getNDims());
-        for(int i=0; i<input1->getNDims(); i++) 
-            assert(input1->getDims()[i] == input2->getDims()[i]);
+    Tensor<T> * NARROW(Tensor<T>* input, int axis, int start, int length) {
+        /*
+            The elements start to start + length - 1 along axis.
+            When they are contiguous in the input (axis is the first dim
+            larger than 1, or the whole dim is kept) the result is a view
+            sharing the input's storage with no link keeping it alive:
+            the input must not be deleted, packed or rearranged while the
+            view or anything computed from it is still read
+            (release_graph frees both together, which is fine)
+        */
+        int outer, n, inner;
+        _axis_split(input, axis, outer, n, inner);
+        if(start < 0) start += n;
+        assert(start >= 0 && length >= 0 && start + length <= n && "SLICE OUT OF RANGE");
+        int n_dims = input->getNDims();
+        int dims[n_dims];
+        copyElements(n_dims, dims, input->getDims());
+        dims[axis] = length;
+        return _slice(input, outer, n, inner, start, length, n_dims, dims);
+    }
 
-        //Set Up iterators
-        iterator<T> it1 = input1->begin();
-        iterator<T> it2 = input2->begin();
+    template <typename T>
+    Tensor<T> * SELECT(Tensor<T>* input, int axis, int index) {
+        //NARROW of one element with axis removed (a 1D input gives a single element),
+        //a view under the same conditions and with the same lifetime contract
+        int outer, n, inner;
+        _axis_split(input, axis, outer, n, inner);
+        if(index < 0) index += n;
+        assert(index >= 0 && index < n && "INDEX OUT OF RANGE");
+        int n_dims = input->getNDims();
+        int dims[n_dims];
+        int out_dims = 0;
+        for(int i=0; i<n_dims; i++) if(i != axis) dims[out_dims++] = input->getDims()[i];
+        if(out_dims == 0) dims[out_dims++] = 1;
+        return _slice(input, outer, n, inner, index, 1, out_dims, dims);
+    }
 
-        //Add data
-        T  new_data[input1->getTotalElements()];
-        for(int i=0; i<input1->getTotalElements(); i++){
-            new_data[i] = it1.next() * it2.next();
+    template <typename T>
+    std::vector<int> _read_index(Tensor<T>* index, int n) {
+        //Index tensors hold integral values in T, as in CROSS_ENTROPY's targets
+        std::vector<int> out(index->getTotalElements());
+        iterator<T> it = index->begin();
+        for(size_t j=0; j<out.size(); j++){
+            out[j] = (int)it.next();
+            if(out[j] < 0) out[j] += n;
+            assert(out[j] >= 0 && out[j] < n && "INDEX OUT OF RANGE");
         }
+        return out;
+    }
 
-        //Create out tensor
-        Tensor<T> * out = new Tensor<T>(new_data, input1->getNDims(), input1->getDims());
-        _MULT<T> * add = new _MULT<T>(out, input1, input2);
-        out->setOP(dynamic_cast<Op<T>*>(add));
+    template <typename T>
+    Tensor<T> * INDEX_SELECT(Tensor<T>* input, int axis, const std::vector<int> & index) {
+        //The slices index[0], index[1], ... along axis, in that order (repeats allowed)
+        int outer, n, inner;
+        _axis_split(input, axis, outer, n, inner);
+        std::vector<int> rows(index);
+        for(size_t k=0; k<rows.size(); k++){
+            if(rows[k] < 0) rows[k] += n;
+            assert(rows[k] >= 0 && rows[k] < n && "INDEX OUT OF RANGE");
+        }
+        int m = rows.size();
+        int n_dims = input->getNDims();
+        int dims[n_dims];
+        copyElements(n_dims, dims, input->getDims());
+        dims[axis] = m;
+        Tensor<T> * out = new Tensor<T>(n_dims, dims);
+
+        //One row copy per selected slice
+        const T * x = input->getData();
+        T * y = out->getData();
+        parallel_for(0, (long)outer * m, std::max(1, (1 << 14) / std::max(1, inner)), [&](long lo, long hi){
+            for(long r=lo; r<hi; r++)
+                std::memcpy(y + (size_t)r * inner, x + ((size_t)(r / m) * n + rows[r % m]) * inner, sizeof(T) * inner);
+        });
+
+        // Set up Out Tensor
+        _INDEX_SELECT<T> * select = new _INDEX_SELECT<T>(out, input, outer, n, m, inner, rows);
+        out->setOP(dynamic_cast<Op<T>*>(select));
         return out;
     }
 
     template <typename T>
-    Tensor<T> * DIV(Tensor<T>* input1, Tensor<T> * input2) {
-        assert(input1->getTotalElements() == input2->getTotalElements());
-        assert(input1->getNDims() == input2->getNDims());
-        for(int i=0; i<input1->getNDims(); i++) 
-            assert(input1->getDims()[i] == input2->getDims()[i]);
+    Tensor<T> * INDEX_SELECT(Tensor<T>* input, int axis, Tensor<T>* index) {
+        int a = axis < 0 ? axis + input->getNDims() : axis;
+        assert(a >= 0 && a < input->getNDims() && "INVALID AXIS");
+        return INDEX_SELECT(input, axis, _read_index(index, input->getDims()[a]));
+    }
 
-        //Set Up iterators
-        iterator<T> it1 = input1->begin();
-        iterator<T> it2 = input2->begin();
+    template <typename T>
+    void _index_layout(Tensor<T>* input, int & axis, Tensor<T>* index, int & outer, int & n, int & m, int & inner) {
+        //index matches input in every dim but axis
+        _axis_split(input, axis, outer, n, inner);
+        assert(index->getNDims() == input->getNDims() && "INDEX SHAPE MISMATCH");
+        for(int i=0; i<input->getNDims(); i++)
+            assert((i == axis || index->getDims()[i] == input->getDims()[i]) && "INDEX SHAPE MISMATCH");
+        m = index->getDims()[axis];
+    }
+
+    template <typename T>
+    Tensor<T> * GATHER(Tensor<T>* input, int axis, Tensor<T>* index) {
+        /*
+            out[.., j, ..] = input[.., index[.., j, ..], ..] along axis,
+            the output has the shape of index
+        */
+        int outer, n, m, inner;
+        _index_layout(input, axis, index, outer, n, m, inner);
+        std::vector<int> idx = _read_index(index, n);
+        Tensor<T> * out = new Tensor<T>(index->getNDims(), index->getDims());
+        const T * x = input->getData();
+        T * y = out->getData();
+        parallel_for(0, (long)outer * m, std::max(1, (1 << 14) / std::max(1, inner)), [&](long lo, long hi){
+            for(long r=lo; r<hi; r++){
+                const T * row = x + (size_t)(r / m) * n * inner;
+                const int * id = idx.data() + (size_t)r * inner;
+                for(int i=0; i<inner; i++) y[(size_t)r * inner + i] = row[(size_t)id[i] * inner + i];
+            }
+        });
+
+        // Set up Out Tensor
+        _INDEX_SELECT<T> * gather = new _INDEX_SELECT<T>(out, input, outer, n, m, inner, idx);
+        out->setOP(dynamic_cast<Op<T>*>(gather));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * SCATTER_ADD(Tensor<T>* input, int axis, Tensor<T>* index, Tensor<T>* src) {
+        /*
+            A copy of input with src[.., j, ..] added to input[.., index[.., j, ..], ..]
+            along axis, src has the shape of index. The inverse of GATHER.
+        */
+        int outer, n, m, inner;
+        _index_layout(input, axis, index, outer, n, m, inner);
+        assert(src->getNDims() == index->getNDims() && "SOURCE SHAPE MISMATCH");
+        for(int i=0; i<src->getNDims(); i++)
+            assert(src->getDims()[i] == index->getDims()[i] && "SOURCE SHAPE MISMATCH");
+        if(!src->is_contiguous()) src->as_contiguous();
+        std::vector<int> idx = _read_index(index, n);
+
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), input->getDims());
+        T * y = out->getData();
+        std::memcpy(y, input->getData(), sizeof(T) * input->getTotalElements());
+        const T * s = src->getData();
+        //Each outer block is scattered by one thread, repeated indices cannot race
+        parallel_for(0, outer, std::max(1, (1 << 14) / std::max(1, m * inner)), [&](int lo, int hi){
+            for(int o=lo; o<hi; o++)
+                for(int k=0; k<m; k++){
+                    size_t j = ((size_t)o * m + k) * inner;
+                    for(int i=0; i<inner; i++) y[((size_t)o * n + idx[j + i]) * inner + i] += s[j + i];
+                }
+        });
+
+        // Set up Out Tensor
+        _SCATTER_ADD<T> * scatter = new _SCATTER_ADD<T>(out, input, src, outer, n, m, inner, idx);
+        out->setOP(dynamic_cast<Op<T>*>(scatter));
+        return out;
+    }
 
-        //Add data
-        T  new_data[input1->getTotalElements()];
-        for(int i=0; i<input1->getTotalElements(); i++){
-            new_data[i] = it1.next() / it2.next();
+    template <typename T>
+    Tensor<T> * _cat(const std::vector<Tensor<T>*> & inputs, int outer, int inner, const std::vector<int> & sizes, int n_dims, const int * dims) {
+        //Writes every (outer, sizes[k], inner) input once into its rows of the preallocated output
+        Tensor<T> * out = new Tensor<T>(n_dims, dims);
+        int total = 0;
+        for(size_t k=0; k<sizes.size(); k++) total += sizes[k];
+        T * y = out->getData();
+        int offset = 0;
+        for(size_t k=0; k<inputs.size(); k++){
+            if(!inputs[k]->is_contiguous()) inputs[k]->as_contiguous();
+            const T * x = inputs[k]->getData();
+            size_t row = (size_t)sizes[k] * inner;
+            parallel_for(0, outer, std::max<int>(1, (1 << 14) / std::max<size_t>(1, row)), [&](int lo, int hi){
+                for(int o=lo; o<hi; o++)
+                    std::memcpy(y + ((size_t)o * total + offset) * inner, x + (size_t)o * row, sizeof(T) * row);
+            });
+            offset += sizes[k];
         }
 
-        //Create out tensor
-        Tensor<T> * out = new Tensor<T>(new_data, input1->getNDims(), input1->getDims());
-        _DIV<T> * div = new _DIV<T>(out, input1, input2);
-        out->setOP(dynamic_cast<Op<T>*>(div));
+        // Set up Out Tensor
+        _CAT<T> * cat = new _CAT<T>(out, inputs, outer, inner, sizes);
+        out->setOP(dynamic_cast<Op<T>*>(cat));
         return out;
     }
 
     template <typename T>
-    Tensor<T> * MatMul(Tensor<T>* input1, Tensor<T> * input2) {
-        assert(input1->getNDims() == input2->getNDims());
+    Tensor<T> * CAT(const std::vector<Tensor<T>*> & inputs, int axis=0) {
+        //Joins the inputs along axis, their other dims must match
+        assert(!inputs.empty() && "NOTHING TO CONCATENATE");
+        int n_dims = inputs[0]->getNDims();
+        if(axis < 0) axis += n_dims;
+        assert(axis >= 0 && axis < n_dims && "INVALID AXIS");
+        int dims[n_dims];
+        copyElements(n_dims, dims, inputs[0]->getDims());
+        std::vector<int> sizes;
+        dims[axis] = 0;
+        for(size_t k=0; k<inputs.size(); k++){
+            assert(inputs[k]->getNDims() == n_dims && "CAT SHAPES DIFFER");
+            for(int i=0; i<n_dims; i++)
+                assert((i == axis || inputs[k]->getDims()[i] == dims[i]) && "CAT SHAPES DIFFER");
+            sizes.push_back(inputs[k]->getDims()[axis]);
+            dims[axis] += sizes.back();
+        }
+        int outer = 1, inner = 1;
+        for(int i=0; i<axis; i++) outer *= dims[i];
+        for(int i=axis+1; i<n_dims; i++) inner *= dims[i];
+        return _cat(inputs, outer, inner, sizes, n_dims, dims);
+    }
 
-        //Multiply Tensors
-        Tensor<T> * out = _matmul(input1, input2);
-        out->use_history();
+    template <typename T>
+    Tensor<T> * STACK(const std::vector<Tensor<T>*> & inputs, int axis=0) {
+        //Joins same shaped inputs along a new dim inserted at axis
+        assert(!inputs.empty() && "NOTHING TO STACK");
+        int n_dims = inputs[0]->getNDims();
+        if(axis < 0) axis += n_dims + 1;
+        assert(axis >= 0 && axis <= n_dims && "INVALID AXIS");
+        int dims[n_dims + 1];
+        int outer = 1, inner = 1;
+        for(int i=0; i<n_dims; i++){
+            dims[i < axis ? i : i + 1] = inputs[0]->getDims()[i];
+            if(i < axis) outer *= inputs[0]->getDims()[i];
+            else inner *= inputs[0]->getDims()[i];
+        }
+        dims[axis] = inputs.size();
+        for(size_t k=0; k<inputs.size(); k++){
+            assert(inputs[k]->getNDims() == n_dims && "STACK SHAPES DIFFER");
+            for(int i=0; i<n_dims; i++)
+                assert(inputs[k]->getDims()[i] == inputs[0]->getDims()[i] && "STACK SHAPES DIFFER");
+        }
+        return _cat(inputs, outer, inner, std::vector<int>(inputs.size(), 1), n_dims + 1, dims);
+    }
+
+    template <typename T>
+    Tensor<T> * EMBEDDING(Tensor<T>* table, Tensor<T>* index) {
+        /*
+            Looks up the rows of a (rows, dim) table named by index,
+            the output has shape (index dims..., dim).
+            Give the table a sparse gradient (use_sparse_grad) so
+            backward only stores the rows that were looked up
+        */
+        assert(table->getNDims() == 2 && "EMBEDDING TABLE MUST BE 2D");
+        if(!table->is_contiguous()) table->as_contiguous();
+        std::vector<int> idx = _read_index(index, table->getDims()[0]);
+        int dim = table->getDims()[1];
+        int n_dims = index->getNDims() + 1;
+        int dims[n_dims];
+        copyElements(n_dims - 1, dims, index->getDims());
+        dims[n_dims - 1] = dim;
+        Tensor<T> * out = new Tensor<T>(n_dims, dims);
+
+        //Rows are gathered in parallel, one memcpy each
+        const T * w = table->getData();
+        T * y = out->getData();
+        parallel_for(0, idx.size(), std::max(1, (1 << 14) / std::max(1, dim)), [&](int lo, int hi){
+            for(int k=lo; k<hi; k++) std::memcpy(y + (size_t)k * dim, w + (size_t)idx[k] * dim, sizeof(T) * dim);
+        });
 
         // Set up Out Tensor
-        _MatMul<T> * matmul = new _MatMul<T>(out, input1, input2);
-        out->setOP(dynamic_cast<Op<T>*>(matmul));
+        _EMBEDDING<T> * embedding = new _EMBEDDING<T>(out, table, idx);
+        out->setOP(dynamic_cast<Op<T>*>(embedding));
         return out;
     }
 
 /***************************
-*     UNARY OPERATIONS     * 
+*    POOLING OPERATIONS    * 
 ****************************/
     template <typename T>
-    Tensor<T> * NEG(Tensor<T>* input) {
+    _Pool2d _pool_geometry(Tensor<T>* input, std::pair<int,int> kernel, std::pair<int,int> stride, std::pair<int,int> padding) {
+        //Stride (0, 0) means the kernel size (non overlapping windows)
+        assert(input->getNDims() == (input->getFormat() == FORMAT_NCHWC ? 5 : 4) && "POOLING EXPECTS (BATCH, CHANNELS, HEIGHT, WIDTH)");
+        ImageLayout L = image_layout(input);
+        _Pool2d P;
+        P.kh = kernel.first;
+        P.kw = kernel.second;
+        P.sh = stride.first > 0 ? stride.first : kernel.first;
+        P.sw = stride.second > 0 ? stride.second : kernel.second;
+        P.ph = padding.first;
+        P.pw = padding.second;
+        P.H = L.H;
+        P.W = L.W;
+        P.inner = L.inner;
+        assert(P.kh > 0 && P.kw > 0 && P.kh * P.kw <= 65536 && "INVALID POOLING WINDOW");
+        assert(2 * P.ph <= P.kh && 2 * P.pw <= P.kw && "PADDING MUST BE AT MOST HALF THE KERNEL");
+        assert(P.H + 2 * P.ph >= P.kh && P.W + 2 * P.pw >= P.kw && "POOLING WINDOW LARGER THAN THE INPUT");
+        P.OH = (P.H + 2 * P.ph - P.kh) / P.sh + 1;
+        P.OW = (P.W + 2 * P.pw - P.kw) / P.sw + 1;
+        return P;
+    }
 
-        iterator<T> it = input->begin();
-        //Add data
-        T  new_data[input->getTotalElements()];
-        for(int i=0; i<input->getTotalElements(); i++){
-            new_data[i] = -it.next();
-        }
-        Tensor<T> * out = new Tensor<T>(new_data, input->getNDims(), input->getDims());
+    template <typename T>
+    Tensor<T> * _pool_output(Tensor<T>* input, const _Pool2d & P) {
+        //(OH, OW) images in the input's memory format
+        ImageLayout L = image_layout(input);
+        L.H = P.OH;
+        L.W = P.OW;
+        int dims[5];
+        Tensor<T> * out = new Tensor<T>(format_dims(input->getFormat(), L, dims), dims);
+        out->setFormat(input->getFormat());
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * MAXPOOL2D(Tensor<T>* input, std::pair<int,int> kernel, std::pair<int,int> stride=std::make_pair(0,0), std::pair<int,int> padding=std::make_pair(0,0)) {
+        //input: (batch, channels, height, width) or another image format, padding never wins the max
+        _Pool2d P = _pool_geometry(input, kernel, stride, padding);
+        Tensor<T> * out = _pool_output(input, P);
+        std::vector<unsigned short> arg(out->getTotalElements());
+        const T * x = input->getData();
+        T * y = out->getData();
+        size_t in_plane = (size_t)P.H * P.W * P.inner, out_plane = (size_t)P.OH * P.OW * P.inner;
+        //One (batch, channel) plane per task, or one image when the channels are innermost
+        parallel_for(0, input->getTotalElements() / in_plane, 1, [&](int lo, int hi){
+            for(int c=lo; c<hi; c++){
+                if(P.inner == 1) _maxpool_plane(x + c * in_plane, P, y + c * out_plane, arg.data() + c * out_plane);
+                else _maxpool_pixels(x + c * in_plane, P, y + c * out_plane, arg.data() + c * out_plane);
+            }
+        });
 
         // Set up Out Tensor
-        _NEG<T> * neg = new _NEG<T>(out, input);
-        out->setOP(dynamic_cast<Op<T>*>(neg));
+        _MAXPOOL2D<T> * pool = new _MAXPOOL2D<T>(out, input, P, arg);
+        out->setOP(dynamic_cast<Op<T>*>(pool));
         return out;
     }
+
     template <typename T>
-    Tensor<T> * ReLU(Tensor<T>* input) {
+    Tensor<T> * AVGPOOL2D(Tensor<T>* input, std::pair<int,int> kernel, std::pair<int,int> stride=std::make_pair(0,0), std::pair<int,int> padding=std::make_pair(0,0)) {
+        //input: (batch, channels, height, width) or another image format, padding counts as zeros
+        _Pool2d P = _pool_geometry(input, kernel, stride, padding);
+        Tensor<T> * out = _pool_output(input, P);
+        const T * x = input->getData();
+        T * y = out->getData();
+        size_t in_plane = (size_t)P.H * P.W * P.inner, out_plane = (size_t)P.OH * P.OW * P.inner;
+        parallel_for(0, input->getTotalElements() / in_plane, 1, [&](int lo, int hi){
+            for(int c=lo; c<hi; c++){
+                if(P.inner == 1) _avgpool_plane(x + c * in_plane, P, y + c * out_plane);
+                else _avgpool_pixels(x + c * in_plane, P, y + c * out_plane);
+            }
+        });
 
-        iterator<T> it = input->begin();
+        // Set up Out Tensor
+        _AVGPOOL2D<T> * pool = new _AVGPOOL2D<T>(out, input, P);
+        out->setOP(dynamic_cast<Op<T>*>(pool));
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * GLOBAL_MAXPOOL2D(Tensor<T>* input) {
+        //(batch, channels, height, width) -> (batch, channels, 1, 1), in the input's memory format
+        image_layout(input);
+        Tensor<T> * out = input->getFormat() == FORMAT_NHWC ? MAX(input, {1, 2}, true) : MAX(input, {2, 3}, true);
+        out->setFormat(input->getFormat());
+        return out;
+    }
+
+    template <typename T>
+    Tensor<T> * GLOBAL_AVGPOOL2D(Tensor<T>* input) {
+        //(batch, channels, height, width) -> (batch, channels, 1, 1), in the input's memory format
+        image_layout(input);
+        Tensor<T> * out = input->getFormat() == FORMAT_NHWC ? MEAN(input, {1, 2}, true) : MEAN(input, {2, 3}, true);
+        out->setFormat(input->getFormat());
+        return out;
+    }
 
-        //Add data
-        T  new_data[input->getTotalElements()];
-        for(int i=0; i<input->getTotalElements(); i++){
-            new_data[i] = std::max(0.0, (double)it.next());
+/***************************
+* NORMALIZATION OPERATIONS * 
+****************************/
+    template <typename T>
+    Tensor<T> * BATCHNORM(Tensor<T>* input, Tensor<T>* gamma, Tensor<T>* beta, Tensor<T>* running_mean, Tensor<T>* running_var,
+                          bool training, T momentum=0.1, T eps=1e-5) {
+        /*
+            input: (batch, C, ...) normalized per channel (dim 1),
+            gamma, beta, running_mean, running_var: (C).
+            Training uses the batch statistics and folds them into the running
+            ones (unbiased variance), which may then be NULL. Eval uses the running ones.
+        */
+        assert(input->getNDims() >= 2 && "BATCHNORM EXPECTS (BATCH, CHANNELS, ...)");
+        assert(input->getFormat() != FORMAT_NCHWC && "BATCHNORM OF BLOCKED CHANNELS, USE TO_FORMAT");
+        if(!input->is_contiguous()) input->as_contiguous();
+        //outer is an element count for channels last, where every pixel is an outer row of C channels
+        long outer = input->getDims()[0];
+        int C = input->getDims()[1];
+        if(input->getFormat() == FORMAT_NHWC){
+            C = input->getDims()[input->getNDims() - 1];
+            outer = input->getTotalElements() / std::max(1, C);
+        }
+        int inner = input->getTotalElements() / std::max(1L, outer * C);
+        assert(gamma->getTotalElements() == C && beta->getTotalElements() == C && "BATCHNORM PARAMETER SHAPE MISMATCH");
+        assert((training || (running_mean != NULL && running_var != NULL)) && "EVAL BATCHNORM NEEDS RUNNING STATISTICS");
+        const T * x = input->getData();
+        std::vector<T> mean(C), inv_std(C);
+
+        if(training){
+            //One Welford pass per channel, the contiguous (o, c) segments are merged in order
+            parallel_for(0, C, 1, [&](int lo, int hi){
+                for(int c=lo; c<hi; c++){
+                    _Moments<T> m;
+                    if(inner == 1) m = _welford(x + c, outer, C);
+                    else for(long o=0; o<outer; o++) m.merge(_welford(x + ((size_t)o * C + c) * inner, inner));
+                    mean[c] = m.mean;
+                    inv_std[c] = 1 / std::sqrt(m.variance() + eps);
+                    if(running_mean != NULL) running_mean->getData()[c] = (1 - momentum) * running_mean->getData()[c] + momentum * m.mean;
+                    if(running_var != NULL){
+                        T unbiased = m.count > 1 ? m.m2 / (m.count - 1) : m.variance();
+                        running_var->getData()[c] = (1 - momentum) * running_var->getData()[c] + momentum * unbiased;
+                    }
+                }
+            });
+        }
+        else {
+            for(int c=0; c<C; c++){
+                mean[c] = running_mean->getData()[c];
+                inv_std[c] = 1 / std::sqrt(running_var->getData()[c] + eps);
+            }
         }
-        Tensor<T> * out = new Tensor<T>(new_data, input->getNDims(), input->getDims());
+
+        //Normalize and apply the affine transform in one sweep: y = x * a + b
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), input->getDims());
+        out->setFormat(input->getFormat());
+        T * y = out->getData();
+        const T * w = gamma->getData();
+        const T * bias = beta->getData();
+        parallel_for(0, outer * C, std::max(1, (1 << 14) / std::max(1, inner)), [&](long lo, long hi){
+            for(long s=lo; s<hi; s++){
+                int c = s % C;
+                T a = w[c] * inv_std[c], b = bias[c] - mean[c] * a;
+                for(int i=0; i<inner; i++) y[(size_t)s * inner + i] = x[(size_t)s * inner + i] * a + b;
+            }
+        });
 
         // Set up Out Tensor
-        _ReLU<T> * rel = new _ReLU<T>(out, input);
-        out->setOP(dynamic_cast<Op<T>*>(rel));
+        _BATCHNORM<T> * bn = new _BATCHNORM<T>(out, input, gamma, beta, outer, C, inner, mean, inv_std, training);
+        out->setOP(dynamic_cast<Op<T>*>(bn));
         return out;
     }
 
     template <typename T>
-    Tensor<T> * EXP(Tensor<T>* input) {
+    Tensor<T> * LAYERNORM(Tensor<T>* input, Tensor<T>* gamma, Tensor<T>* beta, T eps=1e-5) {
+        /*
+            Normalizes over the trailing dims of input that hold
+            gamma->getTotalElements() (= beta's) elements
+        */
+        if(!input->is_contiguous()) input->as_contiguous();
+        int D = gamma->getTotalElements();
+        assert(beta->getTotalElements() == D && D > 0 && input->getTotalElements() % D == 0 && "LAYERNORM PARAMETER SHAPE MISMATCH");
+        int rows = input->getTotalElements() / D;
+        const T * x = input->getData();
+        const T * w = gamma->getData();
+        const T * bias = beta->getData();
+        std::vector<T> mean(rows), inv_std(rows);
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), input->getDims());
+        T * y = out->getData();
+
+        //Statistics (one Welford pass) and the affine sweep while the row is in cache
+        parallel_for(0, rows, std::max(1, (1 << 14) / D), [&](int lo, int hi){
+            for(int r=lo; r<hi; r++){
+                const T * xr = x + (size_t)r * D;
+                _Moments<T> m = _welford(xr, D);
+                mean[r] = m.mean;
+                inv_std[r] = 1 / std::sqrt(m.variance() + eps);
+                T * yr = y + (size_t)r * D;
+                for(int j=0; j<D; j++) yr[j] = (xr[j] - mean[r]) * inv_std[r] * w[j] + bias[j];
+            }
+        });
 
-        iterator<T> it = input->begin();
+        // Set up Out Tensor
+        _LAYERNORM<T> * ln = new _LAYERNORM<T>(out, input, gamma, beta, rows, D, mean, inv_std);
+        out->setOP(dynamic_cast<Op<T>*>(ln));
+        return out;
+    }
 
-        //Add data
-        T  new_data[input->getTotalElements()];
-        for(int i=0; i<input->getTotalElements(); i++){
-            new_data[i]  = std::exp(it.next());
+    template <typename T>
+    void fold_batchnorm(Tensor<T>* weight, Tensor<T>* bias, int out_axis, const Tensor<T>* gamma, const Tensor<T>* beta,
+                        const Tensor<T>* running_mean, const Tensor<T>* running_var, T eps=1e-5) {
+        /*
+            Folds an eval mode BATCHNORM that follows a layer into the layer's
+            weight and bias: channel c of the output (index c of weight along
+            out_axis) is scaled by gamma / sqrt(var + eps) and the bias becomes
+            (bias - mean) * scale + beta. After folding the layer alone computes
+            what the layer followed by the BATCHNORM did.
+            CONV kernels use out_axis 0, Linear weights (in, out) out_axis 1
+        */
+        if(out_axis < 0) out_axis += weight->getNDims();
+        if(!weight->is_contiguous()) weight->as_contiguous();
+        int C = weight->getDims()[out_axis];
+        assert(bias->getTotalElements() == C && gamma->getTotalElements() == C && "FOLD SHAPE MISMATCH");
+        int outer = 1, inner = 1;
+        for(int i=0; i<out_axis; i++) outer *= weight->getDims()[i];
+        for(int i=out_axis+1; i<weight->getNDims(); i++) inner *= weight->getDims()[i];
+        T * w = weight->getData();
+        T * b = bias->getData();
+        for(int c=0; c<C; c++){
+            T scale = gamma->getData()[c] / std::sqrt(running_var->getData()[c] + eps);
+            for(int o=0; o<outer; o++)
+                for(int i=0; i<inner; i++) w[((size_t)o * C + c) * inner + i] *= scale;
+            b[c] = (b[c] - running_mean->getData()[c]) * scale + beta->getData()[c];
         }
-        Tensor<T> * out = new Tensor<T>(new_data, input->getNDims(), input->getDims());
+    }
+
+/***************************
+*    SOFTMAX OPERATIONS    * 
+****************************/
+    template <typename T>
+    Tensor<T> * SOFTMAX(Tensor<T>* input, int axis=-1) {
+        int outer, n, inner;
+        _axis_split(input, axis, outer, n, inner);
+        acc_t<T> * lse = new acc_t<T>[(size_t)outer * inner];
+        _log_sum_exp(input->getData(), outer, n, inner, lse);
+
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), input->getDims());
+        const T * x = input->getData();
+        T * y = out->getData();
+        for(int o=0; o<outer; o++)
+            for(int k=0; k<n; k++)
+                for(int i=0; i<inner; i++){
+                    size_t j = ((size_t)o * n + k) * inner + i;
+                    y[j] = std::exp(x[j] - lse[(size_t)o * inner + i]);
+                }
+        delete [] lse;
 
         // Set up Out Tensor
-        _EXP<T> * exp = new _EXP<T>(out, input);
-        out->setOP(dynamic_cast<Op<T>*>(exp));
+        _SOFTMAX<T> * softmax = new _SOFTMAX<T>(out, input, axis);
+        out->setOP(dynamic_cast<Op<T>*>(softmax));
         return out;
     }
 
     template <typename T>
-    Tensor<T> * PAD(Tensor<T>* input, int padx=2, int pady=2, int pad_val = 0) {
-        assert(input->getNDims() >= 2);
+    Tensor<T> * LOG_SOFTMAX(Tensor<T>* input, int axis=-1) {
+        int outer, n, inner;
+        _axis_split(input, axis, outer, n, inner);
+        acc_t<T> * lse = new acc_t<T>[(size_t)outer * inner];
+        _log_sum_exp(input->getData(), outer, n, inner, lse);
+
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), input->getDims());
+        const T * x = input->getData();
+        T * y = out->getData();
+        for(int o=0; o<outer; o++)
+            for(int k=0; k<n; k++)
+                for(int i=0; i<inner; i++){
+                    size_t j = ((size_t)o * n + k) * inner + i;
+                    y[j] = x[j] - lse[(size_t)o * inner + i];
+                }
+        delete [] lse;
 
-        std::pair<int,int> pad = std::make_pair(padx, pady);
+        // Set up Out Tensor
+        _LOG_SOFTMAX<T> * log_softmax = new _LOG_SOFTMAX<T>(out, input, axis);
+        out->setOP(dynamic_cast<Op<T>*>(log_softmax));
+        return out;
+    }
 
-        //Get new shape
-        int dims[input->getNDims()];
-        copyElements(input->getNDims(), dims, input->getDims());
-        dims[input->getNDims()-2] += 2*pad.first;
-        dims[input->getNDims()-1] += 2*pad.second;
-        //Create out tensor
-        Tensor<T> * out = new Tensor<T>(input->getNDims(), dims);
-        out->setAll(pad_val);//0 pad
-        //Copy elements over
-        iterator<T> it = input->begin();
+    template <typename T>
+    Tensor<T> * CROSS_ENTROPY(Tensor<T>* input, Tensor<T>* target, int axis=-1) {
+        /*
+            Mean negative log likelihood of the classes in target
+            target holds one class index per row of input along axis,
+            in the order of input with axis removed.
+            Returns a tensor with a single element
+        */
+        int outer, n, inner;
+        _axis_split(input, axis, outer, n, inner);
+        assert(target->getTotalElements() == outer * inner && "TARGET SHAPE MISMATCH");
+
+        std::vector<acc_t<T>> lse((size_t)outer * inner);
+        _log_sum_exp(input->getData(), outer, n, inner, lse.data());
+
+        std::vector<int> targets((size_t)outer * inner);
+        iterator<T> it = target->begin();
+        const T * x = input->getData();
+        acc_t<T> loss = 0;
+        for(int o=0; o<outer; o++)
+            for(int i=0; i<inner; i++){
+                int c = (int)it.next();
+                assert(c >= 0 && c < n && "TARGET CLASS OUT OF RANGE");
+                targets[(size_t)o * inner + i] = c;
+                loss += lse[(size_t)o * inner + i] - x[((size_t)o * n + c) * inner + i];
+            }
 
-        int index[input->getNDims()];
-        for(int i=0; i<input->getTotalElements(); i++){
-            it.getCurr(index);
-            index[input->getNDims()-2] += pad.first;
-            index[input->getNDims()-1] += pad.second;
-            out->get(index) = it.next();
-        }
+        Tensor<T> * out = new Tensor<T>(1, 1);
+        out->getData()[0] = loss / (outer * inner);
 
         // Set up Out Tensor
-        _PAD<T> * pad_ = new _PAD<T>(out, input);
-        out->setOP(dynamic_cast<Op<T>*>(pad_));
+        _CROSS_ENTROPY<T> * cross_entropy = new _CROSS_ENTROPY<T>(out, input, axis, targets, lse);
+        out->setOP(dynamic_cast<Op<T>*>(cross_entropy));
         return out;
     }
+
+/***************************
+*      GRAPH UTILITIES     * 
+****************************/
+    template <typename T>
+    std::vector<Tensor<T>*> _topological_order(Tensor<T> * root) {
+        //Post order DFS over the parents, so every tensor
+        //appears after all of the tensors it was computed from
+        std::vector<Tensor<T>*> order;
+        std::set<Tensor<T>*> visited;
+        std::vector<std::pair<Tensor<T>*, bool>> stack;
+        stack.push_back(std::make_pair(root, false));
+        while(!stack.empty()){
+            std::pair<Tensor<T>*, bool> top = stack.back();
+            stack.pop_back();
+            if(top.second) {
+                order.push_back(top.first);
+                continue;
+            }
+            if(visited.count(top.first)) continue;
+            visited.insert(top.first);
+            stack.push_back(std::make_pair(top.first, true));
+            std::vector<Tensor<T>*> parents = top.first->getParents();
+            for(size_t i=0; i<parents.size(); i++)
+                if(!visited.count(parents[i])) stack.push_back(std::make_pair(parents[i], false));
+        }
+        return order;
+    }
+
+    template <typename T>
+    void backward(Tensor<T> * root, const std::function<void(Tensor<T>*)> & on_leaf_ready = nullptr) {
+        //Seeds dL/droot with ones and runs back() for every
+        //op in the graph in reverse topological order
+        //on_leaf_ready is called for each leaf as soon as its gradient is final
+        if(!root->is_grad_init()) return;
+        root->getGrad()->setAll(1);
+        std::vector<Tensor<T>*> order = _topological_order(root);
+
+        //Count how many ops still have to write into each leaf's gradient
+        std::map<Tensor<T>*, int> pending;
+        if(on_leaf_ready){
+            for(size_t i=0; i<order.size(); i++){
+                if(order[i]->getOp() == NULL) continue;
+                std::vector<Tensor<T>*> parents = order[i]->getParents();
+                for(size_t j=0; j<parents.size(); j++)
+                    if(parents[j]->getOp() == NULL) pending[parents[j]]++;
+            }
+        }
+
+        for(int i=order.size()-1; i>=0; i--){
+            if(order[i]->getOp() == NULL) continue;
+            if(order[i]->is_grad_init()) {
+                //Packed tensors (see pack_graph) are decoded for the op that reads them
+                //and freed again once their own op has run, nothing later needs them
+                std::vector<Tensor<T>*> parents = order[i]->getParents();
+                order[i]->unpack();
+                for(size_t j=0; j<parents.size(); j++) parents[j]->unpack();
+                order[i]->getOp()->back();
+            }
+            order[i]->drop_unpacked();
+            if(!on_leaf_ready) continue;
+            std::vector<Tensor<T>*> parents = order[i]->getParents();
+            for(size_t j=0; j<parents.size(); j++)
+                if(parents[j]->getOp() == NULL && --pending[parents[j]] == 0) on_leaf_ready(parents[j]);
+        }
+    }
+
+    /***************************************************************
+    * void pack_graph(Tensor<T> * root, SavedFormat format);
+    *
+    *   Description:
+    *       Packs root and every intermediate tensor it was computed
+    *       from in format (see Tensor::pack), leaves are left alone.
+    *       Call it once the forward pass no longer reads those tensors,
+    *       backward() decodes each of them just for the ops that use it.
+    *       The traversal stops at tensors that are already packed, so
+    *       packing a growing graph step by step costs O(new tensors).
+    *       Tensors that are not contiguous or share storage with a
+    *       view are kept as they are.
+    ***************************************************************/
+    template <typename T>
+    void pack_graph(Tensor<T> * root, SavedFormat format) {
+        if(format == SAVED_FULL) return;
+        std::vector<Tensor<T>*> stack(1, root);
+        std::set<Tensor<T>*> visited;
+        while(!stack.empty()){
+            Tensor<T> * t = stack.back();
+            stack.pop_back();
+            if(t->getOp() == NULL || t->is_packed() || visited.count(t)) continue;
+            visited.insert(t);
+            bool shared = !t->owns_data() || !t->is_contiguous();
+            std::vector<Tensor<T>*> children = t->getChildren();
+            for(size_t i=0; i<children.size(); i++) shared |= !children[i]->owns_data();
+            if(!shared) t->pack(format);
+            std::vector<Tensor<T>*> parents = t->getParents();
+            stack.insert(stack.end(), parents.begin(), parents.end());
+        }
+    }
+
+    template <typename T>
+    void release_graph(Tensor<T> * root) {
+        //Deletes root and every intermediate tensor it was computed from
+        //Leaves (tensors without an op) are kept but unlinked from the graph
+        std::vector<Tensor<T>*> order = _topological_order(root);
+        for(size_t i=0; i<order.size(); i++){
+            if(order[i]->getOp() != NULL) delete order[i];
+            else order[i]->clearGraph();
+        }
+    }
 }
 
 
 template <typename T>
-T convAt(Tensor<T> * X, Tensor<T> * K, std::pair<int,int> s, const int * AT){
-    assert(X->getNDims() == 4);
-    assert(K->getNDims() == 4);
-    //Allocate indexes
-
-    T accum = 0;
-    for(int l=0; l<X->getDims()[1]; l++){
-        for(int m=0; m<K->getDims()[2]; m++){
-            for(int n=0; n<K->getDims()[3]; n++){
-                int k_ind[] = {AT[1], l, m, n};
-                int x_ind[] = {AT[0], l, s.first*AT[2] +m, s.second*AT[3] + n};
-                accum += X->get(x_ind) * K->get(k_ind);
+T convAt(const FixedTensor<T, 4> & X, const FixedTensor<T, 4> & K, std::pair<int,int> s, const int * AT){
+    acc_t<T> accum = 0;
+    for(int l=0; l<X.dim(1); l++){
+        for(int m=0; m<K.dim(2); m++){
+            for(int n=0; n<K.dim(3); n++){
+                accum += X(AT[0], l, s.first*AT[2] + m, s.second*AT[3] + n) * K(AT[1], l, m, n);
             }
         }
     }
@@ -751,15 +2946,17 @@ Tensor<T> * conv(Tensor<T> * X, Tensor<T> * K, std::pair<int,int> s){
     assert(X->getNDims() == 4);
     assert(K->getNDims() == 4);
     //Calculate out shape
-    int height = (X->getDims()[2] - K->getDims()[2] + 1)/s.first;
-    int width = (X->getDims()[3] - K->getDims()[3] + 1)/s.second;
+    int height = (X->getDims()[2] - K->getDims()[2])/s.first + 1;
+    int width = (X->getDims()[3] - K->getDims()[3])/s.second + 1;
     Tensor<T>* out = new Tensor<T>(4, X->getDims()[0], K->getDims()[0], height, width);
-    for(int b=0; b<out->getDims()[0]; b++){
-        for(int i=0; i<out->getDims()[1]; i++){
-            for(int j=0; j<out->getDims()[2]; j++){
-                for(int k=0; k<out->getDims()[3]; k++){
-                    int index[] = {b, i, j, k};
-                    out->get(index) = convAt(X, K, s, index);
+    //Rank 4 views: indexing is four multiply-adds instead of a loop over the dims
+    FixedTensor<T, 4> x(X), k(K), y(out);
+    for(int b=0; b<y.dim(0); b++){
+        for(int i=0; i<y.dim(1); i++){
+            for(int j=0; j<y.dim(2); j++){
+                for(int w=0; w<y.dim(3); w++){
+                    int index[] = {b, i, j, w};
+                    y(b, i, j, w) = convAt(x, k, s, index);
                 }
             }
         }
@@ -767,5 +2964,34 @@ Tensor<T> * conv(Tensor<T> * X, Tensor<T> * K, std::pair<int,int> s){
     return out;
 }
 
+namespace OPS{
+    template <typename T>
+    Tensor<T> * CONV(Tensor<T> * X, Tensor<T> * K, std::pair<int,int> s=std::make_pair(1,1)){
+        //Tracked version of conv, X: (batch, in channels, height, width)
+        //K: (out channels, in channels, kernel height, kernel width)
+        //X in another memory format gives an output in that format (same block)
+        Tensor<T> * out;
+        if(X->getFormat() == FORMAT_NCHW){
+            assert(X->getDims()[1] == K->getDims()[1]);
+            out = conv(X, K, s);
+        }
+        else {
+            ImageLayout in = image_layout(X);
+            assert(K->getNDims() == 4 && in.C == K->getDims()[1]);
+            if(!K->is_contiguous()) K->as_contiguous();
+            int kh = K->getDims()[2], kw = K->getDims()[3];
+            ImageLayout L = image_layout(X->getFormat(), in.N, K->getDims()[0], (in.H - kh) / s.first + 1, (in.W - kw) / s.second + 1, in.inner);
+            int dims[5];
+            out = new Tensor<T>(format_dims(X->getFormat(), L, dims), dims);
+            out->setFormat(X->getFormat());
+            conv_channels_inner((const T *)X->getData(), in, (const T *)K->getData(), kh, kw, s, out->getData(), L);
+        }
+
+        // Set up Out Tensor
+        _CONV<T> * conv_ = new _CONV<T>(out, X, K, s);
+        out->setOP(dynamic_cast<Op<T>*>(conv_));
+        return out;
+    }
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,175 @@
+#ifndef OPTIM_H_
+#define OPTIM_H_
+
+#include <cmath>
+#include <cassert>
+#include <vector>
+
+#include "module.h"
+
+/*
+    Optimizers update a ParameterBuffer in place.
+    Since every parameter lives in the flat buffer a step
+    is a single loop over contiguous memory.
+    Parameters with a sparse gradient (add_sparse) are updated
+    lazily: only the rows present in the gradient are touched,
+    optimizer state of the other rows is left as it is.
+*/
+template <typename T>
+class Optimizer {
+    public:
+        Optimizer(ParameterBuffer<T> * params): params(params) {}
+        virtual ~Optimizer() {}
+
+        /***************************************************************
+        * void step();
+        *
+        *   Description:
+        *       Applies one update to every parameter using
+        *       the gradients currently stored in the buffer
+        ***************************************************************/
+        virtual void step() = 0;
+
+        /***************************************************************
+        * void add_sparse(Tensor<T> * param);
+        *
+        *   Description:
+        *       also updates param (a tensor with a sparse gradient,
+        *       see Module::sparse_parameters) on every step
+        ***************************************************************/
+        void add_sparse(Tensor<T> * param) {
+            assert(param->has_sparse_grad() && "PARAMETER HAS NO SPARSE GRADIENT");
+            sparse.push_back(param);
+        }
+
+        /***************************************************************
+        * void zero_grad();
+        *
+        *   Description:
+        *       sets every gradient to 0
+        ***************************************************************/
+        void zero_grad() {
+            params->zero_grad();
+            for(size_t k=0; k<sparse.size(); k++) sparse[k]->getSparseGrad()->clear();
+        }
+
+    protected:
+        ParameterBuffer<T> * params;
+        std::vector<Tensor<T>*> sparse;
+};
+/*###############################################################################################################*/
+template <typename T>
+class SGD: public Optimizer<T> {
+    public:
+        SGD(ParameterBuffer<T> * params, T lr, T momentum=0)
+            : Optimizer<T>(params), lr(lr), momentum(momentum) {
+            velocity = _aligned_new<T>(params->size());
+        }
+        ~SGD() {
+            std::free(velocity);
+            for(size_t k=0; k<sparse_velocity.size(); k++) std::free(sparse_velocity[k]);
+        }
+
+        void step() {
+            T * w = this->params->getData();
+            const T * g = this->params->getGrad();
+            for(long i=0; i<this->params->size(); i++){
+                velocity[i] = momentum * velocity[i] + g[i];
+                w[i] -= lr * velocity[i];
+            }
+            for(size_t k=0; k<this->sparse.size(); k++) sparse_step(k);
+        }
+
+    private:
+        void sparse_step(size_t k) {
+            //Plain SGD keeps no state for the table
+            Tensor<T> * param = this->sparse[k];
+            if(momentum != 0 && sparse_velocity.size() <= k) sparse_velocity.push_back(_aligned_new<T>(param->getTotalElements()));
+            const SparseGrad<T> * grad = param->getSparseGrad();
+            int row_els = grad->rowSize();
+            for(int r=0; r<grad->size(); r++){
+                size_t base = (size_t)grad->getRows()[r] * row_els;
+                T * w = param->getData() + base;
+                const T * g = grad->getValues() + (size_t)r * row_els;
+                if(momentum == 0){
+                    for(int i=0; i<row_els; i++) w[i] -= lr * g[i];
+                    continue;
+                }
+                T * v = sparse_velocity[k] + base;
+                for(int i=0; i<row_els; i++){
+                    v[i] = momentum * v[i] + g[i];
+                    w[i] -= lr * v[i];
+                }
+            }
+        }
+
+        T lr;
+        T momentum;
+        T * velocity;
+        std::vector<T*> sparse_velocity;
+};
+/*###############################################################################################################*/
+template <typename T>
+class Adam: public Optimizer<T> {
+    public:
+        Adam(ParameterBuffer<T> * params, T lr=0.001, T beta1=0.9, T beta2=0.999, T eps=1e-8)
+            : Optimizer<T>(params), lr(lr), beta1(beta1), beta2(beta2), eps(eps) {
+            m = _aligned_new<T>(params->size());
+            v = _aligned_new<T>(params->size());
+        }
+        ~Adam() {
+            std::free(m);
+            std::free(v);
+            for(size_t k=0; k<sparse_m.size(); k++) { std::free(sparse_m[k]); std::free(sparse_v[k]); }
+        }
+
+        void step() {
+            t++;
+            T * w = this->params->getData();
+            const T * g = this->params->getGrad();
+            //Fold the bias corrections into the step size
+            T step_size = lr * std::sqrt(1 - std::pow(beta2, t)) / (1 - std::pow(beta1, t));
+            for(long i=0; i<this->params->size(); i++){
+                m[i] = beta1 * m[i] + (1 - beta1) * g[i];
+                v[i] = beta2 * v[i] + (1 - beta2) * g[i] * g[i];
+                w[i] -= step_size * m[i] / (std::sqrt(v[i]) + eps);
+            }
+            for(size_t k=0; k<this->sparse.size(); k++) sparse_step(k, step_size);
+        }
+
+    private:
+        void sparse_step(size_t k, T step_size) {
+            //Moments of rows without a gradient are not decayed
+            Tensor<T> * param = this->sparse[k];
+            if(sparse_m.size() <= k){
+                sparse_m.push_back(_aligned_new<T>(param->getTotalElements()));
+                sparse_v.push_back(_aligned_new<T>(param->getTotalElements()));
+            }
+            const SparseGrad<T> * grad = param->getSparseGrad();
+            int row_els = grad->rowSize();
+            for(int r=0; r<grad->size(); r++){
+                size_t base = (size_t)grad->getRows()[r] * row_els;
+                T * w = param->getData() + base;
+                T * mk = sparse_m[k] + base;
+                T * vk = sparse_v[k] + base;
+                const T * g = grad->getValues() + (size_t)r * row_els;
+                for(int i=0; i<row_els; i++){
+                    mk[i] = beta1 * mk[i] + (1 - beta1) * g[i];
+                    vk[i] = beta2 * vk[i] + (1 - beta2) * g[i] * g[i];
+                    w[i] -= step_size * mk[i] / (std::sqrt(vk[i]) + eps);
+                }
+            }
+        }
+
+        T lr;
+        T beta1;
+        T beta2;
+        T eps;
+        int t = 0;
+        T * m;
+        T * v;
+        std::vector<T*> sparse_m;
+        std::vector<T*> sparse_v;
+};
+
+#endif
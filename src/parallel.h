@@ -0,0 +1,231 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <vector>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "tensor.h"
+#include "ops.h"
+#include "module.h"
+#include "threadpool.h"
+
+/*###############################################################################################################*/
+/*                                              DATA PARALLEL                                                    */
+/*###############################################################################################################*/
+template <typename T>
+class DataParallel {
+/*
+    Data parallel training inside one process.
+    The batch is split into a fixed number of shards, each with its own
+    model replica (and flat gradient buffer). Shards run forward/backward
+    on the pool; the flat gradients are cut into buckets and a bucket is
+    reduced into the master model as soon as every shard has finished
+    writing it, overlapping the reduction with the remaining backward work.
+    Buckets always sum the shards in shard order, so the result is
+    identical for any number of threads.
+*/
+    public:
+        typedef std::function<Module<T>*()> Factory;
+        typedef std::function<Tensor<T>*(Module<T>&, Tensor<T>*, Tensor<T>*)> Loss;
+
+        DataParallel(const Factory & factory, int n_shards, int n_threads=0, int bucket_els=1<<15);
+        ~DataParallel();
+
+        DataParallel(const DataParallel<T>&) = delete;
+        DataParallel<T> & operator=(const DataParallel<T>&) = delete;
+
+        /***************************************************************
+        * T step(Tensor<T> * input, Tensor<T> * target, const Loss & loss);
+        *
+        *   Description:
+        *       Splits input and target along the first dimension,
+        *       runs loss(replica, input shard, target shard) and its
+        *       backward on every shard and leaves the batch gradient
+        *       (the row weighted mean of the shard gradients) in the
+        *       master model's flat buffer. target may be NULL.
+        *       The elements of the tensor returned by loss must sum
+        *       to the mean loss over the rows of its shard.
+        *
+        *   Returns:
+        *       the mean loss over the batch
+        ***************************************************************/
+        T step(Tensor<T> * input, Tensor<T> * target, const Loss & loss);
+
+        /***************************************************************
+        * void sync();
+        *
+        *   Description:
+        *       copies the master parameters to every replica,
+        *       call it after each optimizer step on the master
+        ***************************************************************/
+        void sync();
+
+        /***************************************************************
+        * Module<T> & model() { return *master; }
+        *
+        *   Returns:
+        *       the master model, the optimizer should update model().flat()
+        ***************************************************************/
+        Module<T> & model() { return *master; }
+
+    private:
+        Tensor<T> * shard(Tensor<T> * batch, int row, int rows);
+        void shard_ready(int bucket, const std::vector<T> & weights);
+        void reduce(int bucket, const std::vector<T> & weights);
+
+        Module<T> * master;
+        std::vector<Module<T>*> replicas;
+        std::vector<std::map<Tensor<T>*, int>> param_index;
+        std::vector<int> param_bucket;
+        std::vector<long> bucket_begin;
+        int n_shards;
+        ThreadPool pool;
+
+        std::vector<std::vector<int>> pending;  //[shard][bucket] params not yet final
+        std::vector<int> shards_done;           //[bucket] shards whose gradient is final
+        std::mutex lock;
+};
+/*###############################################################################################################*/
+template <typename T>
+DataParallel<T>::DataParallel(const Factory & factory, int n_shards, int n_threads, int bucket_els)
+    : n_shards(n_shards), pool(n_threads > 0 ? n_threads : std::thread::hardware_concurrency()) {
+    master = factory();
+    ParameterBuffer<T> * flat = master->flat();
+
+    //Buckets are runs of whole parameters, cut once they reach bucket_els
+    const std::vector<long> & offsets = flat->getOffsets();
+    for(size_t p=0; p<offsets.size(); p++){
+        if(bucket_begin.empty() || offsets[p] - bucket_begin.back() >= bucket_els)
+            bucket_begin.push_back(offsets[p]);
+        param_bucket.push_back(bucket_begin.size() - 1);
+    }
+    bucket_begin.push_back(flat->size());
+
+    for(int s=0; s<n_shards; s++){
+        replicas.push_back(factory());
+        std::vector<Tensor<T>*> params = replicas[s]->parameters();
+        assert(params.size() == offsets.size() && "REPLICAS MUST HAVE THE SAME PARAMETERS");
+        std::map<Tensor<T>*, int> index;
+        for(size_t p=0; p<params.size(); p++) index[params[p]] = p;
+        param_index.push_back(index);
+    }
+    pending.resize(n_shards);
+    sync();
+}
+/*###############################################################################################################*/
+template <typename T>
+DataParallel<T>::~DataParallel() {
+    for(int s=0; s<n_shards; s++) delete replicas[s];
+    delete master;
+}
+/*###############################################################################################################*/
+template <typename T>
+void DataParallel<T>::sync() {
+    ParameterBuffer<T> * flat = master->flat();
+    for(int s=0; s<n_shards; s++)
+        std::memcpy(replicas[s]->flat()->getData(), flat->getData(), sizeof(T) * flat->size());
+}
+/*###############################################################################################################*/
+template <typename T>
+Tensor<T> * DataParallel<T>::shard(Tensor<T> * batch, int row, int rows) {
+    int dims[batch->getNDims()];
+    copyElements(batch->getNDims(), dims, batch->getDims());
+    dims[0] = rows;
+    long row_els = batch->getTotalElements() / batch->getDims()[0];
+    //A view, the rows are read in place
+    return new Tensor<T>(batch, row * row_els, batch->getNDims(), dims);
+}
+/*###############################################################################################################*/
+template <typename T>
+void DataParallel<T>::reduce(int bucket, const std::vector<T> & weights) {
+    //Fixed shard order keeps the sum identical for any thread count
+    T * out = master->flat()->getGrad();
+    long lo = bucket_begin[bucket], hi = bucket_begin[bucket+1];
+    const T * g = replicas[0]->flat()->getGrad();
+    for(long i=lo; i<hi; i++) out[i] = weights[0] * g[i];
+    for(int s=1; s<n_shards; s++){
+        g = replicas[s]->flat()->getGrad();
+        for(long i=lo; i<hi; i++) out[i] += weights[s] * g[i];
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
+void DataParallel<T>::shard_ready(int bucket, const std::vector<T> & weights) {
+    bool last;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        last = ++shards_done[bucket] == n_shards;
+    }
+    //The shard completing a bucket reduces it while the others keep going
+    if(last) reduce(bucket, weights);
+}
+/*###############################################################################################################*/
+template <typename T>
+T DataParallel<T>::step(Tensor<T> * input, Tensor<T> * target, const Loss & loss) {
+    int batch = input->getDims()[0];
+    assert(batch >= n_shards && "BATCH SMALLER THAN THE NUMBER OF SHARDS");
+    assert(target == NULL || target->getDims()[0] == batch);
+
+    //Shard s covers rows [begin[s], begin[s+1]) and is weighted by its share of the batch
+    std::vector<int> begin;
+    std::vector<T> weights;
+    for(int s=0; s<=n_shards; s++) begin.push_back((long)batch * s / n_shards);
+    for(int s=0; s<n_shards; s++) weights.push_back((T)(begin[s+1] - begin[s]) / batch);
+
+    int n_buckets = bucket_begin.size() - 1;
+    shards_done.assign(n_buckets, 0);
+    for(int s=0; s<n_shards; s++){
+        pending[s].assign(n_buckets, 0);
+        for(size_t p=0; p<param_bucket.size(); p++) pending[s][param_bucket[p]]++;
+    }
+    std::vector<T> losses(n_shards);
+
+    //The shards read the batch concurrently so it must not be rearranged inside the tasks
+    if(!input->is_contiguous()) input->as_contiguous();
+    if(target != NULL && !target->is_contiguous()) target->as_contiguous();
+
+    pool.run(n_shards, [&](int s){
+        Module<T> * replica = replicas[s];
+        replica->zero_grad();
+        Tensor<T> * x = shard(input, begin[s], begin[s+1] - begin[s]);
+        Tensor<T> * y = target == NULL ? NULL : shard(target, begin[s], begin[s+1] - begin[s]);
+
+        Tensor<T> * out = loss(*replica, x, y);
+        iterator<T> it = out->begin();
+        losses[s] = 0;
+        for(long i=0; i<out->getTotalElements(); i++) losses[s] += it.next();
+
+        //Hand finished buckets to the reduction while backward continues
+        std::vector<bool> ready(param_bucket.size(), false);
+        auto leaf_ready = [&](Tensor<T> * leaf){
+            typename std::map<Tensor<T>*, int>::const_iterator it = param_index[s].find(leaf);
+            if(it == param_index[s].end() || ready[it->second]) return;
+            ready[it->second] = true;
+            int b = param_bucket[it->second];
+            if(--pending[s][b] == 0) shard_ready(b, weights);
+        };
+        OPS::backward(out, std::function<void(Tensor<T>*)>(leaf_ready));
+
+        //Parameters the graph never touched have a final (zero) gradient too
+        std::vector<Tensor<T>*> params = replica->parameters();
+        for(size_t p=0; p<params.size(); p++) leaf_ready(params[p]);
+
+        OPS::release_graph(out);
+        delete x;
+        if(y != NULL) delete y;
+    });
+
+    T total = 0;
+    for(int s=0; s<n_shards; s++) total += weights[s] * losses[s];
+    return total;
+}
+
+#endif
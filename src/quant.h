@@ -0,0 +1,650 @@
+#ifndef QUANT_H_
+#define QUANT_H_
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "tensor.h"
+#include "ops.h"
+#include "module.h"
+#include "threadpool.h"
+
+/*
+    Int8 inference path. A quantized value q stands for scale * (q - zero):
+        - activations are uint8 with one (scale, zero) per tensor, the
+          range comes from an Observer run over calibration batches
+        - weights are int8 symmetric (zero 0, [-127, 127]) with one scale
+          per output channel or one for the whole tensor
+    qgemm multiplies uint8 rows by a packed int8 weight into int32 sums
+    and applies the epilogue while the sums are still in registers: zero
+    point correction, scales, bias, optional ReLU, then float output or
+    requantization to uint8 for the next quantized layer.
+    The int32 sums use AVX512-VNNI / AVX-VNNI (vpdpbusd) when available,
+    otherwise AVX2 widens both operands to int16 and uses vpmaddwd
+    (vpmaddubsw would saturate its int16 pair sums on 8 bit weights).
+*/
+
+/***************************************************************
+* QParams choose_qparams(float lo, float hi);
+*
+*   Returns:
+*       uint8 parameters covering [lo, hi], the range is widened
+*       to contain 0 so that 0 (padding, ReLU) is exact
+***************************************************************/
+struct QParams {
+    float scale = 1;
+    int zero = 0;
+};
+
+inline QParams choose_qparams(float lo, float hi) {
+    lo = std::min(lo, 0.0f);
+    hi = std::max(hi, 0.0f);
+    QParams q;
+    if(hi - lo <= 0) return q;
+    q.scale = (hi - lo) / 255;
+    q.zero = std::min(255, std::max(0, (int)std::lrint(-lo / q.scale)));
+    return q;
+}
+
+/***************************************************************
+* void quantize_u8(const T * x, long n, QParams q, uint8_t * out);
+* void dequantize_u8(const uint8_t * x, long n, QParams q, T * out);
+*
+*   Description:
+*       out = clamp(round(x / scale) + zero, 0, 255) and its inverse
+***************************************************************/
+template <typename T>
+inline long _quantize_u8_fast(const T *, long i, long, float, int, uint8_t *) { return i; }
+
+#if defined(__AVX2__)
+inline long _quantize_u8_fast(const float * x, long i, long n, float inv, int zero, uint8_t * out) {
+    __m256 s = _mm256_set1_ps(inv);
+    __m256i z = _mm256_set1_epi32(zero);
+    for(; i+8<=n; i+=8){
+        //cvtps rounds to nearest even, the two packs saturate to [0, 255]
+        __m256i v = _mm256_add_epi32(_mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(x + i), s)), z);
+        __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(w, w));
+    }
+    return i;
+}
+#endif
+
+template <typename T>
+void quantize_u8(const T * x, long n, QParams q, uint8_t * out) {
+    float inv = 1 / q.scale;
+    long i = _quantize_u8_fast(x, 0, n, inv, q.zero, out);
+    for(; i<n; i++) out[i] = (uint8_t)std::min(255L, std::max(0L, std::lrint((float)x[i] * inv) + q.zero));
+}
+
+template <typename T>
+void dequantize_u8(const uint8_t * x, long n, QParams q, T * out) {
+    for(long i=0; i<n; i++) out[i] = (T)(q.scale * (x[i] - q.zero));
+}
+
+/*###############################################################################################################*/
+/*                                                CALIBRATION                                                    */
+/*###############################################################################################################*/
+class Observer {
+/*
+    Range of the values seen over calibration batches.
+    With percentile 100 the range is the overall min/max, below 100
+    every batch contributes its (100 - percentile) and percentile
+    values and the range is their mean over the batches, so rare
+    outliers do not stretch the scale.
+*/
+    public:
+        Observer(double percentile=100): percentile(percentile) {
+            assert(percentile > 50 && percentile <= 100 && "PERCENTILE MUST BE IN (50, 100]");
+        }
+
+        /***************************************************************
+        * void observe(const Tensor<T> * x);
+        * void observe(const T * x, long n);
+        *
+        *   Description:
+        *       adds one batch to the statistics
+        ***************************************************************/
+        template <typename T>
+        void observe(const Tensor<T> * x) {
+            assert(x->is_contiguous() && "CAN ONLY OBSERVE A CONTIGUOUS TENSOR");
+            observe(x->getData(), x->getTotalElements());
+        }
+
+        template <typename T>
+        void observe(const T * x, long n) {
+            if(n == 0) return;
+            float l, h;
+            if(percentile == 100){
+                l = h = (float)x[0];
+                for(long i=1; i<n; i++){
+                    l = std::min(l, (float)x[i]);
+                    h = std::max(h, (float)x[i]);
+                }
+            }
+            else {
+                std::vector<float> v(x, x + n);
+                long k_lo = (long)std::floor((100 - percentile) / 100 * (n - 1));
+                long k_hi = (long)std::ceil(percentile / 100 * (n - 1));
+                std::nth_element(v.begin(), v.begin() + k_lo, v.end());
+                l = v[k_lo];
+                std::nth_element(v.begin(), v.begin() + k_hi, v.end());
+                h = v[k_hi];
+            }
+            lo = batches == 0 ? l : std::min(lo, l);
+            hi = batches == 0 ? h : std::max(hi, h);
+            sum_lo += l;
+            sum_hi += h;
+            batches++;
+        }
+
+        /***************************************************************
+        * QParams qparams() const;
+        *
+        *   Returns:
+        *       uint8 parameters for the observed range
+        ***************************************************************/
+        QParams qparams() const {
+            assert(batches > 0 && "OBSERVER HAS NOT SEEN ANY DATA");
+            if(percentile == 100) return choose_qparams(lo, hi);
+            return choose_qparams(sum_lo / batches, sum_hi / batches);
+        }
+
+        float min() const { return lo; }
+        float max() const { return hi; }
+        int size() const { return batches; }
+
+    private:
+        double percentile;
+        float lo = 0;
+        float hi = 0;
+        double sum_lo = 0;
+        double sum_hi = 0;
+        int batches = 0;
+};
+
+/*###############################################################################################################*/
+/*                                             QUANTIZED TENSORS                                                 */
+/*###############################################################################################################*/
+class QTensor {
+/*
+    uint8 activations with one QParams, row major with the dims
+    of the real tensor they stand for
+*/
+    public:
+        QTensor() {}
+        QTensor(const std::vector<int> & dims, QParams params): dims(dims), q(params) {
+            long n = 1;
+            for(size_t i=0; i<dims.size(); i++) n *= dims[i];
+            data.resize(n);
+        }
+
+        template <typename T>
+        QTensor(const Tensor<T> * x, QParams params): QTensor(std::vector<int>(x->getDims(), x->getDims() + x->getNDims()), params) {
+            assert(x->is_contiguous() && "CAN ONLY QUANTIZE A CONTIGUOUS TENSOR");
+            quantize_u8(x->getData(), data.size(), q, data.data());
+        }
+
+        /***************************************************************
+        * Tensor<T> * dequantize() const;
+        *
+        *   Returns:
+        *       a new tensor with the real values
+        ***************************************************************/
+        template <typename T>
+        Tensor<T> * dequantize() const {
+            Tensor<T> * out = new Tensor<T>(dims.size(), dims.data());
+            dequantize_u8(data.data(), data.size(), q, out->getData());
+            return out;
+        }
+
+        uint8_t * getData() { return data.data(); }
+        const uint8_t * getData() const { return data.data(); }
+        const std::vector<int> & getDims() const { return dims; }
+        int getNDims() const { return dims.size(); }
+        long getTotalElements() const { return data.size(); }
+        QParams params() const { return q; }
+
+    private:
+        std::vector<int> dims;
+        std::vector<uint8_t> data;
+        QParams q;
+};
+/*###############################################################################################################*/
+//Columns per packed block and k values per group
+const int QGEMM_NB = 8;
+const int QGEMM_KG = 4;
+//Rows of A handed to one task
+const int QGEMM_ROWS = 64;
+
+class QWeight {
+/*
+    The int8 (K, N) right operand of qgemm, packed: columns in blocks
+    of 8 and, within a block, groups of 4 consecutive k for each column
+    (32 bytes per group, one vpdpbusd). K is padded to a multiple of 4
+    and N to a multiple of 8 with zeros.
+    Element (k, n) of the real weight is read at w[k * sk + n * sn], so
+    Linear weights (in, out) and CONV kernels (out, in, kh, kw) are
+    packed as they are.
+*/
+    public:
+        QWeight() {}
+
+        template <typename T>
+        QWeight(const T * w, int K, int N, long sk, long sn, bool per_channel=true);
+
+        /***************************************************************
+        * Tensor<T> * dequantize() const;
+        *
+        *   Returns:
+        *       a new (K, N) tensor with the real values of the weight
+        ***************************************************************/
+        template <typename T>
+        Tensor<T> * dequantize() const;
+
+        int rows() const { return K; }
+        int cols() const { return N; }
+        //Padded K, the length rows of A must have
+        int depth() const { return K4; }
+        const int8_t * panel(int block) const { return data.data() + (size_t)block * K4 * QGEMM_NB; }
+        float scale(int n) const { return scales[n]; }
+        int32_t colsum(int n) const { return sums[n]; }
+        size_t bytes() const { return data.size() + (scales.size() + sums.size()) * 4; }
+
+    private:
+        int K = 0;
+        int N = 0;
+        int K4 = 0;
+        int N8 = 0;
+        std::vector<int8_t> data;
+        std::vector<float> scales;      //N8, 0 for the padding
+        std::vector<int32_t> sums;      //sum over k of column n, for the zero point of A
+};
+
+template <typename T>
+QWeight::QWeight(const T * w, int K, int N, long sk, long sn, bool per_channel)
+    : K(K), N(N), K4((K + QGEMM_KG - 1) / QGEMM_KG * QGEMM_KG), N8((N + QGEMM_NB - 1) / QGEMM_NB * QGEMM_NB) {
+    data.assign((size_t)K4 * N8, 0);
+    scales.assign(N8, 0);
+    sums.assign(N8, 0);
+    for(int n=0; n<N; n++){
+        float absmax = 0;
+        for(int k=0; k<K; k++) absmax = std::max(absmax, std::fabs((float)w[k * sk + n * sn]));
+        scales[n] = absmax / 127;
+    }
+    if(!per_channel){
+        float absmax = *std::max_element(scales.begin(), scales.end());
+        std::fill(scales.begin(), scales.begin() + N, absmax);
+    }
+    for(int n=0; n<N; n++){
+        float inv = scales[n] > 0 ? 1 / scales[n] : 0;
+        int8_t * block = data.data() + (size_t)(n / QGEMM_NB) * K4 * QGEMM_NB;
+        for(int k=0; k<K; k++){
+            int8_t v = (int8_t)std::lrint((float)w[k * sk + n * sn] * inv);
+            block[((k / QGEMM_KG) * QGEMM_NB + n % QGEMM_NB) * QGEMM_KG + k % QGEMM_KG] = v;
+            sums[n] += v;
+        }
+    }
+}
+
+template <typename T>
+Tensor<T> * QWeight::dequantize() const {
+    Tensor<T> * out = new Tensor<T>(2, K, N);
+    for(int k=0; k<K; k++)
+        for(int n=0; n<N; n++){
+            int8_t v = panel(n / QGEMM_NB)[((k / QGEMM_KG) * QGEMM_NB + n % QGEMM_NB) * QGEMM_KG + k % QGEMM_KG];
+            out->getData()[(size_t)k * N + n] = (T)(scales[n] * v);
+        }
+    return out;
+}
+
+/*###############################################################################################################*/
+/*                                                   QGEMM                                                       */
+/*###############################################################################################################*/
+struct QEpilogue {
+/*
+    What qgemm does with the int32 sum of row m and column n:
+        y = a.scale * w.scale(n) * (sum - a.zero * w.colsum(n)) + bias[n]
+        y = max(y, 0) if relu
+    then writes y to out_f, or round(y / out.scale) + out.zero clamped
+    to [0, 255] to out_q, at element m * rs + n * cs
+*/
+    const float * bias = NULL;
+    bool relu = false;
+    float * out_f = NULL;
+    uint8_t * out_q = NULL;
+    QParams out;
+    long rs = 0;
+    long cs = 1;
+};
+
+inline int32_t _load4(const uint8_t * p) { int32_t v; std::memcpy(&v, p, 4); return v; }
+
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+inline __m256i _qdot(__m256i acc, __m256i a, __m256i b) { return _mm256_dpbusd_epi32(acc, a, b); }
+#elif defined(__AVXVNNI__)
+inline __m256i _qdot(__m256i acc, __m256i a, __m256i b) { return _mm256_dpbusd_avx_epi32(acc, a, b); }
+#endif
+
+//int32 sums of the 4 rows a[r] (depth bytes each) with one packed column block
+inline void _qtile(const uint8_t * const a[4], const int8_t * b, int depth, int32_t acc[4][QGEMM_NB]) {
+#if defined(__AVX2__)
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+    //The 4 rows are spelled out so the sums stay in registers
+    __m256i c0 = _mm256_setzero_si256(), c1 = c0, c2 = c0, c3 = c0;
+    for(int k=0; k<depth; k+=QGEMM_KG, b+=QGEMM_KG * QGEMM_NB){
+        __m256i w = _mm256_loadu_si256((const __m256i*)b);
+        c0 = _qdot(c0, _mm256_set1_epi32(_load4(a[0] + k)), w);
+        c1 = _qdot(c1, _mm256_set1_epi32(_load4(a[1] + k)), w);
+        c2 = _qdot(c2, _mm256_set1_epi32(_load4(a[2] + k)), w);
+        c3 = _qdot(c3, _mm256_set1_epi32(_load4(a[3] + k)), w);
+    }
+    _mm256_storeu_si256((__m256i*)acc[0], c0);
+    _mm256_storeu_si256((__m256i*)acc[1], c1);
+    _mm256_storeu_si256((__m256i*)acc[2], c2);
+    _mm256_storeu_si256((__m256i*)acc[3], c3);
+#else
+    //Columns 0-3 and 4-7 widened to int16, each 32 bit lane of l/h holds
+    //half the sum of one column, the halves are added once at the end
+    __m256i l0 = _mm256_setzero_si256(), l1 = l0, l2 = l0, l3 = l0, h0 = l0, h1 = l0, h2 = l0, h3 = l0;
+    for(int k=0; k<depth; k+=QGEMM_KG, b+=QGEMM_KG * QGEMM_NB){
+        __m256i w = _mm256_loadu_si256((const __m256i*)b);
+        __m256i wl = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(w));
+        __m256i wh = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(w, 1));
+        __m256i x0 = _mm256_cvtepu8_epi16(_mm_set1_epi32(_load4(a[0] + k)));
+        __m256i x1 = _mm256_cvtepu8_epi16(_mm_set1_epi32(_load4(a[1] + k)));
+        __m256i x2 = _mm256_cvtepu8_epi16(_mm_set1_epi32(_load4(a[2] + k)));
+        __m256i x3 = _mm256_cvtepu8_epi16(_mm_set1_epi32(_load4(a[3] + k)));
+        l0 = _mm256_add_epi32(l0, _mm256_madd_epi16(x0, wl)); h0 = _mm256_add_epi32(h0, _mm256_madd_epi16(x0, wh));
+        l1 = _mm256_add_epi32(l1, _mm256_madd_epi16(x1, wl)); h1 = _mm256_add_epi32(h1, _mm256_madd_epi16(x1, wh));
+        l2 = _mm256_add_epi32(l2, _mm256_madd_epi16(x2, wl)); h2 = _mm256_add_epi32(h2, _mm256_madd_epi16(x2, wh));
+        l3 = _mm256_add_epi32(l3, _mm256_madd_epi16(x3, wl)); h3 = _mm256_add_epi32(h3, _mm256_madd_epi16(x3, wh));
+    }
+    //hadd gives columns (0 1 4 5 | 2 3 6 7)
+    _mm256_storeu_si256((__m256i*)acc[0], _mm256_permute4x64_epi64(_mm256_hadd_epi32(l0, h0), 0xD8));
+    _mm256_storeu_si256((__m256i*)acc[1], _mm256_permute4x64_epi64(_mm256_hadd_epi32(l1, h1), 0xD8));
+    _mm256_storeu_si256((__m256i*)acc[2], _mm256_permute4x64_epi64(_mm256_hadd_epi32(l2, h2), 0xD8));
+    _mm256_storeu_si256((__m256i*)acc[3], _mm256_permute4x64_epi64(_mm256_hadd_epi32(l3, h3), 0xD8));
+#endif
+#else
+    for(int r=0; r<4; r++)
+        for(int c=0; c<QGEMM_NB; c++) acc[r][c] = 0;
+    for(int k=0; k<depth; k+=QGEMM_KG, b+=QGEMM_KG * QGEMM_NB)
+        for(int r=0; r<4; r++)
+            for(int c=0; c<QGEMM_NB; c++)
+                for(int j=0; j<QGEMM_KG; j++) acc[r][c] += a[r][k + j] * b[c * QGEMM_KG + j];
+#endif
+}
+
+//Epilogue of one row of a tile: columns n0 .. n0 + nc, scale/offset/bias are padded to 8 columns
+inline void _qepilogue(const int32_t * acc, long m, int n0, int nc, const float * scale, const int32_t * offset,
+                       const float * bias, const QEpilogue & ep) {
+    alignas(32) float y[QGEMM_NB];
+#if defined(__AVX2__)
+    __m256 v = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)acc), _mm256_loadu_si256((const __m256i*)offset)));
+    v = _mm256_add_ps(_mm256_mul_ps(v, _mm256_loadu_ps(scale)), _mm256_loadu_ps(bias));
+    if(ep.relu) v = _mm256_max_ps(v, _mm256_setzero_ps());
+    if(ep.out_f != NULL && ep.cs == 1 && nc == QGEMM_NB){
+        _mm256_storeu_ps(ep.out_f + m * ep.rs + n0, v);
+        return;
+    }
+    _mm256_store_ps(y, v);
+#else
+    for(int c=0; c<QGEMM_NB; c++){
+        y[c] = (acc[c] - offset[c]) * scale[c] + bias[c];
+        if(ep.relu) y[c] = std::max(y[c], 0.0f);
+    }
+#endif
+    if(ep.out_f != NULL){
+        for(int c=0; c<nc; c++) ep.out_f[m * ep.rs + (n0 + c) * ep.cs] = y[c];
+        return;
+    }
+    uint8_t q[QGEMM_NB];
+    quantize_u8(y, QGEMM_NB, ep.out, q);
+    for(int c=0; c<nc; c++) ep.out_q[m * ep.rs + (n0 + c) * ep.cs] = q[c];
+}
+
+/***************************************************************
+* void qgemm(const uint8_t * A, long lda, int M, QParams a, const QWeight & W, const QEpilogue & ep);
+*
+*   Description:
+*       ep applied to A @ W, A is M rows of uint8 (parameters a),
+*       lda apart, each with at least W.depth() readable bytes
+*       (the bytes past W.rows() are multiplied by 0)
+***************************************************************/
+inline void qgemm(const uint8_t * A, long lda, int M, QParams a, const QWeight & W, const QEpilogue & ep) {
+    assert(lda >= W.depth() && "ROWS OF A MUST HOLD THE PADDED DEPTH");
+    assert((ep.out_f != NULL) != (ep.out_q != NULL) && "QGEMM NEEDS EXACTLY ONE OUTPUT");
+    int N = W.cols(), blocks = (N + QGEMM_NB - 1) / QGEMM_NB, N8 = blocks * QGEMM_NB;
+    std::vector<float> scale(N8, 0), bias(N8, 0);
+    std::vector<int32_t> offset(N8, 0);
+    for(int n=0; n<N; n++){
+        scale[n] = a.scale * W.scale(n);
+        offset[n] = a.zero * W.colsum(n);
+        if(ep.bias != NULL) bias[n] = ep.bias[n];
+    }
+
+    parallel_for(0, (M + QGEMM_ROWS - 1) / QGEMM_ROWS, 1, [&](int lo, int hi){
+        alignas(32) int32_t acc[4][QGEMM_NB];
+        for(int chunk=lo; chunk<hi; chunk++){
+            int m_end = std::min(M, (chunk + 1) * QGEMM_ROWS);
+            //Each column block is reused from cache by every row of the chunk
+            for(int j=0; j<blocks; j++){
+                int n0 = j * QGEMM_NB, nc = std::min(QGEMM_NB, N - n0);
+                for(int m=chunk * QGEMM_ROWS; m<m_end; m+=4){
+                    int mr = std::min(4, m_end - m);
+                    //Missing rows of the last tile repeat the first one, their sums are not written
+                    const uint8_t * rows[4];
+                    for(int r=0; r<4; r++) rows[r] = A + (m + (r < mr ? r : 0)) * lda;
+                    _qtile(rows, W.panel(j), W.depth(), acc);
+                    for(int r=0; r<mr; r++)
+                        _qepilogue(acc[r], m + r, n0, nc, scale.data() + n0, offset.data() + n0, bias.data() + n0, ep);
+                }
+            }
+        }
+    });
+}
+
+/*###############################################################################################################*/
+/*                                              QUANTIZED OPS                                                    */
+/*###############################################################################################################*/
+namespace OPS {
+    template <typename T>
+    void _from_float(const std::vector<float> & y, Tensor<T> * out) {
+        for(size_t i=0; i<y.size(); i++) out->getData()[i] = (T)y[i];
+    }
+
+    template <typename T>
+    Tensor<T> * QMatMul(Tensor<T> * input, const QWeight & W, QParams in, const float * bias=NULL, bool relu=false) {
+        /*
+            input (..., K) @ the (K, N) quantized weight (+ bias, ReLU)
+            with input quantized to uint8 with in. Not tracked, the
+            result has no graph.
+        */
+        assert(input->getDims()[input->getNDims()-1] == W.rows() && "QMATMUL SHAPE MISMATCH");
+        if(!input->is_contiguous()) input->as_contiguous();
+        int K = W.rows(), N = W.cols(), M = input->getTotalElements() / K;
+        std::vector<uint8_t> a((size_t)M * W.depth(), 0);
+        parallel_for(0, M, QGEMM_ROWS, [&](int lo, int hi){
+            for(int m=lo; m<hi; m++) quantize_u8(input->getData() + (size_t)m * K, K, in, a.data() + (size_t)m * W.depth());
+        });
+
+        int dims[input->getNDims()];
+        copyElements(input->getNDims(), dims, input->getDims());
+        dims[input->getNDims()-1] = N;
+        Tensor<T> * out = new Tensor<T>(input->getNDims(), dims);
+        out->no_history();
+        std::vector<float> y(std::is_same<T, float>::value ? 0 : (size_t)M * N);
+        QEpilogue ep;
+        ep.bias = bias;
+        ep.relu = relu;
+        ep.out_f = y.empty() ? (float *)out->getData() : y.data();
+        ep.rs = N;
+        qgemm(a.data(), W.depth(), M, in, W, ep);
+        if(!y.empty()) _from_float(y, out);
+        return out;
+    }
+
+    inline QTensor QMatMul(const QTensor & input, const QWeight & W, QParams out_params, const float * bias=NULL, bool relu=false) {
+        //uint8 in, uint8 out (requantized with out_params)
+        assert(input.getDims().back() == W.rows() && "QMATMUL SHAPE MISMATCH");
+        int K = W.rows(), M = input.getTotalElements() / K;
+        const uint8_t * a = input.getData();
+        std::vector<uint8_t> padded;
+        if(K != W.depth()){
+            padded.assign((size_t)M * W.depth(), 0);
+            for(int m=0; m<M; m++) std::memcpy(padded.data() + (size_t)m * W.depth(), a + (size_t)m * K, K);
+            a = padded.data();
+        }
+        std::vector<int> dims = input.getDims();
+        dims.back() = W.cols();
+        QTensor out(dims, out_params);
+        QEpilogue ep;
+        ep.bias = bias;
+        ep.relu = relu;
+        ep.out_q = out.getData();
+        ep.out = out_params;
+        ep.rs = W.cols();
+        qgemm(a, W.depth(), M, input.params(), W, ep);
+        return out;
+    }
+
+    inline void _qim2col(const uint8_t * x, int C, int H, int W, int kh, int kw, std::pair<int,int> s, int pad,
+                         uint8_t fill, int OH, int OW, int depth, uint8_t * cols) {
+        //Row p = (i, j) of cols is the receptive field of output pixel p, in (c, u, v) order
+        parallel_for(0, OH, 1, [&](int lo, int hi){
+            for(int i=lo; i<hi; i++)
+                for(int j=0; j<OW; j++){
+                    uint8_t * row = cols + ((size_t)i * OW + j) * depth;
+                    int k = 0;
+                    for(int c=0; c<C; c++)
+                        for(int u=0; u<kh; u++){
+                            int y = i * s.first + u - pad;
+                            for(int v=0; v<kw; v++, k++){
+                                int z = j * s.second + v - pad;
+                                row[k] = (y < 0 || y >= H || z < 0 || z >= W) ? fill : x[((size_t)c * H + y) * W + z];
+                            }
+                        }
+                    for(; k<depth; k++) row[k] = 0;
+                }
+        });
+    }
+
+    template <typename T>
+    Tensor<T> * QCONV(Tensor<T> * X, const QWeight & K, int kh, int kw, QParams in, std::pair<int,int> s=std::make_pair(1,1),
+                      int pad=0, const float * bias=NULL, bool relu=false) {
+        /*
+            CONV of X (batch, in channels, height, width) zero padded by pad
+            with a kernel packed as QWeight(k, in * kh * kw, out, 1, in * kh * kw).
+            X is quantized with in, the padding is in.zero (the real 0).
+            Not tracked, the result has no graph.
+        */
+        assert(X->getNDims() == 4 && K.rows() == X->getDims()[1] * kh * kw && "QCONV SHAPE MISMATCH");
+        if(!X->is_contiguous()) X->as_contiguous();
+        int B = X->getDims()[0], C = X->getDims()[1], H = X->getDims()[2], W = X->getDims()[3];
+        int OH = (H + 2 * pad - kh) / s.first + 1, OW = (W + 2 * pad - kw) / s.second + 1, O = K.cols();
+        std::vector<uint8_t> x((size_t)C * H * W), cols((size_t)OH * OW * K.depth());
+        Tensor<T> * out = new Tensor<T>(4, B, O, OH, OW);
+        out->no_history();
+        std::vector<float> y(std::is_same<T, float>::value ? 0 : (size_t)out->getTotalElements());
+        QEpilogue ep;
+        ep.bias = bias;
+        ep.relu = relu;
+        ep.rs = 1;
+        ep.cs = (long)OH * OW;
+        for(int b=0; b<B; b++){
+            quantize_u8(X->getData() + (size_t)b * C * H * W, x.size(), in, x.data());
+            _qim2col(x.data(), C, H, W, kh, kw, s, pad, (uint8_t)in.zero, OH, OW, K.depth(), cols.data());
+            float * o = y.empty() ? (float *)out->getData() : y.data();
+            ep.out_f = o + (size_t)b * O * OH * OW;
+            qgemm(cols.data(), K.depth(), OH * OW, in, K, ep);
+        }
+        if(!y.empty()) _from_float(y, out);
+        return out;
+    }
+}
+
+/*###############################################################################################################*/
+/*                                             QUANTIZED LAYERS                                                  */
+/*###############################################################################################################*/
+template <typename T>
+class QLinear: public Module<T> {
+/*
+    Inference copy of a trained Linear with int8 weights. in are the
+    parameters of its inputs (from an Observer over calibration batches).
+    relu fuses a following ReLU into the epilogue.
+*/
+    public:
+        QLinear(const Linear<T> & layer, QParams in, bool per_channel=true, bool relu=false): in(in), relu(relu) {
+            Tensor<T> * w = layer.weight();
+            assert(w->is_contiguous() && "QLINEAR NEEDS A CONTIGUOUS WEIGHT");
+            W = QWeight(w->getData(), w->getDims()[0], w->getDims()[1], w->getDims()[1], 1, per_channel);
+            if(layer.bias() != NULL) bias.assign(layer.bias()->getData(), layer.bias()->getData() + W.cols());
+        }
+
+        Tensor<T> * forward(Tensor<T> * input) { return OPS::QMatMul(input, W, in, bias_ptr(), relu); }
+
+        /***************************************************************
+        * QTensor forward(const QTensor & input, QParams out);
+        *
+        *   Returns:
+        *       the output requantized with out, for chains of
+        *       quantized layers that never leave uint8
+        ***************************************************************/
+        QTensor forward(const QTensor & input, QParams out) { return OPS::QMatMul(input, W, out, bias_ptr(), relu); }
+
+        const QWeight & weight() const { return W; }
+
+    private:
+        const float * bias_ptr() const { return bias.empty() ? NULL : bias.data(); }
+
+        QWeight W;
+        std::vector<float> bias;
+        QParams in;
+        bool relu;
+};
+/*###############################################################################################################*/
+template <typename T>
+class QConv2d: public Module<T> {
+/*
+    Inference copy of a trained Conv2d with int8 kernels, see QLinear
+*/
+    public:
+        QConv2d(const Conv2d<T> & layer, QParams in, bool per_channel=true, bool relu=false)
+            : in(in), stride(layer.getStride()), padding(layer.getPadding()), relu(relu) {
+            Tensor<T> * k = layer.weight();
+            assert(k->is_contiguous() && "QCONV2D NEEDS A CONTIGUOUS KERNEL");
+            kh = k->getDims()[2];
+            kw = k->getDims()[3];
+            int depth = k->getDims()[1] * kh * kw;
+            K = QWeight(k->getData(), depth, k->getDims()[0], 1, depth, per_channel);
+            if(layer.bias() != NULL) bias.assign(layer.bias()->getData(), layer.bias()->getData() + K.cols());
+        }
+
+        Tensor<T> * forward(Tensor<T> * input) {
+            return OPS::QCONV(input, K, kh, kw, in, std::make_pair(stride, stride), padding, bias.empty() ? NULL : bias.data(), relu);
+        }
+
+        const QWeight & weight() const { return K; }
+
+    private:
+        QWeight K;
+        std::vector<float> bias;
+        QParams in;
+        int kh;
+        int kw;
+        int stride;
+        int padding;
+        bool relu;
+};
+
+#endif
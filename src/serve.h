@@ -0,0 +1,343 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <cerrno>
+#include <cassert>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "inference.h"
+#include "comm.h"
+
+/*
+    Dynamic batching in front of an InferenceEngine.
+    Callers submit single samples from any thread; one worker thread
+    takes the waiting requests as one batch as soon as max_batch of them
+    are queued or the oldest one has waited max_delay seconds, runs a
+    single batched forward pass and hands every caller its row of the
+    output. max_delay bounds the time a request waits for others, so it
+    trades latency at low load for larger batches at high load.
+    The same queue can be reached over a Unix domain socket (listen),
+    InferenceClient is the matching client.
+*/
+
+//Latency percentiles are taken over this many most recent requests
+const int LATENCY_WINDOW = 1 << 16;
+
+struct ServerStats {
+    long requests = 0;
+    long batches = 0;
+    int queue_depth = 0;                //requests waiting when the stats were taken
+    int max_queue_depth = 0;
+    std::vector<long> batch_sizes;      //batch_sizes[b] batches of b requests
+    double mean_batch = 0;
+    double p50 = 0;                     //latency from submission to result, seconds
+    double p99 = 0;
+};
+
+template <typename T>
+class InferenceServer {
+    public:
+        InferenceServer(InferenceEngine<T> & engine, int max_batch, double max_delay);
+        ~InferenceServer();
+
+        InferenceServer(const InferenceServer<T>&) = delete;
+        InferenceServer<T> & operator=(const InferenceServer<T>&) = delete;
+
+        /***************************************************************
+        * void infer(const T * input, T * output);
+        *
+        *   Description:
+        *       queues one sample (engine.input_size() values) and
+        *       blocks until its engine.output_size() values have been
+        *       written to output. Safe to call from any number of threads.
+        ***************************************************************/
+        void infer(const T * input, T * output);
+
+        /***************************************************************
+        * void listen(const std::string & path);
+        *
+        *   Description:
+        *       also accepts requests on a Unix domain socket at path.
+        *       A client first receives the input and output sizes
+        *       (two int64), then sends input_size() values and receives
+        *       output_size() values per request. Every connection is
+        *       served by its own thread, requests of different
+        *       connections are batched together. Throws
+        *       std::runtime_error if the socket cannot be set up.
+        ***************************************************************/
+        void listen(const std::string & path);
+
+        /***************************************************************
+        * ServerStats stats() const;
+        * void reset_stats();
+        *
+        *   Returns:
+        *       counters since the last reset_stats()
+        ***************************************************************/
+        ServerStats stats() const;
+        void reset_stats();
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Request {
+            const T * input;
+            T * output;
+            Clock::time_point arrival;
+            bool done = false;
+        };
+
+        void work();
+        void accept_loop(int listener);
+        void serve_connection(int fd);
+
+        InferenceEngine<T> & engine;
+        int batch_max;
+        Clock::duration delay;
+
+        mutable std::mutex lock;
+        std::condition_variable ready;
+        std::condition_variable finished;
+        std::deque<Request*> queue;
+        bool stopping = false;
+        std::thread worker;
+
+        std::string path;
+        std::atomic<bool> closing{false};
+        std::thread acceptor;
+        //Connection threads are detached, the destructor waits for live to drop to 0
+        std::mutex connection_lock;
+        std::condition_variable connection_closed;
+        int live = 0;
+
+        ServerStats counters;
+        std::vector<double> latencies;
+        size_t latency_next = 0;
+};
+/*###############################################################################################################*/
+template <typename T>
+class InferenceClient {
+/*
+    One connection to InferenceServer::listen, requests on a
+    connection are answered in order. Failing to connect and a
+    server closing the connection throw std::runtime_error.
+*/
+    public:
+        InferenceClient(const std::string & path);
+        ~InferenceClient() { close(fd); }
+
+        InferenceClient(const InferenceClient<T>&) = delete;
+        InferenceClient<T> & operator=(const InferenceClient<T>&) = delete;
+
+        void infer(const T * input, T * output);
+        long input_size() const { return in_size; }
+        long output_size() const { return out_size; }
+
+    private:
+        int fd;
+        long in_size;
+        long out_size;
+};
+/*###############################################################################################################*/
+template <typename T>
+InferenceServer<T>::InferenceServer(InferenceEngine<T> & engine, int max_batch, double max_delay)
+    : engine(engine), batch_max(max_batch),
+      delay(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(max_delay))) {
+    assert(max_batch >= 1 && max_batch <= engine.max_batch() && "BATCH LARGER THAN THE TRACED ONE");
+    assert(max_delay >= 0 && "NEGATIVE DELAY");
+    reset_stats();
+    worker = std::thread(&InferenceServer<T>::work, this);
+}
+/*###############################################################################################################*/
+template <typename T>
+InferenceServer<T>::~InferenceServer() {
+    //The socket threads notice closing within one poll timeout and finish their
+    //request first, the worker then answers whatever is still queued
+    closing = true;
+    if(acceptor.joinable()) acceptor.join();
+    {
+        std::unique_lock<std::mutex> guard(connection_lock);
+        connection_closed.wait(guard, [&]{ return live == 0; });
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    worker.join();
+    if(!path.empty()) unlink(path.c_str());
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceServer<T>::infer(const T * input, T * output) {
+    Request request;
+    request.input = input;
+    request.output = output;
+    request.arrival = Clock::now();
+    std::unique_lock<std::mutex> guard(lock);
+    assert(!stopping && "SERVER IS SHUTTING DOWN");
+    queue.push_back(&request);
+    counters.max_queue_depth = std::max(counters.max_queue_depth, (int)queue.size());
+    //The worker only needs waking for the first request and for a full batch
+    if(queue.size() == 1 || (int)queue.size() == batch_max) ready.notify_one();
+    finished.wait(guard, [&]{ return request.done; });
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceServer<T>::work() {
+    long in_size = engine.input_size(), out_size = engine.output_size();
+    std::vector<T> inputs(batch_max * in_size), outputs(batch_max * out_size);
+    std::vector<Request*> batch;
+
+    std::unique_lock<std::mutex> guard(lock);
+    while(true){
+        ready.wait(guard, [&]{ return stopping || !queue.empty(); });
+        if(queue.empty()) break;
+        //Wait for a full batch until the oldest request is due
+        Clock::time_point due = queue.front()->arrival + delay;
+        ready.wait_until(guard, due, [&]{ return stopping || (int)queue.size() >= batch_max; });
+
+        int n = std::min((int)queue.size(), batch_max);
+        batch.assign(queue.begin(), queue.begin() + n);
+        queue.erase(queue.begin(), queue.begin() + n);
+        guard.unlock();
+
+        for(int i=0; i<n; i++) std::memcpy(inputs.data() + i * in_size, batch[i]->input, in_size * sizeof(T));
+        engine.run(inputs.data(), n, outputs.data());
+        for(int i=0; i<n; i++) std::memcpy(batch[i]->output, outputs.data() + i * out_size, out_size * sizeof(T));
+        Clock::time_point now = Clock::now();
+
+        guard.lock();
+        for(int i=0; i<n; i++){
+            latencies[latency_next++ % LATENCY_WINDOW] = std::chrono::duration<double>(now - batch[i]->arrival).count();
+            batch[i]->done = true;
+        }
+        counters.requests += n;
+        counters.batches++;
+        counters.batch_sizes[n]++;
+        finished.notify_all();
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
+ServerStats InferenceServer<T>::stats() const {
+    std::lock_guard<std::mutex> guard(lock);
+    ServerStats s = counters;
+    s.queue_depth = queue.size();
+    s.mean_batch = s.batches > 0 ? (double)s.requests / s.batches : 0;
+    size_t n = std::min(latency_next, (size_t)LATENCY_WINDOW);
+    if(n > 0){
+        std::vector<double> sorted(latencies.begin(), latencies.begin() + n);
+        std::sort(sorted.begin(), sorted.end());
+        //Nearest rank
+        s.p50 = sorted[(n - 1) / 2];
+        s.p99 = sorted[std::min(n - 1, (size_t)std::ceil(0.99 * n) - 1)];
+    }
+    return s;
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceServer<T>::reset_stats() {
+    std::lock_guard<std::mutex> guard(lock);
+    counters = ServerStats();
+    counters.batch_sizes.assign(batch_max + 1, 0);
+    latencies.assign(LATENCY_WINDOW, 0);
+    latency_next = 0;
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceServer<T>::listen(const std::string & path) {
+    assert(this->path.empty() && "SERVER IS ALREADY LISTENING");
+    sockaddr_un addr = unix_address(path);
+    unlink(path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0) _socket_error("COULD NOT CREATE SOCKET");
+    if(bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(listener, SOMAXCONN) != 0){
+        close(listener);
+        _socket_error("COULD NOT LISTEN ON " + path);
+    }
+    this->path = path;
+    acceptor = std::thread(&InferenceServer<T>::accept_loop, this, listener);
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceServer<T>::accept_loop(int listener) {
+    //Polls with a timeout so shutting down never waits on a client
+    pollfd p = {listener, POLLIN, 0};
+    while(!closing){
+        if(poll(&p, 1, 50) <= 0) continue;
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0) continue;
+        {
+            std::lock_guard<std::mutex> guard(connection_lock);
+            live++;
+        }
+        std::thread(&InferenceServer<T>::serve_connection, this, fd).detach();
+    }
+    close(listener);
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceServer<T>::serve_connection(int fd) {
+    int64_t sizes[2] = {engine.input_size(), engine.output_size()};
+    std::vector<T> input(sizes[0]), output(sizes[1]);
+    bool open = _send_all(fd, sizes, sizeof(sizes));
+    pollfd p = {fd, POLLIN, 0};
+    while(open && !closing){
+        if(poll(&p, 1, 50) <= 0) continue;
+        open = _recv_all(fd, input.data(), input.size() * sizeof(T));
+        if(!open) break;
+        infer(input.data(), output.data());
+        open = _send_all(fd, output.data(), output.size() * sizeof(T));
+    }
+    close(fd);
+    //Last touch of the server, the destructor may run as soon as the lock is released
+    std::lock_guard<std::mutex> guard(connection_lock);
+    live--;
+    connection_closed.notify_all();
+}
+/*###############################################################################################################*/
+template <typename T>
+InferenceClient<T>::InferenceClient(const std::string & path) {
+    sockaddr_un addr = unix_address(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) _socket_error("COULD NOT CREATE SOCKET");
+    int64_t sizes[2];
+    int connected;
+    while((connected = connect(fd, (sockaddr *)&addr, sizeof(addr))) != 0 && errno == EINTR);
+    if(connected != 0 || !_recv_all(fd, sizes, sizeof(sizes))){
+        //The destructor does not run for a throwing constructor
+        int error = errno;
+        close(fd);
+        errno = error;
+        if(connected == 0) throw std::runtime_error("SERVER AT " + path + " CLOSED THE CONNECTION");
+        _socket_error("COULD NOT CONNECT TO " + path);
+    }
+    in_size = sizes[0];
+    out_size = sizes[1];
+}
+/*###############################################################################################################*/
+template <typename T>
+void InferenceClient<T>::infer(const T * input, T * output) {
+    if(!_send_all(fd, input, in_size * sizeof(T)) || !_recv_all(fd, output, out_size * sizeof(T)))
+        throw std::runtime_error("SERVER CLOSED THE CONNECTION");
+}
+
+#endif
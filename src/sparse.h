@@ -0,0 +1,108 @@
+#ifndef SPARSE_H_
+#define SPARSE_H_
+
+#include <vector>
+#include <cassert>
+#include <algorithm>
+
+#include "threadpool.h"
+
+/*
+    Row sparse gradients.
+    A table (rows, row_els) whose gradient only touches a few rows per
+    step (an embedding) keeps the gradient as a sorted list of distinct
+    row indices and one row of values per index instead of a dense
+    tensor the size of the whole table.
+*/
+template <typename T>
+class SparseGrad {
+    public:
+        SparseGrad(int row_els): row_els(row_els) {}
+
+        /***************************************************************
+        * void add(const int * index, int n, const T * values);
+        *
+        *   Description:
+        *       accumulates values (n rows of row_els) into the rows
+        *       index[0], ..., index[n-1]. Repeated indices (in index or
+        *       already stored) are summed, rows stay sorted and distinct.
+        ***************************************************************/
+        void add(const int * index, int n, const T * values);
+
+        /***************************************************************
+        * void clear();
+        *
+        *   Description:
+        *       drops every row, the gradient is 0 again
+        ***************************************************************/
+        void clear() { rows.clear(); vals.clear(); }
+
+        /***************************************************************
+        * int size() const { return rows.size(); }
+        *
+        *   Returns:
+        *       the number of distinct rows with a gradient
+        ***************************************************************/
+        int size() const { return rows.size(); }
+
+        /***************************************************************
+        * int rowSize() const { return row_els; }
+        *
+        *   Returns:
+        *       the number of elements in each row
+        ***************************************************************/
+        int rowSize() const { return row_els; }
+
+        /***************************************************************
+        * const std::vector<int> & getRows() const { return rows; }
+        * const T * getValues() const { return vals.data(); }
+        *
+        *   Returns:
+        *       the sorted row indices, and the values with row
+        *       getRows()[k] starting at getValues() + k * rowSize()
+        ***************************************************************/
+        const std::vector<int> & getRows() const { return rows; }
+        const T * getValues() const { return vals.data(); }
+
+    private:
+        int row_els;
+        std::vector<int> rows;
+        std::vector<T> vals;
+};
+/*###############################################################################################################*/
+template <typename T>
+void SparseGrad<T>::add(const int * index, int n, const T * values) {
+    //Entries < size() are the stored rows, the rest are the new ones
+    int stored = rows.size();
+    std::vector<int> order(stored + n);
+    for(int i=0; i<stored + n; i++) order[i] = i;
+    auto row_of = [&](int e) { return e < stored ? rows[e] : index[e - stored]; };
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return row_of(a) < row_of(b); });
+
+    //Distinct rows and where their run of entries starts
+    std::vector<int> merged, begin;
+    for(int i=0; i<stored + n; i++)
+        if(i == 0 || row_of(order[i]) != merged.back()) {
+            merged.push_back(row_of(order[i]));
+            begin.push_back(i);
+        }
+    begin.push_back(stored + n);
+
+    //Every distinct row is summed by one thread, in entry order
+    std::vector<T> out((size_t)merged.size() * row_els);
+    parallel_for(0, merged.size(), std::max(1, 4096 / std::max(1, row_els)), [&](int lo, int hi){
+        for(int r=lo; r<hi; r++){
+            T * dst = out.data() + (size_t)r * row_els;
+            for(int j=0; j<row_els; j++) dst[j] = 0;
+            for(int i=begin[r]; i<begin[r+1]; i++){
+                int e = order[i];
+                const T * src = e < stored ? vals.data() + (size_t)e * row_els : values + (size_t)(e - stored) * row_els;
+                for(int j=0; j<row_els; j++) dst[j] += src[j];
+            }
+        }
+    });
+    rows.swap(merged);
+    vals.swap(out);
+}
+
+#endif
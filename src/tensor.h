@@ -11,12 +11,26 @@
 
 #include "iterator.h"
 #include "utils.h"
+#include "transpose.h"
+#include "sparse.h"
+#include "compress.h"
 
 
 std::default_random_engine generator;
 
 template <typename T> class Op;
 
+/*
+    Memory format of an image tensor, its dims are always the physical ones:
+        FORMAT_NCHW   (batch, channels, height, width), the default
+        FORMAT_NHWC   (batch, height, width, channels), channels last
+        FORMAT_NCHWC  (batch, channels / b, height, width, b), blocks of
+                      b channels innermost
+    Only the image ops (CONV, PAD, pooling, BATCHNORM) read the tag,
+    elementwise ops pass it on. See layout.h.
+*/
+enum MemoryFormat { FORMAT_NCHW, FORMAT_NHWC, FORMAT_NCHWC };
+
 template <typename T>
 class Tensor {
     public:
@@ -25,9 +39,39 @@ class Tensor {
         Tensor(int n_dims, const int * dims);
         ~Tensor();
 
+        /***************************************************************
+        * Tensor(Tensor<T> * base, long offset, int n_dims, const int * dims);
+        *
+        *   Description:
+        *       A contiguous view: the new tensor reads and writes the
+        *       elements of base starting at offset instead of copying
+        *       them. base must be contiguous and hold offset + the view's
+        *       elements.
+        *       The view keeps a raw pointer into base's storage and no
+        *       link to base itself: it dangles once base is deleted,
+        *       packed or made contiguous again after a transpose, so
+        *       base must stay alive and in place until the view (and
+        *       everything computed from it) is no longer read. Views made
+        *       by ops (NARROW, SELECT) are graph children of base, which
+        *       is how pack() and as_contiguous() refuse to move storage
+        *       still viewed; views made directly are not tracked.
+        ***************************************************************/
+        Tensor(Tensor<T> * base, long offset, int n_dims, const int * dims);
+
         Tensor(const Tensor<T>& tensor);
         Tensor<T> & operator=(const Tensor<T>& tensor);
 
+        /***************************************************************
+        * Tensor(Tensor<T>&& tensor); Tensor<T> & operator=(Tensor<T>&& tensor);
+        *
+        *   Description:
+        *       Takes over the storage, shape and gradient of tensor
+        *       without copying. Graph links (op, parents, children)
+        *       stay with tensor, which is left empty (0 elements).
+        ***************************************************************/
+        Tensor(Tensor<T>&& tensor);
+        Tensor<T> & operator=(Tensor<T>&& tensor);
+
         //Methods
         /***************************************************************
         * T& get(int dims, ...) const;
@@ -96,13 +140,13 @@ class Tensor {
         std::vector<Tensor*> getParents() const { return parents; }
 
         /***************************************************************
-        * const int * getMults() const { return mults; }
+        * const long * getMults() const { return mults; }
         *
         *   Returns:
         *       A pointer to the array storing the offsets for indexing the internal array
         *       The size of the array is n_dims (tensor.getNDims())
         ***************************************************************/
-        const int * getMults() const { return mults; }
+        const long * getMults() const { return mults; }
 
         /***************************************************************
         * const int * getDims() const { return dims; } 
@@ -114,13 +158,13 @@ class Tensor {
         const int * getDims() const { return dims; } 
 
         /***************************************************************
-        * const int * getLocalEls() const;
+        * const long * getLocalEls() const;
         *
         *   Returns:
         *       A pointer to the array storing the total amount
         *       of elements stored in that dimension of the data
         ***************************************************************/
-        const int * getLocalEls() const { return local_els; }
+        const long * getLocalEls() const { return local_els; }
 
         /***************************************************************
         * int getNDims() const { return n_dims; }
@@ -131,23 +175,35 @@ class Tensor {
         int getNDims() const { return n_dims; }
 
         /***************************************************************
-        * int getTotalElements() const { return n_els; }
+        * MemoryFormat getFormat() const { return format; }
+        * void setFormat(MemoryFormat f) { format = f; }
+        *
+        *   Description:
+        *       the memory format the dims are in. setFormat only
+        *       changes the tag, OPS::TO_FORMAT moves the elements.
+        *       reshape resets it to FORMAT_NCHW
+        ***************************************************************/
+        MemoryFormat getFormat() const { return format; }
+        void setFormat(MemoryFormat f) { format = f; }
+
+        /***************************************************************
+        * long getTotalElements() const { return n_els; }
         *
         *   Returns:
         *       the total number of elements of the array,
         *       this is also the length of the internal storage array
         *       for the tensor.
         ***************************************************************/
-        int getTotalElements() const { return n_els; }
+        long getTotalElements() const { return n_els; }
 
         /***************************************************************
-        * int getIndex(int * dims) const;
+        * long getIndex(int * dims) const;
         *
         *   Returns:
         *       The calculated internal array index for the element stored
         *       in the tensor at Tensor[i, j, k, ..., z]
         ***************************************************************/
-        int getIndex(int * dims) const;
+        long getIndex(int * dims) const;
 
         /*Reshape Methods*/
 
@@ -159,6 +215,8 @@ class Tensor {
         *       C contiguous (with respect to the rows).
         *       The internal contiguous array allows us to reshape the tensor
         *       into other dimensions. (Reshape calls this method before shaping the tensor)
+        *       A tensor that op made views (NARROW, SELECT) read from
+        *       must not be rearranged.
         ***************************************************************/
         void as_contiguous();
 
@@ -216,7 +274,7 @@ class Tensor {
         *   Description:
         *       sets all the elements to the value specified
         ***************************************************************/
-        void setAll(T val){ for(int i=0; i<n_els; i++) data[i] = val;}
+        void setAll(T val){ for(long i=0; i<n_els; i++) data[i] = val;}
 
         /***************************************************************
         * void init_grad();
@@ -236,6 +294,27 @@ class Tensor {
         ***************************************************************/
         bool is_grad_init() const { return grad_initialized; }
 
+        /***************************************************************
+        * void use_sparse_grad();
+        *
+        *   Description:
+        *       Keeps the gradient as a SparseGrad over the rows
+        *       (first dim) of the tensor instead of a dense tensor.
+        *       Only ops that understand sparse gradients (EMBEDDING)
+        *       may take the tensor as an input.
+        ***************************************************************/
+        void use_sparse_grad();
+
+        /***************************************************************
+        * bool has_sparse_grad() const { return sparse_grad != NULL; }
+        * SparseGrad<T> * getSparseGrad() const;
+        *
+        *   Returns:
+        *       whether use_sparse_grad() was called, and the sparse gradient
+        ***************************************************************/
+        bool has_sparse_grad() const { return sparse_grad != NULL; }
+        SparseGrad<T> * getSparseGrad() const { assert(sparse_grad != NULL); return sparse_grad; }
+
         /***************************************************************
         * void no_history()
         *
@@ -350,6 +429,77 @@ class Tensor {
         ***************************************************************/
         iterator<T> begin(int * order=NULL) const;
 
+        /***************************************************************
+        * void bind(T * storage, T * grad_storage=NULL);
+        *
+        *   Description:
+        *       Copies the current values into storage and makes
+        *       storage the tensors internal array. If grad_storage
+        *       is provided the gradient is initialized and bound to
+        *       it as well. The tensor does not own bound memory, so
+        *       storage must outlive the tensor.
+        ***************************************************************/
+        void bind(T * storage, T * grad_storage=NULL);
+
+        /***************************************************************
+        * bool owns_data() const { return owns_storage; }
+        *
+        *   Returns:
+        *       false if the internal array was bound to external
+        *       memory with bind() or belongs to a view's base
+        ***************************************************************/
+        bool owns_data() const { return owns_storage; }
+
+        /***************************************************************
+        * T * getData() const { return data; }
+        *
+        *   Returns:
+        *       A pointer to the internal storage array
+        ***************************************************************/
+        T * getData() const { return data; }
+
+        /***************************************************************
+        * void pack(SavedFormat format);
+        *
+        *   Description:
+        *       Replaces the internal array with a reduced precision
+        *       copy (see compress.h) and frees it. Until unpack() the
+        *       tensor has no readable data (getData() is NULL), only
+        *       contiguous tensors owning their storage and without
+        *       view children can be packed.
+        ***************************************************************/
+        void pack(SavedFormat format);
+
+        /***************************************************************
+        * void unpack();
+        * void drop_unpacked();
+        *
+        *   Description:
+        *       unpack() decodes a packed tensor into a new internal
+        *       array (the packed copy is kept), drop_unpacked() frees
+        *       that array again. Both do nothing if there is nothing to do.
+        ***************************************************************/
+        void unpack();
+        void drop_unpacked();
+
+        /***************************************************************
+        * bool is_packed() const { return packed != NULL; }
+        * size_t packed_bytes() const;
+        *
+        *   Returns:
+        *       whether pack() was called, and the bytes of the packed copy
+        ***************************************************************/
+        bool is_packed() const { return packed != NULL; }
+        size_t packed_bytes() const { return packed == NULL ? 0 : packed->bytes(); }
+
+        /***************************************************************
+        * void clearGraph();
+        *
+        *   Description:
+        *       Removes all parent and child links of the tensor
+        ***************************************************************/
+        void clearGraph() { children.clear(); parents.clear(); }
+
         /*Debug Methods*/
         void _printInternalArr() const;
 
@@ -361,18 +511,25 @@ class Tensor {
 
     private:
         T * data;
-        int n_els;
-        int * mults;
+        long n_els;
+        long * mults;
         int * dims;
-        int * local_els;
+        long * local_els;
         int n_dims;
+        MemoryFormat format = FORMAT_NCHW;
         bool contiguous;
+        bool owns_storage = true;
         bool track_history = true;
         bool grad_initialized = false;
         Tensor<T> * grad;
+        SparseGrad<T> * sparse_grad = NULL;
+        PackedStorage * packed = NULL;
         Op<T> * op = NULL;
         std::vector<Tensor*> children;
         std::vector<Tensor*> parents;
+
+        //True if a graph child is a view into this tensor's storage
+        bool has_view_children() const;
 };
 /*###############################################################################################################*/
 /*                                        CONSTRUCTORS/DESTRUCTOR                                                */
@@ -380,9 +537,9 @@ class Tensor {
 template <typename T>
 Tensor<T>::Tensor(int  n_dims, ...) {
     //allocate helpers for indexing
-    mults = new int[n_dims];
+    mults = new long[n_dims];
     dims = new int[n_dims];
-    local_els = new int[n_dims];
+    local_els = new long[n_dims];
 
     this->n_dims = n_dims;
 
@@ -397,7 +554,7 @@ Tensor<T>::Tensor(int  n_dims, ...) {
     }
 
     //set the multipliers for each index
-    int mult = 1;
+    long mult = 1;
     for(int i=n_dims-1; i>=0; i--) {
         mults[i] = mult;
         mult *= dims[i];
@@ -421,11 +578,11 @@ template <typename T>
 Tensor<T>::Tensor(int n_dims, const int * dims){
     //Allocate the data
     //And copy dims
-    int els = 1;
+    long els = 1;
     this->n_dims = n_dims;
     this->dims = new int[n_dims];
-    this->mults = new int[n_dims];
-    this->local_els = new int[n_dims];
+    this->mults = new long[n_dims];
+    this->local_els = new long[n_dims];
     for(int i=0; i<n_dims; i++) {
         els*=dims[i];
         this->dims[i] = dims[i];
@@ -434,7 +591,7 @@ Tensor<T>::Tensor(int n_dims, const int * dims){
     n_els = els;
 
     //Set the multipliers
-    int mult=1;
+    long mult=1;
     for(int i=n_dims-1; i>=0; i--) {
         mults[i] = mult;
         mult *=dims[i];
@@ -452,11 +609,11 @@ template <typename T>
 Tensor<T>::Tensor(const T * data, int n_dims, const int * dims) {
     //Allocate the data
     //And copy dims
-    int els = 1;
+    long els = 1;
     this->n_dims = n_dims;
     this->dims = new int[n_dims];
-    this->mults = new int[n_dims];
-    this->local_els = new int[n_dims];
+    this->mults = new long[n_dims];
+    this->local_els = new long[n_dims];
     for(int i=0; i<n_dims; i++) {
         els*=dims[i];
         this->dims[i] = dims[i];
@@ -465,11 +622,11 @@ Tensor<T>::Tensor(const T * data, int n_dims, const int * dims) {
     n_els = els;
 
     //Copy over the values
-    for(int i=0; i<els; i++)
+    for(long i=0; i<els; i++)
         this->data[i] = data[i];
     
     //Set the multipliers
-    int mult=1;
+    long mult=1;
     for(int i=n_dims-1; i>=0; i--) {
         mults[i] = mult;
         mult *=dims[i];
@@ -484,11 +641,42 @@ Tensor<T>::Tensor(const T * data, int n_dims, const int * dims) {
 }
 /*###############################################################################################################*/
 template <typename T>
+Tensor<T>::Tensor(Tensor<T> * base, long offset, int n_dims, const int * dims) {
+    assert(base->is_contiguous() && "CAN ONLY VIEW A CONTIGUOUS TENSOR");
+    this->n_dims = n_dims;
+    this->dims = new int[n_dims];
+    this->mults = new long[n_dims];
+    this->local_els = new long[n_dims];
+    for(int i=0; i<n_dims; i++) this->dims[i] = dims[i];
+
+    //Set the multipliers
+    long mult=1;
+    for(int i=n_dims-1; i>=0; i--) {
+        mults[i] = mult;
+        mult *=dims[i];
+        local_els[i] = mult;
+    }
+    n_els = mult;
+    assert(offset >= 0 && offset + n_els <= base->n_els && "VIEW OUT OF BOUNDS");
+
+    //Share the storage, a view of the same rank (a batch slice) keeps the memory format
+    this->data = base->data + offset;
+    owns_storage = false;
+    if(n_dims == base->n_dims) format = base->format;
+
+    //Default values
+    children = std::vector<Tensor*>();
+    parents  =  std::vector<Tensor*>();
+    contiguous = true;
+}
+/*###############################################################################################################*/
+template <typename T>
 Tensor<T>::Tensor(const Tensor<T>& tensor) {
 
     //copy values of non pointer values
     this->n_dims = tensor.n_dims;
     this->n_els = tensor.n_els;
+    this->format = tensor.format;
     this->contiguous = tensor.contiguous;
     this->children = tensor.children;
     this->parents = tensor.parents;
@@ -500,15 +688,17 @@ Tensor<T>::Tensor(const Tensor<T>& tensor) {
         //So we wont get stuck in a loop
         this->grad = new Tensor<T>(*tensor.grad);
     }
+    if(tensor.sparse_grad != NULL) this->sparse_grad = new SparseGrad<T>(*tensor.sparse_grad);
 
     //Allocate new memory
     this->data = new T[n_els];
     this->dims = new int[n_dims];
-    this->mults = new int[n_dims];
-    this->local_els = new int[n_dims];
+    this->mults = new long[n_dims];
+    this->local_els = new long[n_dims];
 
-    //Copy over values
-    for(int i=0; i<n_els; i++) 
+    //Copy over values, a packed tensor is copied decoded
+    if(tensor.data == NULL && tensor.packed != NULL) tensor.packed->decode(this->data);
+    else for(long i=0; i<n_els; i++)
         this->data[i] = tensor.data[i];
     for(int i=0; i<n_dims; i++) {
         this->dims[i] = tensor.dims[i];
@@ -523,21 +713,24 @@ Tensor<T> & Tensor<T>::operator=(const Tensor<T>& tensor) {
         //copy values of non pointer values
         this->n_dims = tensor.n_dims;
         this->n_els = tensor.n_els;
+        this->format = tensor.format;
         this->contiguous = tensor.contiguous;
         this->children = tensor.children;
         this->parents = tensor.parents;
 
         //Delete and Allocate new memory
-        delete [] this->data;
+        if(owns_storage) delete [] this->data;
         delete [] this->dims;
         delete [] this->mults;
         delete [] this->local_els;
         
         this->data = new T[n_els];
         this->dims = new int[n_dims];
-        this->mults = new int[n_dims];
-        this->local_els = new int[n_dims];
+        this->mults = new long[n_dims];
+        this->local_els = new long[n_dims];
+        this->owns_storage = true;
 
+        if(this->grad_initialized) delete this->grad;
         this->track_history = tensor.track_history;
         this->grad_initialized = tensor.grad_initialized;
         if(this->grad_initialized){
@@ -545,8 +738,13 @@ Tensor<T> & Tensor<T>::operator=(const Tensor<T>& tensor) {
             //So we wont get stuck in a loop
             this->grad = new Tensor<T>(*tensor.grad);
         }
-        //Copy over values
-        for(int i=0; i<n_els; i++) 
+        delete this->sparse_grad;
+        this->sparse_grad = tensor.sparse_grad == NULL ? NULL : new SparseGrad<T>(*tensor.sparse_grad);
+        delete this->packed;
+        this->packed = NULL;
+        //Copy over values, a packed tensor is copied decoded
+        if(tensor.data == NULL && tensor.packed != NULL) tensor.packed->decode(this->data);
+        else for(long i=0; i<n_els; i++)
             this->data[i] = tensor.data[i];
         for(int i=0; i<n_dims; i++) {
             this->dims[i] = tensor.dims[i];
@@ -558,15 +756,74 @@ Tensor<T> & Tensor<T>::operator=(const Tensor<T>& tensor) {
 }
 /*###############################################################################################################*/
 template <typename T>
+Tensor<T>::Tensor(Tensor<T>&& tensor) {
+    data = NULL;
+    mults = NULL;
+    dims = NULL;
+    local_els = NULL;
+    n_els = 0;
+    n_dims = 0;
+    contiguous = true;
+    *this = std::move(tensor);
+}
+/*###############################################################################################################*/
+template <typename T>
+Tensor<T> & Tensor<T>::operator=(Tensor<T>&& tensor) {
+    if(this != &tensor){
+        //Release our own storage
+        if(owns_storage) delete [] this->data;
+        delete [] this->dims;
+        delete [] this->mults;
+        delete [] this->local_els;
+        if(this->grad_initialized) delete this->grad;
+        delete this->sparse_grad;
+        delete this->packed;
+
+        //Steal the pointers
+        this->data = tensor.data;
+        this->dims = tensor.dims;
+        this->mults = tensor.mults;
+        this->local_els = tensor.local_els;
+        this->grad = tensor.grad;
+        this->sparse_grad = tensor.sparse_grad;
+        this->packed = tensor.packed;
+        this->n_els = tensor.n_els;
+        this->n_dims = tensor.n_dims;
+        this->format = tensor.format;
+        this->contiguous = tensor.contiguous;
+        this->owns_storage = tensor.owns_storage;
+        this->track_history = tensor.track_history;
+        this->grad_initialized = tensor.grad_initialized;
+
+        //Leave tensor empty but destructible
+        tensor.data = NULL;
+        tensor.dims = NULL;
+        tensor.mults = NULL;
+        tensor.local_els = NULL;
+        tensor.grad = NULL;
+        tensor.sparse_grad = NULL;
+        tensor.packed = NULL;
+        tensor.n_els = 0;
+        tensor.n_dims = 0;
+        tensor.contiguous = true;
+        tensor.owns_storage = true;
+        tensor.grad_initialized = false;
+    }
+    return *this;
+}
+/*###############################################################################################################*/
+template <typename T>
 Tensor<T>::~Tensor(){
     /*Have to Deal with Children/Parents when OPS are created*/
-    delete [] data;
+    if(owns_storage) delete [] data;
     delete [] mults;
     delete [] dims;
     delete [] local_els;
 
     if(op!=NULL) { delete op; }
     if (grad_initialized) delete grad;
+    delete sparse_grad;
+    delete packed;
 }
 
 /*###############################################################################################################*/
@@ -594,7 +851,7 @@ T& Tensor<T>::get(const int * dims) const {
     /*
     Gets the data stored at index dims
     */
-    int index = 0;
+    long index = 0;
     for(int i=0; i<n_dims; i++) {
         int sub_index = dims[i];
         index += mults[i] * sub_index;
@@ -605,11 +862,11 @@ T& Tensor<T>::get(const int * dims) const {
 }
 /*###############################################################################################################*/
 template <typename T>
-int Tensor<T>::getIndex(int * dims) const{
+long Tensor<T>::getIndex(int * dims) const{
     /*
     Returns 1d data array index from the tensor index
     */
-    int index = 0;
+    long index = 0;
     for(int i=0; i<n_dims; i++) 
         index += mults[i] * dims[i];
     return index;
@@ -625,7 +882,7 @@ std::ostream& operator<<(std::ostream& ostr, const Tensor<V> & tensor) {
     ostr << "DATA: " << std::endl;
     bool opened[tensor.n_dims];
     for(int i=0; i<tensor.n_dims; i++) opened[i] = false;
-    for(int i=0; i<tensor.n_els; i++){
+    for(long i=0; i<tensor.n_els; i++){
         int count = 0;
         for(int j=0; j<tensor.n_dims; j++){
             if ( i%tensor.local_els[j] == 0 && i<tensor.n_els-1 ) {
@@ -686,15 +943,9 @@ void Tensor<T>::transpose() {
     NOTE: THIS WILL THROW OFF THE SHAPE TRACKER, DONT USE UNLESS YOU INTEND TO CORRECT THIS ERRROR
     */
     assert(n_dims >= 2 && "MUST HAVE A SIZE OF AT LEAST 2 TO PREFORM A TRANSPOSE");
-    int temp = mults[n_dims-1];
-    mults[n_dims-1] = mults[n_dims-2];
-    mults[n_dims-2] = temp;
-    temp = dims[n_dims-1];
-    dims[n_dims-1] = dims[n_dims-2];
-    dims[n_dims-2] = temp;
-    temp = local_els[n_dims-1];
-    local_els[n_dims-1] = local_els[n_dims-2];
-    local_els[n_dims-2] = temp;
+    std::swap(mults[n_dims-1], mults[n_dims-2]);
+    std::swap(dims[n_dims-1], dims[n_dims-2]);
+    std::swap(local_els[n_dims-1], local_els[n_dims-2]);
     contiguous = false;
 }
 /*###############################################################################################################*/
@@ -705,19 +956,16 @@ void Tensor<T>::as_contiguous() {
     contiguous values
     */
 
+    assert(!has_view_children() && "CANNOT REARRANGE A TENSOR WITH VIEWS INTO IT");
+
     //Create new data arr
     T * temp = new T[n_els];
 
-    //set up iterator for tensor
-    iterator<T> it = begin();
-
-    //copy values over
-    for(int i=0; i<n_els; i++){
-        temp[i] = it.next();
-    }
+    //copy values over (tiled when the layout is a transpose)
+    strided_copy((const T *)data, n_dims, dims, mults, temp);
 
     //recalculate the offsets and local els
-    int mult = 1;
+    long mult = 1;
     for(int i=n_dims-1; i>=0; i--){
         this->mults[i] = mult;
         mult *= this->dims[i];
@@ -726,13 +974,20 @@ void Tensor<T>::as_contiguous() {
 
     //clean up
     contiguous = true;
-    delete [] data;
-    data = temp;
+    if(owns_storage){
+        delete [] data;
+        data = temp;
+    }
+    else {
+        //Bound memory stays in place so views into it remain valid
+        copyElements(n_els, data, (const T *)temp);
+        delete [] temp;
+    }
 }
 /*###############################################################################################################*/
 template <typename T>
 void Tensor<T>::_printInternalArr() const {
-    for(int i=0; i<n_els; i++) {
+    for(long i=0; i<n_els; i++) {
         std::cout << data[i] << " ";
     }
     std::cout << std::endl;
@@ -744,7 +999,7 @@ void Tensor<T>::reshape(int n_dims, const int * dims) {
     Reshapes the tensor to have the named dimensions
     */
 
-    int total_els = 1;
+    long total_els = 1;
     bool done = this->n_dims == n_dims;
     for(int i=0; i<n_dims; i++) {
         if(done){
@@ -758,6 +1013,7 @@ void Tensor<T>::reshape(int n_dims, const int * dims) {
 
     //Make sure the array is contiguous
     if(!contiguous) as_contiguous();
+    format = FORMAT_NCHW;
 
     //Delete previous dimensions
     delete [] this->dims;
@@ -766,15 +1022,15 @@ void Tensor<T>::reshape(int n_dims, const int * dims) {
 
     //Reallocate metadata arrays
     this->dims = new int[n_dims];
-    this->mults = new int[n_dims];
-    this->local_els = new int[n_dims];
+    this->mults = new long[n_dims];
+    this->local_els = new long[n_dims];
     this->n_dims = n_dims;
     
     //Copy dims over 
     for(int i=0; i<n_dims; i++) this->dims[i] = dims[i];
 
     //Calculate new offsets and local_els
-    int mult = 1;
+    long mult = 1;
     for(int i=n_dims-1; i>=0; i--){
         this->mults[i] = mult;
         mult *= this->dims[i];
@@ -796,6 +1052,7 @@ void Tensor<T>::reshape(int n_dims, ...) {
 template <typename T>
 void Tensor<T>::init_grad() {
     if(grad_initialized) return;
+    assert(sparse_grad == NULL && "TENSOR HAS A SPARSE GRADIENT");
     grad_initialized = true;
     grad = new Tensor<T>(this->n_dims, this->dims);
     grad->setAll(0);
@@ -803,9 +1060,49 @@ void Tensor<T>::init_grad() {
 }
 /*###############################################################################################################*/
 template <typename T>
+void Tensor<T>::use_sparse_grad() {
+    assert(!grad_initialized && "TENSOR ALREADY HAS A DENSE GRADIENT");
+    if(sparse_grad != NULL) return;
+    sparse_grad = new SparseGrad<T>(n_dims > 0 ? n_els / dims[0] : 1);
+}
+/*###############################################################################################################*/
+template <typename T>
+void Tensor<T>::pack(SavedFormat format) {
+    assert(packed == NULL && "TENSOR IS ALREADY PACKED");
+    assert(contiguous && owns_storage && "CAN ONLY PACK A CONTIGUOUS TENSOR THAT OWNS ITS STORAGE");
+    assert(!has_view_children() && "CANNOT PACK A TENSOR WITH VIEWS INTO IT");
+    packed = new PackedStorage(data, n_els, format);
+    delete [] data;
+    data = NULL;
+}
+/*###############################################################################################################*/
+template <typename T>
+bool Tensor<T>::has_view_children() const {
+    for(size_t i=0; i<children.size(); i++){
+        const Tensor<T> * c = children[i];
+        if(!c->owns_storage && c->data != NULL && c->data >= data && c->data < data + n_els) return true;
+    }
+    return false;
+}
+/*###############################################################################################################*/
+template <typename T>
+void Tensor<T>::unpack() {
+    if(packed == NULL || data != NULL) return;
+    data = new T[n_els];
+    packed->decode(data);
+}
+/*###############################################################################################################*/
+template <typename T>
+void Tensor<T>::drop_unpacked() {
+    if(packed == NULL || data == NULL) return;
+    delete [] data;
+    data = NULL;
+}
+/*###############################################################################################################*/
+template <typename T>
 void Tensor<T>::reshape_grad(int n_dims, const int * dims){
     assert(grad_initialized && "GRAD NOT INITIALIZED");
-    int mult = 1;
+    long mult = 1;
     for(int i=0; i<n_dims; i++) {
         mult *= dims[i];
     }
@@ -815,12 +1112,31 @@ void Tensor<T>::reshape_grad(int n_dims, const int * dims){
 template <typename T>
 void Tensor<T>::randn(){
     std::normal_distribution<double> distribution(0,1);
-    for(int i=0; i<n_els; i++){
+    for(long i=0; i<n_els; i++){
         data[i] = distribution(generator);
     }
 }
 /*###############################################################################################################*/
 template <typename T>
+void Tensor<T>::bind(T * storage, T * grad_storage) {
+    /*
+    Moves the internal array (and optionally the gradient)
+    into externally owned memory
+    */
+    if(!contiguous) as_contiguous();
+    copyElements(n_els, storage, (const T *)data);
+    if(owns_storage) delete [] data;
+    data = storage;
+    owns_storage = false;
+
+    if(grad_storage != NULL){
+        init_grad();
+        grad->reshape(n_dims, dims);
+        grad->bind(grad_storage);
+    }
+}
+/*###############################################################################################################*/
+template <typename T>
 iterator<T> Tensor<T>::begin(int * order) const {
     int arr[n_dims];
     setAllElements(n_dims, arr, 0);
@@ -5,12 +5,24 @@
 #include <iostream>
 #include <vector>
 #include <cstdlib>
+#include <sstream>
+#include <cstdio>
 
 #include "tensor.h"
 #include "iterator.h"
 #include "utils.h"
 #include "ops.h"
+#include "expr.h"
 #include "grad_check.h"
+#include "module.h"
+#include "optim.h"
+#include "dataloader.h"
+#include "parallel.h"
+#include "comm.h"
+#include "jit.h"
+#include "quant.h"
+#include "inference.h"
+#include "serve.h"
 
 //Relative PATH
 #define PATH std::string("..")
@@ -159,6 +171,1644 @@ bool testGrad_unary(int tests,T func, bool matmul){
     return count == tests;
 }
 
+bool testBroadcast(int tests){
+    //Pairs of shapes (padded with 0) that broadcast against each other
+    const int shapes[][2][3] = {
+        {{5, 4, 2}, {2, 0, 0}},
+        {{5, 4, 2}, {4, 1, 0}},
+        {{4, 1, 0}, {5, 4, 2}},
+        {{5, 1, 2}, {1, 4, 1}},
+        {{1, 0, 0}, {3, 2, 0}},
+        {{3, 1, 4}, {3, 2, 1}},
+    };
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        for(size_t c=0; c<sizeof(shapes)/sizeof(shapes[0]); c++){
+            int n_dims[2];
+            for(int k=0; k<2; k++) for(n_dims[k]=0; n_dims[k]<3 && shapes[c][k][n_dims[k]] > 0; n_dims[k]++);
+            for(int f=0; f<4; f++){
+                Tensor<double> * a = new Tensor<double>(n_dims[0], shapes[c][0]);
+                Tensor<double> * b = new Tensor<double>(n_dims[1], shapes[c][1]);
+                a->randn();
+                b->randn();
+                for(int i=0; i<b->getTotalElements(); i++) b->getData()[i] += 2;//For num stability of div
+                if(f == 0) passed &= grad_check(OPS::ADD<double>, a, b);
+                if(f == 1) passed &= grad_check(OPS::SUB<double>, a, b);
+                if(f == 2) passed &= grad_check(OPS::MULT<double>, a, b);
+                if(f == 3) passed &= grad_check(OPS::DIV<double>, a, b);
+                delete a;
+                delete b;
+            }
+        }
+
+        //Forward values against explicit indexing, with a transposed operand
+        Tensor<double> * a = new Tensor<double>(3, 3, 4, 5);
+        Tensor<double> * b = new Tensor<double>(2, 5, 4);
+        a->randn();
+        b->randn();
+        b->transpose();
+        Tensor<double> * out = OPS::MULT(a, b);
+        for(int i=0; i<3; i++)
+            for(int j=0; j<4; j++)
+                for(int k=0; k<5; k++)
+                    passed &= out->get(3, i, j, k) == a->get(3, i, j, k) * b->get(2, j, k);
+        delete out;
+        delete a;
+        delete b;
+
+        //back() leaves the output's gradient as it was seeded (all ones)
+        Tensor<double> * x = new Tensor<double>(2, 4, 3);
+        x->randn();
+        Tensor<double> * ys[] = {OPS::EXP(x), OPS::ADD(x, x), OPS::MULT(x, x), OPS::DIV(x, x), OPS::ReLU(x)};
+        for(Tensor<double> * y : ys){
+            OPS::backward(y);
+            for(int i=0; i<y->getTotalElements(); i++) passed &= y->getGrad()->getData()[i] == 1;
+            OPS::release_graph(y);
+        }
+        delete x;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testFusion(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        auto unary = [](Tensor<double> * x) {
+            return LAZY::eval(LAZY::MULT(LAZY::EXP(LAZY::NEG(LAZY::ADD(x, x))), LAZY::ReLU(x)));
+        };
+        auto binary = [](Tensor<double> * a, Tensor<double> * b) {
+            return LAZY::eval(LAZY::DIV(LAZY::SUB(a, LAZY::MULT(b, LAZY::constant(0.5))), LAZY::ADD(LAZY::EXP(a), b)));
+        };
+        Tensor<double> * x = new Tensor<double>(3,5,4,2);
+        x->randn();
+        passed &= grad_check_unary(unary, x);
+        delete x;
+
+        Tensor<double> * a = new Tensor<double>(3,5,4,2);
+        Tensor<double> * b = new Tensor<double>(3,5,4,2);
+        a->randn();
+        b->randn();
+        for(int i=0; i<b->getTotalElements(); i++) b->getData()[i] += 2;//For num stability of div
+        passed &= grad_check(binary, a, b);
+        delete a;
+        delete b;
+
+        //Same values as the unfused ops
+        a = new Tensor<double>(2, 7, 3);
+        b = new Tensor<double>(2, 7, 3);
+        a->randn();
+        b->randn();
+        Tensor<double> * fused = LAZY::eval(LAZY::EXP(LAZY::NEG(LAZY::ADD(a, b))));
+        Tensor<double> * sum = OPS::ADD(a, b);
+        Tensor<double> * neg = OPS::NEG(sum);
+        Tensor<double> * chain = OPS::EXP(neg);
+        for(int i=0; i<fused->getTotalElements(); i++)
+            passed &= fabs(fused->getData()[i] - chain->getData()[i]) < ERR;
+        delete chain;
+        delete neg;
+        delete sum;
+        delete fused;
+        delete a;
+        delete b;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testMoveAndOut(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+
+        //Moves hand over the storage without copying it
+        Tensor<double> a(3,5,4,2);
+        a.randn();
+        a.init_grad();
+        const double * storage = a.getData();
+        double first = storage[0];
+        Tensor<double> b(std::move(a));
+        passed &= b.getData() == storage && b.getData()[0] == first && b.getTotalElements() == 40;
+        passed &= a.getTotalElements() == 0 && a.getData() == NULL;
+        Tensor<double> c(1, 3);
+        c = std::move(b);
+        passed &= c.getData() == storage && c.getNDims() == 3 && c.getGrad() != NULL;
+
+        //_out variants reuse the caller's buffer and match the tracked ops
+        Tensor<double> * x = new Tensor<double>(2, 6, 3);
+        Tensor<double> * y = new Tensor<double>(1, 3);
+        Tensor<double> * out = new Tensor<double>(2, 6, 3);
+        Tensor<double> * w = new Tensor<double>(2, 3, 4);
+        Tensor<double> * prod = new Tensor<double>(2, 6, 4);
+        const double * buffer = out->getData();
+        for(int step=0; step<3; step++){
+            x->randn();
+            y->randn();
+            w->randn();
+            OPS::MULT_out(out, x, y);
+            Tensor<double> * expected = OPS::MULT(x, y);
+            for(int i=0; i<out->getTotalElements(); i++) passed &= out->getData()[i] == expected->getData()[i];
+            delete expected;
+            OPS::EXP_out(out, out);
+            OPS::MatMul_out(prod, out, w);
+            expected = OPS::MatMul(out, w);
+            for(int i=0; i<prod->getTotalElements(); i++) passed &= fabs(prod->getData()[i] - expected->getData()[i]) < ERR;
+            delete expected;
+            passed &= out->getData() == buffer;
+        }
+        delete x;
+        delete y;
+        delete out;
+        delete w;
+        delete prod;
+
+        //Larger than the default stack
+        Tensor<double> * big = new Tensor<double>(1, 1 << 21);
+        big->setAll(1);
+        Tensor<double> * neg = OPS::NEG(big);
+        passed &= neg->getData()[(1 << 21) - 1] == -1;
+        delete neg;
+        delete big;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testFixedTensor(int tests){
+    static_assert(StaticShape<2, 3, 4>::strides[0] == 12 && StaticShape<2, 3, 4>::size == 24, "CONSTEXPR SHAPE");
+    static_assert(StaticShape<2, 3, 4>::offset(1, 2, 3) == 23, "CONSTEXPR OFFSET");
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+
+        //Views index like get(), also through the strides of a transpose, and write through to the tensor
+        Tensor<double> * a = new Tensor<double>(4, 2, 3, 4, 5);
+        a->randn();
+        for(int transposed=0; transposed<2; transposed++){
+            if(transposed) a->transpose();
+            FixedTensor<double, 4> v(a);
+            passed &= v.is_contiguous() != (bool)transposed && !v.owns_data() && v.size() == 120;
+            for(int i=0; i<2; i++)
+                for(int j=0; j<3; j++)
+                    for(int k=0; k<v.dim(2); k++)
+                        for(int l=0; l<v.dim(3); l++){
+                            passed &= &v(i, j, k, l) == &a->get(4, i, j, k, l);
+                            passed &= &v[{i, j, k, l}] == &v(i, j, k, l);
+                        }
+
+            //for_each walks the same order as the tensor's iterator
+            iterator<double> it = a->begin(), again = a->begin();
+            v.for_each([&](double & x){ passed &= &x == &it.next(); });
+            Tensor<double> * copy = v.to_tensor();
+            passed &= copy->is_contiguous();
+            for(int i=0; i<copy->getTotalElements(); i++) passed &= copy->getData()[i] == again.next();
+            delete copy;
+        }
+        FixedTensor<double, 4> v(a);
+        v(1, 2, 0, 3) = 7;
+        passed &= a->get(4, 1, 2, 0, 3) == 7;
+        delete a;
+
+        //Owned storage is row major, zeroed and deep copied
+        FixedTensor<float, 3> b({3, 1, 2});
+        b.for_each([&](float & x){ passed &= x == 0; });
+        b(2, 0, 1) = 5;
+        FixedTensor<float, 3> c(b);
+        c(2, 0, 1) = 6;
+        passed &= b.owns_data() && c.owns_data() && b.data()[5] == 5 && c.data()[5] == 6 && b.strides()[0] == 2;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testPermute(int tests){
+    const std::vector<std::vector<int>> orders = {{0, 1, 2}, {2, 1, 0}, {1, 0, 2}, {0, 2, 1}, {2, 0, 1}, {-1, 0, 1}};
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        for(size_t o=0; o<orders.size(); o++){
+            std::vector<int> order = orders[o];
+            auto permute = [order](Tensor<double> * x) { return OPS::PERMUTE(x, order); };
+            Tensor<double> * x = new Tensor<double>(3,5,4,2);
+            Tensor<double> * probe = OPS::PERMUTE(x, order);
+            Tensor<double> * weights = new Tensor<double>(probe->getNDims(), probe->getDims());
+            weights->randn();
+            x->randn();
+            passed &= grad_check_unary(permute, x, weights);
+            delete probe;
+            delete weights;
+            delete x;
+        }
+
+        //Tiled path on shapes that are not multiples of the tile, with a transposed input
+        for(int k=0; k<2; k++){
+            Tensor<float> * x = new Tensor<float>(3, 3, 67, 45);
+            x->randn();
+            if(k == 1) x->transpose();
+            Tensor<float> * y = OPS::PERMUTE(x, {2, 0, 1});
+            for(int a=0; a<x->getDims()[0]; a++)
+                for(int b=0; b<x->getDims()[1]; b++)
+                    for(int c=0; c<x->getDims()[2]; c++)
+                        passed &= y->get(3, c, a, b) == x->get(3, a, b, c);
+            Tensor<float> * z = OPS::TRANSPOSE(x);
+            x->as_contiguous();
+            for(int a=0; a<x->getDims()[0]; a++)
+                for(int b=0; b<x->getDims()[1]; b++)
+                    for(int c=0; c<x->getDims()[2]; c++)
+                        passed &= z->get(3, a, c, b) == x->get(3, a, b, c);
+            delete z;
+            delete y;
+            delete x;
+        }
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool _check_unary_weighted(const std::function<Tensor<double>*(Tensor<double>*)> & func, int n_dims, const int * dims){
+    //grad_check_unary against a random weighting of the output
+    Tensor<double> * x = new Tensor<double>(n_dims, dims);
+    x->randn();
+    Tensor<double> * probe = func(x);
+    Tensor<double> * weights = new Tensor<double>(probe->getNDims(), probe->getDims());
+    weights->randn();
+    delete probe;
+    bool passed = grad_check_unary(func, x, weights);
+    delete weights;
+    delete x;
+    return passed;
+}
+
+bool testSlicing(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        int shape[] = {4, 5, 3};
+        Tensor<double> * index = new Tensor<double>(3, 4, 2, 3);
+        for(int i=0; i<index->getTotalElements(); i++) index->getData()[i] = rand() % 5;
+        std::vector<int> rows = {3, 0, 3, 1};
+
+        passed &= _check_unary_weighted([](Tensor<double> * x) { return OPS::NARROW(x, 0, 1, 2); }, 3, shape);
+        passed &= _check_unary_weighted([](Tensor<double> * x) { return OPS::NARROW(x, 1, -3, 2); }, 3, shape);
+        passed &= _check_unary_weighted([](Tensor<double> * x) { return OPS::SELECT(x, 2, 1); }, 3, shape);
+        passed &= _check_unary_weighted([rows](Tensor<double> * x) { return OPS::INDEX_SELECT(x, 1, rows); }, 3, shape);
+        passed &= _check_unary_weighted([index](Tensor<double> * x) { return OPS::GATHER(x, 1, index); }, 3, shape);
+
+        //Ops with several inputs, checked one input at a time
+        int small[] = {4, 2, 3};
+        Tensor<double> * other = new Tensor<double>(3, small);
+        Tensor<double> * same = new Tensor<double>(3, shape);
+        other->randn();
+        same->randn();
+        passed &= _check_unary_weighted([other](Tensor<double> * x) { return OPS::CAT(std::vector<Tensor<double>*>{x, other, x}, 1); }, 3, shape);
+        passed &= _check_unary_weighted([same](Tensor<double> * x) { return OPS::CAT(std::vector<Tensor<double>*>{same, x}, -2); }, 3, small);
+        passed &= _check_unary_weighted([same](Tensor<double> * x) { return OPS::STACK(std::vector<Tensor<double>*>{same, x}, 1); }, 3, shape);
+        passed &= _check_unary_weighted([same](Tensor<double> * x) { return OPS::STACK(std::vector<Tensor<double>*>{x, same}, -1); }, 3, shape);
+        passed &= _check_unary_weighted([index, other](Tensor<double> * x) { return OPS::SCATTER_ADD(x, 1, index, other); }, 3, shape);
+        passed &= _check_unary_weighted([index, same](Tensor<double> * x) { return OPS::SCATTER_ADD(same, 1, index, x); }, 3, small);
+        delete other;
+        delete same;
+        delete index;
+
+        //Leading dim slices share storage, inner slices are copies with the same values
+        Tensor<float> * x = new Tensor<float>(3, 6, 4, 5);
+        x->randn();
+        Tensor<float> * rows_view = OPS::NARROW(x, 0, 2, 3);
+        Tensor<float> * plane = OPS::SELECT(x, 0, 5);
+        Tensor<float> * cols = OPS::NARROW(x, 2, 1, 3);
+        passed &= rows_view->getData() == x->getData() + 2 * 20 && !rows_view->owns_data();
+        passed &= plane->getData() == x->getData() + 5 * 20 && plane->getNDims() == 2;
+        passed &= cols->owns_data() && cols->getDims()[2] == 3;
+        for(int i=0; i<6; i++)
+            for(int j=0; j<4; j++)
+                for(int k=0; k<3; k++){
+                    if(i >= 2 && i < 5) passed &= rows_view->get(3, i - 2, j, k) == x->get(3, i, j, k);
+                    passed &= cols->get(3, i, j, k) == x->get(3, i, j, k + 1);
+                }
+        Tensor<float> * joined = OPS::CAT(std::vector<Tensor<float>*>{x, cols}, 2);
+        for(int i=0; i<6; i++)
+            for(int j=0; j<4; j++)
+                for(int k=0; k<8; k++)
+                    passed &= joined->get(3, i, j, k) == (k < 5 ? x->get(3, i, j, k) : cols->get(3, i, j, k - 5));
+        delete joined;
+        delete cols;
+        delete plane;
+        delete rows_view;
+        delete x;
+
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testEmbedding(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        Tensor<double> * index = new Tensor<double>(2, 3, 4);
+        for(int i=0; i<index->getTotalElements(); i++) index->getData()[i] = rand() % 6;
+        index->getData()[5] = index->getData()[0];
+
+        //Dense table gradient
+        int shape[] = {7, 3};
+        passed &= _check_unary_weighted([index](Tensor<double> * w) { return OPS::EMBEDDING(w, index); }, 2, shape);
+
+        //The sparse gradient holds exactly the rows of the dense one that were looked up
+        Embedding<double> table(7, 3);
+        Tensor<double> * dense = new Tensor<double>(table.weight()->getData(), 2, shape);
+        Tensor<double> * out = table.forward(index);
+        Tensor<double> * expected = OPS::EMBEDDING(dense, index);
+        passed &= out->getNDims() == 3 && out->getDims()[2] == 3;
+        for(int i=0; i<out->getTotalElements(); i++) passed &= out->getData()[i] == expected->getData()[i];
+        for(int i=0; i<out->getTotalElements(); i++) expected->getGrad()->getData()[i] = out->getGrad()->getData()[i] = i % 5 - 2;
+        out->getOp()->back();
+        out->getOp()->back();
+        expected->getOp()->back();
+        expected->getOp()->back();
+        const SparseGrad<double> * grad = table.weight()->getSparseGrad();
+        const double * dw = dense->getGrad()->getData();
+        int r = 0;
+        for(int row=0; row<7; row++){
+            bool touched = false;
+            for(int i=0; i<index->getTotalElements(); i++) touched |= (int)index->getData()[i] == row;
+            if(!touched) continue;
+            passed &= r < grad->size() && grad->getRows()[r] == row;
+            for(int j=0; j<3 && r < grad->size(); j++) passed &= fabs(grad->getValues()[r * 3 + j] - dw[row * 3 + j]) < 1e-12;
+            r++;
+        }
+        passed &= r == grad->size();
+
+        //Lazy updates leave the rows without a gradient alone
+        std::vector<double> before(table.weight()->getData(), table.weight()->getData() + 21);
+        SGD<double> sgd(table.flat(), 0.5);
+        sgd.add_sparse(table.weight());
+        sgd.step();
+        for(int row=0; row<7; row++){
+            bool touched = std::find(grad->getRows().begin(), grad->getRows().end(), row) != grad->getRows().end();
+            for(int j=0; j<3; j++)
+                passed &= fabs(table.weight()->getData()[row * 3 + j] - (before[row * 3 + j] - 0.5 * dw[row * 3 + j])) < 1e-12 || !touched;
+            if(!touched) for(int j=0; j<3; j++) passed &= table.weight()->getData()[row * 3 + j] == before[row * 3 + j];
+        }
+        Adam<double> adam(table.flat(), 0.1);
+        adam.add_sparse(table.weight());
+        before.assign(table.weight()->getData(), table.weight()->getData() + 21);
+        adam.step();
+        for(int i=0; i<21; i++)
+            passed &= (dw[i] == 0) == (table.weight()->getData()[i] == before[i]);
+        table.zero_grad();
+        passed &= grad->size() == 0;
+
+        delete expected;
+        delete out;
+        delete dense;
+        delete index;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testConvGrad(int tests){
+    int count = 0;
+    for(int i=0; i<tests; i++){
+        Tensor<double> * X = new Tensor<double>(4,2,3,6,5);
+        Tensor<double> * K = new Tensor<double>(4,4,3,3,2);
+        X->randn();
+        K->randn();
+        auto conv_func = [](Tensor<double> * x, Tensor<double> * k) { return OPS::CONV(x, k, std::make_pair(2,1)); };
+        if(grad_check(conv_func, X, K)) count++;
+        delete X;
+        delete K;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+double _module_loss(Module<double> & model, Tensor<double> * input){
+    Tensor<double> * out = model.forward(input);
+    double sum = 0;
+    iterator<double> it = out->begin();
+    for(int i=0; i<out->getTotalElements(); i++) sum += it.next();
+    OPS::release_graph(out);
+    return sum;
+}
+
+bool _check_module(Module<double> & model, Tensor<double> * input){
+    bool passed = true;
+    const double EPS = .00001;
+    ParameterBuffer<double> * flat = model.flat();
+
+    //Every parameter and gradient must be a view into the flat buffer
+    std::vector<Tensor<double>*> params = model.parameters();
+    for(size_t i=0; i<params.size(); i++){
+        passed &= params[i]->getData() == flat->getData() + flat->getOffsets()[i];
+        passed &= params[i]->getGrad()->getData() == flat->getGrad() + flat->getOffsets()[i];
+        passed &= ((size_t)params[i]->getData()) % PARAM_ALIGN == 0;
+    }
+
+    //Analytical gradient of sum(out) with respect to the flat buffer
+    model.zero_grad();
+    Tensor<double> * out = model.forward(input);
+    OPS::backward(out);
+    OPS::release_graph(out);
+
+    double * w = flat->getData();
+    for(int i=0; i<flat->size(); i++){
+        double val = w[i];
+        w[i] = val + EPS/2;
+        double out1 = _module_loss(model, input);
+        w[i] = val - EPS/2;
+        double out2 = _module_loss(model, input);
+        w[i] = val;
+        double numerical_der = (out1 - out2) / EPS;
+        if(fabs(numerical_der - flat->getGrad()[i]) > ERR){
+            std::cout << "ERROR IN GRADIENT" << std::endl;
+            std::cout << "EXPECTED GRADIENT: " << std::setprecision(10) << numerical_der << std::endl;
+            std::cout << "RECIEVED GRADIENT: " << std::setprecision(10) << flat->getGrad()[i] << std::endl;
+            passed = false;
+        }
+    }
+
+    //Zeroing and saving go through the flat buffer
+    model.zero_grad();
+    for(int i=0; i<flat->size(); i++) passed &= flat->getGrad()[i] == 0;
+    std::stringstream stream;
+    model.save(stream);
+    double before = _module_loss(model, input);
+    for(int i=0; i<flat->size(); i++) w[i] = 0;
+    model.load(stream);
+    passed &= _module_loss(model, input) == before;
+
+    //A truncated file or a different model's file is an error, never a partial read
+    std::string saved = stream.str();
+    int64_t wrong = flat->size() + 1;
+    std::string sizes[] = {saved.substr(0, saved.size() - 1), std::string((const char *)&wrong, sizeof(int64_t)) + saved.substr(sizeof(int64_t))};
+    for(const std::string & bad : sizes){
+        std::stringstream bad_stream(bad);
+        bool thrown = false;
+        try { model.load(bad_stream); } catch(const std::runtime_error &) { thrown = true; }
+        passed &= thrown;
+    }
+    return passed;
+}
+
+bool testPooling(int tests){
+    //kernel, stride, padding (height, width)
+    const int configs[][6] = {{2, 2, 0, 0, 0, 0}, {3, 3, 1, 1, 1, 1}, {3, 2, 2, 1, 1, 0}, {2, 3, 1, 2, 0, 1}};
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        int shape[] = {2, 3, 6, 7};
+        for(size_t c=0; c<sizeof(configs)/sizeof(configs[0]); c++){
+            std::pair<int,int> k(configs[c][0], configs[c][1]), s(configs[c][2], configs[c][3]), p(configs[c][4], configs[c][5]);
+            int sh = s.first > 0 ? s.first : k.first, sw = s.second > 0 ? s.second : k.second;
+            passed &= _check_unary_weighted([k, s, p](Tensor<double> * x) { return OPS::MAXPOOL2D(x, k, s, p); }, 4, shape);
+            passed &= _check_unary_weighted([k, s, p](Tensor<double> * x) { return OPS::AVGPOOL2D(x, k, s, p); }, 4, shape);
+
+            //Forward against a direct loop over the windows
+            Tensor<float> * x = new Tensor<float>(4, shape);
+            x->randn();
+            Tensor<float> * mx = OPS::MAXPOOL2D(x, k, s, p);
+            Tensor<float> * av = OPS::AVGPOOL2D(x, k, s, p);
+            for(int b=0; b<2; b++)
+                for(int ch=0; ch<3; ch++)
+                    for(int oh=0; oh<mx->getDims()[2]; oh++)
+                        for(int ow=0; ow<mx->getDims()[3]; ow++){
+                            float best = -1e30f, sum = 0;
+                            for(int i=0; i<k.first; i++)
+                                for(int j=0; j<k.second; j++){
+                                    int ih = oh * sh - p.first + i, iw = ow * sw - p.second + j;
+                                    if(ih < 0 || iw < 0 || ih >= 6 || iw >= 7) continue;
+                                    best = std::max(best, x->get(4, b, ch, ih, iw));
+                                    sum += x->get(4, b, ch, ih, iw);
+                                }
+                            passed &= mx->get(4, b, ch, oh, ow) == best;
+                            passed &= fabs(av->get(4, b, ch, oh, ow) - sum / (k.first * k.second)) < 1e-5;
+                        }
+            delete av;
+            delete mx;
+            delete x;
+        }
+        passed &= _check_unary_weighted([](Tensor<double> * x) { return OPS::GLOBAL_MAXPOOL2D(x); }, 4, shape);
+        passed &= _check_unary_weighted([](Tensor<double> * x) { return OPS::GLOBAL_AVGPOOL2D(x); }, 4, shape);
+
+        //No input beats -inf: every window still routes its gradient to an input it covers, never to the padding
+        for(int f=0; f<2; f++){
+            Tensor<double> * x = new Tensor<double>(4, 1, 1, 2, 2);
+            x->setAll(-std::numeric_limits<double>::infinity());
+            Tensor<double> * in = f ? OPS::TO_FORMAT(x, FORMAT_NHWC) : x;
+            Tensor<double> * y = OPS::MAXPOOL2D(in, std::make_pair(2, 2), std::make_pair(1, 1), std::make_pair(1, 1));
+            OPS::backward(y);
+            double total = 0;
+            for(int i=0; i<4; i++) total += x->getGrad()->getData()[i];
+            passed &= total == y->getTotalElements();
+            OPS::release_graph(y);
+            delete x;
+        }
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testMatMulKernels(int tests){
+    //Every path of the dispatch (both GEMVs, unrolled, packed GEMM) with plain and transposed operands against a direct loop
+    int count = 0;
+    std::uniform_int_distribution<int> small(2, SMALL_MATMUL), large(SMALL_MATMUL + 1, 70);
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        int shapes[][3] = {{1, large(generator), large(generator)}, {large(generator), large(generator), 1}, {1, small(generator), 1},
+                           {small(generator), small(generator), small(generator)}, {large(generator), small(generator), large(generator)},
+                           {small(generator), large(generator), small(generator)}};
+        for(size_t i=0; i<sizeof(shapes)/sizeof(shapes[0]); i++)
+            for(int layout=0; layout<4; layout++){
+                int M = shapes[i][0], K = shapes[i][1], N = shapes[i][2];
+                //Bit 0 transposes A, bit 1 transposes B
+                Tensor<double> * a = layout & 1 ? new Tensor<double>(3, 3, K, M) : new Tensor<double>(3, 3, M, K);
+                Tensor<double> * b = layout & 2 ? new Tensor<double>(3, 3, N, K) : new Tensor<double>(3, 3, K, N);
+                a->randn();
+                b->randn();
+                if(layout & 1) a->transpose();
+                if(layout & 2) b->transpose();
+                Tensor<double> * c = OPS::_matmul(a, b);
+                for(int bt=0; bt<3; bt++)
+                    for(int m=0; m<M; m++)
+                        for(int n=0; n<N; n++){
+                            double sum = 0, mag = 0;
+                            for(int k=0; k<K; k++){
+                                sum += a->get(3, bt, m, k) * b->get(3, bt, k, n);
+                                mag += fabs(a->get(3, bt, m, k) * b->get(3, bt, k, n));
+                            }
+                            passed &= fabs(c->get(3, bt, m, n) - sum) <= 1e-12 * (1 + mag);
+                        }
+                delete a;
+                delete b;
+                delete c;
+            }
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+template <typename H>
+bool _check_half(double eps){
+    //eps: relative rounding error of H. Every kernel runs on H inputs and is compared
+    //against float on the same (rounded) values, so only the output rounding differs
+    bool passed = true;
+    auto close = [eps](Tensor<H> * h, Tensor<float> * f, double scale){
+        bool ok = h->getTotalElements() == f->getTotalElements();
+        for(int i=0; ok && i<f->getTotalElements(); i++)
+            ok &= fabs((float)h->getData()[i] - f->getData()[i]) <= eps * (fabs(f->getData()[i]) + scale);
+        return ok;
+    };
+
+    //Array conversion against the scalar one, with a ragged tail
+    Tensor<float> * x = new Tensor<float>(1, 1003);
+    x->randn();
+    Tensor<H> * hx = OPS::CAST<H>(x);
+    for(int i=0; i<x->getTotalElements(); i++) passed &= (float)hx->getData()[i] == (float)H(x->getData()[i]);
+    delete hx;
+    delete x;
+
+    //Long sums are accumulated in float: a running sum kept in H would stop growing at 1 / eps
+    Tensor<H> * ones = new Tensor<H>(2, 1000, 50);
+    ones->setAll(1);
+    Tensor<H> * total = OPS::SUM(ones);
+    Tensor<H> * rows = OPS::SUM(ones, std::vector<int>{0});
+    passed &= fabs((float)total->getData()[0] - 5e4) <= 5e4 * eps;
+    for(int i=0; i<50; i++) passed &= (float)rows->getData()[i] == 1000.0f;
+    delete total;
+    delete rows;
+    delete ones;
+
+    //GEMM, conv, softmax and elementwise ops
+    Tensor<float> * a = new Tensor<float>(3, 2, 17, 130), * b = new Tensor<float>(3, 2, 130, 9);
+    Tensor<float> * img = new Tensor<float>(4, 2, 3, 7, 7), * k = new Tensor<float>(4, 4, 3, 3, 3);
+    a->randn(); b->randn(); img->randn(); k->randn();
+    Tensor<H> * ha = OPS::CAST<H>(a), * hb = OPS::CAST<H>(b), * himg = OPS::CAST<H>(img), * hk = OPS::CAST<H>(k);
+    Tensor<float> * ra = OPS::CAST<float>(ha), * rb = OPS::CAST<float>(hb), * rimg = OPS::CAST<float>(himg), * rk = OPS::CAST<float>(hk);
+    Tensor<H> * hc = OPS::MatMul(ha, hb);
+    Tensor<float> * c = OPS::MatMul(ra, rb);
+    passed &= close(hc, c, 0);
+    Tensor<H> * hconv = OPS::CONV(himg, hk);
+    Tensor<float> * conv_ = OPS::CONV(rimg, rk);
+    passed &= close(hconv, conv_, 0);
+    Tensor<H> * hsm = OPS::SOFTMAX(ha);
+    Tensor<float> * sm = OPS::SOFTMAX(ra);
+    passed &= close(hsm, sm, 0);
+    Tensor<H> * hew = OPS::MULT(OPS::ReLU(ha), OPS::EXP(OPS::NEG(ha)));
+    Tensor<float> * ew = OPS::MULT(OPS::ReLU(ra), OPS::EXP(OPS::NEG(ra)));
+    //Each of the ops rounds its output once
+    passed &= close(hew, ew, 0) || close(hew, ew, 1);
+
+    //Gradients of the same GEMM
+    Tensor<H> * hl = OPS::SUM(hc);
+    Tensor<float> * l = OPS::SUM(c);
+    OPS::backward(hl);
+    OPS::backward(l);
+    Tensor<float> * dh = OPS::CAST<float>(ha->getGrad());
+    for(int i=0; i<a->getTotalElements(); i++) passed &= fabs(dh->getData()[i] - ra->getGrad()->getData()[i]) <= eps * (fabs(ra->getGrad()->getData()[i]) + 1);
+    delete dh;
+
+    OPS::release_graph(hl); OPS::release_graph(l); OPS::release_graph(hconv); OPS::release_graph(conv_);
+    OPS::release_graph(hsm); OPS::release_graph(sm); OPS::release_graph(hew); OPS::release_graph(ew);
+    delete ha; delete hb; delete himg; delete hk; delete ra; delete rb; delete rimg; delete rk;
+    delete a; delete b; delete img; delete k;
+    return passed;
+}
+
+bool testHalf(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = _check_half<bfloat16>(pow(2.0, -8)) && _check_half<float16>(pow(2.0, -11));
+
+        //Conversions of special values
+        passed &= std::isinf((float)bfloat16(std::numeric_limits<float>::max() * 1.01f)) && (float)float16(65520.0f) == std::numeric_limits<float>::infinity();
+        passed &= (float)float16(65504.0f) == 65504.0f && (float)float16(pow(2.0f, -24)) == powf(2.0f, -24);
+        passed &= std::isnan((float)bfloat16(std::numeric_limits<float>::quiet_NaN())) && std::isnan((float)float16(std::numeric_limits<float>::quiet_NaN()));
+        passed &= (float)std::numeric_limits<float16>::max() == 65504.0f && (float)std::numeric_limits<bfloat16>::lowest() < -3e38f;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testQuantization(int tests){
+    //Every quantized result is compared with the float op on the dequantized operands
+    //(only float rounding differs) and with the float op on the original ones
+    auto rel_err = [](Tensor<float> * x, Tensor<float> * y){
+        double num = 0, den = 0;
+        for(int i=0; i<x->getTotalElements(); i++){
+            num += (x->getData()[i] - y->getData()[i]) * (x->getData()[i] - y->getData()[i]);
+            den += y->getData()[i] * y->getData()[i];
+        }
+        return std::sqrt(num / den);
+    };
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        std::uniform_int_distribution<int> size(1, 40);
+        int M = size(generator), K = size(generator), N = size(generator);
+
+        //Round trip and clamping
+        QParams q = choose_qparams(-1.5, 3);
+        Tensor<float> * x = new Tensor<float>(2, M, K);
+        x->randn();
+        QTensor qx(x, q);
+        Tensor<float> * dx = qx.dequantize<float>();
+        for(int i=0; i<x->getTotalElements(); i++){
+            float v = std::min(3.0f, std::max(-1.5f, x->getData()[i]));
+            passed &= fabs(dx->getData()[i] - v) <= q.scale / 2 + 1e-6;
+        }
+        float zero = 0;
+        uint8_t qzero;
+        quantize_u8(&zero, 1, q, &qzero);
+        passed &= qzero == q.zero;
+
+        //GEMM with ragged M, K, N against the dequantized operands
+        Tensor<float> * w = new Tensor<float>(2, K, N), * bias = new Tensor<float>(1, N);
+        w->randn();
+        bias->randn();
+        for(int k=0; k<K; k++) w->getData()[k * N] *= 100;     //a column on another scale
+        QWeight qw(w->getData(), K, N, N, 1);
+        Tensor<float> * dw = qw.dequantize<float>();
+        Tensor<float> * out = OPS::QMatMul(x, qw, q, bias->getData(), true);
+        Tensor<float> * ref = OPS::ReLU(OPS::BIAS_ADD(OPS::MatMul(dx, dw), bias));
+        for(int i=0; i<out->getTotalElements(); i++) passed &= fabs(out->getData()[i] - ref->getData()[i]) <= 1e-4 * (1 + fabs(ref->getData()[i]));
+
+        //Per channel scales keep the small columns accurate
+        Tensor<float> * full = OPS::MatMul(dx, w);
+        Tensor<float> * pc = OPS::QMatMul(dx, qw, q);
+        QWeight pt(w->getData(), K, N, N, 1, false);
+        Tensor<float> * pt_out = OPS::QMatMul(dx, pt, q);
+        if(N > 1) passed &= rel_err(pc, full) < rel_err(pt_out, full);
+
+        //uint8 out: requantized GEMM against quantizing the float result
+        QParams qo = choose_qparams(0, 4);
+        QTensor qy = OPS::QMatMul(qx, qw, qo, bias->getData(), true);
+        QTensor qref(ref, qo);
+        for(int i=0; i<qy.getTotalElements(); i++) passed &= abs(qy.getData()[i] - qref.getData()[i]) <= 1;
+
+        OPS::release_graph(ref); OPS::release_graph(full);
+        delete x; delete dx; delete w; delete dw; delete bias; delete out; delete pc; delete pt_out;
+
+        //Layers against their float versions, calibrated on a few batches and run on the last one
+        Linear<float> lin(64, 48);
+        Conv2d<float> conv_(3, 8, 3, 2, 1);
+        //A percentile range clips the tails of the batches, so it is only checked to be narrower
+        Observer obs_lin, obs_conv, obs_pct(99.9);
+        Tensor<float> * xl = new Tensor<float>(2, 16, 64), * xc = new Tensor<float>(4, 2, 3, 11, 11);
+        for(int b=0; b<4; b++){
+            xl->randn();
+            xc->randn();
+            obs_lin.observe(xl);
+            obs_conv.observe(xc);
+            obs_pct.observe(xc);
+        }
+        passed &= obs_pct.qparams().scale < obs_conv.qparams().scale;
+        QLinear<float> qlin(lin, obs_lin.qparams());
+        QConv2d<float> qconv(conv_, obs_conv.qparams());
+        Tensor<float> * yl = lin.forward(xl), * yc = conv_.forward(xc);
+        Tensor<float> * ql = qlin.forward(xl), * qc = qconv.forward(xc);
+        passed &= ql->getTotalElements() == yl->getTotalElements() && qc->getTotalElements() == yc->getTotalElements();
+        for(int i=0; i<4; i++) passed &= qc->getDims()[i] == yc->getDims()[i];
+        passed &= rel_err(ql, yl) < 0.02 && rel_err(qc, yc) < 0.02;
+        OPS::release_graph(yl); OPS::release_graph(yc);
+        delete xl; delete xc; delete ql; delete qc;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testActivations(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        int shape[] = {3, 5, 70};
+
+        //ReLU gradient from the 1 bit mask, exact zeros give 0 (not NaN), in double and float
+        Tensor<double> * x = new Tensor<double>(3, shape);
+        Tensor<float> * xf = new Tensor<float>(3, shape);
+        x->randn();
+        for(int i=0; i<x->getTotalElements(); i+=7) x->getData()[i] = 0;
+        for(int i=0; i<x->getTotalElements(); i++) xf->getData()[i] = x->getData()[i];
+        Tensor<double> * y = OPS::ReLU(x);
+        Tensor<float> * yf = OPS::ReLU(xf);
+        OPS::backward(y);
+        OPS::backward(yf);
+        for(int i=0; i<x->getTotalElements(); i++){
+            double expected = x->getData()[i] > 0 ? 1 : 0;
+            passed &= x->getGrad()->getData()[i] == expected && xf->getGrad()->getData()[i] == expected;
+        }
+        OPS::release_graph(y);
+        OPS::release_graph(yf);
+        BitMask mask;
+        mask.pack_positive(xf->getData(), xf->getTotalElements());
+        passed &= mask.bytes() == (size_t)(xf->getTotalElements() + 63) / 64 * 8;
+        delete xf;
+
+        //Dropout: the same (seed, stream) gives the same mask, the kept elements are scaled by 1/(1-p)
+        passed &= _check_unary_weighted([](Tensor<double> * in) { return OPS::DROPOUT(in, 0.3, 11, 2); }, 3, shape);
+        Tensor<double> * a = OPS::DROPOUT(x, 0.3, t, 5);
+        Tensor<double> * b = OPS::DROPOUT(x, 0.3, t, 5);
+        Tensor<double> * c = OPS::DROPOUT(x, 0.3, t, 6);
+        bool same = true, differ = false;
+        for(int i=0; i<x->getTotalElements(); i++){
+            double v = a->getData()[i];
+            passed &= v == 0 || fabs(v - x->getData()[i] / 0.7) < 1e-12;
+            same &= v == b->getData()[i];
+            differ |= v != c->getData()[i];
+        }
+        passed &= same && differ;
+        OPS::release_graph(a);
+        OPS::release_graph(b);
+        OPS::release_graph(c);
+
+        //Keep rate over a large tensor
+        Tensor<float> * ones = new Tensor<float>(2, 1000, 100);
+        ones->setAll(1);
+        Tensor<float> * kept = OPS::DROPOUT(ones, 0.25f, 100 + t);
+        int n_kept = 0;
+        for(int i=0; i<kept->getTotalElements(); i++) n_kept += kept->getData()[i] != 0;
+        passed &= fabs(n_kept / 100000.0 - 0.75) < 0.01;
+        OPS::release_graph(kept);
+        delete ones;
+
+        //The module draws a new mask every call in training and is the identity in eval
+        Dropout<double> drop(0.5, t);
+        Tensor<double> * d1 = drop.forward(x);
+        Tensor<double> * d2 = drop.forward(x);
+        differ = false;
+        for(int i=0; i<x->getTotalElements(); i++) differ |= d1->getData()[i] != d2->getData()[i];
+        passed &= differ;
+        OPS::release_graph(d1);
+        OPS::release_graph(d2);
+        drop.train(false);
+        passed &= drop.forward(x) == x;
+        delete x;
+
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testNormalization(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        int image[] = {3, 2, 4, 5}, flat[] = {6, 3}, channels[] = {2}, features[] = {5};
+        Tensor<double> * gamma = new Tensor<double>(1, channels);
+        Tensor<double> * beta = new Tensor<double>(1, channels);
+        Tensor<double> * x = new Tensor<double>(4, image);
+        Tensor<double> * gamma3 = new Tensor<double>(1, 3);
+        Tensor<double> * beta3 = new Tensor<double>(1, 3);
+        Tensor<double> * gamma5 = new Tensor<double>(1, features);
+        Tensor<double> * beta5 = new Tensor<double>(1, features);
+        Tensor<double> * mean = new Tensor<double>(1, channels);
+        Tensor<double> * var = new Tensor<double>(1, channels);
+        gamma->randn(); beta->randn(); x->randn(); gamma3->randn(); beta3->randn(); gamma5->randn(); beta5->randn();
+        mean->randn();
+        var->setAll(0.7);
+
+        //Training (batch statistics) and eval (running statistics), every input
+        for(int train=0; train<2; train++){
+            passed &= _check_unary_weighted([=](Tensor<double> * in) { return OPS::BATCHNORM(in, gamma, beta, mean, var, train == 1, 0.0); }, 4, image);
+            passed &= _check_unary_weighted([=](Tensor<double> * g) { return OPS::BATCHNORM(x, g, beta, mean, var, train == 1, 0.0); }, 1, channels);
+            passed &= _check_unary_weighted([=](Tensor<double> * b) { return OPS::BATCHNORM(x, gamma, b, mean, var, train == 1, 0.0); }, 1, channels);
+        }
+        passed &= _check_unary_weighted([=](Tensor<double> * in) { return OPS::BATCHNORM(in, gamma3, beta3, (Tensor<double>*)NULL, (Tensor<double>*)NULL, true); }, 2, flat);
+        passed &= _check_unary_weighted([=](Tensor<double> * in) { return OPS::LAYERNORM(in, gamma5, beta5); }, 4, image);
+        passed &= _check_unary_weighted([=](Tensor<double> * g) { return OPS::LAYERNORM(x, g, beta5); }, 1, features);
+        passed &= _check_unary_weighted([=](Tensor<double> * b) { return OPS::LAYERNORM(x, gamma5, b); }, 1, features);
+
+        //Welford statistics stay accurate on a large offset in float
+        Tensor<float> * shifted = new Tensor<float>(4, 4, 3, 7, 9);
+        shifted->randn();
+        for(int i=0; i<shifted->getTotalElements(); i++) shifted->getData()[i] = 1e4f + shifted->getData()[i] * (1 + i % 3);
+        Tensor<float> * g1 = new Tensor<float>(1, 3), * b1 = new Tensor<float>(1, 3), * rm = new Tensor<float>(1, 3), * rv = new Tensor<float>(1, 3);
+        g1->setAll(1); b1->setAll(0); rm->setAll(0); rv->setAll(0);
+        Tensor<float> * y = OPS::BATCHNORM(shifted, g1, b1, rm, rv, true, 1.0f);
+        for(int c=0; c<3; c++){
+            double s = 0, s2 = 0, ys = 0, ys2 = 0;
+            int n = 0;
+            for(int b=0; b<4; b++) for(int h=0; h<7; h++) for(int w=0; w<9; w++){
+                s += shifted->get(4, b, c, h, w);
+                ys += y->get(4, b, c, h, w);
+                ys2 += y->get(4, b, c, h, w) * y->get(4, b, c, h, w);
+                n++;
+            }
+            for(int b=0; b<4; b++) for(int h=0; h<7; h++) for(int w=0; w<9; w++) s2 += pow(shifted->get(4, b, c, h, w) - s / n, 2);
+            passed &= fabs(rm->getData()[c] - s / n) < 1e-2 && fabs(rv->getData()[c] / (s2 / (n - 1)) - 1) < 1e-3;
+            passed &= fabs(ys / n) < 1e-3 && fabs(ys2 / n - 1) < 1e-2;
+        }
+        delete y; delete g1; delete b1; delete rm; delete rv; delete shifted;
+
+        //Folding an eval BatchNorm into the layer before it leaves the output unchanged
+        Conv2d<double> * conv = new Conv2d<double>(2, 3, 3, 1, 1);
+        BatchNorm<double> * bn = new BatchNorm<double>(3);
+        Linear<double> * fc = new Linear<double>(4, 6);
+        BatchNorm<double> * bn2 = new BatchNorm<double>(6);
+        Sequential<double> cnn, mlp;
+        cnn.add(conv).add(bn);
+        mlp.add(fc).add(bn2);
+        Tensor<double> * inputs[2] = {new Tensor<double>(4, 2, 2, 3, 4), new Tensor<double>(2, 5, 4)};
+        Sequential<double> * nets[2] = {&cnn, &mlp};
+        for(int k=0; k<2; k++){
+            std::vector<Tensor<double>*> params = nets[k]->parameters();
+            for(size_t i=0; i<params.size(); i++) params[i]->randn();
+            nets[k]->train(false);
+            inputs[k]->randn();
+        }
+        bn->mean()->randn(); bn->var()->setAll(2.5); bn2->mean()->randn(); bn2->var()->setAll(0.3);
+        for(int k=0; k<2; k++){
+            Tensor<double> * before = nets[k]->forward(inputs[k]);
+            Tensor<double> * expected = new Tensor<double>(before->getData(), before->getNDims(), before->getDims());
+            OPS::release_graph(before);
+            if(k == 0) bn->fold_into(*conv);
+            else bn2->fold_into(*fc);
+            Tensor<double> * after = nets[k]->forward(inputs[k]);
+            for(int i=0; i<after->getTotalElements(); i++) passed &= fabs(after->getData()[i] - expected->getData()[i]) < 1e-9;
+            OPS::release_graph(after);
+            delete expected;
+            delete inputs[k];
+        }
+
+        delete gamma; delete beta; delete x; delete gamma3; delete beta3; delete gamma5; delete beta5; delete mean; delete var;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testModule(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        Sequential<double> cnn;
+        cnn.add(new Conv2d<double>(2, 3, 3, 1, 1)).add(new ReLU<double>()).add(new MaxPool2d<double>(2, 1)).add(new Conv2d<double>(3, 2, 2, 2));
+        Tensor<double> * image = new Tensor<double>(4, 2, 2, 5, 4);
+        image->randn();
+
+        Sequential<double> mlp;
+        Sequential<double> * head = new Sequential<double>();
+        head->add(new ReLU<double>()).add(new Linear<double>(4, 2));
+        mlp.add(new Linear<double>(5, 4)).add(head);
+        Tensor<double> * batch = new Tensor<double>(2, 3, 5);
+        batch->randn();
+
+        if(_check_module(cnn, image) && _check_module(mlp, batch)) count++;
+        delete image;
+        delete batch;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+template <typename T>
+class _ResidualHead: public Module<T> {
+    //softmax(relu(xW + b) + x), an ADD and a SOFTMAX between activations
+    public:
+        _ResidualHead(int features) { layer = this->register_module(new Linear<T>(features, features)); }
+        Tensor<T> * forward(Tensor<T> * input) { return OPS::SOFTMAX(OPS::ADD(layer->forward(input), input)); }
+    private:
+        Module<T> * layer;
+};
+
+bool _check_engine(Module<double> & model, Tensor<double> * input, int expected_steps) {
+    //The engine against the eager forward pass on the traced batch and on its first rows
+    model.train(false);
+    std::vector<Tensor<double>*> params = model.parameters();
+    for(size_t i=0; i<params.size(); i++)
+        for(int j=0; j<params[i]->getTotalElements(); j++) params[i]->getData()[j] += 0.1 * std::normal_distribution<double>()(generator);
+    InferenceEngine<double> engine(model, input);
+    bool passed = engine.steps() == expected_steps;
+
+    Tensor<double> * expected = model.forward(input);
+    Tensor<double> * out = engine.run(input);
+    passed &= out->getTotalElements() == expected->getTotalElements();
+    for(int i=0; i<out->getTotalElements() && passed; i++) passed &= fabs(out->getData()[i] - expected->getData()[i]) <= 1e-10 * (1 + fabs(expected->getData()[i]));
+
+    std::vector<double> rows(engine.output_size() * 2);
+    engine.run(input->getData(), 2, rows.data());
+    for(size_t i=0; i<rows.size(); i++) passed &= rows[i] == out->getData()[i];
+
+    //Frozen: updating the model does not change the engine
+    for(size_t i=0; i<params.size(); i++) params[i]->getData()[0] += 1;
+    Tensor<double> * again = engine.run(input);
+    for(int i=0; i<out->getTotalElements(); i++) passed &= again->getData()[i] == out->getData()[i];
+
+    OPS::release_graph(expected);
+    delete out;
+    delete again;
+    return passed;
+}
+
+bool testInference(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        //Linear + BatchNorm + ReLU collapse into one GEMM step, Dropout is gone in eval mode
+        Sequential<double> mlp;
+        mlp.add(new Linear<double>(6, 16)).add(new BatchNorm<double>(16)).add(new ReLU<double>()).add(new Dropout<double>(0.5))
+           .add(new Linear<double>(16, 16)).add(new ReLU<double>()).add(new Linear<double>(16, 3));
+        Tensor<double> * batch = new Tensor<double>(2, 7, 6);
+        batch->randn();
+
+        //PAD + CONV + bias + BatchNorm + ReLU are one step, then the two pools and the last CONV
+        Sequential<double> cnn;
+        cnn.add(new Conv2d<double>(2, 4, 3, 1, 1)).add(new BatchNorm<double>(4)).add(new ReLU<double>()).add(new MaxPool2d<double>(2, 1))
+           .add(new AvgPool2d<double>(2, 1, 1)).add(new Conv2d<double>(4, 3, 2, 2));
+        Tensor<double> * image = new Tensor<double>(4, 3, 2, 7, 6);
+        image->randn();
+
+        //GEMM (bias, ReLU), ADD, SOFTMAX
+        _ResidualHead<double> head(5);
+        Tensor<double> * x = new Tensor<double>(2, 4, 5);
+        x->randn();
+
+        if(_check_engine(mlp, batch, 3) && _check_engine(cnn, image, 4) && _check_engine(head, x, 3)) count++;
+        delete batch;
+        delete image;
+        delete x;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool _same(Tensor<double> * a, Tensor<double> * b) {
+    bool passed = a->getNDims() == b->getNDims() && a->getTotalElements() == b->getTotalElements();
+    for(int d=0; d<a->getNDims() && passed; d++) passed &= a->getDims()[d] == b->getDims()[d];
+    for(long i=0; i<a->getTotalElements() && passed; i++) passed &= fabs(a->getData()[i] - b->getData()[i]) <= 1e-10 * (1 + fabs(b->getData()[i]));
+    return passed;
+}
+
+bool testLayouts(int tests){
+    //The image ops in NHWC and NCHWc (blocks of 4) against NCHW, then the engine in every format
+    typedef std::function<Tensor<double>*(Tensor<double>*)> Image_op;
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        int shape[] = {2, 8, 5, 6};
+        Tensor<double> * K = new Tensor<double>(4, 8, 8, 3, 2);
+        Tensor<double> * gamma = new Tensor<double>(1, 8), * beta = new Tensor<double>(1, 8);
+        K->randn();
+        gamma->randn();
+        beta->randn();
+        std::vector<Image_op> ops = {
+            [K](Tensor<double> * x) { return OPS::CONV(x, K, std::make_pair(2, 1)); },
+            [](Tensor<double> * x) { return OPS::PAD(x, 1, 2); },
+            [](Tensor<double> * x) { return OPS::MAXPOOL2D(x, std::make_pair(3, 2), std::make_pair(2, 1), std::make_pair(1, 1)); },
+            [](Tensor<double> * x) { return OPS::AVGPOOL2D(x, std::make_pair(2, 3), std::make_pair(1, 2), std::make_pair(1, 1)); },
+            [](Tensor<double> * x) { return OPS::GLOBAL_MAXPOOL2D(x); },
+            [](Tensor<double> * x) { return OPS::ReLU(OPS::ADD(x, x)); },
+            [gamma, beta](Tensor<double> * x) { return OPS::BATCHNORM(x, gamma, beta, (Tensor<double>*)NULL, (Tensor<double>*)NULL, true); }
+        };
+        const MemoryFormat formats[] = {FORMAT_NHWC, FORMAT_NCHWC};
+        for(int f=0; f<2; f++)
+            for(size_t o=0; o<ops.size(); o++){
+                //BATCHNORM of blocked channels is not supported
+                if(formats[f] == FORMAT_NCHWC && o + 1 == ops.size()) continue;
+                //Into the format and back, so the gradient goes through both TO_FORMATs too
+                MemoryFormat format = formats[f];
+                Image_op op = ops[o];
+                Image_op in_format = [format, op](Tensor<double> * x) { return OPS::TO_FORMAT(op(OPS::TO_FORMAT(x, format, 4)), FORMAT_NCHW); };
+                Tensor<double> * x = new Tensor<double>(4, shape);
+                x->randn();
+                Tensor<double> * expected = op(x), * out = in_format(x);
+                passed &= out->getFormat() == FORMAT_NCHW && _same(out, expected);
+
+                //Same gradients for x and the parameters from a random weighting of both outputs
+                Tensor<double> * w = new Tensor<double>(expected->getNDims(), expected->getDims());
+                w->randn();
+                std::vector<Tensor<double>*> leaves = {x, K, gamma, beta};
+                std::vector<Tensor<double>*> grads(leaves.size(), (Tensor<double>*)NULL);
+                Tensor<double> * losses[] = {OPS::MULT(expected, w), OPS::MULT(out, w)};
+                for(int r=0; r<2; r++){
+                    OPS::backward(losses[r]);
+                    for(size_t l=0; l<leaves.size(); l++){
+                        if(!leaves[l]->is_grad_init()) continue;
+                        if(r == 0) grads[l] = new Tensor<double>(*leaves[l]->getGrad());
+                        else passed &= grads[l] != NULL && _same(leaves[l]->getGrad(), grads[l]);
+                        leaves[l]->getGrad()->setAll(0);
+                    }
+                    OPS::release_graph(losses[r]);
+                }
+                for(size_t l=0; l<leaves.size(); l++) delete grads[l];
+                delete w;
+                delete x;
+            }
+        delete K;
+        delete gamma;
+        delete beta;
+
+        //The engine keeps every CONV output in the format: NHWC reorders once before the (NCHW) output,
+        //the last CONV has 6 channels, not a multiple of the block, so NCHWc falls back to NCHW there
+        Sequential<double> cnn;
+        cnn.add(new Conv2d<double>(3, 8, 3, 1, 1)).add(new BatchNorm<double>(8)).add(new ReLU<double>()).add(new MaxPool2d<double>(2))
+           .add(new Conv2d<double>(8, 8, 3, 1, 1)).add(new BatchNorm<double>(8)).add(new AvgPool2d<double>(2, 1))
+           .add(new Conv2d<double>(8, 6, 2, 1));
+        cnn.train(false);
+        Tensor<double> * image = new Tensor<double>(4, 3, 3, 10, 9);
+        image->randn();
+        Tensor<double> * expected = cnn.forward(image);
+        const MemoryFormat engine_formats[] = {FORMAT_NCHW, FORMAT_NHWC, FORMAT_NCHWC};
+        const int reorders[] = {0, 1, 0};
+        for(int f=0; f<3; f++){
+            InferenceEngine<double> engine(cnn, image, engine_formats[f], 4);
+            passed &= engine.reorders() == reorders[f] && engine.steps() == 5 + reorders[f];
+            Tensor<double> * out = engine.run(image);
+            passed &= _same(out, expected);
+            delete out;
+        }
+        OPS::release_graph(expected);
+        delete image;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool _check_stats(const ServerStats & s, int requests, int max_batch, int clients) {
+    long counted = 0, batches = 0;
+    for(size_t b=0; b<s.batch_sizes.size(); b++){
+        counted += b * s.batch_sizes[b];
+        batches += s.batch_sizes[b];
+    }
+    return s.requests == requests && counted == requests && batches == s.batches && s.batch_sizes.size() == (size_t)max_batch + 1
+        && s.batch_sizes[0] == 0 && s.queue_depth == 0 && s.max_queue_depth >= 1 && s.max_queue_depth <= clients
+        && s.p50 > 0 && s.p50 <= s.p99 && s.mean_batch >= 1;
+}
+
+bool testServer(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        Sequential<double> model;
+        model.add(new Linear<double>(6, 16)).add(new ReLU<double>()).add(new Linear<double>(16, 3));
+        model.train(false);
+        const int clients = 4, samples = 100, max_batch = 8;
+        Tensor<double> * x = new Tensor<double>(2, samples, 6);
+        x->randn();
+        Tensor<double> * expected = model.forward(x);
+        Tensor<double> example(2, max_batch, 6);
+        InferenceEngine<double> engine(model, &example);
+
+        //Every client thread sends its share of the samples one at a time, in process and over the socket
+        std::vector<double> local(samples * 3), remote(samples * 3);
+        bool passed = true;
+        {
+            InferenceServer<double> server(engine, max_batch, 1e-3);
+            std::vector<std::thread> threads;
+            for(int c=0; c<clients; c++) threads.push_back(std::thread([&, c]{
+                for(int i=c; i<samples; i+=clients) server.infer(x->getData() + i * 6, local.data() + i * 3);
+            }));
+            for(int c=0; c<clients; c++) threads[c].join();
+            passed &= _check_stats(server.stats(), samples, max_batch, clients);
+
+            server.reset_stats();
+            server.listen("/tmp/lennygrad_serve_test.sock");
+            threads.clear();
+            for(int c=0; c<clients; c++) threads.push_back(std::thread([&, c]{
+                InferenceClient<double> client("/tmp/lennygrad_serve_test.sock");
+                for(int i=c; i<samples; i+=clients) client.infer(x->getData() + i * 6, remote.data() + i * 3);
+            }));
+            for(int c=0; c<clients; c++) threads[c].join();
+            passed &= _check_stats(server.stats(), samples, max_batch, clients);
+        }
+
+        //Rows of a batch are computed independently, so the batch a request landed in does not matter
+        for(int i=0; i<samples * 3; i++){
+            passed &= fabs(local[i] - expected->getData()[i]) <= 1e-10 * (1 + fabs(expected->getData()[i]));
+            passed &= remote[i] == local[i];
+        }
+        if(passed) count++;
+        OPS::release_graph(expected);
+        delete x;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testDataLoader(int epochs){
+    //Sample i is filled with the value i so every batch can be checked
+    const int samples = 103;
+    Tensor<double> * values = new Tensor<double>(3, samples, 3, 2);
+    Tensor<double> * labels = new Tensor<double>(1, samples);
+    for(int i=0; i<values->getTotalElements(); i++) values->getData()[i] = i / 6;
+    for(int i=0; i<samples; i++) labels->getData()[i] = i;
+    std::string path = "/tmp/lennygrad_loader_test.bin";
+    save_array(values, path);
+
+    int count = 0;
+    {
+        ArrayFileDataset<double> inputs(path);
+        TensorDataset<double> targets(labels);
+        DataLoader<double> loader(&inputs, &targets, 8, 3, 2, true, false);
+        for(int e=0; e<epochs; e++){
+            bool passed = true;
+            std::vector<int> seen(samples, 0);
+            Batch<double> batch;
+            int n_batches = 0;
+            while(loader.next(batch)){
+                n_batches++;
+                for(int i=0; i<batch.size; i++){
+                    int label = batch.target->getData()[i];
+                    seen[label]++;
+                    for(int j=0; j<6; j++) passed &= batch.input->getData()[i*6 + j] == label;
+                }
+            }
+            passed &= n_batches == loader.batches() && n_batches == 13;
+            for(int i=0; i<samples; i++) passed &= seen[i] == 1;
+            passed &= loader.stats().batches == 13 * (e + 1);
+            if(passed) count++;
+        }
+    }
+    std::remove(path.c_str());
+    delete values;
+    delete labels;
+    std::cout << "PASSED: " << count << "/" << epochs << std::endl;
+    return count == epochs;
+}
+
+Module<double> * _small_mlp(){
+    Sequential<double> * model = new Sequential<double>();
+    model->add(new Linear<double>(6, 8)).add(new ReLU<double>()).add(new Linear<double>(8, 3));
+    return model;
+}
+
+Tensor<double> * _squared_error(Module<double> & model, Tensor<double> * x, Tensor<double> * y){
+    Tensor<double> * diff = OPS::SUB(model.forward(x), y);
+    return OPS::MULT(diff, diff);
+}
+
+bool testDataParallel(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        Tensor<double> * x = new Tensor<double>(2, 12, 6);
+        Tensor<double> * y = new Tensor<double>(2, 12, 3);
+        x->randn();
+        y->randn();
+
+        //The reduced gradient must not depend on the number of threads
+        std::vector<double> reference;
+        unsigned seed = generator();
+        for(int threads=1; threads<=4; threads+=3){
+            generator.seed(seed);
+            DataParallel<double> parallel(_small_mlp, 4, threads, 40);
+            parallel.step(x, y, _squared_error);
+            ParameterBuffer<double> * flat = parallel.model().flat();
+            std::vector<double> grad(flat->getGrad(), flat->getGrad() + flat->size());
+            if(reference.empty()) reference = grad;
+            passed &= grad == reference;
+
+            //And it must match the full batch gradient (4 equal shards of a summed loss)
+            parallel.model().zero_grad();
+            Tensor<double> * loss = _squared_error(parallel.model(), x, y);
+            OPS::backward(loss);
+            OPS::release_graph(loss);
+            for(int i=0; i<flat->size(); i++) passed &= fabs(flat->getGrad()[i] / 4 - grad[i]) < ERR;
+        }
+        if(passed) count++;
+        delete x;
+        delete y;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+Module<double> * _deep_mlp(){
+    Sequential<double> * model = new Sequential<double>();
+    model->add(new Linear<double>(6, 16)).add(new ReLU<double>()).add(new Linear<double>(16, 16)).add(new ReLU<double>()).add(new Linear<double>(16, 3));
+    return model;
+}
+
+Module<double> * _small_cnn(){
+    Sequential<double> * model = new Sequential<double>();
+    model->add(new Conv2d<double>(2, 4, 3, 1, 1)).add(new ReLU<double>()).add(new MaxPool2d<double>(2, 1)).add(new Conv2d<double>(4, 3, 2, 2));
+    return model;
+}
+
+bool testSavedActivations(int tests){
+    const SavedFormat formats[] = {SAVED_FULL, SAVED_BF16, SAVED_FP16, SAVED_INT8};
+    //Largest relative gradient error allowed for each format
+    const double tolerance[] = {0, 1e-2, 2e-3, 2e-2};
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        //Independent of the tests run before: training is compared with the full precision run from a fixed start
+        generator.seed(t);
+        srand(t);
+
+        //Round trip error of the codecs
+        std::vector<double> x(1000);
+        for(size_t i=0; i<x.size(); i++) x[i] = (rand() / (double)RAND_MAX - 0.5) * pow(2.0, (int)(i % 11) - 5);
+        std::vector<double> y(x.size());
+        PackedStorage(x.data(), x.size(), SAVED_BF16).decode(y.data());
+        for(size_t i=0; i<x.size(); i++) passed &= fabs(y[i] - x[i]) <= fabs(x[i]) * pow(2.0, -8);
+        PackedStorage(x.data(), x.size(), SAVED_FP16).decode(y.data());
+        for(size_t i=0; i<x.size(); i++) passed &= fabs(y[i] - x[i]) <= fabs(x[i]) * pow(2.0, -11) + 1e-7;
+        PackedStorage(x.data(), x.size(), SAVED_INT8).decode(y.data());
+        for(size_t b=0; b<x.size(); b+=PACK_INT8_BLOCK){
+            double absmax = 0;
+            for(size_t i=b; i<std::min(x.size(), b + PACK_INT8_BLOCK); i++) absmax = std::max(absmax, fabs(x[i]));
+            for(size_t i=b; i<std::min(x.size(), b + PACK_INT8_BLOCK); i++) passed &= fabs(y[i] - x[i]) <= absmax / 254 * 1.0001;
+        }
+
+        Module<double> * (*factories[2])() = {_deep_mlp, _small_cnn};
+        Tensor<double> * inputs[2] = {new Tensor<double>(2, 12, 6), new Tensor<double>(4, 3, 2, 6, 6)};
+        Tensor<double> * targets[2] = {new Tensor<double>(2, 12, 3), new Tensor<double>(4, 3, 3, 2, 2)};
+        for(int k=0; k<2; k++){
+            inputs[k]->randn();
+            targets[k]->randn();
+            unsigned seed = generator();
+            std::vector<double> reference;
+            double start = 0, full = 0;
+            for(int f=0; f<4; f++){
+                generator.seed(seed);
+                Module<double> * model = factories[k]();
+                model->save_activations(formats[f]);
+                ParameterBuffer<double> * flat = model->flat();
+
+                //One gradient: the intermediate tensors are packed and the gradient is close to the full precision one
+                Tensor<double> * loss = _squared_error(*model, inputs[k], targets[k]);
+                std::vector<Tensor<double>*> graph = OPS::_topological_order(loss);
+                size_t packed = 0, dense = 0;
+                for(size_t i=0; i<graph.size(); i++)
+                    if(graph[i]->is_packed()) {
+                        packed += graph[i]->packed_bytes();
+                        dense += sizeof(double) * graph[i]->getTotalElements();
+                    }
+                passed &= f == 0 ? packed == 0 : packed > 0 && packed * 3 < dense;
+                OPS::backward(loss);
+                OPS::release_graph(loss);
+                std::vector<double> grad(flat->getGrad(), flat->getGrad() + flat->size());
+                if(f == 0) reference = grad;
+                double diff = 0, norm = 0;
+                for(size_t i=0; i<grad.size(); i++){
+                    diff += pow(grad[i] - reference[i], 2);
+                    norm += pow(reference[i], 2);
+                }
+                passed &= sqrt(diff) <= tolerance[f] * sqrt(norm);
+
+                //Training converges like the full precision run
+                SGD<double> sgd(flat, 0.002);
+                for(int step=0; step<100; step++){
+                    model->zero_grad();
+                    loss = _squared_error(*model, inputs[k], targets[k]);
+                    double value = 0;
+                    for(int i=0; i<loss->getTotalElements(); i++) value += loss->getData()[i];
+                    if(step == 0 && f == 0) start = value;
+                    if(step == 99 && f == 0) full = value;
+                    if(step == 99) passed &= value < 0.5 * start && fabs(value - full) < 0.01 * start;
+                    OPS::backward(loss);
+                    OPS::release_graph(loss);
+                    sgd.step();
+                }
+                delete model;
+            }
+            delete inputs[k];
+            delete targets[k];
+        }
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+//Rank 0 of 2 whose peer is gone
+class _BrokenTransport: public Transport {
+    public:
+        int rank() const { return 0; }
+        int size() const { return 2; }
+        void send(int, const void *, size_t) { throw std::runtime_error("BROKEN"); }
+        void recv(int, void *, size_t) { throw std::runtime_error("BROKEN"); }
+        void sendrecv(int, const void *, size_t, int, void *, size_t) { throw std::runtime_error("BROKEN"); }
+};
+
+bool testCollectives(int tests){
+    //Run t launches t + 1 ranks, so ring sizes 1, 2, 3, ... are covered
+    //Created before the fork, the children get their own threads for it
+    ThreadPool pool(3);
+    int count = 0;
+    for(int t=0; t<tests; t++) count += spawn_local(t + 1, [&pool](Transport * transport){
+        Communicator<double> comm(transport);
+        int r = comm.rank(), p = comm.size();
+        bool ok = true;
+
+        std::atomic<int> ran{0};
+        for(int run=0; run<3; run++) pool.run(64, [&](int i){ ran += i; });
+        ok &= ran == 3 * 64 * 63 / 2;
+
+        //Sizes smaller than, equal to and not divisible by the number of ranks
+        int sizes[] = {1, p, 1001};
+        for(int n : sizes){
+            std::vector<double> data(n);
+            for(int i=0; i<n; i++) data[i] = r * 1000 + i;
+            comm.all_reduce(data.data(), n);
+            for(int i=0; i<n; i++) ok &= data[i] == 1000.0 * p * (p-1) / 2 + (double)p * i;
+
+            for(int i=0; i<n; i++) data[i] = (r == p-1) ? i : -1;
+            comm.broadcast(data.data(), n, p-1);
+            for(int i=0; i<n; i++) ok &= data[i] == i;
+
+            std::vector<double> gathered(n * p);
+            for(int i=0; i<n; i++) data[i] = r + i;
+            comm.all_gather(data.data(), n, gathered.data());
+            for(int q=0; q<p; q++) for(int i=0; i<n; i++) ok &= gathered[q*n + i] == q + i;
+        }
+
+        //Bucketed gradient averaging must match averaging the full buffer
+        generator.seed(7);
+        Module<double> * model = _small_mlp();
+        generator.seed(100 + r);
+        Tensor<double> * x = new Tensor<double>(2, 5, 6);
+        Tensor<double> * y = new Tensor<double>(2, 5, 3);
+        x->randn();
+        y->randn();
+        ParameterBuffer<double> * flat = model->flat();
+
+        model->zero_grad();
+        Tensor<double> * loss = _squared_error(*model, x, y);
+        OPS::backward(loss);
+        OPS::release_graph(loss);
+        std::vector<double> expected(flat->getGrad(), flat->getGrad() + flat->size());
+        comm.all_reduce(expected.data(), flat->size());
+
+        {
+            GradientSync<double> sync(&comm, model, 20);
+            for(int step=0; step<2; step++){
+                model->zero_grad();
+                loss = _squared_error(*model, x, y);
+                sync.backward(loss);
+                OPS::release_graph(loss);
+                for(int i=0; i<flat->size(); i++) ok &= fabs(flat->getGrad()[i] - expected[i] / p) < ERR;
+            }
+        }
+
+        //A model without parameters has nothing to wait for
+        {
+            Sequential<double> empty;
+            empty.add(new ReLU<double>());
+            GradientSync<double> sync(&comm, &empty);
+            loss = empty.forward(x);
+            sync.backward(loss);
+            OPS::release_graph(loss);
+        }
+
+        //A failed transfer reaches the caller of backward() instead of terminating the process
+        {
+            _BrokenTransport broken;
+            Communicator<double> broken_comm(&broken);
+            GradientSync<double> sync(&broken_comm, model);
+            model->zero_grad();
+            loss = _squared_error(*model, x, y);
+            bool thrown = false;
+            try { sync.backward(loss); } catch(const std::runtime_error &) { thrown = true; }
+            ok &= thrown;
+            OPS::release_graph(loss);
+        }
+        delete x;
+        delete y;
+        delete model;
+        return ok;
+    });
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testSoftmax(int tests){
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        for(int axis=-1; axis<3; axis++){
+            auto softmax = [axis](Tensor<double> * x) { return OPS::SOFTMAX(x, axis); };
+            auto log_softmax = [axis](Tensor<double> * x) { return OPS::LOG_SOFTMAX(x, axis); };
+
+            //Softmax sums to a constant, so weight the outputs to get a non trivial gradient
+            Tensor<double> * weights = new Tensor<double>(3,5,4,2);
+            weights->randn();
+            for(int f=0; f<2; f++){
+                Tensor<double> * x = new Tensor<double>(3,5,4,2);
+                x->randn();
+                passed &= f == 0 ? grad_check_unary(softmax, x, weights) : grad_check_unary(log_softmax, x, weights);
+                delete x;
+            }
+            delete weights;
+
+            //Targets hold one class per row, in the order of the input with axis removed
+            int dims[] = {5, 4, 2};
+            int n_axis = axis < 0 ? 2 : axis;
+            int kept[2], k = 0;
+            for(int i=0; i<3; i++) if(i != n_axis) kept[k++] = dims[i];
+            Tensor<double> * target = new Tensor<double>(2, kept);
+            for(int i=0; i<target->getTotalElements(); i++) target->getData()[i] = rand() % dims[n_axis];
+            target->no_history();
+            auto cross_entropy = [axis, target](Tensor<double> * x) { return OPS::CROSS_ENTROPY(x, target, axis); };
+            Tensor<double> * x = new Tensor<double>(3,5,4,2);
+            x->randn();
+            passed &= grad_check_unary(cross_entropy, x);
+            delete x;
+            delete target;
+        }
+
+        //Large logits must not overflow
+        Tensor<double> * x = new Tensor<double>(2, 3, 4);
+        x->randn();
+        for(int i=0; i<x->getTotalElements(); i++) x->getData()[i] *= 1000;
+        Tensor<double> * y = OPS::SOFTMAX(x);
+        Tensor<double> * log_y = OPS::LOG_SOFTMAX(x);
+        for(int r=0; r<3; r++){
+            double sum = 0;
+            for(int c=0; c<4; c++) {
+                sum += y->get(2, r, c);
+                passed &= std::isfinite(log_y->get(2, r, c));
+            }
+            passed &= fabs(sum - 1) < ERR;
+        }
+        delete y;
+        delete log_y;
+        delete x;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testReductions(int tests){
+    int count = 0;
+    const std::vector<std::vector<int>> axis_sets = {{}, {0}, {1}, {2}, {-1}, {0, 2}, {1, 2}, {0, 1}};
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        for(size_t a=0; a<axis_sets.size(); a++){
+            for(int keepdim=0; keepdim<2; keepdim++){
+                std::vector<int> axes = axis_sets[a];
+                auto sum = [axes, keepdim](Tensor<double> * x) { return OPS::SUM(x, axes, keepdim); };
+                auto mean = [axes, keepdim](Tensor<double> * x) { return OPS::MEAN(x, axes, keepdim); };
+                auto max = [axes, keepdim](Tensor<double> * x) { return OPS::MAX(x, axes, keepdim); };
+                auto min = [axes, keepdim](Tensor<double> * x) { return OPS::MIN(x, axes, keepdim); };
+
+                //Sum and mean of every axis have a constant gradient, weight the outputs
+                Tensor<double> * shape = new Tensor<double>(3,4,3,5);
+                Tensor<double> * probe = OPS::SUM(shape, axes, keepdim);
+                Tensor<double> * weights = new Tensor<double>(probe->getNDims(), probe->getDims());
+                weights->randn();
+                for(int f=0; f<4; f++){
+                    Tensor<double> * x = new Tensor<double>(3,4,3,5);
+                    x->randn();
+                    if(f == 0) passed &= grad_check_unary(sum, x, weights);
+                    if(f == 1) passed &= grad_check_unary(mean, x, weights);
+                    if(f == 2) passed &= grad_check_unary(max, x, weights);
+                    if(f == 3) passed &= grad_check_unary(min, x, weights);
+                    delete x;
+                }
+                delete weights;
+                delete probe;
+                delete shape;
+            }
+        }
+
+        //Forward values against a plain loop, middle axis of a (7, 33, 9) tensor
+        Tensor<double> * x = new Tensor<double>(3, 7, 33, 9);
+        x->randn();
+        Tensor<double> * s = OPS::SUM(x, {1});
+        Tensor<double> * m = OPS::MAX(x, {0, 2}, true);
+        Tensor<double> * arg = OPS::ARGMAX(x, 1);
+        passed &= s->getNDims() == 2 && m->getNDims() == 3 && m->getDims()[1] == 33;
+        for(int i=0; i<7; i++){
+            for(int k=0; k<9; k++){
+                double total = 0, best = x->get(3, i, 0, k);
+                int best_at = 0;
+                for(int j=0; j<33; j++){
+                    total += x->get(3, i, j, k);
+                    if(x->get(3, i, j, k) > best) { best = x->get(3, i, j, k); best_at = j; }
+                }
+                passed &= fabs(s->get(2, i, k) - total) < ERR;
+                passed &= arg->get(2, i, k) == best_at;
+            }
+        }
+        for(int j=0; j<33; j++){
+            double best = x->get(3, 0, j, 0);
+            for(int i=0; i<7; i++) for(int k=0; k<9; k++) best = std::max(best, x->get(3, i, j, k));
+            passed &= m->get(3, 0, j, 0) == best;
+        }
+        delete s;
+        delete m;
+        delete arg;
+        delete x;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    return count == tests;
+}
+
+bool testJIT(int tests){
+    char dir[] = "/tmp/lennygrad-jit-test-XXXXXX";
+    if(mkdtemp(dir) == NULL) return false;
+    int count = 0;
+    for(int t=0; t<tests; t++){
+        bool passed = true;
+        Tensor<double> * a = new Tensor<double>(3,5,4,6);
+        Tensor<double> * b = new Tensor<double>(3,5,4,6);
+        Tensor<double> * bias = new Tensor<double>(1,6);
+        a->randn();
+        b->randn();
+        bias->randn();
+
+        //Mean over the trailing axes of a fused chain, and a chain over a broadcast input
+        Tensor<double> * sum = OPS::ADD(a, b);
+        Tensor<double> * neg = OPS::NEG(sum);
+        Tensor<double> * exp = OPS::EXP(neg);
+        Tensor<double> * relu = OPS::ReLU(a);
+        Tensor<double> * prod = OPS::MULT(exp, relu);
+        Tensor<double> * mean = OPS::MEAN(prod, {1, 2});
+        Tensor<double> * shifted = OPS::ADD(a, bias);
+        Tensor<double> * out = OPS::EXP(OPS::DIV(shifted, b));
+        Tensor<double> * roots[] = {mean, out};
+
+        for(int r=0; r<2; r++){
+            //The second JIT starts with a warm disk cache
+            for(int warm=0; warm<2; warm++){
+                JIT jit(dir);
+                JITKernel<double> kernel = jit.compile(roots[r]);
+                passed &= kernel.valid();
+                if(!kernel.valid()) continue;
+                passed &= t > 0 || (warm ? jit.loaded() == 1 && jit.compiled() == 0 : jit.compiled() == 1);
+                Tensor<double> * y = kernel();
+                passed &= y->getTotalElements() == roots[r]->getTotalElements();
+                for(int i=0; i<y->getTotalElements(); i++)
+                    passed &= fabs(y->getData()[i] - roots[r]->getData()[i]) < ERR;
+                delete y;
+            }
+        }
+        //Nothing is loaded from a cache others can write to
+        if(t == 0){
+            chmod(dir, 0777);
+            std::streambuf * err = std::cerr.rdbuf(NULL);
+            JIT jit(dir);
+            passed &= !jit.compile(mean).valid();
+            std::cerr.rdbuf(err);
+            chmod(dir, 0700);
+        }
+        OPS::release_graph(out);
+        OPS::release_graph(mean);
+        delete a;
+        delete b;
+        delete bias;
+        if(passed) count++;
+    }
+    std::cout << "PASSED: " << count << "/" << tests << std::endl;
+    std::system((std::string("rm -rf ") + dir).c_str());
+    return count == tests;
+}
 
 bool run_tests() {
     std::ifstream tensor_file;
@@ -220,11 +1870,21 @@ bool run_tests() {
     passed_tests &= testGrad(tests, OPS::DIV<double>, false);
     std::cout << "===========================================================" << std::endl;
 
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING BROADCAST GRADIENTS" << std::endl;
+    passed_tests &= testBroadcast(10);
+    std::cout << "===========================================================" << std::endl;
+
     std::cout << "===========================================================" << std::endl;
     std::cout << "TESTING MATMULT GRADIENTS" << std::endl;
     passed_tests &= testGrad(tests, OPS::MatMul<double>, true);
     std::cout << "===========================================================" << std::endl;
 
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING MATMUL KERNELS" << std::endl;
+    passed_tests &= testMatMulKernels(10);
+    std::cout << "===========================================================" << std::endl;
+
     std::cout << "===========================================================" << std::endl;
     std::cout << "TESTING NEG GRADIENTS" << std::endl;
     passed_tests &= testGrad_unary(tests, OPS::NEG<double>, true);
@@ -240,6 +1900,121 @@ bool run_tests() {
     passed_tests &= testGrad_unary(tests, OPS::EXP<double>, true);
     std::cout << "===========================================================" << std::endl;
 
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING ACTIVATIONS" << std::endl;
+    passed_tests &= testActivations(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING 16 BIT TYPES" << std::endl;
+    passed_tests &= testHalf(3);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING QUANTIZATION" << std::endl;
+    passed_tests &= testQuantization(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING INFERENCE ENGINE" << std::endl;
+    passed_tests &= testInference(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING MEMORY FORMATS" << std::endl;
+    passed_tests &= testLayouts(3);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING INFERENCE SERVER" << std::endl;
+    passed_tests &= testServer(3);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING FUSED EXPRESSION GRADIENTS" << std::endl;
+    passed_tests &= testFusion(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING MOVES AND OUT VARIANTS" << std::endl;
+    passed_tests &= testMoveAndOut(3);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING FIXED RANK TENSORS" << std::endl;
+    passed_tests &= testFixedTensor(3);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING PERMUTE GRADIENTS" << std::endl;
+    passed_tests &= testPermute(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING SLICING GRADIENTS" << std::endl;
+    passed_tests &= testSlicing(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING EMBEDDING" << std::endl;
+    passed_tests &= testEmbedding(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING SOFTMAX GRADIENTS" << std::endl;
+    passed_tests &= testSoftmax(100);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING REDUCTION GRADIENTS" << std::endl;
+    passed_tests &= testReductions(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING CONV GRADIENTS" << std::endl;
+    passed_tests &= testConvGrad(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING POOLING GRADIENTS" << std::endl;
+    passed_tests &= testPooling(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING NORMALIZATION GRADIENTS" << std::endl;
+    passed_tests &= testNormalization(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING JIT" << std::endl;
+    passed_tests &= testJIT(3);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING MODULES" << std::endl;
+    passed_tests &= testModule(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING DATA LOADER" << std::endl;
+    passed_tests &= testDataLoader(3);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING DATA PARALLEL" << std::endl;
+    passed_tests &= testDataParallel(10);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING ACTIVATION COMPRESSION" << std::endl;
+    passed_tests &= testSavedActivations(3);
+    std::cout << "===========================================================" << std::endl;
+
+    std::cout << "===========================================================" << std::endl;
+    std::cout << "TESTING COLLECTIVES" << std::endl;
+    passed_tests &= testCollectives(4);
+    std::cout << "===========================================================" << std::endl;
+
     return passed_tests;
 }
 
@@ -0,0 +1,243 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <vector>
+#include <cstdlib>
+#include <climits>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <new>
+
+#include <pthread.h>
+
+/*
+    Thread level parallelism
+    ThreadPool runs indexed tasks on a fixed set of threads,
+    the calling thread takes part so a pool of size 1 runs inline.
+    Tasks are handed out dynamically, results must therefore never
+    depend on which thread runs which task.
+    A forked child inherits every pool but none of its threads: a
+    pthread_atfork handler drops the inherited handles and resets the
+    locks (only the forking thread survives, whatever else held them is
+    gone), and the child's pool starts fresh threads on its first run.
+    Forking from inside a task is not supported.
+*/
+class ThreadPool {
+    public:
+        ThreadPool(int n_threads);
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool & operator=(const ThreadPool&) = delete;
+
+        /***************************************************************
+        * void run(int n_tasks, const std::function<void(int)> & task);
+        *
+        *   Description:
+        *       calls task(i) for every i in [0, n_tasks) and
+        *       returns once all of them have finished.
+        *       If the pool is already running tasks for another
+        *       caller the tasks run inline on the calling thread.
+        ***************************************************************/
+        void run(int n_tasks, const std::function<void(int)> & task);
+
+        /***************************************************************
+        * int size() const { return n_threads; }
+        *
+        *   Returns:
+        *       the number of threads (including the caller)
+        ***************************************************************/
+        int size() const { return n_threads; }
+
+    private:
+        void work();
+        void drain(const std::function<void(int)> & task, int n_tasks);
+        void after_fork();
+
+        static std::mutex & registry_lock();
+        static std::vector<ThreadPool*> & registry();
+
+        int n_threads;
+        std::vector<std::thread> workers;
+        std::mutex busy;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const std::function<void(int)> * task = NULL;
+        int n_tasks = 0;
+        std::atomic<int> next_task{0};
+        int finished = 0;
+        int active = 0;
+        long generation = 0;
+        bool running = false;   //between the setup of a run and the caller seeing it done
+        bool stop = false;
+};
+/*###############################################################################################################*/
+inline std::mutex & ThreadPool::registry_lock() {
+    static std::mutex lock;
+    return lock;
+}
+
+inline std::vector<ThreadPool*> & ThreadPool::registry() {
+    //Every live pool, for the fork handler. The handler is installed with the first pool and
+    //holds the registry lock across fork so the child never inherits it locked.
+    static std::vector<ThreadPool*> pools;
+    static bool installed = pthread_atfork(
+        []{ registry_lock().lock(); },
+        []{ registry_lock().unlock(); },
+        []{
+            for(size_t i=0; i<registry().size(); i++) registry()[i]->after_fork();
+            registry_lock().unlock();
+        }) == 0;
+    (void)installed;
+    return pools;
+}
+/*###############################################################################################################*/
+inline ThreadPool::ThreadPool(int n_threads): n_threads(n_threads > 0 ? n_threads : 1) {
+    {
+        std::lock_guard<std::mutex> guard(registry_lock());
+        registry().push_back(this);
+    }
+    for(int i=1; i<this->n_threads; i++) workers.push_back(std::thread(&ThreadPool::work, this));
+}
+/*###############################################################################################################*/
+inline ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(registry_lock());
+        std::vector<ThreadPool*> & pools = registry();
+        pools.erase(std::find(pools.begin(), pools.end(), this));
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    wake.notify_all();
+    for(size_t i=0; i<workers.size(); i++) workers[i].join();
+}
+/*###############################################################################################################*/
+inline void ThreadPool::after_fork() {
+    //Runs in the child, where the workers never existed: their handles are released without
+    //a join, and the locks and condition variables, which may have been held or waited on by
+    //threads of the parent, are built again. run() starts new workers when it needs them.
+    for(size_t i=0; i<workers.size(); i++) workers[i].detach();
+    workers.clear();
+    new (&busy) std::mutex();
+    new (&lock) std::mutex();
+    new (&wake) std::condition_variable();
+    new (&done) std::condition_variable();
+    task = NULL;
+    n_tasks = 0;
+    next_task = 0;
+    finished = 0;
+    active = 0;
+    running = false;
+    stop = false;
+}
+/*###############################################################################################################*/
+inline void ThreadPool::drain(const std::function<void(int)> & task, int n_tasks) {
+    //Take tasks until none are left, counting the ones this thread finished.
+    //task and n_tasks were read under the lock when this thread joined the run.
+    int count = 0;
+    for(int i = next_task++; i < n_tasks; i = next_task++){
+        task(i);
+        count++;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    finished += count;
+    active--;
+    if(finished == this->n_tasks && active == 0) done.notify_all();
+}
+/*###############################################################################################################*/
+inline void ThreadPool::work() {
+    long seen = 0;
+    const std::function<void(int)> * run_task;
+    int run_tasks;
+    while(true){
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            //Only join a run still in progress: a worker waking after the caller saw its run
+            //done must not count itself into, or read the task of, the next one
+            wake.wait(guard, [this, seen]{ return stop || (running && generation != seen); });
+            if(stop) return;
+            seen = generation;
+            active++;
+            run_task = task;
+            run_tasks = n_tasks;
+        }
+        drain(*run_task, run_tasks);
+    }
+}
+/*###############################################################################################################*/
+inline void ThreadPool::run(int n_tasks, const std::function<void(int)> & task) {
+    if(n_tasks <= 0) return;
+    //A pool already busy with another caller (or a nested run) runs the tasks inline
+    std::unique_lock<std::mutex> owner(busy, std::try_to_lock);
+    if(n_threads == 1 || n_tasks == 1 || !owner.owns_lock()){
+        for(int i=0; i<n_tasks; i++) task(i);
+        return;
+    }
+    //First run in a forked child
+    while((int)workers.size() < n_threads - 1) workers.push_back(std::thread(&ThreadPool::work, this));
+    {
+        //No thread is in drain() between runs (running is false), so the counters can be reset
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [this]{ return active == 0; });
+        this->task = &task;
+        this->n_tasks = n_tasks;
+        finished = 0;
+        next_task = 0;
+        active += 1;
+        running = true;
+        generation++;
+    }
+    wake.notify_all();
+    drain(task, n_tasks);
+    //Wait for every thread to leave drain() so none of them sees the next run's counters
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [this]{ return finished == this->n_tasks && active == 0; });
+    running = false;
+}
+/*###############################################################################################################*/
+inline ThreadPool & default_pool() {
+    //Sized by LENNYGRAD_THREADS, or the number of cores when it is not set
+    static ThreadPool pool([]{
+        const char * env = std::getenv("LENNYGRAD_THREADS");
+        if(env != NULL && std::atoi(env) > 0) return std::atoi(env);
+        return (int)std::thread::hardware_concurrency();
+    }());
+    return pool;
+}
+
+/***************************************************************
+* void parallel_for(long begin, long end, long grain, fn);
+*
+*   Description:
+*       splits [begin, end) into chunks of at least grain
+*       indices and calls fn(lo, hi) for each chunk on the
+*       default pool. The chunking only depends on the range
+*       and grain, never on the number of threads.
+*       Ranges are 64 bit, so callers over a number of
+*       elements take (long lo, long hi), callers over rows
+*       or planes may keep (int lo, int hi).
+***************************************************************/
+inline void parallel_for(long begin, long end, long grain, const std::function<void(long, long)> & fn) {
+    if(end <= begin) return;
+    if(grain < 1) grain = 1;
+    //The pool numbers its tasks with ints
+    if((end - begin + grain - 1) / grain > INT_MAX) grain = (end - begin + INT_MAX - 1) / INT_MAX;
+    int n_chunks = (int)((end - begin + grain - 1) / grain);
+    if(n_chunks == 1) {
+        fn(begin, end);
+        return;
+    }
+    default_pool().run(n_chunks, [&](int c){
+        long lo = begin + c * grain;
+        fn(lo, std::min(end, lo + grain));
+    });
+}
+
+#endif
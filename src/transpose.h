@@ -0,0 +1,212 @@
+#ifndef TRANSPOSE_H_
+#define TRANSPOSE_H_
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "threadpool.h"
+
+/*
+    Strided gather into a contiguous array, the kernel behind
+    as_contiguous() and PERMUTE.
+    After merging dims the copy is one of:
+        - rows that are contiguous in the source: plain row copies
+        - a 2D transpose between the source's unit stride dim and the
+          destination's innermost dim: done in square tiles that fit in
+          L1, with the inner 8x8 (float) or 4x4 (double) blocks
+          transposed in registers when AVX is available
+        - anything else: an element gather
+    Work is split across the outer dims and blocks with parallel_for.
+*/
+
+//Tile edge in elements, a 32x32 float/double tile of source and destination stays in L1
+const int TRANSPOSE_TILE = 32;
+//Block edge in elements, the rows of a block on both sides span few enough pages for the TLB
+const int TRANSPOSE_BLOCK = 256;
+
+template <typename T>
+inline void _transpose_block(const T * src, long src_ld, T * dst, long dst_ld, int rows, int cols) {
+    //dst[c][r] = src[r][c]
+    for(int r=0; r<rows; r++)
+        for(int c=0; c<cols; c++) dst[c * dst_ld + r] = src[r * src_ld + c];
+}
+
+//Register kernels: run() transposes a step x step block, step 0 means none for this type
+template <typename T>
+struct _transpose_micro {
+    static const int step = 0;
+    static void run(const T *, long, T *, long) {}
+};
+
+#if defined(__AVX__)
+template <>
+struct _transpose_micro<float> {
+    static const int step = 8;
+    static void run(const float * src, long src_ld, float * dst, long dst_ld) {
+        __m256 r0 = _mm256_loadu_ps(src + 0 * src_ld), r1 = _mm256_loadu_ps(src + 1 * src_ld);
+        __m256 r2 = _mm256_loadu_ps(src + 2 * src_ld), r3 = _mm256_loadu_ps(src + 3 * src_ld);
+        __m256 r4 = _mm256_loadu_ps(src + 4 * src_ld), r5 = _mm256_loadu_ps(src + 5 * src_ld);
+        __m256 r6 = _mm256_loadu_ps(src + 6 * src_ld), r7 = _mm256_loadu_ps(src + 7 * src_ld);
+        __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+        __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+        __m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+        __m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+        __m256 s0 = _mm256_shuffle_ps(t0, t2, 0x44), s1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+        __m256 s2 = _mm256_shuffle_ps(t1, t3, 0x44), s3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+        __m256 s4 = _mm256_shuffle_ps(t4, t6, 0x44), s5 = _mm256_shuffle_ps(t4, t6, 0xEE);
+        __m256 s6 = _mm256_shuffle_ps(t5, t7, 0x44), s7 = _mm256_shuffle_ps(t5, t7, 0xEE);
+        _mm256_storeu_ps(dst + 0 * dst_ld, _mm256_permute2f128_ps(s0, s4, 0x20));
+        _mm256_storeu_ps(dst + 1 * dst_ld, _mm256_permute2f128_ps(s1, s5, 0x20));
+        _mm256_storeu_ps(dst + 2 * dst_ld, _mm256_permute2f128_ps(s2, s6, 0x20));
+        _mm256_storeu_ps(dst + 3 * dst_ld, _mm256_permute2f128_ps(s3, s7, 0x20));
+        _mm256_storeu_ps(dst + 4 * dst_ld, _mm256_permute2f128_ps(s0, s4, 0x31));
+        _mm256_storeu_ps(dst + 5 * dst_ld, _mm256_permute2f128_ps(s1, s5, 0x31));
+        _mm256_storeu_ps(dst + 6 * dst_ld, _mm256_permute2f128_ps(s2, s6, 0x31));
+        _mm256_storeu_ps(dst + 7 * dst_ld, _mm256_permute2f128_ps(s3, s7, 0x31));
+    }
+};
+
+template <>
+struct _transpose_micro<double> {
+    static const int step = 4;
+    static void run(const double * src, long src_ld, double * dst, long dst_ld) {
+        __m256d r0 = _mm256_loadu_pd(src + 0 * src_ld), r1 = _mm256_loadu_pd(src + 1 * src_ld);
+        __m256d r2 = _mm256_loadu_pd(src + 2 * src_ld), r3 = _mm256_loadu_pd(src + 3 * src_ld);
+        __m256d t0 = _mm256_unpacklo_pd(r0, r1), t1 = _mm256_unpackhi_pd(r0, r1);
+        __m256d t2 = _mm256_unpacklo_pd(r2, r3), t3 = _mm256_unpackhi_pd(r2, r3);
+        _mm256_storeu_pd(dst + 0 * dst_ld, _mm256_permute2f128_pd(t0, t2, 0x20));
+        _mm256_storeu_pd(dst + 1 * dst_ld, _mm256_permute2f128_pd(t1, t3, 0x20));
+        _mm256_storeu_pd(dst + 2 * dst_ld, _mm256_permute2f128_pd(t0, t2, 0x31));
+        _mm256_storeu_pd(dst + 3 * dst_ld, _mm256_permute2f128_pd(t1, t3, 0x31));
+    }
+};
+#endif
+
+template <typename T>
+inline void _transpose_tile(const T * src, long src_ld, T * dst, long dst_ld, int rows, int cols) {
+    //dst[c][r] = src[r][c] for a tile, register blocks first then the ragged edges
+    const int step = _transpose_micro<T>::step;
+    if(step == 0 || rows < step || cols < step) {
+        _transpose_block(src, src_ld, dst, dst_ld, rows, cols);
+        return;
+    }
+    int full_rows = rows - rows % step, full_cols = cols - cols % step;
+    for(int r=0; r<full_rows; r+=step)
+        for(int c=0; c<full_cols; c+=step)
+            _transpose_micro<T>::run(src + r * src_ld + c, src_ld, dst + c * dst_ld + r, dst_ld);
+    if(full_cols < cols)
+        _transpose_block(src + full_cols, src_ld, dst + full_cols * dst_ld, dst_ld, rows, cols - full_cols);
+    if(full_rows < rows)
+        _transpose_block(src + full_rows * src_ld, src_ld, dst + full_rows, dst_ld, rows - full_rows, full_cols);
+}
+
+/***************************************************************
+* void strided_copy(const T * src, int n_dims, const int * dims, const long * strides, T * dst);
+*
+*   Description:
+*       dst (contiguous, shape dims) [i0, ..., in] = src[sum(ik * strides[k])]
+***************************************************************/
+template <typename T>
+void strided_copy(const T * src, int n_dims, const int * dims, const long * strides, T * dst) {
+    //Merge dims that are contiguous with the next one in the source, drop size 1 dims
+    std::vector<int> d;
+    std::vector<long> s;
+    long n = 1;
+    for(int i=0; i<n_dims; i++){
+        n *= dims[i];
+        if(dims[i] == 1) continue;
+        if(!d.empty() && s.back() == strides[i] * dims[i]) {
+            d.back() *= dims[i];
+            s.back() = strides[i];
+        }
+        else {
+            d.push_back(dims[i]);
+            s.push_back(strides[i]);
+        }
+    }
+    if(n == 0) return;
+    if(d.empty()) { dst[0] = src[0]; return; }
+    int nd = d.size();
+
+    //Contiguous destination strides
+    std::vector<long> ds(nd);
+    ds[nd-1] = 1;
+    for(int i=nd-2; i>=0; i--) ds[i] = ds[i+1] * d[i+1];
+
+    //Source offset of the outer index o over the dims not in skip
+    auto outer_offsets = [&](long o, int skip1, int skip2, long & src_off, long & dst_off){
+        src_off = 0;
+        dst_off = 0;
+        for(int i=nd-1; i>=0; i--){
+            if(i == skip1 || i == skip2) continue;
+            long idx = o % d[i];
+            o /= d[i];
+            src_off += idx * s[i];
+            dst_off += idx * ds[i];
+        }
+    };
+
+    if(s[nd-1] == 1){
+        //Rows already contiguous in the source
+        long row = d[nd-1];
+        long rows = n / row;
+        parallel_for(0, rows, std::max(1L, 32768 / row), [&](long lo, long hi){
+            for(long r=lo; r<hi; r++){
+                long src_off, dst_off;
+                outer_offsets(r, nd-1, -1, src_off, dst_off);
+                std::memcpy(dst + dst_off, src + src_off, sizeof(T) * row);
+            }
+        });
+        return;
+    }
+
+    int p = -1;
+    for(int i=0; i<nd-1; i++) if(s[i] == 1) p = i;
+    if(p < 0){
+        //No unit stride dim in the source, gather element by element
+        long row = d[nd-1];
+        long rows = n / row;
+        parallel_for(0, rows, std::max(1L, 32768 / row), [&](long lo, long hi){
+            for(long r=lo; r<hi; r++){
+                long src_off, dst_off;
+                outer_offsets(r, nd-1, -1, src_off, dst_off);
+                for(long i=0; i<row; i++) dst[dst_off + i] = src[src_off + i * s[nd-1]];
+            }
+        });
+        return;
+    }
+
+    //2D transpose between dim p (unit source stride) and the last dim (unit destination stride).
+    //Each task copies a TRANSPOSE_BLOCK square of one plane (so the pages it touches stay
+    //in the TLB) as TRANSPOSE_TILE tiles (which stay in L1)
+    const int q = nd - 1;
+    long rows_q = d[q], cols_p = d[p];
+    long planes = n / (rows_q * cols_p);
+    long row_blocks = (rows_q + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+    long col_blocks = (cols_p + TRANSPOSE_BLOCK - 1) / TRANSPOSE_BLOCK;
+    long blocks = row_blocks * col_blocks;
+    parallel_for(0, planes * blocks, 1, [&](long lo, long hi){
+        for(long task=lo; task<hi; task++){
+            long plane = task / blocks, block = task % blocks;
+            long src_off, dst_off;
+            outer_offsets(plane, p, q, src_off, dst_off);
+            long r_end = std::min<long>(rows_q, (block / col_blocks + 1) * TRANSPOSE_BLOCK);
+            long c_end = std::min<long>(cols_p, (block % col_blocks + 1) * TRANSPOSE_BLOCK);
+            for(long r0=(block / col_blocks) * TRANSPOSE_BLOCK; r0<r_end; r0+=TRANSPOSE_TILE){
+                int rows = std::min<long>(TRANSPOSE_TILE, r_end - r0);
+                for(long c0=(block % col_blocks) * TRANSPOSE_BLOCK; c0<c_end; c0+=TRANSPOSE_TILE){
+                    int cols = std::min<long>(TRANSPOSE_TILE, c_end - c0);
+                    //source tile: rows along q (stride s[q]), cols along p (stride 1)
+                    _transpose_tile(src + src_off + r0 * s[q] + c0, s[q], dst + dst_off + c0 * ds[p] + r0, ds[p], rows, cols);
+                }
+            }
+        }
+    });
+}
+
+#endif